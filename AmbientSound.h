@@ -6,6 +6,7 @@
 //
 
 #import <Foundation/Foundation.h>
+#import "SoundEngine.h"
 
 
 @interface AmbientSound : NSObject {
@@ -13,7 +14,7 @@
 }
 
 @property (nonatomic, assign) float volume;
-@property (nonatomic, assign) int slot;
+@property (nonatomic, readonly) SoundEngineStreamID stream;
 
 
 - (void) stopAndUnloadWithFadeTime:(double)fade;
@@ -12,22 +12,29 @@
 @implementation AmbientSound
 
 @synthesize volume;
-@synthesize slot;
+@synthesize stream;
 
 
 - (id) init {
 	self = [super init];
 	if (self) {
 		self.volume = -1.0;
-
+		SoundEngine_CreateStream(kSoundEngineBus_Music, &stream);
 	}
 	return self;
 }
 
+- (void) dealloc {
+	[NSObject cancelPreviousPerformRequestsWithTarget:self];
+	[_replacing release];
+	SoundEngine_DestroyStream(stream);
+	[super dealloc];
+}
+
 - (void) unload {
 	if (self.volume != -1.0) {
-		SoundEngine_StopBackgroundMusic(slot, FALSE);
-		SoundEngine_UnloadBackgroundMusicTrack(slot);
+		SoundEngine_StopStream(stream, FALSE);
+		SoundEngine_UnloadStreamTrack(stream);
 		self.volume = -1.0;
 	}
 }
@@ -43,7 +50,7 @@
 
 - (void) stopAndUnloadWithStepDelay:(NSNumber*)delay {
 	self.volume -= 0.1;
-	SoundEngine_SetBackgroundMusicVolume(self.slot, self.volume);
+	SoundEngine_SetStreamVolume(self.stream, self.volume);
 	if (self.volume <= 0.0) {
 		[self unload];
 		[self completedStopWithFade:[delay doubleValue]*10.0];
@@ -69,14 +76,14 @@
 - (void) loadFromPath:(NSString*)path {
 	char buf[512];
 	[path getCString:buf maxLength:512 encoding:NSUTF8StringEncoding];
-	SoundEngine_LoadBackgroundMusicTrack(self.slot, buf, FALSE, FALSE);
+	SoundEngine_LoadStreamTrack(self.stream, buf, FALSE, FALSE);
 }
 
 
 - (void) playWithStepDelay:(NSNumber*)delay {
 		//	NSLog(@"play: increase volumen from %f", self.volume);
 	self.volume += 0.1;
-	SoundEngine_SetBackgroundMusicVolume(self.slot, self.volume);
+	SoundEngine_SetStreamVolume(self.stream, self.volume);
 	if (self.volume < 1.0) {
 		[self performSelector:@selector(playWithStepDelay:) withObject:delay afterDelay:[delay doubleValue]];
 	}
@@ -86,26 +93,35 @@
 
 - (void) playLoadedWithFadeTime:(double)time {
 	if (time == 0.0) {
-		SoundEngine_SetBackgroundMusicVolume(slot, 1.0f);
+		SoundEngine_SetStreamVolume(stream, 1.0f);
 		self.volume = 1.0f;
-		SoundEngine_StartBackgroundMusic(slot);
+		SoundEngine_StartStream(stream);
 	} else {
-		SoundEngine_SetBackgroundMusicVolume(slot, 0.0f);
+		SoundEngine_SetStreamVolume(stream, 0.0f);
 		self.volume = 0.0f;
 		[self playWithStepDelay:[NSNumber numberWithDouble:time/10.0]];
-		SoundEngine_StartBackgroundMusic(slot);
+		SoundEngine_StartStream(stream);
 	}	
 }
 
 
 - (void) replaceCurrentWith:(NSString*)path withFadeTime:(double)fade {
-	if (self.volume == -1.0) {
-			// nothing to replace
+	[NSObject cancelPreviousPerformRequestsWithTarget:self];
+	[_replacing release];
+	_replacing = nil;
+	if (self.volume <= 0.0) {
+			// nothing audible to replace
+		[self unload];
 		[self loadFromPath:path];
 		[self playLoadedWithFadeTime:fade];
 	} else {
-		_replacing = [path retain];
-		[self stopAndUnloadWithFadeTime:fade];
+			// the engine overlaps both tracks, the new one keeps the current volume
+		char buf[512];
+		[path getCString:buf maxLength:512 encoding:NSUTF8StringEncoding];
+		SoundEngine_CrossfadeStreamTrack(self.stream, buf, FALSE, fade);
+		if (self.volume < 1.0) {
+			[self playWithStepDelay:[NSNumber numberWithDouble:fade/10.0]];
+		}
 	}
 }
 
@@ -105,11 +105,26 @@ Copyright (C) 2008 Apple Inc. All Rights Reserved.
 
 //	System Includes
 #include <AudioToolbox/AudioToolbox.h>
+#include <Accelerate/Accelerate.h>
 #include <CoreFoundation/CFURL.h>
+#include <libkern/OSAtomic.h>
 #include <map>
 #include <vector>
+#include <algorithm>
 #include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/sysctl.h>
+#include <execinfo.h>
+#include <malloc/malloc.h>
 #include <mach/mach.h>
+#include <math.h>
+#include <float.h>
 
 // Local Includes
 #include "SoundEngine.h"
@@ -129,15 +144,54 @@ Copyright (C) 2008 Apple Inc. All Rights Reserved.
 			}
 
 #define kNumberBuffers 3    // Used for the bgMusic audio queue
-#define MAX_SOURCES 10
-#define kBackgroundMusicSlots 2
+#define MAX_SOURCES 10      // Real OpenAL sources, shared by all playing voices
+#define MAX_VOICES 1024     // Logical voices (primed effects), real or virtual, until SoundEngine_SetMaxVoices
+#define kMaxVoiceCapacity 0xFFFE	// voice IDs keep the index in their low 16 bits
+#define kCacheLineSize 64
+#define kBackgroundMusicSlots 2   // streams reachable through the int slot API, any number through stream IDs
+
+#define kStealReserveSources 2  // Extra sources a stolen voice fades out on while the thief starts
+
+#define kVoiceUpdateInterval			0.010	// seconds between two passes of the voice update thread
+#define kDefaultVirtualVoiceThreshold	0.001	// ~ -60 dB, below this a voice is not worth a real source
+#define kStealFadeTime					0.030	// seconds a stolen voice takes to fade out
+#define kLoudnessBands					8		// 6 dB wide bands used to find the quietest real voice
+#define kVoiceBuckets					(kSoundEnginePriorityLevels * kLoudnessBands)
+#define kNoVoice						0xFFFFFFFF
+#define kIOChunkBytes					0x10000	// bulk reads are split so a stream refill never waits behind a whole file
+#define kIOMaxCoalescedBytes			0x40000	// contiguous requests are merged into reads of up to this size
+#define kIORefillWindow					1.0		// seconds after a stream or speech read during which loads are read a chunk at a time
+#define kEffectCommandSlots				256		// fire-and-forget plays waiting for the voice update thread, a power of two
+#define kTrackMgrBlocks					16		// track managers alive at once, two per stream while crossfading, a power of two
+#define kTrackFileBlocks				64		// files in the playlists of all the track managers
+#define kCrossfadeBlocks				8		// crossfades loading at once
+#define kVoiceChunkSize					64		// voices per task of a parallel voice update pass
+#define kParallelVoiceThreshold			256		// primed voices below which a pass is not worth splitting
+#define kMaxTaskThreads					4		// threads running a pass, the voice update thread included
+#define kRefillSlots					8		// buffers of a track manager waiting for the refill thread, over kNumberBuffers + 1
+#define kRealtimeReportFrames			32		// call stack depth printed for a realtime violation
+#define kDecodeCacheMagic				'sedc'	// first word of a decode cache key file
+#define kDecodeChunkFrames				0x8000	// frames decoded per read when filling the decode cache
+#define kLoadEventSlots					64		// completed async loads waiting to be polled, a power of two
+#define kMeterWindow					0.030	// seconds a bus meter measures before its levels are published
+#define kMeterStaleTime					0.100	// a meter not published for this long reads as silence
+#define kMeterBlockFrames				256		// frames per level of the envelope of an effect
+#define kVoiceMeterSlots				16		// voices metered at once
+#define kDefaultTrimThreshold			0.0		// effects are not trimmed until SoundEngine_SetEffectTrimThreshold
+
+// the allocator hook patches the default malloc zone, it is only built into debug builds
+#if !defined(kSoundEngineRealtimeAllocHook)
+	#if defined(DEBUG)
+		#define kSoundEngineRealtimeAllocHook 1
+	#else
+		#define kSoundEngineRealtimeAllocHook 0
+	#endif
+#endif
 
 class OpenALObject;
 class BackgroundTrackMgr;
 
 static OpenALObject			*sOpenALObject = NULL;
-static BackgroundTrackMgr	*sBackgroundTrackMgr[kBackgroundMusicSlots] = {NULL, NULL};
-static Float32				gMasterVolumeGain = 1.0;
 
 // ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 typedef ALvoid	AL_APIENTRY	(*alBufferDataStaticProcPtr) (const ALint bid, ALenum format, ALvoid* data, ALsizei size, ALsizei freq);
@@ -171,12 +225,202 @@ ALvoid  alcMacOSXMixerOutputRateProc(const ALdouble value)
     return;
 }
 
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// ALC_EXT_ASA, Apple's spatial audio extension: per source occlusion (a low-pass) and reverb send, 
+// and the shared reverb they send to.
+typedef ALenum	(*alcASASetSourceProcPtr) (const ALuint property, ALuint source, ALvoid *data, ALuint dataSize);
+ALenum  alcASASetSourceProc(const ALuint property, ALuint source, ALvoid *data, ALuint dataSize)
+{
+	static	alcASASetSourceProcPtr	proc = NULL;
+    
+    if (proc == NULL) {
+        proc = (alcASASetSourceProcPtr) alcGetProcAddress(NULL, (const ALCchar*) "alcASASetSource");
+    }
+    
+    if (proc)
+        return proc(property, source, data, dataSize);
+
+    return AL_INVALID_OPERATION;
+}
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+typedef ALenum	(*alcASASetListenerProcPtr) (const ALuint property, ALvoid *data, ALuint dataSize);
+ALenum  alcASASetListenerProc(const ALuint property, ALvoid *data, ALuint dataSize)
+{
+	static	alcASASetListenerProcPtr	proc = NULL;
+    
+    if (proc == NULL) {
+        proc = (alcASASetListenerProcPtr) alcGetProcAddress(NULL, (const ALCchar*) "alcASASetListener");
+    }
+    
+    if (proc)
+        return proc(property, data, dataSize);
+
+    return AL_INVALID_OPERATION;
+}
+
+#pragma mark ***** SoundEngineRealtimeGuard *****
+//==================================================================================================
+//	SoundEngineRealtimeGuard class
+//==================================================================================================
+// Audio callbacks must not allocate, free, take a lock or block in the kernel, any of which can wait 
+// on a lower priority thread and glitch the output. Callbacks open a SoundEngineRealtimeScope; the 
+// engine's locks and file reads check for one, and in debug builds the default malloc zone is patched 
+// to check as well, so allocations made by the system on our behalf are caught too. A violation is 
+// counted, and in the report mode printed with its call stack. While off, a check is one load.
+static void InstallRealtimeAllocHook();
+
+class SoundEngineRealtimeGuard
+{
+	public:
+		SoundEngineRealtimeGuard()
+			:	mMode(kSoundEngineRealtimeCheck_Off)
+		{
+			pthread_key_create(&mDepthKey, NULL);
+			Reset();
+		}
+		
+		void SetMode(UInt32 inMode)
+		{
+			if (inMode != kSoundEngineRealtimeCheck_Off)
+				InstallRealtimeAllocHook();
+			mMode = inMode;
+		}
+		
+		// the scope depth is kept per thread, false if nothing was entered
+		Boolean Enter()
+		{
+			if (mMode == kSoundEngineRealtimeCheck_Off)
+				return false;
+			pthread_setspecific(mDepthKey, (void*)((intptr_t)pthread_getspecific(mDepthKey) + 1));
+			return true;
+		}
+		
+		void Leave()
+		{
+			pthread_setspecific(mDepthKey, (void*)((intptr_t)pthread_getspecific(mDepthKey) - 1));
+		}
+		
+		void Check(UInt32 inKind)
+		{
+			if ((mMode == kSoundEngineRealtimeCheck_Off) || ((intptr_t)pthread_getspecific(mDepthKey) <= 0))
+				return;
+			OSAtomicIncrement32Barrier(&mViolations[inKind]);
+			if (mMode == kSoundEngineRealtimeCheck_Report)
+				Report(inKind);
+		}
+		
+		OSStatus GetViolations(UInt32 inKind, UInt32 *outCount)
+		{
+			if (inKind >= kSoundEngineRealtimeViolationKinds)
+				return kSoundEngineErrInvalidID;
+			*outCount = mViolations[inKind];
+			return noErr;
+		}
+		
+		void Reset()
+		{
+			for (UInt32 i = 0; i < kSoundEngineRealtimeViolationKinds; ++i)
+				mViolations[i] = 0;
+		}
+		
+	private:
+		void Report(UInt32 inKind)
+		{
+			static const char *kKindNames[kSoundEngineRealtimeViolationKinds] = { "allocation", "free", "lock", "blocking call" };
+			
+			// printing allocates, the thread is out of its scope until done
+			void *theDepth = pthread_getspecific(mDepthKey);
+			pthread_setspecific(mDepthKey, NULL);
+			printf("Realtime violation: %s on an audio thread\n", kKindNames[inKind]);
+			fflush(stdout);
+			void *theFrames[kRealtimeReportFrames];
+			backtrace_symbols_fd(theFrames, backtrace(theFrames, kRealtimeReportFrames), STDOUT_FILENO);
+			pthread_setspecific(mDepthKey, theDepth);
+		}
+		
+		volatile UInt32							mMode;
+		pthread_key_t							mDepthKey;
+		volatile int32_t						mViolations[kSoundEngineRealtimeViolationKinds];
+};
+
+static SoundEngineRealtimeGuard	sRealtimeGuard;
+
+class SoundEngineRealtimeScope
+{
+	public:
+		SoundEngineRealtimeScope() : mEntered(sRealtimeGuard.Enter()) {}
+		~SoundEngineRealtimeScope() { if (mEntered) sRealtimeGuard.Leave(); }
+	private:
+		Boolean mEntered;
+};
+
+#if kSoundEngineRealtimeAllocHook
+static malloc_zone_t	sRealtimeOriginalZone;
+
+static void *RealtimeHookMalloc(malloc_zone_t *inZone, size_t inSize)
+{
+	sRealtimeGuard.Check(kSoundEngineRealtimeViolation_Alloc);
+	return sRealtimeOriginalZone.malloc(inZone, inSize);
+}
+
+static void *RealtimeHookCalloc(malloc_zone_t *inZone, size_t inCount, size_t inSize)
+{
+	sRealtimeGuard.Check(kSoundEngineRealtimeViolation_Alloc);
+	return sRealtimeOriginalZone.calloc(inZone, inCount, inSize);
+}
+
+static void *RealtimeHookValloc(malloc_zone_t *inZone, size_t inSize)
+{
+	sRealtimeGuard.Check(kSoundEngineRealtimeViolation_Alloc);
+	return sRealtimeOriginalZone.valloc(inZone, inSize);
+}
+
+static void *RealtimeHookRealloc(malloc_zone_t *inZone, void *inPointer, size_t inSize)
+{
+	sRealtimeGuard.Check(kSoundEngineRealtimeViolation_Alloc);
+	return sRealtimeOriginalZone.realloc(inZone, inPointer, inSize);
+}
+
+static void RealtimeHookFree(malloc_zone_t *inZone, void *inPointer)
+{
+	sRealtimeGuard.Check(kSoundEngineRealtimeViolation_Free);
+	sRealtimeOriginalZone.free(inZone, inPointer);
+}
+
+// the zone functions are called through a table the system keeps read-only
+static void PatchDefaultZone()
+{
+	malloc_zone_t *theZone = malloc_default_zone();
+	sRealtimeOriginalZone = *theZone;
+	if (vm_protect(mach_task_self(), (vm_address_t)theZone, sizeof(malloc_zone_t), false, VM_PROT_READ | VM_PROT_WRITE) != KERN_SUCCESS)
+	{
+		printf("Error patching the malloc zone, allocations are not checked\n");
+		return;
+	}
+	theZone->malloc = RealtimeHookMalloc;
+	theZone->calloc = RealtimeHookCalloc;
+	theZone->valloc = RealtimeHookValloc;
+	theZone->realloc = RealtimeHookRealloc;
+	theZone->free = RealtimeHookFree;
+	vm_protect(mach_task_self(), (vm_address_t)theZone, sizeof(malloc_zone_t), false, VM_PROT_READ);
+}
+
+static void InstallRealtimeAllocHook()
+{
+	static pthread_once_t sOnce = PTHREAD_ONCE_INIT;
+	pthread_once(&sOnce, PatchDefaultZone);
+}
+#else
+static void InstallRealtimeAllocHook() {}
+#endif
 
 //==================================================================================================
 //	Helper functions
 //==================================================================================================
 OSStatus OpenFile(const char *inFilePath, AudioFileID &outAFID)
 {
+	sRealtimeGuard.Check(kSoundEngineRealtimeViolation_Syscall);
 	
 	CFURLRef theURL = CFURLCreateFromFileSystemRepresentation(kCFAllocatorDefault, (UInt8*)inFilePath, strlen(inFilePath), false);
 	if (theURL == NULL)
@@ -193,6 +437,22 @@ OSStatus OpenFile(const char *inFilePath, AudioFileID &outAFID)
 		return result;
 }
 
+Float64 HostTimeToSeconds(UInt64 inHostTime)
+{
+	static Float64 sSecondsPerHostTick = 0.0;
+	if (sSecondsPerHostTick == 0.0) {
+		mach_timebase_info_data_t theTimebase;
+		mach_timebase_info(&theTimebase);
+		sSecondsPerHostTick = ((Float64)theTimebase.numer / (Float64)theTimebase.denom) * 1.0e-9;
+	}
+	return inHostTime * sSecondsPerHostTick;
+}
+
+UInt64 SecondsToHostTime(Float64 inSeconds)
+{
+	return (UInt64)(inSeconds / HostTimeToSeconds(1));
+}
+
 OSStatus LoadFileDataInfo(const char *inFilePath, AudioFileID &outAFID, AudioStreamBasicDescription &outFormat, UInt64 &outDataSize)
 {
 	UInt32 thePropSize = sizeof(outFormat);				
@@ -210,6 +470,33 @@ end:
 	return result;
 }
 
+// Loop points stored in the file, as the first region flagged for looping (CAF and AIFF regions)
+Boolean ReadLoopMarkers(AudioFileID inAFID, UInt32 &outLoopStart, UInt32 &outLoopEnd)
+{
+	UInt32 theSize = 0;
+	Boolean isFound = false;
+	if (AudioFileGetPropertyInfo(inAFID, kAudioFilePropertyRegionList, &theSize, NULL) || (theSize == 0))
+		return false;
+	
+	AudioFileRegionList *theList = (AudioFileRegionList*)malloc(theSize);
+	if (AudioFileGetProperty(inAFID, kAudioFilePropertyRegionList, &theSize, theList) == noErr)
+	{
+		AudioFileRegion *theRegion = theList->mRegions;
+		for (UInt32 i = 0; (i < theList->mNumberRegions) && !isFound; ++i)
+		{
+			if ((theRegion->mFlags & kAudioFileRegionFlag_LoopEnable) && (theRegion->mNumberMarkers >= 2))
+			{
+				outLoopStart = (UInt32)theRegion->mMarkers[0].mFramePosition;
+				outLoopEnd = (UInt32)theRegion->mMarkers[1].mFramePosition;
+				isFound = true;
+			}
+			theRegion = NextAudioFileRegion(theRegion);
+		}
+	}
+	free(theList);
+	return isFound;
+}
+
 void CalculateBytesForTime (AudioStreamBasicDescription & inDesc, UInt32 inMaxPacketSize, Float64 inSeconds, UInt32 *outBufferSize, UInt32 *outNumPackets)
 {
 	static const UInt32 maxBufferSize = 0x10000; // limit size to 64K
@@ -301,994 +588,6517 @@ Boolean FormatIsEqual(AudioStreamBasicDescription x, AudioStreamBasicDescription
 		&& MATCH(mBitsPerChannel) ;
 }
 
-#pragma mark ***** BackgroundTrackMgr *****
+#pragma mark ***** SoundEngineDSPChain *****
 //==================================================================================================
-//	BackgroundTrackMgr class
+//	SoundEngineDSPChain class
 //==================================================================================================
-class BackgroundTrackMgr
-{	
-	#define CurFileInfo THIS->mBGFileInfo[THIS->mCurrentFileIndex]
+// A cascade of biquad sections run with vDSP_biquad, one delay line per channel. Sections are
+// given as normalized b0, b1, b2, a1, a2 coefficients. A chain is built off the render thread and 
+// handed over to the processing tap of a music queue as a whole.
+class SoundEngineDSPChain
+{
 	public:
-		typedef struct BG_FileInfo {
-			char*						mFilePath;
-			AudioFileID						mAFID;
-			AudioStreamBasicDescription		mFileFormat;
-			UInt64							mFileDataSize;
-			//UInt64							mFileNumPackets; // this is only used if loading file to memory
-			Boolean							mLoadAtOnce;
-			Boolean							mFileDataInQueue;
-		} BackgroundMusicFileInfo;
+		SoundEngineDSPChain(const std::vector<double> &inCoefficients, UInt32 inChannels)
+			:	mSections(inCoefficients.size() / 5),
+				mChannels(inChannels)
+		{
+			mSetup = vDSP_biquad_CreateSetup(&inCoefficients[0], mSections);
+			mDelay = (float*)calloc((2 * mSections + 2) * mChannels, sizeof(float));
+		}
 		
-		BackgroundTrackMgr() 
-			:	mQueue(0),
-				mBufferByteSize(0),
-				mCurrentPacket(0),
-				mNumPacketsToRead(0),
-				mVolume(1.0),
-				mPacketDescs(NULL),
-				mCurrentFileIndex(0),
-				mMakeNewQueueWhenStopped(false),
-				mStopAtEnd(false),
-				mStopped(false){ }
+		~SoundEngineDSPChain()
+		{
+			vDSP_biquad_DestroySetup(mSetup);
+			free(mDelay);
+		}
+		
+		void Process(AudioBufferList *ioData, UInt32 inNumberFrames)
+		{
+			UInt32 theChannel = 0;
+			for (UInt32 i = 0; i < ioData->mNumberBuffers; ++i)
+			{
+				AudioBuffer &theBuffer = ioData->mBuffers[i];
+				UInt32 theStride = theBuffer.mNumberChannels;
+				for (UInt32 j = 0; (j < theStride) && (theChannel < mChannels); ++j, ++theChannel)
+				{
+					float *theData = (float*)theBuffer.mData + j;
+					vDSP_biquad(mSetup, mDelay + theChannel * (2 * mSections + 2), theData, theStride, theData, theStride, inNumberFrames);
+				}
+			}
+		}
+		
+		// RBJ audio EQ cookbook, appends the 5 coefficients of one section
+		static void AddFilterSection(std::vector<double> &ioCoefficients, UInt32 inType, Float64 inFrequency, Float64 inQ, Float64 inGainDB, Float64 inSampleRate)
+		{
+			if (inFrequency > inSampleRate * 0.49)
+				inFrequency = inSampleRate * 0.49;
+			if (inQ <= 0.0)
+				inQ = M_SQRT1_2;
+			
+			Float64 w0 = 2.0 * M_PI * inFrequency / inSampleRate;
+			Float64 cosw0 = cos(w0);
+			Float64 alpha = sin(w0) / (2.0 * inQ);
+			Float64 A = pow(10.0, inGainDB / 40.0);
+			Float64 sqA = 2.0 * sqrt(A) * alpha;
+			Float64 b0, b1, b2, a0, a1, a2;
+			
+			switch (inType)
+			{
+				case kSoundEngineFilter_LowPass:
+					b0 = (1.0 - cosw0) / 2.0;	b1 = 1.0 - cosw0;		b2 = b0;
+					a0 = 1.0 + alpha;			a1 = -2.0 * cosw0;		a2 = 1.0 - alpha;
+					break;
+				case kSoundEngineFilter_HighPass:
+					b0 = (1.0 + cosw0) / 2.0;	b1 = -(1.0 + cosw0);	b2 = b0;
+					a0 = 1.0 + alpha;			a1 = -2.0 * cosw0;		a2 = 1.0 - alpha;
+					break;
+				case kSoundEngineFilter_Peak:
+					b0 = 1.0 + alpha * A;		b1 = -2.0 * cosw0;		b2 = 1.0 - alpha * A;
+					a0 = 1.0 + alpha / A;		a1 = -2.0 * cosw0;		a2 = 1.0 - alpha / A;
+					break;
+				case kSoundEngineFilter_LowShelf:
+					b0 = A * ((A + 1.0) - (A - 1.0) * cosw0 + sqA);
+					b1 = 2.0 * A * ((A - 1.0) - (A + 1.0) * cosw0);
+					b2 = A * ((A + 1.0) - (A - 1.0) * cosw0 - sqA);
+					a0 = (A + 1.0) + (A - 1.0) * cosw0 + sqA;
+					a1 = -2.0 * ((A - 1.0) + (A + 1.0) * cosw0);
+					a2 = (A + 1.0) + (A - 1.0) * cosw0 - sqA;
+					break;
+				case kSoundEngineFilter_HighShelf:
+					b0 = A * ((A + 1.0) + (A - 1.0) * cosw0 + sqA);
+					b1 = -2.0 * A * ((A - 1.0) + (A + 1.0) * cosw0);
+					b2 = A * ((A + 1.0) + (A - 1.0) * cosw0 - sqA);
+					a0 = (A + 1.0) - (A - 1.0) * cosw0 + sqA;
+					a1 = 2.0 * ((A - 1.0) - (A + 1.0) * cosw0);
+					a2 = (A + 1.0) - (A - 1.0) * cosw0 - sqA;
+					break;
+				default:
+					return;
+			}
+			
+			ioCoefficients.push_back(b0 / a0);
+			ioCoefficients.push_back(b1 / a0);
+			ioCoefficients.push_back(b2 / a0);
+			ioCoefficients.push_back(a1 / a0);
+			ioCoefficients.push_back(a2 / a0);
+		}
+		
+		// one-pole low-pass y[n] = a.x[n] + (1-a).y[n-1], run as a degenerate biquad section
+		static void AddLowPassSection(std::vector<double> &ioCoefficients, Float64 inCutoff, Float64 inSampleRate)
+		{
+			Float64 a = 1.0 - exp(-2.0 * M_PI * inCutoff / inSampleRate);
+			ioCoefficients.push_back(a);
+			ioCoefficients.push_back(0.0);
+			ioCoefficients.push_back(0.0);
+			ioCoefficients.push_back(-(1.0 - a));
+			ioCoefficients.push_back(0.0);
+		}
 		
-		~BackgroundTrackMgr() { Teardown(); }
+	private:
+		vDSP_Length								mSections;
+		UInt32									mChannels;
+		vDSP_biquad_Setup						mSetup;
+		float*									mDelay;
+};
 
-		void Teardown()
+#pragma mark ***** SoundEngineBusGraph *****
+//==================================================================================================
+//	SoundEngineBusGraph class
+//==================================================================================================
+// Buses form a tree under the master bus, with the music, effects and speech categories below it.
+// A bus is only created after its parent, so walking the array in order visits parents first.
+// The gains are cached per bus, and each category pushes them once to its own output:
+//	- effects: master * effects goes into the OpenAL listener gain, applied on the summed effects.
+//			   Sub-bus gains are folded into the gain of the (at most MAX_SOURCES) real voices.
+//	- music:   the whole chain goes into the volume of each background music queue.
+class SoundEngineBusGraph
+{
+	public:
+		SoundEngineBusGraph()
+			:	mNumBuses(0)
 		{
-			if (mQueue)
-				AudioQueueDispose(mQueue, true);
-			for (UInt32 i=0; i < mBGFileInfo.size(); i++)
-				if (mBGFileInfo[i]->mAFID)
-					AudioFileClose(mBGFileInfo[i]->mAFID);
+			for (UInt32 i = 0; i < kSoundEngineMaxDuckings; ++i)
+				mDuckings[i].mInUse = false;
 
-			if (mPacketDescs)
-				delete mPacketDescs;
+			AddBus(kSoundEngineBus_Master);		// kSoundEngineBus_Master, its own parent
+			AddBus(kSoundEngineBus_Master);		// kSoundEngineBus_Music
+			AddBus(kSoundEngineBus_Master);		// kSoundEngineBus_Effects
+			AddBus(kSoundEngineBus_Master);		// kSoundEngineBus_Speech
+			UpdateGains();
 		}
 		
-		AudioStreamPacketDescription *GetPacketDescsPtr() { return mPacketDescs; }
+		Boolean IsValid(SoundEngineBusID inBus) { return inBus < mNumBuses; }
+		UInt32 GetNumBuses() { return mNumBuses; }
+		SoundEngineBusID GetParent(SoundEngineBusID inBus) { return mBuses[inBus].mParent; }
 		
-		UInt32 GetNumPacketsToRead(BackgroundTrackMgr::BG_FileInfo *inFileInfo) 
-		{ 
-			return mNumPacketsToRead; 
+		OSStatus CreateBus(SoundEngineBusID inParent, SoundEngineBusID *outBus)
+		{
+			if (!IsValid(inParent) || (inParent == kSoundEngineBus_Master))
+				return kSoundEngineErrInvalidID;
+			if (mNumBuses == kSoundEngineMaxBuses)
+				return kSoundEngineErrNoSourcesAvailable;
+			
+			*outBus = AddBus(inParent);
+			UpdateGains();
+			return noErr;
 		}
-
-		static OSStatus AttachNewCookie(AudioQueueRef inQueue, BackgroundTrackMgr::BG_FileInfo *inFileInfo)
+		
+		OSStatus SetVolume(SoundEngineBusID inBus, Float32 inValue)
 		{
-			OSStatus result = noErr;
-			UInt32 size = sizeof(UInt32);
-			result = AudioFileGetPropertyInfo (inFileInfo->mAFID, kAudioFilePropertyMagicCookieData, &size, NULL);
-			if (!result && size) 
-			{
-				char* cookie = new char [size];		
-				result = AudioFileGetProperty (inFileInfo->mAFID, kAudioFilePropertyMagicCookieData, &size, cookie);
-					AssertNoError("Error getting cookie data", end);
-				result = AudioQueueSetProperty(inQueue, kAudioQueueProperty_MagicCookie, cookie, size);
-				delete [] cookie;
-					AssertNoError("Error setting cookie data for queue", end);
-			}
+			if (!IsValid(inBus))
+				return kSoundEngineErrInvalidID;
+			mBuses[inBus].mVolume = inValue;
+			UpdateGains();
 			return noErr;
+		}
 		
-		end:
+		Float32 GetVolume(SoundEngineBusID inBus) { return mBuses[inBus].mVolume; }
+		
+		// product of the bus volumes from inBus up to and including master
+		Float32 GetGain(SoundEngineBusID inBus) { return mBuses[inBus].mGain; }
+		
+		// product of the bus volumes from inBus up to, but not including, its category bus
+		Float32 GetGainBelowCategory(SoundEngineBusID inBus) { return mBuses[inBus].mGainBelowCategory; }
+		
+		// kSoundEngineBus_Music, _Effects or _Speech, or kSoundEngineBus_Master for master itself
+		SoundEngineBusID GetCategory(SoundEngineBusID inBus) { return mBuses[inBus].mCategory; }
+		
+		OSStatus SetFilter(SoundEngineBusID inBus, UInt32 inSection, UInt32 inType, Float32 inFrequency, Float32 inQ, Float32 inGainDB)
+		{
+			if (!IsValid(inBus) || (inSection >= kSoundEngineMaxFilterSections))
+				return kSoundEngineErrInvalidID;
+			Filter &theFilter = mBuses[inBus].mFilters[inSection];
+			theFilter.mType = inType;
+			theFilter.mFrequency = inFrequency;
+			theFilter.mQ = inQ;
+			theFilter.mGainDB = inGainDB;
 			return noErr;
 		}
-
-		static void QueueStoppedProc(	void *                  inUserData,
-										AudioQueueRef           inAQ,
-										AudioQueuePropertyID    inID)
+		
+		OSStatus SetLowPass(SoundEngineBusID inBus, Float32 inCutoff)
 		{
-			UInt32 isRunning;
-			UInt32 propSize = sizeof(isRunning);
-
-			BackgroundTrackMgr *THIS = (BackgroundTrackMgr*)inUserData;
-			OSStatus result = AudioQueueGetProperty(inAQ, kAudioQueueProperty_IsRunning, &isRunning, &propSize);
-				
-			if ((!isRunning) && (THIS->mMakeNewQueueWhenStopped))
-			{
-				result = AudioQueueDispose(inAQ, true);
-					AssertNoError("Error disposing queue", end);
-				result = THIS->SetupQueue(CurFileInfo);
-					AssertNoError("Error setting up new queue", end);
-				result = THIS->SetupBuffers(CurFileInfo);
-					AssertNoError("Error setting up new queue buffers", end);
-				result = THIS->Start();
-					AssertNoError("Error starting queue", end);
-			}
-		end:
-			return;
+			if (!IsValid(inBus))
+				return kSoundEngineErrInvalidID;
+			mBuses[inBus].mLowPass = inCutoff;
+			return noErr;
 		}
 		
-		static Boolean DisposeBuffer(AudioQueueRef inAQ, std::vector<AudioQueueBufferRef> inDisposeBufferList, AudioQueueBufferRef inBufferToDispose)
+		// sections of inBus, then of each parent up to its category bus, for the given sample rate
+		void GetDSPCoefficients(SoundEngineBusID inBus, Float64 inSampleRate, std::vector<double> &outCoefficients)
 		{
-			for (unsigned int i=0; i < inDisposeBufferList.size(); i++)
+			SoundEngineBusID theBus = inBus;
+			while (theBus != kSoundEngineBus_Master)
 			{
-				if (inBufferToDispose == inDisposeBufferList[i])
+				Bus &theBusInfo = mBuses[theBus];
+				for (UInt32 i = 0; i < kSoundEngineMaxFilterSections; ++i)
 				{
-					OSStatus result = AudioQueueFreeBuffer(inAQ, inBufferToDispose);
-					if (result == noErr)
-						inDisposeBufferList.pop_back();
-					return true;
+					Filter &theFilter = theBusInfo.mFilters[i];
+					SoundEngineDSPChain::AddFilterSection(outCoefficients, theFilter.mType, theFilter.mFrequency, theFilter.mQ, theFilter.mGainDB, inSampleRate);
 				}
+				if (theBusInfo.mLowPass > 0.0)
+					SoundEngineDSPChain::AddLowPassSection(outCoefficients, theBusInfo.mLowPass, inSampleRate);
+				theBus = theBusInfo.mParent;
 			}
-			return false;
 		}
 		
-		enum {
-			kQueueState_DoNothing		= 0,
-			kQueueState_ResizeBuffer	= 1,
-			kQueueState_NeedNewCookie	= 2,
-			kQueueState_NeedNewBuffers	= 3,
-			kQueueState_NeedNewQueue	= 4,
-		};
+		// The activity of a bus is the level it is heard at, used as the key signal for ducking.
+		// Effects buses get it from the voice update thread (sum of the audible gain of the real 
+		// voices), other buses from whoever plays into them through SoundEngine_SetBusActivity.
+		void SetActivity(SoundEngineBusID inBus, Float32 inLevel) { mBuses[inBus].mActivity = inLevel; }
+		Float32 GetActivity(SoundEngineBusID inBus) { return mBuses[inBus].mActivity; }
 		
-		static SInt8 GetQueueStateForNextBuffer(BackgroundTrackMgr::BG_FileInfo *inFileInfo, BackgroundTrackMgr::BG_FileInfo *inNextFileInfo)
+		// ioLevels holds the level of the voices routed to each bus, sub-buses are summed into parents
+		void SetCategoryActivity(SoundEngineBusID inCategory, Float32 *ioLevels)
 		{
-			inFileInfo->mFileDataInQueue = false;
-			
-			// unless the data formats are the same, we need a new queue
-			if (!FormatIsEqual(inFileInfo->mFileFormat, inNextFileInfo->mFileFormat))
-				return kQueueState_NeedNewQueue;
-				
-			// if going from a load-at-once file to streaming or vice versa, we need new buffers
-			if (inFileInfo->mLoadAtOnce != inNextFileInfo->mLoadAtOnce)
-				return kQueueState_NeedNewBuffers;
-			
-			// if the next file is smaller than the current, we just need to resize
-			if (inNextFileInfo->mLoadAtOnce)
-				return (inFileInfo->mFileDataSize >= inNextFileInfo->mFileDataSize) ? kQueueState_ResizeBuffer : kQueueState_NeedNewBuffers;
-				
-			return kQueueState_NeedNewCookie;
+			for (UInt32 i = mNumBuses - 1; i > kSoundEngineBus_Master; --i)
+			{
+				if (mBuses[i].mCategory != inCategory)
+					continue;
+				if (i != inCategory)
+					ioLevels[mBuses[i].mParent] += ioLevels[i];
+				mBuses[i].mActivity = ioLevels[i];
+			}
 		}
 		
-		static void QueueCallback(	void *					inUserData,
-									AudioQueueRef			inAQ,
-									AudioQueueBufferRef		inCompleteAQBuffer) 
+		OSStatus AddDucking(SoundEngineBusID inKeyBus, SoundEngineBusID inTargetBus, Float32 inThreshold, Float32 inDepthDB, Float32 inAttackMs, Float32 inReleaseMs, UInt32 *outDuckingID)
 		{
-			// dispose of the buffer if no longer in use
-			OSStatus result = noErr;
-			BackgroundTrackMgr *THIS = (BackgroundTrackMgr*)inUserData;
-			if (DisposeBuffer(inAQ, THIS->mBuffersToDispose, inCompleteAQBuffer))
-				return;
+			if (!IsValid(inKeyBus) || !IsValid(inTargetBus))
+				return kSoundEngineErrInvalidID;
 			
-			if (THIS->mStopped){
-				return;
+			for (UInt32 i = 0; i < kSoundEngineMaxDuckings; ++i)
+			{
+				Ducking &theDucking = mDuckings[i];
+				if (theDucking.mInUse)
+					continue;
+				theDucking.mKeyBus = inKeyBus;
+				theDucking.mTargetBus = inTargetBus;
+				theDucking.mThreshold = inThreshold;
+				theDucking.mDepth = pow(10.0, -fabs(inDepthDB) / 20.0);
+				theDucking.mAttack = (inAttackMs > 0.0) ? inAttackMs * 0.001 : 0.001;
+				theDucking.mRelease = (inReleaseMs > 0.0) ? inReleaseMs * 0.001 : 0.001;
+				OSMemoryBarrier();
+				theDucking.mInUse = true;
+				*outDuckingID = i;
+				return noErr;
 			}
-			
-			UInt32 nPackets = 0;
-			// loop the current buffer if the following:
+			return kSoundEngineErrNoSourcesAvailable;
+		}
+		
+		OSStatus RemoveDucking(UInt32 inDuckingID)
+		{
+			if ((inDuckingID >= kSoundEngineMaxDuckings) || !mDuckings[inDuckingID].mInUse)
+				return kSoundEngineErrInvalidID;
+			mDuckings[inDuckingID].mInUse = false;
+			return noErr;
+		}
+		
+		// Called once per block from a music tap. Moves the gain of each ducking that applies to inBus 
+		// towards its target with a one-pole attack/release, and returns the overall gain.
+		Float32 UpdateDuckingGains(SoundEngineBusID inBus, Float32 *ioGains, Float64 inBlockSeconds)
+		{
+			Float32 theGain = 1.0;
+			for (UInt32 i = 0; i < kSoundEngineMaxDuckings; ++i)
+			{
+				Ducking &theDucking = mDuckings[i];
+				Float32 theTarget = 1.0;
+				if (theDucking.mInUse && IsDescendant(inBus, theDucking.mTargetBus) && (mBuses[theDucking.mKeyBus].mActivity > theDucking.mThreshold))
+					theTarget = theDucking.mDepth;
+				
+				Float32 theTime = (theTarget < ioGains[i]) ? theDucking.mAttack : theDucking.mRelease;
+				Float32 theCoefficient = expf(-inBlockSeconds / theTime);
+				ioGains[i] = theTarget + (ioGains[i] - theTarget) * theCoefficient;
+				theGain *= ioGains[i];
+			}
+			return theGain;
+		}
+		
+		Boolean IsDescendant(SoundEngineBusID inBus, SoundEngineBusID inAncestor)
+		{
+			for (SoundEngineBusID theBus = inBus; theBus != kSoundEngineBus_Master; theBus = mBuses[theBus].mParent)
+			{
+				if (theBus == inAncestor)
+					return true;
+			}
+			return inAncestor == kSoundEngineBus_Master;
+		}
+
+	private:
+		SoundEngineBusID AddBus(SoundEngineBusID inParent)
+		{
+			Bus &theBus = mBuses[mNumBuses];
+			theBus.mParent = inParent;
+			theBus.mVolume = 1.0;
+			theBus.mGain = 1.0;
+			theBus.mGainBelowCategory = 1.0;
+			theBus.mCategory = kSoundEngineBus_Master;
+			for (UInt32 i = 0; i < kSoundEngineMaxFilterSections; ++i)
+				theBus.mFilters[i].mType = kSoundEngineFilter_None;
+			theBus.mLowPass = 0.0;
+			theBus.mActivity = 0.0;
+			return mNumBuses++;
+		}
+		
+		void UpdateGains()
+		{
+			mBuses[kSoundEngineBus_Master].mGain = mBuses[kSoundEngineBus_Master].mVolume;
+			for (UInt32 i = kSoundEngineBus_Master + 1; i < mNumBuses; ++i)
+			{
+				Bus &theBus = mBuses[i];
+				Bus &theParent = mBuses[theBus.mParent];
+				theBus.mGain = theBus.mVolume * theParent.mGain;
+				if (theBus.mParent == kSoundEngineBus_Master)
+				{
+					theBus.mCategory = i;
+					theBus.mGainBelowCategory = 1.0;
+				}
+				else
+				{
+					theBus.mCategory = theParent.mCategory;
+					theBus.mGainBelowCategory = theBus.mVolume * theParent.mGainBelowCategory;
+				}
+			}
+		}
+		
+		struct Filter {
+			UInt32								mType;
+			Float32								mFrequency;
+			Float32								mQ;
+			Float32								mGainDB;
+		};
+		
+		struct Bus {
+			SoundEngineBusID					mParent;
+			SoundEngineBusID					mCategory;
+			Float32								mVolume;
+			Float32								mGain;
+			Float32								mGainBelowCategory;
+			Filter								mFilters[kSoundEngineMaxFilterSections];
+			Float32								mLowPass;
+			Float32								mActivity;
+		};
+		
+		struct Ducking {
+			SoundEngineBusID					mKeyBus;
+			SoundEngineBusID					mTargetBus;
+			Float32								mThreshold;
+			Float32								mDepth;			// linear gain when fully ducked
+			Float32								mAttack;		// seconds
+			Float32								mRelease;
+			volatile Boolean					mInUse;
+		};
+		
+		Bus										mBuses[kSoundEngineMaxBuses];
+		UInt32									mNumBuses;
+		Ducking									mDuckings[kSoundEngineMaxDuckings];
+};
+
+static SoundEngineBusGraph	sBusGraph;
+
+#pragma mark ***** SoundEngineMeters *****
+//==================================================================================================
+//	SoundEngineMeters class
+//==================================================================================================
+// Peak and RMS levels, linear, of the buses and of a few selected voices, as heard at the output.
+// A level pair is packed in 64 bits, so it is published and read with one atomic access and the
+// read side never waits. Music queues are measured with vDSP in their tap, on the block it has just
+// processed. Effects are mixed by OpenAL, out of reach, so each effect gets an envelope when it is
+// loaded and the voice update pass reads it at the play cursor of the voice.
+union SoundEngineMeterLevels
+{
+	struct {
+		Float32							mPeak;
+		Float32							mRMS;
+	}									mLevels;
+	int64_t								mBits;
+};
+
+static inline Float32 MeterBitsToFloat(int32_t inBits) { union { int32_t i; Float32 f; } theValue; theValue.i = inBits; return theValue.f; }
+static inline int32_t MeterFloatToBits(Float32 inValue) { union { int32_t i; Float32 f; } theValue; theValue.f = inValue; return theValue.i; }
+static inline int64_t MeterLoad64(volatile int64_t *inValue) { return OSAtomicAdd64Barrier(0, inValue); }
+
+static inline void MeterStore64(volatile int64_t *ioValue, int64_t inValue)
+{
+	int64_t theOld;
+	do theOld = *ioValue;
+	while (!OSAtomicCompareAndSwap64Barrier(theOld, inValue, ioValue));
+}
+
+class SoundEngineMeter
+{
+	public:
+		SoundEngineMeter()
+			:	mPeakBits(0),
+				mEnergyBits(0),
+				mWindowStart(0),
+				mLevels(0),
+				mPublishTime(0)
+		{
+		}
+		
+		// From any thread: a block of inSeconds is added to the window being measured. Whoever adds
+		// the block that closes the window publishes it.
+		void Add(Float32 inPeak, Float32 inMeanSquare, Float64 inSeconds, UInt64 inNow)
+		{
+			int32_t theOld;
+			do theOld = mPeakBits;
+			while ((inPeak > MeterBitsToFloat(theOld)) && !OSAtomicCompareAndSwap32Barrier(theOld, MeterFloatToBits(inPeak), &mPeakBits));
+			do theOld = mEnergyBits;
+			while (!OSAtomicCompareAndSwap32Barrier(theOld, MeterFloatToBits(MeterBitsToFloat(theOld) + inMeanSquare * inSeconds), &mEnergyBits));
+			
+			int64_t theStart = mWindowStart;
+			if (theStart == 0)
+			{
+				OSAtomicCompareAndSwap64Barrier(0, (int64_t)inNow, &mWindowStart);
+				return;
+			}
+			if ((inNow - (UInt64)theStart < SecondsToHostTime(kMeterWindow)) || !OSAtomicCompareAndSwap64Barrier(theStart, (int64_t)inNow, &mWindowStart))
+				return;
+			
+			Float32 thePeak = MeterBitsToFloat(Take(&mPeakBits));
+			Float32 theEnergy = MeterBitsToFloat(Take(&mEnergyBits));
+			Publish(thePeak, sqrtf(theEnergy / HostTimeToSeconds(inNow - (UInt64)theStart)), inNow);
+		}
+		
+		// one writer at a time
+		void Publish(Float32 inPeak, Float32 inRMS, UInt64 inNow)
+		{
+			SoundEngineMeterLevels theLevels;
+			theLevels.mLevels.mPeak = inPeak;
+			theLevels.mLevels.mRMS = inRMS;
+			MeterStore64(&mLevels, theLevels.mBits);
+			MeterStore64(&mPublishTime, (int64_t)inNow);
+		}
+		
+		// silence once nothing was published for a while, the source stopped or went away
+		void Read(Float32 *outPeak, Float32 *outRMS)
+		{
+			SoundEngineMeterLevels theLevels;
+			theLevels.mBits = MeterLoad64(&mLevels);
+			UInt64 thePublishTime = (UInt64)MeterLoad64(&mPublishTime);
+			if ((thePublishTime == 0) || (mach_absolute_time() - thePublishTime > SecondsToHostTime(kMeterStaleTime)))
+				theLevels.mLevels.mPeak = theLevels.mLevels.mRMS = 0.0;
+			if (outPeak)
+				*outPeak = theLevels.mLevels.mPeak;
+			if (outRMS)
+				*outRMS = theLevels.mLevels.mRMS;
+		}
+		
+	private:
+		static int32_t Take(volatile int32_t *ioBits)
+		{
+			int32_t theOld;
+			do theOld = *ioBits;
+			while (!OSAtomicCompareAndSwap32Barrier(theOld, 0, ioBits));
+			return theOld;
+		}
+		
+		volatile int32_t						mPeakBits;		// Float32, of the window being measured
+		volatile int32_t						mEnergyBits;	// Float32, mean square times seconds
+		volatile int64_t						mWindowStart;	// host time
+		volatile int64_t						mLevels;		// SoundEngineMeterLevels, last window
+		volatile int64_t						mPublishTime;
+};
+
+// Levels of an effect, one peak and mean square per kMeterBlockFrames over all its channels.
+class SoundEngineEnvelope
+{
+	public:
+		SoundEngineEnvelope()
+			:	mLevels(NULL),
+				mBlocks(0)
+		{
+		}
+		
+		~SoundEngineEnvelope() { free(mLevels); }
+		
+		void Build(const void *inData, UInt32 inFrames, UInt32 inChannels, UInt32 inBitsPerChannel)
+		{
+			free(mLevels);
+			mBlocks = (inFrames + kMeterBlockFrames - 1) / kMeterBlockFrames;
+			mLevels = (Float32*)malloc(2 * mBlocks * sizeof(Float32));
+			if ((mLevels == NULL) || (inChannels > 2))
+			{
+				mBlocks = 0;
+				return;
+			}
+			
+			Float32 theSamples[kMeterBlockFrames * 2];
+			Float32 theScale = (inBitsPerChannel == 16) ? 1.0 / 32768.0 : 1.0 / 128.0;
+			for (UInt32 i = 0; i < mBlocks; ++i)
+			{
+				UInt32 theFirst = i * kMeterBlockFrames * inChannels;
+				vDSP_Length theCount = std::min<UInt32>(kMeterBlockFrames, inFrames - i * kMeterBlockFrames) * inChannels;
+				if (inBitsPerChannel == 16)
+					vDSP_vflt16((const short*)inData + theFirst, 1, theSamples, 1, theCount);
+				else
+				{
+					// 8 bit samples are unsigned, centered on 128
+					Float32 theOffset = -128.0;
+					vDSP_vfltu8((const unsigned char*)inData + theFirst, 1, theSamples, 1, theCount);
+					vDSP_vsadd(theSamples, 1, &theOffset, theSamples, 1, theCount);
+				}
+				Float32 thePeak, theMeanSquare;
+				vDSP_maxmgv(theSamples, 1, &thePeak, theCount);
+				vDSP_measqv(theSamples, 1, &theMeanSquare, theCount);
+				mLevels[2 * i] = thePeak * theScale;
+				mLevels[2 * i + 1] = theMeanSquare * theScale * theScale;
+			}
+		}
+		
+		// the frames from inStart to inEnd, at least the block inStart falls in. Frames before 0 are the
+		// lead-in of a trimmed effect, silence.
+		void Measure(Float64 inStart, Float64 inEnd, Float32 &ioPeak, Float32 &ioMeanSquares, UInt32 &ioBlocks) const
+		{
+			if (inEnd <= 0.0)
+				return;
+			if (inStart < 0.0)
+				inStart = 0.0;
+			UInt32 theFirst = (UInt32)(inStart / kMeterBlockFrames);
+			UInt32 theEnd = std::min<UInt32>((UInt32)ceil(inEnd / kMeterBlockFrames), mBlocks);
+			if (theEnd <= theFirst)
+				theEnd = std::min<UInt32>(theFirst + 1, mBlocks);
+			for (UInt32 i = theFirst; i < theEnd; ++i)
+			{
+				if (mLevels[2 * i] > ioPeak)
+					ioPeak = mLevels[2 * i];
+				ioMeanSquares += mLevels[2 * i + 1];
+				++ioBlocks;
+			}
+		}
+		
+		// the blocks from outFirst to outEnd hold every peak at or above inThreshold, false if none does
+		Boolean FindSound(Float32 inThreshold, UInt32 &outFirst, UInt32 &outEnd) const
+		{
+			outFirst = 0;
+			while ((outFirst < mBlocks) && (mLevels[2 * outFirst] < inThreshold))
+				++outFirst;
+			outEnd = mBlocks;
+			while ((outEnd > outFirst) && (mLevels[2 * (outEnd - 1)] < inThreshold))
+				--outEnd;
+			return outEnd > outFirst;
+		}
+		
+		// keeps the blocks from inFirst to inEnd, once the data has been trimmed the same way
+		void Trim(UInt32 inFirst, UInt32 inEnd)
+		{
+			memmove(mLevels, mLevels + 2 * inFirst, 2 * (inEnd - inFirst) * sizeof(Float32));
+			mBlocks = inEnd - inFirst;
+		}
+		
+		// peak and RMS of the whole effect
+		void GetLevels(Float32 &outPeak, Float32 &outRMS) const
+		{
+			Float32 theMeanSquares = 0.0;
+			UInt32 theBlocks = 0;
+			outPeak = 0.0;
+			Measure(0.0, (Float64)mBlocks * kMeterBlockFrames, outPeak, theMeanSquares, theBlocks);
+			outRMS = (theBlocks) ? sqrtf(theMeanSquares / theBlocks) : 0.0;
+		}
+		
+	private:
+		Float32 *								mLevels;
+		UInt32									mBlocks;
+};
+
+class SoundEngineMeters
+{
+	public:
+		SoundEngineMeters()
+			:	mBusMetering(false)
+		{
+			for (UInt32 i = 0; i < kVoiceMeterSlots; ++i)
+				mVoiceSlots[i].mVoiceID = 0;
+		}
+		
+		void SetBusMetering(Boolean inEnable) { mBusMetering = inEnable; }
+		Boolean IsBusMetering() { return mBusMetering; }
+		
+		// a block of what inBus itself plays, counted in inBus and every bus above it
+		void MeterBus(SoundEngineBusID inBus, Float32 inPeak, Float32 inMeanSquare, Float64 inSeconds, UInt64 inNow)
+		{
+			SoundEngineBusID theBus = inBus;
+			while (theBus != kSoundEngineBus_Master)
+			{
+				mBuses[theBus].Add(inPeak, inMeanSquare, inSeconds, inNow);
+				theBus = sBusGraph.GetParent(theBus);
+			}
+			mBuses[kSoundEngineBus_Master].Add(inPeak, inMeanSquare, inSeconds, inNow);
+		}
+		
+		void ReadBus(SoundEngineBusID inBus, Float32 *outPeak, Float32 *outRMS) { mBuses[inBus].Read(outPeak, outRMS); }
+		
+		// slots are handed out under the voice lock, published by the thread updating the voice
+		OSStatus AddVoice(SoundEngineVoiceID inVoiceID, UInt32 *outSlot)
+		{
+			for (UInt32 i = 0; i < kVoiceMeterSlots; ++i)
+			{
+				if (mVoiceSlots[i].mVoiceID)
+					continue;
+				mVoiceSlots[i].mMeter.Publish(0.0, 0.0, 0);
+				OSMemoryBarrier();
+				mVoiceSlots[i].mVoiceID = inVoiceID;
+				*outSlot = i;
+				return noErr;
+			}
+			return kSoundEngineErrNoSourcesAvailable;
+		}
+		
+		void RemoveVoice(UInt32 inSlot) { mVoiceSlots[inSlot].mVoiceID = 0; }
+		
+		void RemoveAllVoices()
+		{
+			for (UInt32 i = 0; i < kVoiceMeterSlots; ++i)
+				mVoiceSlots[i].mVoiceID = 0;
+		}
+		
+		void PublishVoice(UInt32 inSlot, Float32 inPeak, Float32 inRMS, UInt64 inNow) { mVoiceSlots[inSlot].mMeter.Publish(inPeak, inRMS, inNow); }
+		
+		OSStatus ReadVoice(SoundEngineVoiceID inVoiceID, Float32 *outPeak, Float32 *outRMS)
+		{
+			for (UInt32 i = 0; i < kVoiceMeterSlots; ++i)
+			{
+				if (mVoiceSlots[i].mVoiceID == inVoiceID)
+				{
+					mVoiceSlots[i].mMeter.Read(outPeak, outRMS);
+					return noErr;
+				}
+			}
+			return kSoundEngineErrInvalidID;
+		}
+		
+	private:
+		struct VoiceSlot {
+			volatile SoundEngineVoiceID			mVoiceID;		// 0 when free
+			SoundEngineMeter					mMeter;
+		};
+		
+		SoundEngineMeter						mBuses[kSoundEngineMaxBuses];
+		VoiceSlot								mVoiceSlots[kVoiceMeterSlots];
+		volatile Boolean						mBusMetering;
+};
+
+static SoundEngineMeters	sMeters;
+
+#pragma mark ***** SoundEngineProfiler *****
+//==================================================================================================
+//	SoundEngineProfiler class
+//==================================================================================================
+// Histograms of the time the render paths take: the processing tap of each music queue, and the 
+// passes of the voice update thread which is where the engine spends its time on effects (the 
+// mixing itself happens inside OpenAL). Recording is a few atomic adds, so any thread can record 
+// or read at any time; a reader may see a sample in the count before it is in the bins.
+class SoundEngineHistogram
+{
+	public:
+		// inScale converts recorded values to reported ones, inBinWidth 0 means power of two bins
+		void Init(UInt32 inScale, UInt32 inBinWidth)
+		{
+			mScale = inScale;
+			mBinWidth = inBinWidth;
+			Reset();
+		}
+		
+		void Record(UInt32 inValue)
+		{
+			UInt32 theBin;
+			UInt32 theReported = inValue / mScale;
+			if (mBinWidth)
+				theBin = theReported / mBinWidth;
+			else
+				theBin = theReported ? 32 - __builtin_clz(theReported) : 0;
+			if (theBin >= kSoundEngineProfileBins)
+				theBin = kSoundEngineProfileBins - 1;
+			
+			OSAtomicIncrement32(&mBins[theBin]);
+			OSAtomicAdd64(inValue, &mTotal);
+			OSAtomicIncrement32(&mCount);
+			
+			SInt32 theMax = mMax;
+			while (((SInt32)inValue > theMax) && !OSAtomicCompareAndSwap32Barrier(theMax, inValue, &mMax))
+				theMax = mMax;
+		}
+		
+		void Get(SoundEngineProfile *outProfile)
+		{
+			outProfile->mCount = mCount;
+			outProfile->mMean = outProfile->mCount ? (Float32)mTotal / outProfile->mCount / mScale : 0.0;
+			outProfile->mMax = (Float32)mMax / mScale;
+			for (UInt32 i = 0; i < kSoundEngineProfileBins; ++i)
+				outProfile->mBins[i] = mBins[i];
+		}
+		
+		void Reset()
+		{
+			for (UInt32 i = 0; i < kSoundEngineProfileBins; ++i)
+				mBins[i] = 0;
+			mCount = 0;
+			mTotal = 0;
+			mMax = 0;
+		}
+		
+	private:
+		volatile SInt32							mBins[kSoundEngineProfileBins];
+		volatile SInt32							mCount;
+		volatile SInt64							mTotal;
+		volatile SInt32							mMax;
+		UInt32									mScale;
+		UInt32									mBinWidth;
+};
+
+class SoundEngineProfiler
+{
+	public:
+		SoundEngineProfiler()
+			:	mEnabled(false)
+		{
+			// times are recorded in ns and reported in us, loads in 1/100 % and reported in %
+			for (UInt32 i = 0; i < kSoundEngineProfileMetrics; ++i)
+			{
+				Boolean isLoad = (i == kSoundEngineProfile_MusicBlockLoad) || (i == kSoundEngineProfile_EffectsPassLoad);
+				mMetrics[i].Init(isLoad ? 100 : 1000, isLoad ? kSoundEngineProfileLoadBinWidth : 0);
+			}
+			for (UInt32 i = 0; i < kSoundEngineMaxBuses; ++i)
+				mBuses[i].Init(1000, 0);
+		}
+		
+		Boolean IsEnabled() const { return mEnabled; }
+		void SetEnabled(Boolean inEnabled) { mEnabled = inEnabled; }
+		
+		// one block of a render path: its wall time and the share of its deadline it used
+		void RecordBlock(UInt32 inTimeMetric, UInt32 inLoadMetric, Float64 inSeconds, Float64 inDeadline)
+		{
+			mMetrics[inTimeMetric].Record(ToValue(inSeconds * 1.0e9));
+			if (inDeadline > 0.0)
+				mMetrics[inLoadMetric].Record(ToValue(inSeconds / inDeadline * 10000.0));
+		}
+		
+		void RecordVoice(Float64 inSeconds) { mMetrics[kSoundEngineProfile_VoiceTime].Record(ToValue(inSeconds * 1.0e9)); }
+		void RecordBus(SoundEngineBusID inBus, Float64 inSeconds) { mBuses[inBus].Record(ToValue(inSeconds * 1.0e9)); }
+		void RecordRead(UInt32 inClass, Float64 inSeconds) { mMetrics[kSoundEngineProfile_StreamReadLatency + inClass].Record(ToValue(inSeconds * 1.0e9)); }
+		
+		OSStatus Get(UInt32 inMetric, SoundEngineProfile *outProfile)
+		{
+			if (inMetric >= kSoundEngineProfileMetrics)
+				return kSoundEngineErrInvalidID;
+			mMetrics[inMetric].Get(outProfile);
+			return noErr;
+		}
+		
+		OSStatus GetBus(SoundEngineBusID inBus, SoundEngineProfile *outProfile)
+		{
+			if (inBus >= kSoundEngineMaxBuses)
+				return kSoundEngineErrInvalidID;
+			mBuses[inBus].Get(outProfile);
+			return noErr;
+		}
+		
+		void Reset()
+		{
+			for (UInt32 i = 0; i < kSoundEngineProfileMetrics; ++i)
+				mMetrics[i].Reset();
+			for (UInt32 i = 0; i < kSoundEngineMaxBuses; ++i)
+				mBuses[i].Reset();
+		}
+		
+	private:
+		static UInt32 ToValue(Float64 inValue) { return (inValue < 2.0e9) ? (UInt32)inValue : 2000000000; }
+		
+		volatile Boolean						mEnabled;
+		SoundEngineHistogram					mMetrics[kSoundEngineProfileMetrics];
+		SoundEngineHistogram					mBuses[kSoundEngineMaxBuses];
+};
+
+static SoundEngineProfiler	sProfiler;
+
+class SoundEngineLock
+{
+	public:
+		SoundEngineLock(pthread_mutex_t &inMutex) : mMutex(inMutex) 
+		{ 
+			sRealtimeGuard.Check(kSoundEngineRealtimeViolation_Lock);
+			pthread_mutex_lock(&mMutex); 
+		}
+		~SoundEngineLock() { pthread_mutex_unlock(&mMutex); }
+	private:
+		pthread_mutex_t &mMutex;
+};
+
+#pragma mark ***** SoundEngineIOScheduler *****
+//==================================================================================================
+//	SoundEngineIOScheduler class
+//==================================================================================================
+enum {
+	kIOClass_Stream			= 0,	// music refills, an underrun is audible
+	kIOClass_Speech			= 1,
+	kIOClass_Load			= 2,	// whole effects and tracks loaded at once
+	kIOClasses				= 3,
+};
+
+struct SoundEngineIORequest
+{
+	UInt32							mClass;
+	UInt64							mDeadline;		// host time, requests of a class are served earliest first
+	UInt64							mSubmitTime;
+	AudioFileID						mAFID;
+	Boolean							mPackets;		// AudioFileReadPackets, else AudioFileReadBytes
+	SInt64							mStart;			// first packet or byte
+	UInt32							mNumPackets;
+	UInt32							mNumBytes;
+	AudioStreamPacketDescription*	mPacketDescs;
+	void*							mBuffer;
+	OSStatus						mResult;
+	Boolean							mDone;
+};
+
+// All the disk reads of the engine go through one thread. It serves stream refills first, then
+// speech, then bulk loads, earliest deadline first within a class, so a refill waits at most for 
+// the read in progress. Pending byte reads of the same file that continue each other on disk and 
+// in memory are merged into one read, unless streams are refilling: then a load is read one chunk
+// at a time so a refill never waits behind more than a chunk. Callers block until their request 
+// is served, which keeps the reading code where it was.
+class SoundEngineIOScheduler
+{
+	public:
+		SoundEngineIOScheduler()
+			:	mThreadState(kThreadState_None),
+				mMaxQueueDepth(0),
+				mLastRefillTime(0)
+		{
+			pthread_mutex_init(&mLock, NULL);
+			pthread_cond_init(&mWorkCondition, NULL);
+			pthread_cond_init(&mDoneCondition, NULL);
+		}
+		
+		OSStatus ReadPackets(UInt32 inClass, Float64 inDeadline, AudioFileID inAFID, UInt32 *outNumBytes, AudioStreamPacketDescription *outPacketDescs, 
+								SInt64 inStartPacket, UInt32 *ioNumPackets, void *outBuffer)
+		{
+			SoundEngineIORequest theRequest;
+			InitRequest(theRequest, inClass, inDeadline, inAFID, inStartPacket, outBuffer);
+			theRequest.mPackets = true;
+			theRequest.mNumPackets = *ioNumPackets;
+			theRequest.mPacketDescs = outPacketDescs;
+			
+			Execute(&theRequest, 1);
+			*outNumBytes = theRequest.mNumBytes;
+			*ioNumPackets = theRequest.mNumPackets;
+			return theRequest.mResult;
+		}
+		
+		OSStatus ReadBytes(UInt32 inClass, Float64 inDeadline, AudioFileID inAFID, SInt64 inStartByte, UInt32 *ioNumBytes, void *outBuffer)
+		{
+			UInt32 theCount = (*ioNumBytes + kIOChunkBytes - 1) / kIOChunkBytes;
+			if (theCount == 0)
+				return noErr;
+			
+			std::vector<SoundEngineIORequest> theRequests(theCount);
+			for (UInt32 i = 0; i < theCount; ++i)
+			{
+				UInt32 theOffset = i * kIOChunkBytes;
+				InitRequest(theRequests[i], inClass, inDeadline, inAFID, inStartByte + theOffset, (char*)outBuffer + theOffset);
+				theRequests[i].mNumBytes = std::min<UInt32>(kIOChunkBytes, *ioNumBytes - theOffset);
+			}
+			Execute(&theRequests[0], theCount);
+			
+			OSStatus result = noErr;
+			UInt32 theBytesRead = 0;
+			for (UInt32 i = 0; i < theCount; ++i)
+			{
+				theBytesRead += theRequests[i].mNumBytes;
+				if (theRequests[i].mResult && !result)
+					result = theRequests[i].mResult;
+			}
+			*ioNumBytes = theBytesRead;
+			return result;
+		}
+		
+		void GetQueueDepth(UInt32 *outDepth, UInt32 *outMaxDepth)
+		{
+			SoundEngineLock theLock(mLock);
+			if (outDepth)
+				*outDepth = mPending.size();
+			if (outMaxDepth)
+				*outMaxDepth = mMaxQueueDepth;
+		}
+		
+		void ResetQueueDepth()
+		{
+			SoundEngineLock theLock(mLock);
+			mMaxQueueDepth = mPending.size();
+		}
+		
+		// Serves what is pending and joins the thread, the next read starts a new one.
+		void Stop()
+		{
+			pthread_mutex_lock(&mLock);
+			if (mThreadState != kThreadState_Running)
+			{
+				pthread_mutex_unlock(&mLock);
+				return;
+			}
+			mThreadState = kThreadState_Stopping;
+			pthread_cond_signal(&mWorkCondition);
+			pthread_mutex_unlock(&mLock);
+			
+			pthread_join(mThread, NULL);
+			
+			SoundEngineLock theLock(mLock);
+			mThreadState = kThreadState_None;
+		}
+		
+	private:
+		enum {
+			kThreadState_None		= 0,
+			kThreadState_Running	= 1,
+			kThreadState_Failed		= 2,	// reads are served on the calling thread
+			kThreadState_Stopping	= 3,	// as well, until the thread is joined
+		};
+		
+		void InitRequest(SoundEngineIORequest &outRequest, UInt32 inClass, Float64 inDeadline, AudioFileID inAFID, SInt64 inStart, void *inBuffer)
+		{
+			memset(&outRequest, 0, sizeof(outRequest));
+			outRequest.mClass = inClass;
+			outRequest.mSubmitTime = mach_absolute_time();
+			outRequest.mDeadline = (inDeadline > 0.0) ? outRequest.mSubmitTime + SecondsToHostTime(inDeadline) : 0xFFFFFFFFFFFFFFFFULL;
+			outRequest.mAFID = inAFID;
+			outRequest.mStart = inStart;
+			outRequest.mBuffer = inBuffer;
+		}
+		
+		void Execute(SoundEngineIORequest *inRequests, UInt32 inCount)
+		{
+			sRealtimeGuard.Check(kSoundEngineRealtimeViolation_Syscall);
+			pthread_mutex_lock(&mLock);
+			if (mThreadState == kThreadState_None)
+				mThreadState = pthread_create(&mThread, NULL, ThreadEntry, this) ? kThreadState_Failed : kThreadState_Running;
+			if (inRequests[0].mClass != kIOClass_Load)
+				mLastRefillTime = inRequests[0].mSubmitTime;
+			
+			if (mThreadState != kThreadState_Running)
+			{
+				pthread_mutex_unlock(&mLock);
+				for (UInt32 i = 0; i < inCount; ++i)
+					ServeInline(&inRequests[i]);
+				return;
+			}
+			
+			for (UInt32 i = 0; i < inCount; ++i)
+				mPending.push_back(&inRequests[i]);
+			if (mPending.size() > mMaxQueueDepth)
+				mMaxQueueDepth = mPending.size();
+			pthread_cond_signal(&mWorkCondition);
+			
+			for (UInt32 i = 0; i < inCount; ++i)
+				while (!inRequests[i].mDone)
+					pthread_cond_wait(&mDoneCondition, &mLock);
+			pthread_mutex_unlock(&mLock);
+		}
+		
+		static Boolean IsMoreUrgent(const SoundEngineIORequest *inA, const SoundEngineIORequest *inB)
+		{
+			if (inA->mClass != inB->mClass)
+				return inA->mClass < inB->mClass;
+			if (inA->mDeadline != inB->mDeadline)
+				return inA->mDeadline < inB->mDeadline;
+			return inA->mSubmitTime < inB->mSubmitTime;
+		}
+		
+		// takes the most urgent request and the byte reads it can be merged with, called with the lock held
+		UInt32 TakeNext(SoundEngineIORequest **outBatch, UInt32 inMaxBatch)
+		{
+			UInt32 theBest = 0;
+			for (UInt32 i = 1; i < mPending.size(); ++i)
+				if (IsMoreUrgent(mPending[i], mPending[theBest]))
+					theBest = i;
+			outBatch[0] = mPending[theBest];
+			mPending.erase(mPending.begin() + theBest);
+			
+			// while streams refill, a load is not merged past one chunk and refills get in between
+			UInt32 theMaxBytes = kIOMaxCoalescedBytes;
+			if ((outBatch[0]->mClass == kIOClass_Load) && (mach_absolute_time() - mLastRefillTime < SecondsToHostTime(kIORefillWindow)))
+				theMaxBytes = kIOChunkBytes;
+			
+			UInt32 theCount = 1;
+			UInt32 theBytes = outBatch[0]->mNumBytes;
+			Boolean isMerged = !outBatch[0]->mPackets;
+			while (isMerged && (theCount < inMaxBatch))
+			{
+				SoundEngineIORequest *theLast = outBatch[theCount - 1];
+				isMerged = false;
+				for (UInt32 i = 0; i < mPending.size(); ++i)
+				{
+					SoundEngineIORequest *theNext = mPending[i];
+					if (!theNext->mPackets && (theNext->mAFID == theLast->mAFID) && (theNext->mStart == theLast->mStart + theLast->mNumBytes) &&
+							(theNext->mBuffer == (char*)theLast->mBuffer + theLast->mNumBytes) && (theBytes + theNext->mNumBytes <= theMaxBytes))
+					{
+						outBatch[theCount++] = theNext;
+						theBytes += theNext->mNumBytes;
+						mPending.erase(mPending.begin() + i);
+						isMerged = true;
+						break;
+					}
+				}
+			}
+			return theCount;
+		}
+		
+		// reads a batch of contiguous requests at once, called without the lock
+		static void Serve(SoundEngineIORequest **inBatch, UInt32 inCount)
+		{
+			SoundEngineIORequest *theFirst = inBatch[0];
+			if (theFirst->mPackets)
+			{
+				theFirst->mResult = AudioFileReadPackets(theFirst->mAFID, false, &theFirst->mNumBytes, theFirst->mPacketDescs, theFirst->mStart, &theFirst->mNumPackets, theFirst->mBuffer);
+				return;
+			}
+			
+			UInt32 theBytes = 0;
+			for (UInt32 i = 0; i < inCount; ++i)
+				theBytes += inBatch[i]->mNumBytes;
+			OSStatus result = AudioFileReadBytes(theFirst->mAFID, false, theFirst->mStart, &theBytes, theFirst->mBuffer);
+			
+			// a short read leaves the end of the batch empty
+			for (UInt32 i = 0; i < inCount; ++i)
+			{
+				UInt32 theRequested = inBatch[i]->mNumBytes;
+				inBatch[i]->mNumBytes = std::min(theRequested, theBytes);
+				inBatch[i]->mResult = result;
+				theBytes -= inBatch[i]->mNumBytes;
+			}
+		}
+		
+		static void ServeInline(SoundEngineIORequest *inRequest)
+		{
+			Serve(&inRequest, 1);
+			inRequest->mDone = true;
+		}
+		
+		static void *ThreadEntry(void *inScheduler)
+		{
+			((SoundEngineIOScheduler*)inScheduler)->Run();
+			return NULL;
+		}
+		
+		void Run()
+		{
+			SoundEngineIORequest *theBatch[kIOMaxCoalescedBytes / kIOChunkBytes];
+			pthread_mutex_lock(&mLock);
+			while (true)
+			{
+				while (mPending.empty() && (mThreadState == kThreadState_Running))
+					pthread_cond_wait(&mWorkCondition, &mLock);
+				if (mPending.empty())
+					break;
+				
+				UInt32 theCount = TakeNext(theBatch, sizeof(theBatch) / sizeof(theBatch[0]));
+				pthread_mutex_unlock(&mLock);
+				
+				Serve(theBatch, theCount);
+				
+				if (sProfiler.IsEnabled())
+				{
+					UInt64 theNow = mach_absolute_time();
+					for (UInt32 i = 0; i < theCount; ++i)
+						sProfiler.RecordRead(theBatch[i]->mClass, HostTimeToSeconds(theNow - theBatch[i]->mSubmitTime));
+				}
+				
+				pthread_mutex_lock(&mLock);
+				for (UInt32 i = 0; i < theCount; ++i)
+					theBatch[i]->mDone = true;
+				pthread_cond_broadcast(&mDoneCondition);
+			}
+			pthread_mutex_unlock(&mLock);
+		}
+		
+		pthread_mutex_t							mLock;
+		pthread_cond_t							mWorkCondition;
+		pthread_cond_t							mDoneCondition;
+		pthread_t								mThread;
+		UInt32									mThreadState;
+		std::vector<SoundEngineIORequest*>		mPending;
+		UInt32									mMaxQueueDepth;
+		UInt64									mLastRefillTime;	// submit time of the last stream or speech read
+};
+
+static SoundEngineIOScheduler	sIOScheduler;
+
+#pragma mark ***** SoundEngineBlockPool *****
+//==================================================================================================
+//	SoundEngineBlockPool class
+//==================================================================================================
+// A fixed number of blocks, each large enough for one T, in storage that lives as long as the engine. 
+// The stream bookkeeping classes route their operator new and delete here, so playing tracks one after
+// the other reuses the same blocks and never goes to the heap. Allocate returns NULL once all the 
+// blocks are taken; the classes declare a non throwing operator new, so new returns NULL as well.
+template <class T, UInt32 N>
+class SoundEngineBlockPool
+{
+	public:
+		SoundEngineBlockPool()
+			:	mFreeCount(N)
+		{
+			pthread_mutex_init(&mLock, NULL);
+			for (UInt32 i = 0; i < N; ++i)
+				mFree[i] = N - 1 - i;
+		}
+		
+		void *Allocate()
+		{
+			SoundEngineLock theLock(mLock);
+			return mFreeCount ? &mBlocks[mFree[--mFreeCount]] : NULL;
+		}
+		
+		void Release(void *inBlock)
+		{
+			if (inBlock == NULL)
+				return;
+			SoundEngineLock theLock(mLock);
+			mFree[mFreeCount++] = (UInt32)((Block*)inBlock - mBlocks);
+		}
+		
+	private:
+		union Block {
+			char								mBytes[sizeof(T)];
+			UInt64								mAlignInt;
+			Float64								mAlignFloat;
+			void *								mAlignPointer;
+		};
+		
+		Block									mBlocks[N];
+		UInt32									mFree[N];
+		UInt32									mFreeCount;
+		pthread_mutex_t							mLock;
+};
+
+#pragma mark ***** SoundEngineCommandQueue *****
+//==================================================================================================
+//	SoundEngineCommandQueue class
+//==================================================================================================
+// Bounded queue any thread pushes to without taking a lock or allocating: a slot is claimed by a 
+// compare and swap on the enqueue position and published by bumping its sequence. There is a single
+// consumer. N must be a power of two.
+template <class T, UInt32 N>
+class SoundEngineCommandQueue
+{
+	public:
+		SoundEngineCommandQueue()
+			:	mEnqueuePos(0),
+				mDequeuePos(0)
+		{
+			for (UInt32 i = 0; i < N; ++i)
+				mSlots[i].mSequence = i;
+		}
+		
+		// false when the queue is full
+		Boolean Push(const T &inCommand)
+		{
+			while (true)
+			{
+				UInt32 thePos = (UInt32)mEnqueuePos;
+				Slot *theSlot = &mSlots[thePos & (N - 1)];
+				SInt32 theDiff = (SInt32)((UInt32)theSlot->mSequence - thePos);
+				if (theDiff < 0)
+					return false;
+				if ((theDiff == 0) && OSAtomicCompareAndSwap32Barrier((int32_t)thePos, (int32_t)(thePos + 1), &mEnqueuePos))
+				{
+					theSlot->mCommand = inCommand;
+					OSMemoryBarrier();
+					theSlot->mSequence = (int32_t)(thePos + 1);
+					return true;
+				}
+			}
+		}
+		
+		Boolean Pop(T &outCommand)
+		{
+			Slot *theSlot = &mSlots[mDequeuePos & (N - 1)];
+			if ((UInt32)theSlot->mSequence != mDequeuePos + 1)
+				return false;
+			OSMemoryBarrier();
+			outCommand = theSlot->mCommand;
+			OSMemoryBarrier();
+			theSlot->mSequence = (int32_t)(mDequeuePos + N);
+			mDequeuePos++;
+			return true;
+		}
+		
+	private:
+		struct Slot {
+			volatile int32_t				mSequence;
+			T								mCommand;
+		};
+		
+		Slot								mSlots[N];
+		volatile int32_t					mEnqueuePos;
+		UInt32								mDequeuePos;
+};
+
+#pragma mark ***** SoundEngineRefillThread *****
+//==================================================================================================
+//	SoundEngineRefillThread class
+//==================================================================================================
+// AudioQueue callbacks hand their buffers over to this thread rather than refilling them in place,
+// so no callback reads the disk, opens a file or rebuilds a queue. A track manager keeps its own
+// buffers and is posted here at most once until they are served, so the queue never holds more than
+// one entry per manager. The thread starts with the first track manager and is joined at teardown.
+typedef void (*SoundEngineRefillProc)(void *inRefCon);
+
+struct SoundEngineRefill
+{
+	SoundEngineRefillProc		mProc;
+	void *						mRefCon;
+};
+
+class SoundEngineRefillThread
+{
+	public:
+		SoundEngineRefillThread()
+			:	mThreadState(kThreadState_None)
+		{
+			pthread_mutex_init(&mLock, NULL);
+			semaphore_create(mach_task_self(), &mWakeSemaphore, SYNC_POLICY_FIFO, 0);
+		}
+		
+		void Start()
+		{
+			SoundEngineLock theLock(mLock);
+			if (mThreadState == kThreadState_None)
+				mThreadState = pthread_create(&mThread, NULL, ThreadEntry, this) ? kThreadState_Failed : kThreadState_Running;
+			if (mThreadState == kThreadState_Failed)
+				printf("Error creating refill thread\n");
+		}
+		
+		// Serves what is posted and joins the thread, the next track manager starts a new one.
+		void Stop()
+		{
+			{
+				SoundEngineLock theLock(mLock);
+				if (mThreadState != kThreadState_Running)
+					return;
+				mThreadState = kThreadState_Stopping;
+			}
+			semaphore_signal(mWakeSemaphore);
+			pthread_join(mThread, NULL);
+			
+			SoundEngineLock theLock(mLock);
+			mThreadState = kThreadState_None;
+		}
+		
+		Boolean IsRunning() { return mThreadState == kThreadState_Running; }
+		
+		// realtime safe, false when there is no thread
+		Boolean Post(const SoundEngineRefill &inRefill)
+		{
+			if ((mThreadState != kThreadState_Running) || !mRefills.Push(inRefill))
+				return false;
+			semaphore_signal(mWakeSemaphore);
+			return true;
+		}
+		
+	private:
+		enum {
+			kThreadState_None		= 0,
+			kThreadState_Running	= 1,
+			kThreadState_Failed		= 2,
+			kThreadState_Stopping	= 3,
+		};
+		
+		static void *ThreadEntry(void *inRefCon)
+		{
+			SoundEngineRefillThread *THIS = (SoundEngineRefillThread*)inRefCon;
+			SoundEngineRefill theRefill;
+			while (THIS->mThreadState == kThreadState_Running)
+			{
+				semaphore_wait(THIS->mWakeSemaphore);
+				while (THIS->mRefills.Pop(theRefill))
+					theRefill.mProc(theRefill.mRefCon);
+			}
+			return NULL;
+		}
+		
+		pthread_mutex_t							mLock;
+		pthread_t								mThread;
+		volatile UInt32							mThreadState;
+		semaphore_t								mWakeSemaphore;
+		SoundEngineCommandQueue<SoundEngineRefill, kTrackMgrBlocks>	mRefills;
+};
+
+static SoundEngineRefillThread	sRefillThread;
+
+#pragma mark ***** SoundEngineDecodeCache *****
+//==================================================================================================
+//	SoundEngineDecodeCache class
+//==================================================================================================
+// Compressed tracks loaded at once are decoded to 16 bit PCM in the background the first time they
+// are loaded and kept in a directory, later loads and launches map the PCM instead of decoding it
+// again. A decoded file is named after the hash of the source content. A key file, named after the hash of the source path, 
+// keeps the size, modification time and content hash of the source: an unchanged source is found 
+// without being read, a changed one is hashed again and decoded to a new file.
+class SoundEngineDecodeCache
+{
+	public:
+		SoundEngineDecodeCache()
+		{
+			mDirectory[0] = 0;
+			pthread_mutex_init(&mLock, NULL);
+		}
+		
+		~SoundEngineDecodeCache()
+		{
+			pthread_mutex_destroy(&mLock);
+		}
+		
+		// NULL turns the cache off, the decoded files are left where they are
+		OSStatus SetDirectory(const char *inPath)
+		{
+			SoundEngineLock theLock(mLock);
+			if (inPath == NULL)
+			{
+				mDirectory[0] = 0;
+				return noErr;
+			}
+			
+			// room for the names of the files in it
+			if (strlen(inPath) + 32 >= sizeof(mDirectory))
+				return kSoundEngineErrFileNotFound;
+			if ((mkdir(inPath, 0755) != 0) && (errno != EEXIST))
+				return kSoundEngineErrFileNotFound;
+			strcpy(mDirectory, inPath);
+			return noErr;
+		}
+		
+		// Path of the decoded PCM of a source when the cache has it. Otherwise the source is hashed and
+		// decoded on a thread of its own, once however many loads ask for it, and played as it is 
+		// until then: a load never waits on a decode, nor holds the locks of its caller through one.
+		OSStatus GetDecodedPath(const char *inSourcePath, char *outPath)
+		{
+			struct stat theStat;
+			if (stat(inSourcePath, &theStat) != 0)
+				return kSoundEngineErrFileNotFound;
+			
+			char theDirectory[PATH_MAX];
+			{
+				SoundEngineLock theLock(mLock);
+				if (mDirectory[0] == 0)
+					return kSoundEngineErrUnitialized;
+				strcpy(theDirectory, mDirectory);
+			}
+			
+			char theKeyPath[PATH_MAX];
+			UInt64 theSourceHash = HashBytes(inSourcePath, strlen(inSourcePath));
+			snprintf(theKeyPath, sizeof(theKeyPath), "%s/%016llx.key", theDirectory, (unsigned long long)theSourceHash);
+			
+			// the decoded file may have been purged with the rest of the caches
+			DecodeCacheKey theKey;
+			if (ReadKey(theKeyPath, theKey) && (theKey.mSize == (UInt64)theStat.st_size) && (theKey.mModified == (SInt64)theStat.st_mtime))
+			{
+				snprintf(outPath, PATH_MAX, "%s/%016llx.caf", theDirectory, (unsigned long long)theKey.mHash);
+				if (access(outPath, R_OK) == 0)
+					return noErr;
+			}
+			
+			StartDecode(inSourcePath, theDirectory, theKeyPath, theSourceHash);
+			return kSoundEngineErrFileNotFound;
+		}
+		
+	private:
+		struct DecodeJob {
+			char							mSourcePath[PATH_MAX];
+			char							mDirectory[PATH_MAX];
+			char							mKeyPath[PATH_MAX];
+			UInt64							mSourceHash;
+			SoundEngineDecodeCache *		mCache;
+		};
+		
+		void StartDecode(const char *inSourcePath, const char *inDirectory, const char *inKeyPath, UInt64 inSourceHash)
+		{
+			SoundEngineLock theLock(mLock);
+			if (std::find(mDecoding.begin(), mDecoding.end(), inSourceHash) != mDecoding.end())
+				return;
+			
+			DecodeJob *theJob = new DecodeJob;
+			strcpy(theJob->mSourcePath, inSourcePath);
+			strcpy(theJob->mDirectory, inDirectory);
+			strcpy(theJob->mKeyPath, inKeyPath);
+			theJob->mSourceHash = inSourceHash;
+			theJob->mCache = this;
+			
+			pthread_t theThread;
+			pthread_attr_t theAttributes;
+			pthread_attr_init(&theAttributes);
+			pthread_attr_setdetachstate(&theAttributes, PTHREAD_CREATE_DETACHED);
+			if (pthread_create(&theThread, &theAttributes, DecodeThreadEntry, theJob) == 0)
+				mDecoding.push_back(inSourceHash);
+			else
+			{
+				printf("Error creating decode thread\n");
+				delete theJob;
+			}
+			pthread_attr_destroy(&theAttributes);
+		}
+		
+		static void *DecodeThreadEntry(void *inJob)
+		{
+			DecodeJob *theJob = (DecodeJob*)inJob;
+			struct stat theStat;
+			DecodeCacheKey theKey;
+			theKey.mMagic = kDecodeCacheMagic;
+			if ((stat(theJob->mSourcePath, &theStat) == 0) && HashFile(theJob->mSourcePath, theKey.mHash))
+			{
+				theKey.mSize = theStat.st_size;
+				theKey.mModified = theStat.st_mtime;
+				
+				char theDecodedPath[PATH_MAX];
+				snprintf(theDecodedPath, sizeof(theDecodedPath), "%s/%016llx.caf", theJob->mDirectory, (unsigned long long)theKey.mHash);
+				if ((access(theDecodedPath, R_OK) == 0) || (Decode(theJob->mSourcePath, theDecodedPath) == noErr))
+					WriteKey(theJob->mKeyPath, theKey);
+			}
+			
+			{
+				SoundEngineDecodeCache *theCache = theJob->mCache;
+				SoundEngineLock theLock(theCache->mLock);
+				theCache->mDecoding.erase(std::remove(theCache->mDecoding.begin(), theCache->mDecoding.end(), theJob->mSourceHash), theCache->mDecoding.end());
+			}
+			delete theJob;
+			return NULL;
+		}
+		
+		struct DecodeCacheKey {
+			UInt32							mMagic;
+			UInt64							mSize;
+			SInt64							mModified;
+			UInt64							mHash;
+		};
+		
+		// FNV-1a, 64 bit
+		static UInt64 HashBytes(const void *inBytes, size_t inSize)
+		{
+			UInt64 theHash = 0xcbf29ce484222325ULL;
+			const UInt8 *theBytes = (const UInt8*)inBytes;
+			for (size_t i = 0; i < inSize; ++i)
+				theHash = (theHash ^ theBytes[i]) * 0x100000001b3ULL;
+			return theHash;
+		}
+		
+		static Boolean HashFile(const char *inPath, UInt64 &outHash)
+		{
+			int theFile = open(inPath, O_RDONLY);
+			if (theFile < 0)
+				return false;
+			
+			struct stat theStat;
+			void *theMapping = MAP_FAILED;
+			if ((fstat(theFile, &theStat) == 0) && (theStat.st_size > 0))
+				theMapping = mmap(NULL, theStat.st_size, PROT_READ, MAP_PRIVATE, theFile, 0);
+			close(theFile);
+			if (theMapping == MAP_FAILED)
+				return false;
+			
+			madvise(theMapping, theStat.st_size, MADV_SEQUENTIAL);
+			outHash = HashBytes(theMapping, theStat.st_size);
+			munmap(theMapping, theStat.st_size);
+			return true;
+		}
+		
+		static Boolean ReadKey(const char *inPath, DecodeCacheKey &outKey)
+		{
+			int theFile = open(inPath, O_RDONLY);
+			if (theFile < 0)
+				return false;
+			Boolean isRead = (read(theFile, &outKey, sizeof(outKey)) == sizeof(outKey)) && (outKey.mMagic == kDecodeCacheMagic);
+			close(theFile);
+			return isRead;
+		}
+		
+		// written aside and renamed, like a decoded file, a key is never read half written
+		static void WriteKey(const char *inPath, const DecodeCacheKey &inKey)
+		{
+			char theTempPath[PATH_MAX];
+			snprintf(theTempPath, sizeof(theTempPath), "%s.tmp", inPath);
+			int theFile = open(theTempPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if (theFile < 0)
+				return;
+			Boolean isWritten = (write(theFile, &inKey, sizeof(inKey)) == sizeof(inKey));
+			if (close(theFile) != 0)
+				isWritten = false;
+			if (!isWritten || (rename(theTempPath, inPath) != 0))
+				unlink(theTempPath);
+		}
+		
+		// Decodes to a temporary file renamed once complete, an interrupted decode never looks cached.
+		static OSStatus Decode(const char *inSourcePath, const char *inDecodedPath)
+		{
+			ExtAudioFileRef theSource = NULL;
+			ExtAudioFileRef theDecoded = NULL;
+			CFURLRef theSourceURL = NULL;
+			CFURLRef theDecodedURL = NULL;
+			void *theData = NULL;
+			AudioStreamBasicDescription theFileFormat;
+			AudioStreamBasicDescription thePCMFormat;
+			UInt32 size = sizeof(theFileFormat);
+			char theTempPath[PATH_MAX];
+			snprintf(theTempPath, sizeof(theTempPath), "%s.tmp", inDecodedPath);
+			
+			OSStatus result = kSoundEngineErrFileNotFound;
+			theSourceURL = CFURLCreateFromFileSystemRepresentation(kCFAllocatorDefault, (UInt8*)inSourcePath, strlen(inSourcePath), false);
+			theDecodedURL = CFURLCreateFromFileSystemRepresentation(kCFAllocatorDefault, (UInt8*)theTempPath, strlen(theTempPath), false);
+			if ((theSourceURL == NULL) || (theDecodedURL == NULL))
+				goto end;
+			
+			result = ExtAudioFileOpenURL(theSourceURL, &theSource);
+				AssertNoError("Error opening file to decode", end);
+			result = ExtAudioFileGetProperty(theSource, kExtAudioFileProperty_FileDataFormat, &size, &theFileFormat);
+				AssertNoError("Error getting format of file to decode", end);
+			
+			memset(&thePCMFormat, 0, sizeof(thePCMFormat));
+			thePCMFormat.mSampleRate = theFileFormat.mSampleRate;
+			thePCMFormat.mFormatID = kAudioFormatLinearPCM;
+			thePCMFormat.mFormatFlags = kAudioFormatFlagIsSignedInteger | kAudioFormatFlagIsPacked | kAudioFormatFlagsNativeEndian;
+			thePCMFormat.mChannelsPerFrame = theFileFormat.mChannelsPerFrame;
+			thePCMFormat.mBitsPerChannel = 16;
+			thePCMFormat.mBytesPerFrame = thePCMFormat.mBytesPerPacket = 2 * theFileFormat.mChannelsPerFrame;
+			thePCMFormat.mFramesPerPacket = 1;
+			
+			result = ExtAudioFileSetProperty(theSource, kExtAudioFileProperty_ClientDataFormat, sizeof(thePCMFormat), &thePCMFormat);
+				AssertNoError("Error setting decoded format", end);
+			result = ExtAudioFileCreateWithURL(theDecodedURL, kAudioFileCAFType, &thePCMFormat, NULL, kAudioFileFlags_EraseFile, &theDecoded);
+				AssertNoError("Error creating decoded file", end);
+			
+			theData = malloc(kDecodeChunkFrames * thePCMFormat.mBytesPerFrame);
+			while (true)
+			{
+				UInt32 theFrames = kDecodeChunkFrames;
+				AudioBufferList theList;
+				theList.mNumberBuffers = 1;
+				theList.mBuffers[0].mNumberChannels = thePCMFormat.mChannelsPerFrame;
+				theList.mBuffers[0].mDataByteSize = kDecodeChunkFrames * thePCMFormat.mBytesPerFrame;
+				theList.mBuffers[0].mData = theData;
+				result = ExtAudioFileRead(theSource, &theFrames, &theList);
+				if (result || (theFrames == 0))
+					break;
+				result = ExtAudioFileWrite(theDecoded, theFrames, &theList);
+				if (result)
+					break;
+			}
+				AssertNoError("Error decoding file", end);
+			
+			result = ExtAudioFileDispose(theDecoded);
+			theDecoded = NULL;
+				AssertNoError("Error closing decoded file", end);
+			if (rename(theTempPath, inDecodedPath) != 0)
+				result = kSoundEngineErrFileNotFound;
+			
+		end:
+			if (theDecoded)
+				ExtAudioFileDispose(theDecoded);
+			if (theSource)
+				ExtAudioFileDispose(theSource);
+			if (theSourceURL)
+				CFRelease(theSourceURL);
+			if (theDecodedURL)
+				CFRelease(theDecodedURL);
+			free(theData);
+			if (result)
+				unlink(theTempPath);
+			return result;
+		}
+		
+		char									mDirectory[PATH_MAX];
+		pthread_mutex_t							mLock;
+		std::vector<UInt64>						mDecoding;		// hashes of the source paths being decoded
+};
+
+static SoundEngineDecodeCache	sDecodeCache;
+
+#pragma mark ***** BackgroundTrackMgr *****
+//==================================================================================================
+//	BackgroundTrackMgr class
+//==================================================================================================
+class BackgroundTrackMgr
+{	
+	#define CurFileInfo THIS->mBGFileInfo[THIS->mCurrentFileIndex]
+	public:
+		typedef struct BG_FileInfo {
+			char							mFilePath[PATH_MAX];
+			AudioFileID						mAFID;
+			AudioStreamBasicDescription		mFileFormat;
+			UInt64							mFileDataSize;
+			//UInt64							mFileNumPackets; // this is only used if loading file to memory
+			Boolean							mLoadAtOnce;
+			Boolean							mFileDataInQueue;
+			void*							mMapping;		// the whole file, when read through callbacks
+			SInt64							mMappingSize;
+			
+			static void *operator new(size_t inSize) throw() { return GetPool().Allocate(); }
+			static void operator delete(void *inBlock) { GetPool().Release(inBlock); }
+			static SoundEngineBlockPool<BG_FileInfo, kTrackFileBlocks> &GetPool()
+			{
+				static SoundEngineBlockPool<BG_FileInfo, kTrackFileBlocks> sPool;
+				return sPool;
+			}
+		} BackgroundMusicFileInfo;
+		
+		static void *operator new(size_t inSize) throw() { return GetPool().Allocate(); }
+		static void operator delete(void *inBlock) { GetPool().Release(inBlock); }
+		static SoundEngineBlockPool<BackgroundTrackMgr, kTrackMgrBlocks> &GetPool()
+		{
+			static SoundEngineBlockPool<BackgroundTrackMgr, kTrackMgrBlocks> sPool;
+			return sPool;
+		}
+		
+		BackgroundTrackMgr(SoundEngineBusID inBus = kSoundEngineBus_Music, CFRunLoopRef inRunLoop = NULL) 
+			:	mQueue(0),
+				mRunLoop(inRunLoop ? inRunLoop : CFRunLoopGetCurrent()),
+				mBufferByteSize(0),
+				mCurrentPacket(0),
+				mNumPacketsToRead(0),
+				mVolume(1.0),
+				mBus(inBus),
+				mTap(NULL),
+				mDSPChain(NULL),
+				mTapBlocks(0),
+				mDuckGain(1.0),
+				mFadeState(kFadeState_None),
+				mFadeGain(1.0),
+				mFadeFrames(0),
+				mFadePosition(0),
+				mLoopStartFrame(0),
+				mLoopEndFrame(0),
+				mLoopStartPacket(0),
+				mLoopEndPacket(0),
+				mLoopStartTrim(0),
+				mLoopEndTrim(0),
+				mLoopFileTrimStart(0),
+				mLoopFileTrimEnd(0),
+				mLooped(false),
+				mLoopCachePackets(0),
+				mRegionStartPacket(0),
+				mRegionEndPacket(0),
+				mRegionStartTrim(0),
+				mRegionEndTrim(0),
+				mPacketDescs(NULL),
+				mCurrentFileIndex(0),
+				mMakeNewQueueWhenStopped(false),
+				mStopAtEnd(false),
+				mStopped(false),
+				mPlaying(false),
+				mNumBuffersToDispose(0),
+				mPendingRefills(0),
+				mRefillPosted(0),
+				mRefillEpoch(0),
+				mTearingDown(false)
+		{
+			for (UInt32 i = 0; i < kSoundEngineMaxDuckings; ++i)
+				mDuckingGains[i] = 1.0;
+			
+			// the API and the refill thread both drive the queue, and Start is called under the lock
+			pthread_mutexattr_t theAttributes;
+			pthread_mutexattr_init(&theAttributes);
+			pthread_mutexattr_settype(&theAttributes, PTHREAD_MUTEX_RECURSIVE);
+			pthread_mutex_init(&mRefillLock, &theAttributes);
+			pthread_mutexattr_destroy(&theAttributes);
+			pthread_cond_init(&mRefillsDone, NULL);
+			sRefillThread.Start();
+		}
+		
+		~BackgroundTrackMgr() 
+		{ 
+			Teardown(); 
+			pthread_cond_destroy(&mRefillsDone);
+			pthread_mutex_destroy(&mRefillLock);
+		}
+
+		void Teardown()
+		{
+			// no refill may be running or waiting for this manager once it is gone
+			{
+				SoundEngineLock theLock(mRefillLock);
+				mTearingDown = true;
+				while (mPendingRefills)
+					pthread_cond_wait(&mRefillsDone, &mRefillLock);
+			}
+			
+			DisposeTap();
+			if (mQueue)
+				AudioQueueDispose(mQueue, true);
+			ReleaseFiles();
+		}
+		
+		// the files of the playlist go back to the pool all at once
+		void ReleaseFiles()
+		{
+			for (UInt32 i=0; i < mBGFileInfo.size(); i++)
+			{
+				CloseFile(mBGFileInfo[i]);
+				delete mBGFileInfo[i];
+			}
+			mBGFileInfo.clear();
+			mCurrentFileIndex = 0;
+		}
+		
+		AudioStreamPacketDescription *GetPacketDescsPtr() { return mPacketDescs; }
+		
+		UInt32 GetNumPacketsToRead(BackgroundTrackMgr::BG_FileInfo *inFileInfo) 
+		{ 
+			return mNumPacketsToRead; 
+		}
+		
+		static void CloseFile(BG_FileInfo *inFileInfo)
+		{
+			if (inFileInfo->mAFID)
+				AudioFileClose(inFileInfo->mAFID);
+			if (inFileInfo->mMapping)
+				munmap(inFileInfo->mMapping, inFileInfo->mMappingSize);
+			inFileInfo->mAFID = 0;
+			inFileInfo->mMapping = NULL;
+		}
+		
+		static OSStatus MappedFileRead(void *inClientData, SInt64 inPosition, UInt32 inRequestCount, void *outBuffer, UInt32 *outActualCount)
+		{
+			BG_FileInfo *theFileInfo = (BG_FileInfo*)inClientData;
+			if ((inPosition < 0) || (inPosition > theFileInfo->mMappingSize))
+				return kAudioFilePositionError;
+			*outActualCount = (UInt32)std::min<SInt64>(inRequestCount, theFileInfo->mMappingSize - inPosition);
+			memcpy(outBuffer, (char*)theFileInfo->mMapping + inPosition, *outActualCount);
+			return noErr;
+		}
+		
+		static SInt64 MappedFileGetSize(void *inClientData)
+		{
+			return ((BG_FileInfo*)inClientData)->mMappingSize;
+		}
+		
+		// Maps the whole file and reads it through AudioFile callbacks, for a file many short regions
+		// are played from: once its pages are resident a region starts without waiting on the disk.
+		static OSStatus OpenMappedFile(BG_FileInfo *ioFileInfo)
+		{
+			int theFile = open(ioFileInfo->mFilePath, O_RDONLY);
+			if (theFile < 0)
+				return kSoundEngineErrFileNotFound;
+			
+			struct stat theStat;
+			void *theMapping = MAP_FAILED;
+			if ((fstat(theFile, &theStat) == 0) && (theStat.st_size > 0))
+				theMapping = mmap(NULL, theStat.st_size, PROT_READ, MAP_PRIVATE, theFile, 0);
+			close(theFile);
+			if (theMapping == MAP_FAILED)
+				return kSoundEngineErrInvalidFileFormat;
+			
+			madvise(theMapping, theStat.st_size, MADV_WILLNEED);
+			ioFileInfo->mMapping = theMapping;
+			ioFileInfo->mMappingSize = theStat.st_size;
+			
+			UInt32 size = 0;
+			OSStatus result = AudioFileOpenWithCallbacks(ioFileInfo, MappedFileRead, NULL, MappedFileGetSize, NULL, 0, &ioFileInfo->mAFID);
+				AssertNoError("Error opening mapped file", end);
+			
+			size = sizeof(ioFileInfo->mFileFormat);
+			result = AudioFileGetProperty(ioFileInfo->mAFID, kAudioFilePropertyDataFormat, &size, &ioFileInfo->mFileFormat);
+				AssertNoError("Error getting file format", end);
+			
+			size = sizeof(UInt64);
+			result = AudioFileGetProperty(ioFileInfo->mAFID, kAudioFilePropertyAudioDataByteCount, &size, &ioFileInfo->mFileDataSize);
+				AssertNoError("Error getting file data size", end);
+		
+		end:
+			return result;
+		}
+		
+		// reads go through the I/O scheduler, in the class of what the track is used for
+		OSStatus ReadPackets(BG_FileInfo *inFileInfo, UInt32 *outNumBytes, SInt64 inStartPacket, UInt32 *ioNumPackets, void *outBuffer)
+		{
+			UInt32 theClass = kIOClass_Stream;
+			if (inFileInfo->mLoadAtOnce)
+				theClass = kIOClass_Load;
+			else if (sBusGraph.GetCategory(mBus) == kSoundEngineBus_Speech)
+				theClass = kIOClass_Speech;
+			return sIOScheduler.ReadPackets(theClass, GetRefillDeadline(inFileInfo), inFileInfo->mAFID, outNumBytes, mPacketDescs, inStartPacket, ioNumPackets, outBuffer);
+		}
+		
+		// a refill is due before the buffers still queued have played
+		Float64 GetRefillDeadline(BackgroundTrackMgr::BG_FileInfo *inFileInfo)
+		{
+			const AudioStreamBasicDescription &theFormat = inFileInfo->mFileFormat;
+			Float64 theBufferSeconds = (theFormat.mFramesPerPacket && (theFormat.mSampleRate > 0.0)) ? 
+											mNumPacketsToRead * theFormat.mFramesPerPacket / theFormat.mSampleRate : 0.5;
+			return (kNumberBuffers - 1) * theBufferSeconds;
+		}
+
+		// cookies and channel layouts are read into a buffer kept for the life of the manager
+		void *GetPropertyScratch(UInt32 inSize)
+		{
+			if (mPropertyScratch.size() < inSize)
+				mPropertyScratch.resize(inSize);
+			return &mPropertyScratch[0];
+		}
+		
+		OSStatus AttachNewCookie(AudioQueueRef inQueue, BackgroundTrackMgr::BG_FileInfo *inFileInfo)
+		{
+			OSStatus result = noErr;
+			UInt32 size = sizeof(UInt32);
+			result = AudioFileGetPropertyInfo (inFileInfo->mAFID, kAudioFilePropertyMagicCookieData, &size, NULL);
+			if (!result && size) 
+			{
+				void* cookie = GetPropertyScratch(size);
+				result = AudioFileGetProperty (inFileInfo->mAFID, kAudioFilePropertyMagicCookieData, &size, cookie);
+					AssertNoError("Error getting cookie data", end);
+				result = AudioQueueSetProperty(inQueue, kAudioQueueProperty_MagicCookie, cookie, size);
+					AssertNoError("Error setting cookie data for queue", end);
+			}
+			return noErr;
+		
+		end:
+			return noErr;
+		}
+
+		// Audio callbacks: both only hand over to the refill thread, under the realtime contract. Starting
+		// the queue fires QueueStoppedProc as well, the refill thread checks whether it really stopped.
+		static void QueueStoppedProc(	void *                  inUserData,
+										AudioQueueRef           inAQ,
+										AudioQueuePropertyID    inID)
+		{
+			SoundEngineRealtimeScope theScope;
+			((BackgroundTrackMgr*)inUserData)->PostRefill(inAQ, NULL);
+		}
+		
+		static void QueueCallback(	void *					inUserData,
+									AudioQueueRef			inAQ,
+									AudioQueueBufferRef		inCompleteAQBuffer) 
+		{
+			SoundEngineRealtimeScope theScope;
+			((BackgroundTrackMgr*)inUserData)->PostRefill(inAQ, inCompleteAQBuffer);
+		}
+		
+		// The buffer waits in the manager, which is posted to the refill thread unless it is already. 
+		// Each buffer and each post is counted, which keeps Teardown waiting until the refill thread is 
+		// done with this manager; a manager being torn down is still posted, so that the count drops 
+		// on the refill thread. Nothing is refilled here: without a refill thread the buffer is dropped.
+		void PostRefill(AudioQueueRef inAQ, AudioQueueBufferRef inBuffer)
+		{
+			if (!sRefillThread.IsRunning())
+				return;
+			
+			OSAtomicIncrement32Barrier(&mPendingRefills);
+			Refill theRefill = { inAQ, inBuffer, mRefillEpoch };
+			if (!mRefills.Push(theRefill))
+			{
+				// a queue holds fewer buffers than there are slots, this is not expected to happen
+				EndRefill();
+				return;
+			}
+			if (!OSAtomicCompareAndSwap32Barrier(0, 1, &mRefillPosted))
+				return;
+			
+			// a manager is posted once at most, the refill thread has room for all of them
+			OSAtomicIncrement32Barrier(&mPendingRefills);
+			SoundEngineRefill thePost = { RefillProc, this };
+			if (!sRefillThread.Post(thePost))
+				EndRefill();
+		}
+		
+		// On the refill thread. A buffer handed over before the queue was stopped and filled again by 
+		// the API, or by a queue since replaced, is left alone. The count of the post is released last,
+		// after that the manager may be gone.
+		static void RefillProc(void *inRefCon)
+		{
+			BackgroundTrackMgr *THIS = (BackgroundTrackMgr*)inRefCon;
+			OSAtomicCompareAndSwap32Barrier(1, 0, &THIS->mRefillPosted);
+			
+			Refill theRefill;
+			while (THIS->mRefills.Pop(theRefill))
+			{
+				{
+					SoundEngineLock theLock(THIS->mRefillLock);
+					if (!THIS->mTearingDown && (theRefill.mQueue == THIS->mQueue) && (theRefill.mEpoch == THIS->mRefillEpoch))
+					{
+						if (theRefill.mBuffer)
+							RefillBuffer(THIS, theRefill.mQueue, theRefill.mBuffer);
+						else
+							RebuildQueue(THIS, theRefill.mQueue);
+					}
+				}
+				THIS->EndRefill();
+			}
+			THIS->EndRefill();
+		}
+		
+		// under the lock, so Teardown can not miss the last one between its check and its wait
+		void EndRefill()
+		{
+			SoundEngineLock theLock(mRefillLock);
+			if ((OSAtomicDecrement32Barrier(&mPendingRefills) == 0) && mTearingDown)
+				pthread_cond_signal(&mRefillsDone);
+		}
+		
+		static void RebuildQueue(void *inUserData, AudioQueueRef inAQ)
+		{
+			UInt32 isRunning;
+			UInt32 propSize = sizeof(isRunning);
+
+			BackgroundTrackMgr *THIS = (BackgroundTrackMgr*)inUserData;
+			OSStatus result = AudioQueueGetProperty(inAQ, kAudioQueueProperty_IsRunning, &isRunning, &propSize);
+				
+			if ((!isRunning) && (THIS->mMakeNewQueueWhenStopped))
+			{
+				THIS->DisposeTap();
+				result = AudioQueueDispose(inAQ, true);
+					AssertNoError("Error disposing queue", end);
+				THIS->mNumBuffersToDispose = 0;		// went with the queue
+				result = THIS->SetupQueue(CurFileInfo);
+					AssertNoError("Error setting up new queue", end);
+				result = THIS->SetupBuffers(CurFileInfo);
+					AssertNoError("Error setting up new queue buffers", end);
+				result = THIS->Start();
+					AssertNoError("Error starting queue", end);
+			}
+		end:
+			return;
+		}
+		
+		Boolean DisposeBuffer(AudioQueueRef inAQ, AudioQueueBufferRef inBufferToDispose)
+		{
+			for (unsigned int i=0; i < mNumBuffersToDispose; i++)
+			{
+				if (inBufferToDispose == mBuffersToDispose[i])
+				{
+					OSStatus result = AudioQueueFreeBuffer(inAQ, inBufferToDispose);
+					if (result == noErr)
+						mBuffersToDispose[i] = mBuffersToDispose[--mNumBuffersToDispose];
+					return true;
+				}
+			}
+			return false;
+		}
+		
+		enum {
+			kQueueState_DoNothing		= 0,
+			kQueueState_ResizeBuffer	= 1,
+			kQueueState_NeedNewCookie	= 2,
+			kQueueState_NeedNewBuffers	= 3,
+			kQueueState_NeedNewQueue	= 4,
+		};
+		
+		static SInt8 GetQueueStateForNextBuffer(BackgroundTrackMgr::BG_FileInfo *inFileInfo, BackgroundTrackMgr::BG_FileInfo *inNextFileInfo)
+		{
+			inFileInfo->mFileDataInQueue = false;
+			
+			// unless the data formats are the same, we need a new queue
+			if (!FormatIsEqual(inFileInfo->mFileFormat, inNextFileInfo->mFileFormat))
+				return kQueueState_NeedNewQueue;
+				
+			// if going from a load-at-once file to streaming or vice versa, we need new buffers
+			if (inFileInfo->mLoadAtOnce != inNextFileInfo->mLoadAtOnce)
+				return kQueueState_NeedNewBuffers;
+			
+			// if the next file is smaller than the current, we just need to resize
+			if (inNextFileInfo->mLoadAtOnce)
+				return (inFileInfo->mFileDataSize >= inNextFileInfo->mFileDataSize) ? kQueueState_ResizeBuffer : kQueueState_NeedNewBuffers;
+				
+			return kQueueState_NeedNewCookie;
+		}
+		
+		static void RefillBuffer(	void *					inUserData,
+									AudioQueueRef			inAQ,
+									AudioQueueBufferRef		inCompleteAQBuffer) 
+		{
+			// dispose of the buffer if no longer in use
+			OSStatus result = noErr;
+			BackgroundTrackMgr *THIS = (BackgroundTrackMgr*)inUserData;
+			if (THIS->DisposeBuffer(inAQ, inCompleteAQBuffer))
+				return;
+			
+			if (THIS->mStopped){
+				return;
+			}
+			
+			// a region plays once, the queue stops after its last buffer
+			if (THIS->mRegionEndPacket)
+			{
+				if ((THIS->mCurrentPacket < THIS->mRegionEndPacket) && (THIS->EnqueueRegionBuffer(inAQ, inCompleteAQBuffer) == noErr) && 
+						(THIS->mCurrentPacket >= THIS->mRegionEndPacket))
+					AudioQueueStop(inAQ, false);
+				return;
+			}
+			
+			UInt32 nPackets = 0;
+			UInt32 theTrimStart = 0;
+			UInt32 theTrimEnd = 0;
+			// loop the current buffer if the following:
 			// 1. file was loaded into the buffer previously
 			// 2. only one file in the queue
 			// 3. we have not been told to stop at playlist completion
 			if ((CurFileInfo->mFileDataInQueue) && (THIS->mBGFileInfo.size() == 1) && (!THIS->mStopAtEnd))
+			{
 				nPackets = THIS->GetNumPacketsToRead(CurFileInfo);
+				// with a loop region, only the region plays after the first time through
+				if (THIS->HasLoop())
+				{
+					theTrimStart = THIS->mLoopFileTrimStart;
+					theTrimEnd = THIS->mLoopFileTrimEnd;
+				}
+			}
+			
+			else if (THIS->HasLoop() && !CurFileInfo->mLoadAtOnce)
+			{
+				THIS->EnqueueLoopBuffer(inAQ, inCompleteAQBuffer);
+				return;
+			}
+
+			else
+			{
+				UInt32 numBytes;
+				while (nPackets == 0)
+				{
+					// if loadAtOnce, get all packets in the file, otherwise ~.5 seconds of data
+					nPackets = THIS->GetNumPacketsToRead(CurFileInfo);					
+					result = THIS->ReadPackets(CurFileInfo, &numBytes, THIS->mCurrentPacket, &nPackets, inCompleteAQBuffer->mAudioData);
+						AssertNoError("Error reading file data", end);
+					
+					inCompleteAQBuffer->mAudioDataByteSize = numBytes;	
+											
+					if (nPackets == 0) // no packets were read, this file has ended.
+					{
+						if (CurFileInfo->mLoadAtOnce)
+							CurFileInfo->mFileDataInQueue = true;
+						
+						THIS->mCurrentPacket = 0;
+						UInt32 theNextFileIndex = (THIS->mCurrentFileIndex < THIS->mBGFileInfo.size()-1) ? THIS->mCurrentFileIndex+1 : 0;
+						
+						// we have gone through the playlist. if mStopAtEnd, stop the queue here
+						if (theNextFileIndex == 0 && THIS->mStopAtEnd)
+						{
+							THIS->mStopped = true;
+							result = AudioQueueStop(inAQ, false);
+								AssertNoError("Error stopping queue", end);
+							return;
+						}
+						
+						SInt8 theQueueState = GetQueueStateForNextBuffer(CurFileInfo, THIS->mBGFileInfo[theNextFileIndex]);
+						if (theNextFileIndex != THIS->mCurrentFileIndex)
+						{
+							// if were are not looping the same file. Close the old one and open the new
+							CloseFile(CurFileInfo);
+							THIS->mCurrentFileIndex = theNextFileIndex;
+
+							result = LoadFileDataInfo(CurFileInfo->mFilePath, CurFileInfo->mAFID, CurFileInfo->mFileFormat, CurFileInfo->mFileDataSize);
+								AssertNoError("Error opening file", end);
+						}
+						
+						switch (theQueueState) 
+						{							
+							// if we need to resize the buffer, set the buffer's audio data size to the new file's size
+							// we will also need to get the new file cookie
+							case kQueueState_ResizeBuffer:
+								inCompleteAQBuffer->mAudioDataByteSize = CurFileInfo->mFileDataSize;							
+							// if the data format is the same but we just need a new cookie, attach a new cookie
+							case kQueueState_NeedNewCookie:
+								result = THIS->AttachNewCookie(inAQ, CurFileInfo);
+									AssertNoError("Error attaching new file cookie data to queue", end);
+								break;
+							
+							// we can keep the same queue, but not the same buffer(s)
+							case kQueueState_NeedNewBuffers:
+								if (THIS->mNumBuffersToDispose < kNumberBuffers + 1)
+									THIS->mBuffersToDispose[THIS->mNumBuffersToDispose++] = inCompleteAQBuffer;
+								THIS->SetupBuffers(CurFileInfo);
+								break;
+							
+							// if the data formats are not the same, we need to dispose the current queue and create a new one
+							case kQueueState_NeedNewQueue:
+								THIS->mMakeNewQueueWhenStopped = true;
+								result = AudioQueueStop(inAQ, false);
+									AssertNoError("Error stopping queue", end);
+								return;
+								
+							default:
+								break;
+						}
+					}
+				}
+			}
+			
+			// the whole file is in the buffer: the first time through plays the intro and stops at the loop end
+			if (THIS->HasLoop() && CurFileInfo->mLoadAtOnce && !CurFileInfo->mFileDataInQueue)
+				theTrimEnd = THIS->mLoopFileTrimEnd;
+			
+			result = AudioQueueEnqueueBufferWithParameters(inAQ, inCompleteAQBuffer, (THIS->mPacketDescs ? nPackets : 0), THIS->mPacketDescs, theTrimStart, theTrimEnd, 0, NULL, NULL, NULL);
+				AssertNoError("Error enqueuing new buffer", end);
+			if (CurFileInfo->mLoadAtOnce)
+				CurFileInfo->mFileDataInQueue = true;
+				
+			THIS->mCurrentPacket += nPackets;
+		
+		end:
+			return;
+		}
+		
+		Boolean HasLoop() { return (mLoopEndPacket > 0) && (mBGFileInfo.size() == 1) && !mStopAtEnd; }
+		
+		// Streams the loop region. Reads stop at the loop start, so the first buffer of the region can 
+		// be kept and enqueued again at each wrap without going back to the file, and at the loop end 
+		// where reading wraps. Trimming the boundary packets makes the loop sample accurate.
+		OSStatus EnqueueLoopBuffer(AudioQueueRef inAQ, AudioQueueBufferRef inBuffer)
+		{
+			BG_FileInfo *theFileInfo = mBGFileInfo[mCurrentFileIndex];
+			UInt32 nPackets = mNumPacketsToRead;
+			UInt32 theTrimStart = 0;
+			UInt32 theTrimEnd = 0;
+			OSStatus result = noErr;
+			
+			if (mCurrentPacket >= mLoopEndPacket)
+			{
+				mCurrentPacket = mLoopStartPacket;
+				mLooped = true;
+			}
+			
+			Boolean isLoopStart = (mCurrentPacket == mLoopStartPacket);
+			if ((mCurrentPacket < mLoopStartPacket) && (mCurrentPacket + nPackets > mLoopStartPacket))
+				nPackets = (UInt32)(mLoopStartPacket - mCurrentPacket);
+			if (mCurrentPacket + nPackets > mLoopEndPacket)
+				nPackets = (UInt32)(mLoopEndPacket - mCurrentPacket);
+			
+			if (isLoopStart && mLoopCachePackets)
+			{
+				nPackets = mLoopCachePackets;
+				memcpy(inBuffer->mAudioData, &mLoopCache[0], mLoopCache.size());
+				inBuffer->mAudioDataByteSize = mLoopCache.size();
+				if (mPacketDescs)
+					memcpy(mPacketDescs, &mLoopCacheDescs[0], nPackets * sizeof(AudioStreamPacketDescription));
+			}
+			else
+			{
+				UInt32 numBytes;
+				result = ReadPackets(theFileInfo, &numBytes, mCurrentPacket, &nPackets, inBuffer->mAudioData);
+					AssertNoError("Error reading file data", end);
+				// the file ends before the loop end, so it ends the loop from now on; a loop start past 
+				// it loops the whole file. The buffer is filled again from the new loop start.
+				if (nPackets == 0)
+				{
+					if (mCurrentPacket == 0)
+					{
+						printf("Loop region past the end of the file\n");
+						return kSoundEngineErrInvalidRange;
+					}
+					if (isLoopStart)
+					{
+						mLoopStartPacket = 0;
+						mLoopStartTrim = 0;
+					}
+					mLoopEndPacket = mCurrentPacket;
+					mLoopEndTrim = 0;
+					mLoopCachePackets = 0;
+					return EnqueueLoopBuffer(inAQ, inBuffer);
+				}
+				inBuffer->mAudioDataByteSize = numBytes;
+				
+				if (isLoopStart)
+				{
+					mLoopCache.assign((char*)inBuffer->mAudioData, (char*)inBuffer->mAudioData + numBytes);
+					if (mPacketDescs)
+						mLoopCacheDescs.assign(mPacketDescs, mPacketDescs + nPackets);
+					mLoopCachePackets = nPackets;
+				}
+			}
+			
+			if (isLoopStart && mLooped)
+				theTrimStart = mLoopStartTrim;
+			if (mCurrentPacket + nPackets == mLoopEndPacket)
+			{
+				theTrimEnd = mLoopEndTrim;
+				mCurrentPacket = mLoopStartPacket;
+				mLooped = true;
+			}
+			else
+				mCurrentPacket += nPackets;
+			
+			result = AudioQueueEnqueueBufferWithParameters(inAQ, inBuffer, (mPacketDescs ? nPackets : 0), mPacketDescs, theTrimStart, theTrimEnd, 0, NULL, NULL, NULL);
+				AssertNoError("Error enqueuing new buffer", end);
+		
+		end:
+			return result;
+		}
+		
+		// Loop points are frames of the decoded audio, 0 and 0 loops the whole file as before. They 
+		// only apply to a single file, not to a playlist.
+		OSStatus SetLoopPoints(UInt32 inLoopStart, UInt32 inLoopEnd)
+		{
+			SoundEngineLock theLock(mRefillLock);
+			mLoopStartFrame = inLoopStart;
+			mLoopEndFrame = inLoopEnd;
+			return UpdateLoop();
+		}
+		
+		OSStatus UpdateLoop()
+		{
+			mLoopEndPacket = 0;
+			mLooped = false;
+			mLoopCache.clear();
+			mLoopCacheDescs.clear();
+			mLoopCachePackets = 0;
+			if ((mLoopStartFrame == 0) && (mLoopEndFrame == 0))
+				return noErr;
+			if (mBGFileInfo.size() != 1)
+				return kSoundEngineErrUnsupported;
+			
+			BG_FileInfo *theFileInfo = mBGFileInfo[0];
+			UInt32 theFramesPerPacket = theFileInfo->mFileFormat.mFramesPerPacket;
+			if (theFramesPerPacket == 0)
+				return kSoundEngineErrUnsupported;
+			
+			UInt64 theFileFrames = 0;
+			SInt64 thePriming = 0;
+			OSStatus result = GetFileFrames(theFileInfo, theFileFrames, thePriming);
+			if (result)
+				return result;
+			
+			UInt64 theStart = mLoopStartFrame + thePriming;
+			UInt64 theEnd = mLoopEndFrame + thePriming;
+			if ((theEnd <= theStart) || (theEnd > theFileFrames))
+				return kSoundEngineErrInvalidRange;
+			
+			mLoopStartPacket = theStart / theFramesPerPacket;
+			mLoopStartTrim = theStart % theFramesPerPacket;
+			mLoopEndPacket = (theEnd + theFramesPerPacket - 1) / theFramesPerPacket;
+			mLoopEndTrim = (UInt32)(mLoopEndPacket * theFramesPerPacket - theEnd);
+			mLoopFileTrimStart = (UInt32)theStart;
+			mLoopFileTrimEnd = (UInt32)(theFileFrames - theEnd);
+			return noErr;
+		}
+		
+		// frames in the file, the encoder priming that comes before frame 0 of the decoded audio included
+		static OSStatus GetFileFrames(BG_FileInfo *inFileInfo, UInt64 &outFileFrames, SInt64 &outPriming)
+		{
+			UInt64 thePacketCount = 0;
+			UInt32 size = sizeof(thePacketCount);
+			OSStatus result = AudioFileGetProperty(inFileInfo->mAFID, kAudioFilePropertyAudioDataPacketCount, &size, &thePacketCount);
+			if (result)
+				return result;
+			
+			AudioFilePacketTableInfo thePacketTable;
+			outPriming = 0;
+			size = sizeof(thePacketTable);
+			if (AudioFileGetProperty(inFileInfo->mAFID, kAudioFilePropertyPacketTableInfo, &size, &thePacketTable) == noErr)
+				outPriming = thePacketTable.mPrimingFrames;
+			
+			outFileFrames = thePacketCount * inFileInfo->mFileFormat.mFramesPerPacket;
+			return noErr;
+		}
+		
+		// Plays a region of a single track once, times in seconds of the decoded audio. Speech chunks
+		// are regions of one narration file. The buffers are filled before the queue starts, so the 
+		// region is heard as soon as the queue runs.
+		OSStatus PlayRegion(Float64 inStart, Float64 inLength)
+		{
+			SoundEngineLock theLock(mRefillLock);
+			if ((mQueue == NULL) || (mBGFileInfo.size() != 1))
+				return kSoundEngineErrUnitialized;
+			
+			BG_FileInfo *theFileInfo = mBGFileInfo[0];
+			UInt32 theFramesPerPacket = theFileInfo->mFileFormat.mFramesPerPacket;
+			if (theFramesPerPacket == 0)
+				return kSoundEngineErrUnsupported;
+			
+			UInt64 theFileFrames = 0;
+			SInt64 thePriming = 0;
+			OSStatus result = GetFileFrames(theFileInfo, theFileFrames, thePriming);
+			if (result)
+				return result;
+			
+			if (inStart < 0.0)
+				return kSoundEngineErrInvalidRange;
+			
+			// a length of 0 or less plays to the end of the track
+			Float64 theSampleRate = theFileInfo->mFileFormat.mSampleRate;
+			UInt64 theStart = (UInt64)(inStart * theSampleRate) + thePriming;
+			UInt64 theEnd = (inLength > 0.0) ? (UInt64)((inStart + inLength) * theSampleRate) + thePriming : theFileFrames;
+			if (theEnd > theFileFrames)
+				theEnd = theFileFrames;		// chunk lengths are rounded
+			if (theStart >= theEnd)
+				return kSoundEngineErrInvalidRange;
+			
+			mStopped = true;
+			result = AudioQueueStop(mQueue, true);
+				AssertNoError("Error stopping queue", end);
+			++mRefillEpoch;
+			
+			mRegionStartPacket = theStart / theFramesPerPacket;
+			mRegionStartTrim = theStart % theFramesPerPacket;
+			mRegionEndPacket = (theEnd + theFramesPerPacket - 1) / theFramesPerPacket;
+			mRegionEndTrim = (UInt32)(mRegionEndPacket * theFramesPerPacket - theEnd);
+			mCurrentPacket = mRegionStartPacket;
+			mStopped = false;
+			
+			if (theFileInfo->mLoadAtOnce)
+			{
+				// the one buffer holds the whole file
+				result = AudioQueueEnqueueBufferWithParameters(mQueue, mBuffers[0], (mPacketDescs ? mNumPacketsToRead : 0), mPacketDescs, 
+																(UInt32)theStart, (UInt32)(theFileFrames - theEnd), 0, NULL, NULL, NULL);
+				mCurrentPacket = mRegionEndPacket;
+			}
+			else
+			{
+				for (UInt32 i = 0; (i < kNumberBuffers) && (mCurrentPacket < mRegionEndPacket) && (result == noErr); ++i)
+					result = EnqueueRegionBuffer(mQueue, mBuffers[i]);
+			}
+				AssertNoError("Error enqueuing region", end);
+			
+			result = Start();
+				AssertNoError("Error starting queue", end);
+			if (mCurrentPacket >= mRegionEndPacket)
+				result = AudioQueueStop(mQueue, false);
+		
+		end:
+			return result;
+		}
+		
+		OSStatus EnqueueRegionBuffer(AudioQueueRef inAQ, AudioQueueBufferRef inBuffer)
+		{
+			BG_FileInfo *theFileInfo = mBGFileInfo[mCurrentFileIndex];
+			UInt32 nPackets = (UInt32)std::min<SInt64>(mNumPacketsToRead, mRegionEndPacket - mCurrentPacket);
+			UInt32 theTrimStart = (mCurrentPacket == mRegionStartPacket) ? mRegionStartTrim : 0;
+			UInt32 theTrimEnd = 0;
+			UInt32 numBytes;
+			
+			OSStatus result = ReadPackets(theFileInfo, &numBytes, mCurrentPacket, &nPackets, inBuffer->mAudioData);
+				AssertNoError("Error reading file data", end);
+			if (nPackets == 0)
+			{
+				mCurrentPacket = mRegionEndPacket;
+				return kSoundEngineErrInvalidRange;
+			}
+			inBuffer->mAudioDataByteSize = numBytes;
+			
+			mCurrentPacket += nPackets;
+			if (mCurrentPacket >= mRegionEndPacket)
+				theTrimEnd = mRegionEndTrim;
+			result = AudioQueueEnqueueBufferWithParameters(inAQ, inBuffer, (mPacketDescs ? nPackets : 0), mPacketDescs, theTrimStart, theTrimEnd, 0, NULL, NULL, NULL);
+				AssertNoError("Error enqueuing new buffer", end);
+		
+		end:
+			return result;
+		}
+		
+		OSStatus SetupQueue(BG_FileInfo *inFileInfo)
+		{
+			UInt32 size = 0;
+			OSStatus result = AudioQueueNewOutput(&inFileInfo->mFileFormat, QueueCallback, this, mRunLoop, kCFRunLoopCommonModes, 0, &mQueue);
+			if(result != noErr)
+			{
+				printf("%s: %d\n", "Error creating queue", (int)result);
+				return result;
+			}
+			
+			// (2) If the file has a cookie, we should get it and set it on the AQ
+			size = sizeof(UInt32);
+			result = AudioFileGetPropertyInfo (inFileInfo->mAFID, kAudioFilePropertyMagicCookieData, &size, NULL);
+
+			if (!result && size) {
+				void* cookie = GetPropertyScratch(size);
+				result = AudioFileGetProperty (inFileInfo->mAFID, kAudioFilePropertyMagicCookieData, &size, cookie);
+				if(result != noErr)
+				{
+					printf("%s: %d\n", "Error getting magic cookie", (int)result);
+					return result;
+				}
+				
+				result = AudioQueueSetProperty(mQueue, kAudioQueueProperty_MagicCookie, cookie, size);
+				if(result != noErr)
+				{
+					printf("%s: %d\n", "Error setting magic cookie", (int)result);
+					return result;
+				}
+			}
+
+			// channel layout
+			OSStatus err = AudioFileGetPropertyInfo(inFileInfo->mAFID, kAudioFilePropertyChannelLayout, &size, NULL);
+			if (err == noErr && size > 0) {
+				AudioChannelLayout *acl = (AudioChannelLayout *)GetPropertyScratch(size);
+				result = AudioFileGetProperty(inFileInfo->mAFID, kAudioFilePropertyChannelLayout, &size, acl);
+				if(result != noErr)
+				{
+					printf("%s: %d\n", "Error getting channel layout from file", (int)result);
+					return result;
+				}
+				
+				result = AudioQueueSetProperty(mQueue, kAudioQueueProperty_ChannelLayout, acl, size);
+				if(result != noErr)
+				{
+					printf("%s: %d\n", "Error setting channel layout on queue", (int)result);
+					return result;
+				}
+			}
+			
+			// add a notification proc for when the queue stops
+			result = AudioQueueAddPropertyListener(mQueue, kAudioQueueProperty_IsRunning, QueueStoppedProc, this);
+			if(result != noErr)
+			{
+				printf("%s: %d\n", "Error adding isRunning property listener to queue", (int)result);
+				return result;
+			}
+			
+			// the processing tap runs the DSP chain of the bus the queue is routed to
+			result = SetupTap();
+			if(result != noErr)
+			{
+				printf("%s: %d\n", "Error adding processing tap to queue", (int)result);
+				result = noErr;		// play without DSP rather than not at all
+			}
+			
+			// we need to reset this variable so that if the queue is stopped mid buffer we don't dispose it 
+			mMakeNewQueueWhenStopped = false;
+			
+			// volume
+			result = SetVolume(mVolume);
+			
+		end:
+			return result;
+		}
+
+		OSStatus SetupBuffers(BG_FileInfo *inFileInfo)
+		{
+			int numBuffersToQueue = kNumberBuffers;
+			UInt32 maxPacketSize;
+			UInt32 size = sizeof(maxPacketSize);
+			// we need to calculate how many packets we read at a time, and how big a buffer we need
+			// we base this on the size of the packets in the file and an approximate duration for each buffer
+				
+			// first check to see what the max size of a packet is - if it is bigger
+			// than our allocation default size, that needs to become larger
+			OSStatus result = AudioFileGetProperty(inFileInfo->mAFID, kAudioFilePropertyPacketSizeUpperBound, &size, &maxPacketSize);
+			if(result != noErr)
+			{
+				printf("%s: %d\n", "Error getting packet upper bound size", (int)result);
+				return result;
+			}
+			
+			bool isFormatVBR = (inFileInfo->mFileFormat.mBytesPerPacket == 0 || inFileInfo->mFileFormat.mFramesPerPacket == 0);
+
+			CalculateBytesForTime(inFileInfo->mFileFormat, maxPacketSize, 0.5/*seconds*/, &mBufferByteSize, &mNumPacketsToRead);
+			
+			// if the file is smaller than the capacity of all the buffer queues, always load it at once
+			if ((mBufferByteSize * numBuffersToQueue) > inFileInfo->mFileDataSize)
+				inFileInfo->mLoadAtOnce = true;
+				
+			if (inFileInfo->mLoadAtOnce)
+			{
+				UInt64 theFileNumPackets;
+				size = sizeof(UInt64);
+				result = AudioFileGetProperty(inFileInfo->mAFID, kAudioFilePropertyAudioDataPacketCount, &size, &theFileNumPackets);
+					AssertNoError("Error getting packet count for file", end);
+				
+				mNumPacketsToRead = (UInt32)theFileNumPackets;
+				mBufferByteSize = inFileInfo->mFileDataSize;
+				numBuffersToQueue = 1;
+			}	
+			else
+			{
+				mNumPacketsToRead = mBufferByteSize / maxPacketSize;
+			}
+			
+			// the descriptions are kept from one file to the next, and only grow past the largest buffer so far
+			if (isFormatVBR)
+			{
+				if (mPacketDescStorage.size() < mNumPacketsToRead)
+					mPacketDescStorage.resize(mNumPacketsToRead);
+				mPacketDescs = &mPacketDescStorage[0];
+			}
+			else
+				mPacketDescs = NULL; // we don't provide packet descriptions for constant bit rate formats (like linear PCM)	
+				
+			// allocate the queue's buffers
+			for (int i = 0; i < numBuffersToQueue; ++i) 
+			{
+				result = AudioQueueAllocateBuffer(mQueue, mBufferByteSize, &mBuffers[i]);
+					AssertNoError("Error allocating buffer for queue", end);
+				RefillBuffer (this, mQueue, mBuffers[i]);
+				if (inFileInfo->mLoadAtOnce)
+					inFileInfo->mFileDataInQueue = true;
+			}
+		
+		end:
+			return result;
+		}
+		
+		// what SetupBuffers decides: a file smaller than all the buffers is loaded at once as well
+		static Boolean IsLoadedAtOnce(BG_FileInfo *inFileInfo)
+		{
+			if (inFileInfo->mLoadAtOnce)
+				return true;
+			
+			UInt32 maxPacketSize;
+			UInt32 size = sizeof(maxPacketSize);
+			if (AudioFileGetProperty(inFileInfo->mAFID, kAudioFilePropertyPacketSizeUpperBound, &size, &maxPacketSize) != noErr)
+				return false;
+			
+			UInt32 theBufferByteSize = 0;
+			UInt32 theNumPackets = 0;
+			CalculateBytesForTime(inFileInfo->mFileFormat, maxPacketSize, 0.5/*seconds*/, &theBufferByteSize, &theNumPackets);
+			return (theBufferByteSize * kNumberBuffers) > inFileInfo->mFileDataSize;
+		}
+		
+		// A compressed file played from a single buffer is decoded by the queue on every loop; the 
+		// decode cache hands out PCM instead. The file info then stands for the decoded file, mapped and
+		// streamed from the mapping: the PCM is larger than the source, it is not worth a buffer of its
+		// own. The source stays open while the cache does not have it yet.
+		static void OpenDecodedFile(BG_FileInfo *ioFileInfo, Boolean inMapped)
+		{
+			char theSourcePath[PATH_MAX];
+			if (ioFileInfo->mFileFormat.mFormatID == kAudioFormatLinearPCM)
+				return;
+			strcpy(theSourcePath, ioFileInfo->mFilePath);
+			if (sDecodeCache.GetDecodedPath(theSourcePath, ioFileInfo->mFilePath) != noErr)
+			{
+				strcpy(ioFileInfo->mFilePath, theSourcePath);
+				return;
+			}
+			
+			CloseFile(ioFileInfo);
+			if (OpenMappedFile(ioFileInfo) == noErr)
+			{
+				ioFileInfo->mLoadAtOnce = false;
+				return;
+			}
+			
+			CloseFile(ioFileInfo);
+			strcpy(ioFileInfo->mFilePath, theSourcePath);
+			OpenFileInfo(ioFileInfo, inMapped);
+		}
+		
+		static OSStatus OpenFileInfo(BG_FileInfo *ioFileInfo, Boolean inMapped)
+		{
+			return (inMapped) ? OpenMappedFile(ioFileInfo) : LoadFileDataInfo(ioFileInfo->mFilePath, ioFileInfo->mAFID, ioFileInfo->mFileFormat, ioFileInfo->mFileDataSize);
+		}
+		
+		OSStatus LoadTrack(const char* inFilePath, Boolean inAddToQueue, Boolean inLoadAtOnce, Boolean inMapped = false)
+		{
+			SoundEngineLock theLock(mRefillLock);
+			BG_FileInfo *fileInfo = new BG_FileInfo;
+			if (fileInfo == NULL)
+				return kSoundEngineErrPoolExhausted;
+			fileInfo->mAFID = 0;
+			fileInfo->mMapping = NULL;
+			fileInfo->mMappingSize = 0;
+			mRegionEndPacket = 0;
+			
+			OSStatus result = kSoundEngineErrFileNotFound;
+			if (strlen(inFilePath) >= sizeof(fileInfo->mFilePath))
+				goto fail;
+			strcpy(fileInfo->mFilePath, inFilePath);
+			result = OpenFileInfo(fileInfo, inMapped);
+				AssertNoError("Error getting file data info", fail);
+			fileInfo->mLoadAtOnce = inLoadAtOnce;
+			fileInfo->mFileDataInQueue = false;
+			// if not adding to the queue, clear the current file vector
+			if (!inAddToQueue)
+				ReleaseFiles();
+				
+			mBGFileInfo.push_back(fileInfo);
+			
+			// loop points stored in the file, they must be known before the first buffers are read
+			mLoopStartFrame = mLoopEndFrame = 0;
+			if (mBGFileInfo.size() == 1)
+			{
+				ReadLoopMarkers(fileInfo->mAFID, mLoopStartFrame, mLoopEndFrame);
+				if (IsLoadedAtOnce(fileInfo))
+					OpenDecodedFile(fileInfo, inMapped);
+			}
+			if (UpdateLoop())
+				mLoopStartFrame = mLoopEndFrame = 0;
+			
+			// setup the queue if this is the first (or only) file
+			if (mBGFileInfo.size() == 1)
+			{
+				result = SetupQueue(fileInfo);
+					AssertNoError("Error setting up queue", fail);
+				result = SetupBuffers(fileInfo);
+					AssertNoError("Error setting up queue buffers", fail);					
+			}
+			// if this is just part of the playlist, close the file for now
+			else
+				CloseFile(fileInfo);
+			return result;
+		
+		fail:
+			if (fileInfo)
+			{
+				if (!mBGFileInfo.empty() && (mBGFileInfo.back() == fileInfo))
+					mBGFileInfo.pop_back();
+				CloseFile(fileInfo);
+				delete fileInfo;
+			}
+			return result;
+		}
+		
+		OSStatus UpdateGain()
+		{
+			return SetVolume(mVolume);
+		}
+		
+		Float32 GetVolume() { return mVolume; }
+		Boolean IsPlaying() { return mPlaying && !mStopped; }
+		
+		OSStatus SetVolume(Float32 inVolume)
+		{
+			mVolume = inVolume;
+			return AudioQueueSetParameter(mQueue, kAudioQueueParam_Volume, mVolume * sBusGraph.GetGain(mBus));
+		}
+		
+		OSStatus SetBus(SoundEngineBusID inBus)
+		{
+			mBus = inBus;
+			UpdateDSP();
+			return UpdateGain();
+		}
+		
+		static void TapCallback(	void *							inClientData,
+									AudioQueueProcessingTapRef		inAQTap,
+									UInt32							inNumberFrames,
+									AudioTimeStamp *				ioTimeStamp,
+									AudioQueueProcessingTapFlags *	ioFlags,
+									UInt32 *						outNumberFrames,
+									AudioBufferList *				ioData)
+		{
+			SoundEngineRealtimeScope theScope;
+			BackgroundTrackMgr *THIS = (BackgroundTrackMgr*)inClientData;
+			UInt64 theBlockStart = mach_absolute_time();
+			OSStatus result = AudioQueueProcessingTapGetSourceAudio(inAQTap, inNumberFrames, ioTimeStamp, ioFlags, outNumberFrames, ioData);
+				AssertNoError("Error getting tap source audio", end);
+			
+			{
+				SoundEngineDSPChain *theChain = THIS->mDSPChain;
+				if (theChain)
+					theChain->Process(ioData, *outNumberFrames);
+				
+				if (THIS->mTapFormat.mFormatFlags & kAudioFormatFlagIsFloat)
+				{
+					THIS->ApplyGain(ioData, *outNumberFrames);
+					if (sMeters.IsBusMetering())
+						THIS->MeterBlock(ioData, *outNumberFrames);
+				}
+				
+				if (sProfiler.IsEnabled())
+				{
+					// the block includes pulling (decoding) the source audio
+					Float64 theSeconds = HostTimeToSeconds(mach_absolute_time() - theBlockStart);
+					sProfiler.RecordBlock(kSoundEngineProfile_MusicBlockTime, kSoundEngineProfile_MusicBlockLoad, theSeconds, *outNumberFrames / THIS->mTapFormat.mSampleRate);
+					sProfiler.RecordBus(THIS->mBus, theSeconds);
+				}
+			}
+		end:
+			OSAtomicIncrement32Barrier(&THIS->mTapBlocks);
+		}
+		
+		enum {
+			kFadeState_None		= 0,
+			kFadeState_In		= 1,
+			kFadeState_Out		= 2,
+			kFadeState_Silent	= 3,
+		};
+		
+		// Equal-power fade run by the tap, so two crossfading queues sum to a constant power. Fading 
+		// in must be set up before Start, fading out can start at any time. Without a float tap the 
+		// fade can not be applied and the caller has to fall back to the queue volume.
+		Boolean Fade(Boolean inFadeIn, Float64 inSeconds)
+		{
+			if ((mTap == NULL) || !(mTapFormat.mFormatFlags & kAudioFormatFlagIsFloat))
+				return false;
+			
+			mFadeFrames = (UInt64)(inSeconds * mTapFormat.mSampleRate) + 1;
+			mFadePosition = 0;
+			if (inFadeIn)
+				mFadeGain = 0.0;
+			OSMemoryBarrier();
+			mFadeState = inFadeIn ? kFadeState_In : kFadeState_Out;
+			return true;
+		}
+		
+		Float32 NextFadeGain(UInt32 inNumberFrames)
+		{
+			if (mFadeState == kFadeState_None)
+				return 1.0;
+			if (mFadeState == kFadeState_Silent)
+				return 0.0;
+			
+			mFadePosition += inNumberFrames;
+			if (mFadePosition >= mFadeFrames)
+			{
+				mFadeState = (mFadeState == kFadeState_In) ? kFadeState_None : kFadeState_Silent;
+				return (mFadeState == kFadeState_None) ? 1.0 : 0.0;
+			}
+			
+			Float32 theAngle = (Float32)mFadePosition / mFadeFrames * M_PI_2;
+			return (mFadeState == kFadeState_In) ? sinf(theAngle) : cosf(theAngle);
+		}
+		
+		// ducking and crossfade gain, ramped over the block to avoid zipper noise
+		void ApplyGain(AudioBufferList *ioData, UInt32 inNumberFrames)
+		{
+			if (inNumberFrames == 0)
+				return;
+			
+			Float32 theStartGain = mDuckGain * mFadeGain;
+			mDuckGain = sBusGraph.UpdateDuckingGains(mBus, mDuckingGains, inNumberFrames / mTapFormat.mSampleRate);
+			mFadeGain = NextFadeGain(inNumberFrames);
+			Float32 theEndGain = mDuckGain * mFadeGain;
+			if ((theStartGain == 1.0) && (theEndGain == 1.0))
+				return;
+			
+			Float32 theStep = (theEndGain - theStartGain) / inNumberFrames;
+			for (UInt32 i = 0; i < ioData->mNumberBuffers; ++i)
+			{
+				AudioBuffer &theBuffer = ioData->mBuffers[i];
+				UInt32 theStride = theBuffer.mNumberChannels;
+				for (UInt32 j = 0; j < theStride; ++j)
+				{
+					float *theData = (float*)theBuffer.mData + j;
+					Float32 theGain = theStartGain;
+					vDSP_vrampmul(theData, theStride, &theGain, &theStep, theData, theStride, inNumberFrames);
+				}
+			}
+		}
+		
+		// the block is still in cache from the DSP and gain, the queue volume is applied after the tap
+		void MeterBlock(AudioBufferList *inData, UInt32 inNumberFrames)
+		{
+			if ((inNumberFrames == 0) || (inData->mNumberBuffers == 0))
+				return;
+			
+			Float32 thePeak = 0.0;
+			Float32 theMeanSquare = 0.0;
+			for (UInt32 i = 0; i < inData->mNumberBuffers; ++i)
+			{
+				AudioBuffer &theBuffer = inData->mBuffers[i];
+				vDSP_Length theCount = inNumberFrames * theBuffer.mNumberChannels;
+				Float32 theBufferPeak, theBufferMeanSquare;
+				vDSP_maxmgv((const float*)theBuffer.mData, 1, &theBufferPeak, theCount);
+				vDSP_measqv((const float*)theBuffer.mData, 1, &theBufferMeanSquare, theCount);
+				thePeak = std::max(thePeak, theBufferPeak);
+				theMeanSquare += theBufferMeanSquare / inData->mNumberBuffers;
+			}
+			
+			Float32 theGain = mVolume * sBusGraph.GetGain(mBus);
+			sMeters.MeterBus(mBus, thePeak * theGain, theMeanSquare * theGain * theGain, inNumberFrames / mTapFormat.mSampleRate, mach_absolute_time());
+		}
+		
+		OSStatus SetupTap()
+		{
+			UInt32 theMaxFrames;
+			OSStatus result = AudioQueueProcessingTapNew(mQueue, TapCallback, this, kAudioQueueProcessingTap_PreEffects, &theMaxFrames, &mTapFormat, &mTap);
+			if (result)
+			{
+				mTap = NULL;
+				return result;
+			}
+			UpdateDSP();
+			return noErr;
+		}
+		
+		void DisposeTap()
+		{
+			if (mTap)
+			{
+				AudioQueueProcessingTapDispose(mTap);
+				mTap = NULL;
+			}
+			if (mDSPChain)
+			{
+				delete mDSPChain;
+				mDSPChain = NULL;
+			}
+			// without a tap nothing can still be running a retired chain
+			for (UInt32 i = 0; i < mRetiredChains.size(); ++i)
+				delete mRetiredChains[i].mChain;
+			mRetiredChains.clear();
+		}
+		
+		// Builds the chain for the current bus routing and hands it to the tap. The previous chain is 
+		// retired, and deleted by a later update once the tap has acknowledged it.
+		void UpdateDSP()
+		{
+			SoundEngineLock theLock(mRefillLock);
+			if (mTap == NULL)
+				return;
+			
+			std::vector<double> theCoefficients;
+			sBusGraph.GetDSPCoefficients(mBus, mTapFormat.mSampleRate, theCoefficients);
+			
+			SoundEngineDSPChain *theNewChain = NULL;
+			if (!theCoefficients.empty() && (mTapFormat.mFormatFlags & kAudioFormatFlagIsFloat))
+				theNewChain = new SoundEngineDSPChain(theCoefficients, mTapFormat.mChannelsPerFrame);
+			
+			RetiredChain theRetired = { mDSPChain, mTapBlocks };
+			OSAtomicCompareAndSwapPtrBarrier(theRetired.mChain, theNewChain, (void* volatile*)&mDSPChain);
+			if (theRetired.mChain)
+				mRetiredChains.push_back(theRetired);
+			ReclaimChains();
+		}
+		
+		// A block in progress when a chain was swapped out may still run it, and ends by counting 
+		// itself; the block after that can only have read the new chain.
+		void ReclaimChains()
+		{
+			for (UInt32 i = 0; i < mRetiredChains.size(); )
+			{
+				if (mTapBlocks - mRetiredChains[i].mTapBlocks < 2)
+				{
+					++i;
+					continue;
+				}
+				delete mRetiredChains[i].mChain;
+				mRetiredChains[i] = mRetiredChains.back();
+				mRetiredChains.pop_back();
+			}
+		}
+		
+		OSStatus Start()
+		{
+			SoundEngineLock theLock(mRefillLock);
+			OSStatus result = AudioQueuePrime(mQueue, 1, NULL);	
+			if (result)
+			{
+				mStopped = true;
+				printf("Error priming queue");
+				return result;
+			}
+			mStopped = false;
+			mPlaying = true;
+			return AudioQueueStart(mQueue, NULL);
+		}
+		
+		OSStatus Stop(Boolean inStopAtEnd)
+		{
+			SoundEngineLock theLock(mRefillLock);
+			if (inStopAtEnd)
+			{
+				mStopAtEnd = true;
+				return noErr;
+			}
+			else{
+				mStopped = true;
+				mPlaying = false;
+				OSStatus result = AudioQueueStop(mQueue, true);
+				++mRefillEpoch;
+				return result;
+			}
+		}
+		
+		OSStatus Pause() 
+		{ 
+			SoundEngineLock theLock(mRefillLock);
+			mPlaying = false;
+			return AudioQueuePause(mQueue); 
+		}
+		
+		OSStatus Resume() 
+		{ 
+			SoundEngineLock theLock(mRefillLock);
+			mPlaying = true;
+			return AudioQueueStart(mQueue, NULL); 
+		}
+		
+		// An interruption pauses the queue behind our back; a track that was playing carries on from
+		// where it was, its buffers and position are still in the queue.
+		OSStatus Restart()
+		{
+			SoundEngineLock theLock(mRefillLock);
+			if (mStopped || !mPlaying || (mQueue == 0))
+				return noErr;
+			return AudioQueueStart(mQueue, NULL);
+		}
+	
+	private:
+		AudioQueueRef						mQueue;
+		CFRunLoopRef						mRunLoop;
+		AudioQueueBufferRef					mBuffers[kNumberBuffers];
+		UInt32								mBufferByteSize;
+		SInt64								mCurrentPacket;
+		UInt32								mNumPacketsToRead;
+		Float32								mVolume;
+		SoundEngineBusID					mBus;
+		AudioQueueProcessingTapRef			mTap;
+		AudioStreamBasicDescription			mTapFormat;
+		SoundEngineDSPChain * volatile		mDSPChain;
+		volatile SInt32						mTapBlocks;
+		struct RetiredChain {
+			SoundEngineDSPChain *			mChain;
+			SInt32							mTapBlocks;		// blocks the tap had run when it was swapped out
+		};
+		std::vector<RetiredChain>			mRetiredChains;
+		Float32								mDuckGain;
+		Float32								mDuckingGains[kSoundEngineMaxDuckings];
+		volatile UInt32						mFadeState;
+		Float32								mFadeGain;
+		UInt64								mFadeFrames;
+		UInt64								mFadePosition;
+		UInt32								mLoopStartFrame;
+		UInt32								mLoopEndFrame;
+		SInt64								mLoopStartPacket;
+		SInt64								mLoopEndPacket;		// 0 without a loop region
+		UInt32								mLoopStartTrim;		// frames of the boundary packets outside the region
+		UInt32								mLoopEndTrim;
+		UInt32								mLoopFileTrimStart;	// the same, for a file loaded at once
+		UInt32								mLoopFileTrimEnd;
+		Boolean								mLooped;
+		std::vector<char>					mLoopCache;			// first buffer of the loop region
+		std::vector<AudioStreamPacketDescription>	mLoopCacheDescs;
+		UInt32								mLoopCachePackets;
+		SInt64								mRegionStartPacket;
+		SInt64								mRegionEndPacket;	// 0 unless playing a region
+		UInt32								mRegionStartTrim;
+		UInt32								mRegionEndTrim;
+		AudioStreamPacketDescription *		mPacketDescs;		// into mPacketDescStorage, NULL for constant bit rate files
+		std::vector<AudioStreamPacketDescription>	mPacketDescStorage;
+		std::vector<char>					mPropertyScratch;
+		std::vector<BG_FileInfo*>			mBGFileInfo;
+		UInt32								mCurrentFileIndex;
+		Boolean								mMakeNewQueueWhenStopped;
+		Boolean								mStopAtEnd;
+		Boolean								mStopped;
+		Boolean								mPlaying;		// started and not paused since, for Restart
+		AudioQueueBufferRef					mBuffersToDispose[kNumberBuffers + 1];
+		UInt32								mNumBuffersToDispose;
+		pthread_mutex_t						mRefillLock;		// held by the refill thread and by the API
+		volatile int32_t					mPendingRefills;
+		volatile int32_t					mRefillPosted;		// 1 from PostRefill until RefillProc takes the buffers
+		struct Refill {
+			AudioQueueRef					mQueue;
+			AudioQueueBufferRef				mBuffer;		// NULL when the queue stopped and may have to be rebuilt
+			UInt32							mEpoch;
+		};
+		SoundEngineCommandQueue<Refill, kRefillSlots>	mRefills;	// handed over by the callbacks
+		pthread_cond_t						mRefillsDone;		// signalled when the last pending refill ends during Teardown
+		volatile UInt32						mRefillEpoch;		// bumped when the queue is flushed, stale refills are dropped
+		volatile Boolean					mTearingDown;
+};
+
+#pragma mark ***** SoundEngineEffect *****
+//==================================================================================================
+//	SoundEngineEffect class
+//==================================================================================================
+class SoundEngineEffect
+{
+	public:	
+		// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+		SoundEngineEffect(const char* inPath, UInt32 inEffectID) 
+			:	mEffectID(inEffectID),
+				mBufferID(0),
+				mIntroBufferID(0),
+				mLoopBufferID(0),
+				mPath(inPath),
+				mData(NULL),
+				mDataSize(0),
+				mFrames(0),
+				mSampleRate(0.0),
+				mALFormat(0),
+				mBytesPerFrame(0),
+				mLoopStart(0),
+				mLoopEnd(0),
+				mTrimStart(0),
+				mTrimEnd(0),
+				mPeak(0.0),
+				mLoudness(0.0)
+			{ }
+		
+		~SoundEngineEffect()
+		{			
+			DeleteLoopBuffers();
+			if (mBufferID)
+				alDeleteBuffers(1, &mBufferID);
+			if (mData)
+				free(mData);
+		}
+		
+		// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+		// Accessors
+		// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+		UInt32	GetEffectID() { return mEffectID; }		
+		ALuint	GetBufferID() { return mBufferID; }
+		UInt32	GetFrames() { return mFrames; }
+		Float64	GetSampleRate() { return mSampleRate; }
+		Boolean	HasLoopPoints() { return mLoopEnd != 0; }
+		UInt32	GetLoopStart() { return mLoopStart; }
+		UInt32	GetLoopEnd() { return mLoopEnd ? mLoopEnd : mFrames; }
+		ALuint	GetIntroBufferID() { return mIntroBufferID; }
+		ALuint	GetLoopBufferID() { return mLoopBufferID ? mLoopBufferID : mBufferID; }
+		const SoundEngineEnvelope *GetEnvelope() { return &mEnvelope; }
+		UInt32	GetTrimStart() { return mTrimStart; }
+		UInt32	GetTrimEnd() { return mTrimEnd; }
+		Float32	GetPeak() { return mPeak; }
+		Float32	GetLoudness() { return mLoudness; }
+		
+		// Buffers belong to the device, they are made once it is open; until then the effect only 
+		// holds its data.
+		OSStatus CreateBuffers()
+		{
+			OSStatus result = noErr;
+			if (mBufferID)
+				return noErr;
+			
+			alGenBuffers(1, &mBufferID);
+				AssertNoOALError("Error generating buffer\n", fail);
+			alBufferDataStaticProc(mBufferID, mALFormat, mData, mDataSize, mSampleRate);
+				AssertNoOALError("Error attaching data to buffer\n", fail);
+			
+			result = CreateLoopBuffers();
+				AssertNoError("Error creating loop buffers", fail);
+			return noErr;
+			
+		fail:
+			DeleteLoopBuffers();
+			if (mBufferID)
+				alDeleteBuffers(1, &mBufferID);
+			mBufferID = 0;
+			return result;
+		}
+		
+		OSStatus SetLoopPoints(UInt32 inLoopStart, UInt32 inLoopEnd)
+		{
+			DeleteLoopBuffers();
+			mLoopStart = mLoopEnd = 0;
+			if ((inLoopStart == 0) && (inLoopEnd == 0))
+				return noErr;
+			if ((inLoopEnd <= inLoopStart) || (inLoopEnd > mFrames))
+				return kSoundEngineErrInvalidRange;
+			
+			mLoopStart = inLoopStart;
+			mLoopEnd = inLoopEnd;
+			if (mBufferID == 0)
+				return noErr;
+			
+			OSStatus result = CreateLoopBuffers();
+			if (result)
+				mLoopStart = mLoopEnd = 0;
+			return result;
+		}
+		
+		// Same as SetLoopPoints, in frames of the file. A region can not start in the silence trimmed
+		// off the head, that data is gone.
+		OSStatus SetFileLoopPoints(UInt32 inLoopStart, UInt32 inLoopEnd)
+		{
+			if ((inLoopStart == 0) && (inLoopEnd == 0))
+				return SetLoopPoints(0, 0);
+			if ((inLoopStart < mTrimStart) || (inLoopEnd <= inLoopStart))
+			{
+				SetLoopPoints(0, 0);
+				return kSoundEngineErrInvalidRange;
+			}
+			return SetLoopPoints(inLoopStart - mTrimStart, inLoopEnd - mTrimStart);
+		}
+		
+		// The intro and the loop region get buffers of their own over the memory of the whole effect,
+		// so a source can queue the intro, then loop the region, with nothing copied.
+		OSStatus CreateLoopBuffers()
+		{
+			OSStatus result = noErr;
+			if (mLoopEnd == 0)
+				return noErr;
+			
+			if (mLoopStart > 0)
+			{
+				alGenBuffers(1, &mIntroBufferID);
+					AssertNoOALError("Error generating intro buffer", fail);
+				alBufferDataStaticProc(mIntroBufferID, mALFormat, mData, mLoopStart * mBytesPerFrame, mSampleRate);
+					AssertNoOALError("Error attaching data to intro buffer", fail);
+			}
+			alGenBuffers(1, &mLoopBufferID);
+				AssertNoOALError("Error generating loop buffer", fail);
+			alBufferDataStaticProc(mLoopBufferID, mALFormat, (char*)mData + mLoopStart * mBytesPerFrame, (mLoopEnd - mLoopStart) * mBytesPerFrame, mSampleRate);
+				AssertNoOALError("Error attaching data to loop buffer", fail);
+			return noErr;
+		
+		fail:
+			DeleteLoopBuffers();
+			return result;
+		}
+		
+		void DeleteLoopBuffers()
+		{
+			if (mIntroBufferID)
+				alDeleteBuffers(1, &mIntroBufferID);
+			if (mLoopBufferID)
+				alDeleteBuffers(1, &mLoopBufferID);
+			mIntroBufferID = mLoopBufferID = 0;
+		}
+
+		// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+		// Helper Functions
+		// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+		ALenum GetALFormat(AudioStreamBasicDescription inFileFormat)
+		{
+			if (inFileFormat.mFormatID != kAudioFormatLinearPCM)
+				return kSoundEngineErrInvalidFileFormat;
+				
+			if ((inFileFormat.mChannelsPerFrame > 2) || (inFileFormat.mChannelsPerFrame < 1))
+				return kSoundEngineErrInvalidFileFormat;
+			
+			if(inFileFormat.mBitsPerChannel == 8)
+				return (inFileFormat.mChannelsPerFrame == 1) ? AL_FORMAT_MONO8 : AL_FORMAT_STEREO8;
+			else if(inFileFormat.mBitsPerChannel == 16)
+				return (inFileFormat.mChannelsPerFrame == 1) ? AL_FORMAT_MONO16 : AL_FORMAT_STEREO16;
+
+			return kSoundEngineErrInvalidFileFormat;
+		}
+
+		// A load that can be canceled reads one coalesced read at a time and gives up at the first 
+		// one after the cancel, so a page flipped past does not keep the disk busy.
+		static OSStatus ReadFileData(AudioFileID inAFID, UInt32 &ioDataSize, void *outData, const volatile int32_t *inCanceled)
+		{
+			if (inCanceled == NULL)
+				return sIOScheduler.ReadBytes(kIOClass_Load, 0.0, inAFID, 0, &ioDataSize, outData);
+			
+			UInt32 theOffset = 0;
+			while (theOffset < ioDataSize)
+			{
+				if (*inCanceled)
+					return kSoundEngineErrCanceled;
+				UInt32 theRequested = std::min<UInt32>(kIOMaxCoalescedBytes, ioDataSize - theOffset);
+				UInt32 theBytes = theRequested;
+				OSStatus result = sIOScheduler.ReadBytes(kIOClass_Load, 0.0, inAFID, theOffset, &theBytes, (char*)outData + theOffset);
+				theOffset += theBytes;
+				if (result || (theBytes < theRequested))
+				{
+					ioDataSize = theOffset;
+					return result;
+				}
+			}
+			return noErr;
+		}
+
+		// Drops the whole envelope blocks below inThreshold at both ends of the data, never inside the
+		// loop region. Voices wait out the frames dropped from the head, the sound starts on time.
+		void TrimSilence(void* &ioData, UInt32 &ioDataSize, Float32 inThreshold)
+		{
+			UInt32 theFirstBlock, theEndBlock;
+			if ((inThreshold <= 0.0) || !mEnvelope.FindSound(inThreshold, theFirstBlock, theEndBlock))
+				return;
+			
+			UInt32 theStart = theFirstBlock * kMeterBlockFrames;
+			UInt32 theEnd = std::min<UInt32>(theEndBlock * kMeterBlockFrames, mFrames);
+			Boolean hasLoop = (mLoopEnd > mLoopStart) && (mLoopEnd <= mFrames);
+			if (hasLoop)
+			{
+				theStart = std::min<UInt32>(theStart, mLoopStart / kMeterBlockFrames * kMeterBlockFrames);
+				theEnd = std::max<UInt32>(theEnd, mLoopEnd);
+			}
+			if ((theStart == 0) && (theEnd == mFrames))
+				return;
+			
+			ioDataSize = (theEnd - theStart) * mBytesPerFrame;
+			memmove(ioData, (char*)ioData + theStart * mBytesPerFrame, ioDataSize);
+			void *theData = realloc(ioData, ioDataSize);
+			if (theData)
+				ioData = theData;
+			mEnvelope.Trim(theStart / kMeterBlockFrames, (theEnd + kMeterBlockFrames - 1) / kMeterBlockFrames);
+			
+			mTrimStart = theStart;
+			mTrimEnd = mFrames - theEnd;
+			mFrames = theEnd - theStart;
+			if (hasLoop)
+			{
+				mLoopStart -= theStart;
+				mLoopEnd -= theStart;
+			}
+		}
+		
+		OSStatus LoadFileData(const char *inFilePath, void* &outData, UInt32 &outDataSize, Float32 inTrimThreshold, const volatile int32_t *inCanceled)
+		{
+			AudioFileID theAFID = 0;
+			OSStatus result = noErr;
+			UInt64 theFileSize = 0;
+			AudioStreamBasicDescription theFileFormat;
+			
+			result = LoadFileDataInfo(inFilePath, theAFID, theFileFormat, theFileSize);
+			outDataSize = (UInt32)theFileSize;
+				AssertNoError("Error loading file info", fail)
+
+			outData = malloc(outDataSize);
+
+			result = ReadFileData(theAFID, outDataSize, outData, inCanceled);
+			if (result != kSoundEngineErrCanceled)
+				AssertNoError("Error reading file data", fail)
+			if (result)
+				goto fail;
+				
+			if (!TestAudioFormatNativeEndian(theFileFormat) && (theFileFormat.mBitsPerChannel > 8)) 
+			{
+				result = kSoundEngineErrInvalidFileFormat;
+				goto fail;
+			}
+			
+			// checked here, the buffer that would have refused the format is only made with the device
+			if (GetALFormat(theFileFormat) == (ALenum)kSoundEngineErrInvalidFileFormat)
+			{
+				result = kSoundEngineErrInvalidFileFormat;
+				goto fail;
+			}
+
+			// keep the length in frames, virtual voices need it to advance their play cursor
+			mFrames = (theFileFormat.mBytesPerFrame) ? outDataSize / theFileFormat.mBytesPerFrame : 0;
+			mSampleRate = theFileFormat.mSampleRate;
+			mALFormat = GetALFormat(theFileFormat);
+			mBytesPerFrame = theFileFormat.mBytesPerFrame;
+			ReadLoopMarkers(theAFID, mLoopStart, mLoopEnd);
+			mEnvelope.Build(outData, mFrames, theFileFormat.mChannelsPerFrame, theFileFormat.mBitsPerChannel);
+			TrimSilence(outData, outDataSize, inTrimThreshold);
+			// kept for gain normalization, no voice has to scan the data
+			mEnvelope.GetLevels(mPeak, mLoudness);
+
+			AudioFileClose(theAFID);
+			return result;
+			
+		fail:			
+			if (theAFID)
+				AudioFileClose(theAFID);
+			if (outData)
+			{
+				free(outData);
+				outData = NULL;
+			}
+			return result;
+		}
+		
+		OSStatus initialize(Float32 inTrimThreshold, const volatile int32_t *inCanceled = NULL)
+		{
+			OSStatus result = AL_NO_ERROR;			
+
+			result = LoadFileData(mPath, mData, mDataSize, inTrimThreshold, inCanceled);
+				AssertNoError("Error loading sound file info", end)
+			
+			// a loop region found in the file is not worth failing the load for
+			if (mLoopEnd && SetLoopPoints(mLoopStart, mLoopEnd))
+				printf("Ignoring the loop markers of %s\n", mPath);
+
+		end:
+			return result;
+		}
+
+	private:
+		UInt32					mEffectID;
+		ALuint					mBufferID;
+		ALuint					mIntroBufferID;
+		ALuint					mLoopBufferID;
+		const char*				mPath;
+		void*					mData;
+		UInt32					mDataSize;
+		UInt32					mFrames;
+		Float64					mSampleRate;
+		ALenum					mALFormat;
+		UInt32					mBytesPerFrame;
+		UInt32					mLoopStart;
+		UInt32					mLoopEnd;
+		UInt32					mTrimStart;		// frames of silence trimmed off the head of the file
+		UInt32					mTrimEnd;		// and off its tail
+		Float32					mPeak;
+		Float32					mLoudness;		// RMS of the trimmed effect
+		SoundEngineEnvelope		mEnvelope;
+};
+
+#pragma mark ***** SoundEngineEffectMap *****
+//==================================================================================================
+//	SoundEngineEffectMap class
+//==================================================================================================
+class SoundEngineEffectMap 
+	: std::multimap<UInt32, SoundEngineEffect*, std::less<ALuint> > 
+{
+	public:
+    // add a new context to the map
+    void Add (const	ALuint	inEffectToken, SoundEngineEffect **inEffect)
+	{
+		iterator	it = upper_bound(inEffectToken);
+		insert(it, value_type (inEffectToken, *inEffect));
+	}
+
+    SoundEngineEffect* Get(ALuint	inEffectToken) 
+	{
+        iterator	it = find(inEffectToken);
+        if (it != end())
+            return ((*it).second);
+		return (NULL);
+    }
+
+    void Remove (const	ALuint	inSourceToken) {
+        iterator 	it = find(inSourceToken);
+        if (it != end())
+            erase(it);
+    }
+	
+    SoundEngineEffect* GetEffectByIndex(UInt32	inIndex) {
+        iterator	it = begin();
+
+		for (UInt32 i = 0; i < inIndex; i++) {
+            if (it != end())
+                ++it;
+            else
+                i = inIndex;
+        }
+        
+        if (it != end())
+            return ((*it).second);		
+		return (NULL);
+    }
+
+	iterator GetIterator() { return begin(); }
+	
+	// for the effects loaded before the device was open; one whose buffers fail plays silence
+	void CreateBuffers()
+	{
+		for (iterator it = begin(); it != end(); ++it)
+		{
+			if (it->second->CreateBuffers())
+				printf("Error creating buffers of effect %u\n", (unsigned int)it->first);
+		}
+	}
+	
+    UInt32 Size () const { return size(); }
+    bool Empty () const { return empty(); }
+};
+
+#pragma mark ***** SoundEngineVoice *****
+//==================================================================================================
+//	SoundEngineVoice struct
+//==================================================================================================
+// A voice is what SoundEngine_PrimeEffect hands out. It only holds one of the MAX_SOURCES OpenAL
+// sources while it is playing and audible. Otherwise it is virtual: the voice update thread keeps
+// advancing its play cursor so it resumes at the right frame once it turns audible again.
+struct SoundEngineVoice
+{
+	UInt16					mGeneration;
+	UInt32					mEffectID;
+	ALuint					mSourceID;		// 0 while the voice is virtual
+	Float32					mPitch;
+	Float32					mPosition[3];
+	UInt32					mFrames;
+	Float64					mSampleRate;
+	Float32					mOcclusion;		// dB, ALC_ASA_OCCLUSION
+	Float32					mReverbSend;	// ALC_ASA_REVERB_SEND_LEVEL
+	UInt8					mPriority;
+	UInt8					mBus;
+	UInt8					mBucket;		// steal bucket while real
+	UInt32					mPrevReal;		// neighbours in the steal bucket
+	UInt32					mNextReal;
+	UInt32					mLoopStart;		// loop region of the effect, in frames, the whole effect by default
+	UInt32					mLoopEnd;
+	Boolean					mLooping;
+	UInt8					mLoopPhase;		// what the source has queued while real
+	Boolean					mOneShot;		// started by SoundEngine_PlayEffect, freed as soon as it stops
+	Boolean					mRelative;		// panned relative to the listener (one-shots)
+	const SoundEngineEnvelope *	mEnvelope;	// of the effect, for the meters
+	UInt8					mMeterSlot;		// voice meter slot + 1, 0 when the voice is not metered
+	UInt32					mLeadIn;		// frames of silence trimmed off the effect, waited out at start
+	UInt64					mLeadInEnd;		// sample time the sound of the voice starts at, 0 out of the lead-in
+
+	Boolean IsReal() const { return mSourceID != 0; }
+};
+
+enum {
+	kVoiceState_Free		= 0,
+	kVoiceState_Stopped		= 1,
+	kVoiceState_Playing		= 2,
+};
+
+enum {
+	kLoopPhase_None			= 0,	// the whole effect, once
+	kLoopPhase_Intro		= 1,	// intro then loop region queued, until the intro is processed
+	kLoopPhase_Body			= 2,	// loop region alone with AL_LOOPING, offsets are relative to it
+};
+
+#pragma mark ***** SoundEngineVoiceLanes *****
+//==================================================================================================
+//	SoundEngineVoiceLanes class
+//==================================================================================================
+// The voice fields the update pass reads for every voice, one array each, indexed like the voices.
+// A pass streams through the few lanes it needs instead of striding over whole voices, and each
+// lane starts on a cache line. The rest of a voice stays in SoundEngineVoice.
+class SoundEngineVoiceLanes
+{
+	public:
+		SoundEngineVoiceLanes()
+			:	mState(NULL),
+				mCursor(NULL),
+				mIncrement(NULL),
+				mGain(NULL),
+				mPan(NULL),
+				mCapacity(0)
+		{
+		}
+		
+		~SoundEngineVoiceLanes()
+		{
+			FreeLanes();
+		}
+		
+		UInt32 GetCapacity() { return mCapacity; }
+		
+		// Keeps the voices below both capacities, the new ones are free. Nothing changes on failure.
+		Boolean Resize(UInt32 inCapacity)
+		{
+			SoundEngineVoiceLanes theLanes;
+			if (!AllocateLane(theLanes.mState, inCapacity) || !AllocateLane(theLanes.mCursor, inCapacity) || 
+				!AllocateLane(theLanes.mIncrement, inCapacity) || !AllocateLane(theLanes.mGain, inCapacity) || 
+				!AllocateLane(theLanes.mPan, inCapacity))
+				return false;
+			
+			UInt32 theKept = std::min<UInt32>(mCapacity, inCapacity);
+			if (theKept)
+			{
+				memcpy(theLanes.mState, mState, theKept * sizeof(*mState));
+				memcpy(theLanes.mCursor, mCursor, theKept * sizeof(*mCursor));
+				memcpy(theLanes.mIncrement, mIncrement, theKept * sizeof(*mIncrement));
+				memcpy(theLanes.mGain, mGain, theKept * sizeof(*mGain));
+				memcpy(theLanes.mPan, mPan, theKept * sizeof(*mPan));
+			}
+			
+			std::swap(mState, theLanes.mState);
+			std::swap(mCursor, theLanes.mCursor);
+			std::swap(mIncrement, theLanes.mIncrement);
+			std::swap(mGain, theLanes.mGain);
+			std::swap(mPan, theLanes.mPan);
+			mCapacity = inCapacity;
+			return true;
+		}
+		
+		UInt8 *									mState;
+		Float64 *								mCursor;		// play cursor, in frames
+		Float64 *								mIncrement;		// frames the cursor moves per second, sample rate times pitch
+		Float32 *								mGain;
+		Float32 *								mPan;			// -1.0 (left) to 1.0 (right), for the relative voices
+		
+	private:
+		template <class T>
+		static Boolean AllocateLane(T *&outLane, UInt32 inCapacity)
+		{
+			void *theLane = NULL;
+			if (posix_memalign(&theLane, kCacheLineSize, std::max<UInt32>(inCapacity, 1) * sizeof(T)))
+				return false;
+			memset(theLane, 0, inCapacity * sizeof(T));
+			outLane = (T*)theLane;
+			return true;
+		}
+		
+		void FreeLanes()
+		{
+			free(mState);
+			free(mCursor);
+			free(mIncrement);
+			free(mGain);
+			free(mPan);
+		}
+		
+		UInt32									mCapacity;
+};
+
+// voice IDs carry a generation so a stale ID never reaches a voice that has been primed again
+static inline SoundEngineVoiceID VoiceIDForIndex(UInt32 inIndex, UInt16 inGeneration) { return ((UInt32)inGeneration << 16) | (inIndex + 1); }
+static inline UInt32 VoiceIndexForID(SoundEngineVoiceID inVoiceID) { return (inVoiceID & 0xFFFF) - 1; }
+static inline UInt16 VoiceGenerationForID(SoundEngineVoiceID inVoiceID) { return (UInt16)(inVoiceID >> 16); }
+
+#pragma mark ***** SoundEngineEffectCommand *****
+//==================================================================================================
+//	SoundEngineEffectCommand
+//==================================================================================================
+// a fire-and-forget play, waiting for the voice update thread
+struct SoundEngineEffectCommand
+{
+	UInt32					mEffectID;
+	Float32					mGain;
+	Float32					mPitch;
+	Float32					mPan;
+	UInt8					mPriority;
+};
+
+#pragma mark ***** SoundEngineTaskPool *****
+//==================================================================================================
+//	SoundEngineTaskPool class
+//==================================================================================================
+// Runs the tasks of a pass on the calling thread and up to kMaxTaskThreads - 1 helper threads. Each
+// thread is dealt a contiguous range of tasks and takes from its front; once done it steals from the
+// back of the other ranges, so a range of slow tasks does not hold the pass back. Which thread runs a
+// task varies from pass to pass, so the caller keeps one result per task and combines them in task
+// order afterwards: the outcome is then the same whatever the number of threads.
+typedef void (*SoundEngineTaskProc)(void *inRefCon, UInt32 inTask);
+
+class SoundEngineTaskPool
+{
+	public:
+		SoundEngineTaskPool()
+			:	mNumThreads(1),
+				mNumWorkers(0),
+				mActiveThreads(0),
+				mProc(NULL),
+				mRefCon(NULL)
+		{
+			semaphore_create(mach_task_self(), &mDoneSemaphore, SYNC_POLICY_FIFO, 0);
+		}
+		
+		~SoundEngineTaskPool()
+		{
+			for (UInt32 i = 0; i < mNumWorkers; ++i)
+			{
+				mWorkers[i].mRunning = false;
+				semaphore_signal(mWorkers[i].mStartSemaphore);
+				pthread_join(mWorkers[i].mThread, NULL);
+				semaphore_destroy(mach_task_self(), mWorkers[i].mStartSemaphore);
+			}
+			semaphore_destroy(mach_task_self(), mDoneSemaphore);
+		}
+		
+		// not while a pass runs; helper threads are created on demand and kept
+		void SetThreads(UInt32 inThreads)
+		{
+			inThreads = std::max<UInt32>(1, std::min<UInt32>(inThreads, kMaxTaskThreads));
+			while (mNumWorkers + 1 < inThreads)
+			{
+				Worker &theWorker = mWorkers[mNumWorkers];
+				theWorker.mPool = this;
+				theWorker.mIndex = mNumWorkers + 1;
+				theWorker.mRunning = true;
+				semaphore_create(mach_task_self(), &theWorker.mStartSemaphore, SYNC_POLICY_FIFO, 0);
+				if (pthread_create(&theWorker.mThread, NULL, WorkerEntry, &theWorker))
+				{
+					printf("Error creating voice update worker\n");
+					semaphore_destroy(mach_task_self(), theWorker.mStartSemaphore);
+					break;
+				}
+				++mNumWorkers;
+			}
+			mNumThreads = std::min<UInt32>(inThreads, mNumWorkers + 1);
+		}
+		
+		void Run(SoundEngineTaskProc inProc, void *inRefCon, UInt32 inNumTasks)
+		{
+			UInt32 theThreads = std::min<UInt32>(mNumThreads, inNumTasks);
+			if (theThreads <= 1)
+			{
+				for (UInt32 i = 0; i < inNumTasks; ++i)
+					inProc(inRefCon, i);
+				return;
+			}
+			
+			mProc = inProc;
+			mRefCon = inRefCon;
+			mActiveThreads = theThreads;
+			for (UInt32 i = 0; i < theThreads; ++i)
+				mRanges[i] = MakeRange(i * inNumTasks / theThreads, (i + 1) * inNumTasks / theThreads);
+			OSMemoryBarrier();
+			
+			for (UInt32 i = 1; i < theThreads; ++i)
+				semaphore_signal(mWorkers[i - 1].mStartSemaphore);
+			Work(0);
+			for (UInt32 i = 1; i < theThreads; ++i)
+				semaphore_wait(mDoneSemaphore);
+		}
+		
+	private:
+		struct Worker {
+			SoundEngineTaskPool *			mPool;
+			UInt32							mIndex;
+			pthread_t						mThread;
+			semaphore_t						mStartSemaphore;
+			volatile bool					mRunning;
+		};
+		
+		// the next and end task of a range share one word, taking from either side is a single swap
+		static int64_t MakeRange(UInt32 inNext, UInt32 inEnd) { return (int64_t)(((UInt64)inEnd << 32) | inNext); }
+		
+		Boolean TakeTask(UInt32 inRange, Boolean inFromFront, UInt32 &outTask)
+		{
+			while (true)
+			{
+				int64_t theRange = mRanges[inRange];
+				UInt32 theNext = (UInt32)theRange;
+				UInt32 theEnd = (UInt32)((UInt64)theRange >> 32);
+				if (theNext >= theEnd)
+					return false;
+				
+				outTask = inFromFront ? theNext : theEnd - 1;
+				int64_t theNewRange = inFromFront ? MakeRange(theNext + 1, theEnd) : MakeRange(theNext, theEnd - 1);
+				if (OSAtomicCompareAndSwap64Barrier(theRange, theNewRange, &mRanges[inRange]))
+					return true;
+			}
+		}
+		
+		void Work(UInt32 inThread)
+		{
+			UInt32 theTask;
+			while (TakeTask(inThread, true, theTask))
+				mProc(mRefCon, theTask);
+			for (UInt32 i = 1; i < mActiveThreads; ++i)
+			{
+				UInt32 theVictim = (inThread + i) % mActiveThreads;
+				while (TakeTask(theVictim, false, theTask))
+					mProc(mRefCon, theTask);
+			}
+		}
+		
+		static void *WorkerEntry(void *inWorker)
+		{
+			Worker *theWorker = (Worker*)inWorker;
+			while (true)
+			{
+				semaphore_wait(theWorker->mStartSemaphore);
+				if (!theWorker->mRunning)
+					break;
+				theWorker->mPool->Work(theWorker->mIndex);
+				semaphore_signal(theWorker->mPool->mDoneSemaphore);
+			}
+			return NULL;
+		}
+		
+		UInt32									mNumThreads;
+		UInt32									mNumWorkers;
+		Worker									mWorkers[kMaxTaskThreads - 1];
+		volatile int64_t						mRanges[kMaxTaskThreads];
+		UInt32									mActiveThreads;
+		SoundEngineTaskProc						mProc;
+		void *									mRefCon;
+		semaphore_t								mDoneSemaphore;
+};
+
+// spare cores, the one running the app and the render thread left alone
+static UInt32 GetDefaultTaskThreads()
+{
+	int theCPUs = 1;
+	size_t theSize = sizeof(theCPUs);
+	if (sysctlbyname("hw.activecpu", &theCPUs, &theSize, NULL, 0))
+		theCPUs = 1;
+	return (theCPUs > 2) ? std::min<UInt32>(theCPUs - 1, kMaxTaskThreads) : 1;
+}
+
+#pragma mark ***** OpenALObject *****
+//==================================================================================================
+//	OpenALObject class
+//==================================================================================================
+class OpenALObject
+{	
+	public:	
+		OpenALObject(Float32 inMixerOutputRate)
+			:	mOutputRate(inMixerOutputRate),
+				mContext(NULL),
+				mDevice(NULL),
+				mEffectsMap(NULL),
+				mListenerGain(1.0),
+				mReferenceDistance(1.0),
+				mMaxDistance(FLT_MAX),
+				mRolloffFactor(1.0),
+				mVirtualThreshold(kDefaultVirtualVoiceThreshold),
+				mTrimThreshold(kDefaultTrimThreshold),
+				mHasASA(false),
+				mReverbSet(false),
+				mReverbOn(false),
+				mReverbRoomType(0),
+				mReverbLevel(0.0),
+				mClockStartTime(mach_absolute_time()),
+				mClockRate(44100.0),
+				mLastUpdateTime(0),
+				mUpdateThreadRunning(false),
+				mLastEffectID(0),
+				mDeviceRequested(0),
+				mHasStartupThread(false)
+		{
+			pthread_mutex_init(&mDeviceLock, NULL);
+			memset(mStartupTimes, 0, sizeof(mStartupTimes));
+			mEffectsMap = new SoundEngineEffectMap();
+			mListenerPosition[0] = mListenerPosition[1] = mListenerPosition[2] = 0.0;
+			
+			for (int i = 0; i < kVoiceBuckets; ++i)
+				mBucketHead[i] = mBucketTail[i] = kNoVoice;
+			mBucketMask[0] = mBucketMask[1] = 0;
+			
+			SetVoiceCapacity(MAX_VOICES);
+			mTaskPool.SetThreads(GetDefaultTaskThreads());
+			
+			pthread_mutex_init(&mVoiceLock, NULL);
+			semaphore_create(mach_task_self(), &mWakeSemaphore, SYNC_POLICY_FIFO, 0);
+		}
+		
+		~OpenALObject() 
+		{ 
+			Teardown(); 
+			semaphore_destroy(mach_task_self(), mWakeSemaphore);
+			pthread_mutex_destroy(&mVoiceLock);
+		}
+
+		// Opens the device right away, the way SoundEngine_Initialize always has.
+		OSStatus Initialize()
+		{
+			return OpenDevice();
+		}
+		
+		// Lazy startup: nothing touches the audio hardware until the first playback, which opens the 
+		// device on a thread of its own. Effects load in the meantime and get their buffers once the
+		// context exists; voices started before that are virtual and become real on the first pass.
+		void RequestDevice()
+		{
+			if (mDevice || !OSAtomicCompareAndSwap32Barrier(0, 1, &mDeviceRequested))
+				return;
+			// a startup thread that failed has cleared the request on its way out
+			if (mHasStartupThread)
+			{
+				pthread_join(mStartupThread, NULL);
+				mHasStartupThread = false;
+			}
+			if (pthread_create(&mStartupThread, NULL, StartupThreadEntry, this))
+			{
+				printf("Error creating startup thread\n");
+				OpenDeviceOrRetry();
+				return;
+			}
+			mHasStartupThread = true;
+		}
+		
+		// The next playback requests the device again if this attempt fails.
+		void OpenDeviceOrRetry()
+		{
+			if (OpenDevice() != noErr)
+				OSAtomicCompareAndSwap32Barrier(1, 0, &mDeviceRequested);
+		}
+		
+		// Each phase is timed, SoundEngine_GetStartupTime reports them.
+		OSStatus OpenDevice()
+		{
+			SoundEngineLock theDeviceLock(mDeviceLock);
+			if (mDevice)
+				return noErr;
+			
+			OSStatus result = noErr;
+			UInt64 theStart = mach_absolute_time();
+			UInt64 thePhaseStart = theStart;
+			mDevice = alcOpenDevice(NULL);
+				AssertNoOALError("Error opening output device", end)
+			if(mDevice == NULL) { return kSoundEngineErrDeviceNotFound; }
+			thePhaseStart = RecordStartupPhase(kSoundEngineStartup_Device, thePhaseStart);
+			
+			{
+				SoundEngineLock theLock(mVoiceLock);
+				UInt64 theSampleTime = GetSampleTime();
+				result = CreateContext();
+					AssertNoError("Error creating OpenAL context", end);
+				
+				alGetSourcef(mSourceID[0], AL_ROLLOFF_FACTOR, &mRolloffFactor);
+				mHasASA = alcIsExtensionPresent(NULL, (const ALCchar*) "ALC_EXT_ASA");
+				if (mHasASA) {
+					mASAOcclusion = alcGetEnumValue(NULL, (const ALCchar*) "ALC_ASA_OCCLUSION");
+					mASAReverbSendLevel = alcGetEnumValue(NULL, (const ALCchar*) "ALC_ASA_REVERB_SEND_LEVEL");
+					mASAReverbOn = alcGetEnumValue(NULL, (const ALCchar*) "ALC_ASA_REVERB_ON");
+					mASAReverbRoomType = alcGetEnumValue(NULL, (const ALCchar*) "ALC_ASA_REVERB_ROOM_TYPE");
+					mASAReverbGlobalLevel = alcGetEnumValue(NULL, (const ALCchar*) "ALC_ASA_REVERB_GLOBAL_LEVEL");
+				}
+				ApplyContextState();
+				mClockStartTime = mach_absolute_time() - SecondsToHostTime(theSampleTime / mClockRate);
+				thePhaseStart = RecordStartupPhase(kSoundEngineStartup_Context, thePhaseStart);
+				
+				mEffectsMap->CreateBuffers();
+				RecordStartupPhase(kSoundEngineStartup_Buffers, thePhaseStart);
+			}
+			
+			StartUpdateThread();
+			RecordStartupPhase(kSoundEngineStartup_Total, theStart);
+			
+		end:
+			// leave nothing half open, the next attempt starts from the device again
+			if (result != noErr)
+			{
+				DestroyContext();
+				if (mDevice) {
+					alcCloseDevice(mDevice);
+					mDevice = NULL;
+				}
+			}
+			return result;
+		}
+		
+		OSStatus GetStartupTime(UInt32 inPhase, Float64 *outSeconds)
+		{
+			if (inPhase >= kSoundEngineStartupPhases)
+				return kSoundEngineErrInvalidID;
+			*outSeconds = mStartupTimes[inPhase];
+			return noErr;
+		}
+		
+		// Rebuilds what belongs to the context only, for a new output rate or after an interruption.
+		// Buffers belong to the device, which is kept: effects, their IDs and the primed voices stay, 
+		// real voices go virtual at their cursor and take a new source on the next pass.
+		OSStatus Reinitialize(Float32 inMixerOutputRate)
+		{
+			SoundEngineLock theDeviceLock(mDeviceLock);
+			if (mDevice == NULL)
+			{
+				// not started yet, the device opens at the new rate
+				mOutputRate = inMixerOutputRate;
+				return noErr;
+			}
+			
+			StopUpdateThread();
+			
+			OSStatus result = noErr;
+			{
+				SoundEngineLock theLock(mVoiceLock);
+				UInt64 theSampleTime = GetSampleTime();
+				DeleteSources();
+				DestroyContext();
+				
+				mOutputRate = inMixerOutputRate;
+				result = CreateContext();
+					AssertNoError("Error creating OpenAL context", end);
+				ApplyContextState();
+				
+				// the sample clock carries on where it was, scheduled starts keep their time
+				mClockStartTime = mach_absolute_time() - SecondsToHostTime(theSampleTime / mClockRate);
+			}
+			
+		end:
+			StartUpdateThread();
+			return result;
+		}
+		
+		void Teardown()
+		{
+			if (mHasStartupThread)
+			{
+				pthread_join(mStartupThread, NULL);
+				mHasStartupThread = false;
+			}
+			StopUpdateThread();
+			sMeters.RemoveAllVoices();
+			
+			// [FIXED] alGenSources() created sources should be deleted.
+			// Deleted before the effects so that no buffer is still attached to a source.
+			if (mContext)
+				DeleteSources();
+			
+			if (mEffectsMap) {
+				// [FIXED] In old FOR loop, Remove() will decrease Size(), but variable i will increase whenever
+				while (mEffectsMap->Size()){
+					SoundEngineEffect *theEffect = mEffectsMap->GetEffectByIndex(0);
+					if (theEffect){
+						mEffectsMap->Remove(theEffect->GetEffectID());
+						delete theEffect;
+					}
+				}
+				delete mEffectsMap;
+				mEffectsMap = NULL;
+			}
+			
+			DestroyContext();
+			
+			if (mDevice) {
+				alcCloseDevice(mDevice);
+				mDevice = NULL;
+			}
+		}
+
+		OSStatus SetListenerPosition(Float32 inX, Float32 inY, Float32 inZ)
+		{
+			SoundEngineLock theLock(mVoiceLock);
+			mListenerPosition[0] = inX;
+			mListenerPosition[1] = inY;
+			mListenerPosition[2] = inZ;
+			alListener3f(AL_POSITION, inX, inY, inZ);
+			return GetALError();
+		}
+
+		OSStatus SetListenerGain(Float32 inValue)
+		{
+			SoundEngineLock theLock(mVoiceLock);
+			mListenerGain = inValue;
+			alListenerf(AL_GAIN, GetListenerGain());
+			return GetALError();
+		}
+		
+		OSStatus SetMaxDistance(Float32 inValue)
+		{
+			SoundEngineLock theLock(mVoiceLock);
+			OSStatus result = 0;
+			mMaxDistance = inValue;
+			for (UInt32 i=0; mContext && (i < MAX_SOURCES + kStealReserveSources); i++)
+			{
+				alSourcef(mSourceID[i], AL_MAX_DISTANCE, inValue);
+
+				if ((result = alGetError()) != AL_NO_ERROR)
+					return result;
+			}
+			return result;			
+		}
+
+	
+		OSStatus SetReferenceDistance(Float32 inValue)
+		{
+			SoundEngineLock theLock(mVoiceLock);
+			OSStatus result = 0;
+			mReferenceDistance = inValue;
+			for (UInt32 i=0; mContext && (i < MAX_SOURCES + kStealReserveSources); i++)
+			{
+				alSourcef(mSourceID[i], AL_REFERENCE_DISTANCE, inValue);
+				
+				if ((result = alGetError()) != AL_NO_ERROR)
+					return result;
+			}
+			return result;		
+		}
+
+	
+		// Master and effects bus volumes are applied once, through the listener gain. Only a sub-bus
+		// change has to reach the sources, and only real voices have one.
+		OSStatus UpdateBusGain(SoundEngineBusID inBus)
+		{
+			SoundEngineLock theLock(mVoiceLock);
+			if ((inBus == kSoundEngineBus_Master) || (inBus == kSoundEngineBus_Effects))
+			{
+				alListenerf(AL_GAIN, GetListenerGain());
+				return GetALError();
+			}
+			
+			OSStatus result = 0;
+			for (UInt32 i=0; i < mVoices.size(); i++)
+			{
+				SoundEngineVoice *theVoice = &mVoices[i];
+				if (!theVoice->IsReal())
+					continue;
+				alSourcef(theVoice->mSourceID, AL_GAIN, GetSourceGain(theVoice));
+				
+				if ((result = alGetError()) != AL_NO_ERROR)
+					return result;
+			}
+			return result;		
+		}
+		
+		OSStatus SetEffectBus(SoundEngineVoiceID inVoiceID, SoundEngineBusID inBus)
+		{
+			SoundEngineLock theLock(mVoiceLock);
+			SoundEngineVoice *theVoice = GetVoice(inVoiceID);
+			if (theVoice == NULL)
+				return kSoundEngineErrInvalidID;
+			
+			theVoice->mBus = inBus;
+			if (theVoice->IsReal())
+				alSourcef(theVoice->mSourceID, AL_GAIN, GetSourceGain(theVoice));
+			return GetALError();
+		}
+		
+		OSStatus SetVoiceMetering(SoundEngineVoiceID inVoiceID, Boolean inEnable)
+		{
+			SoundEngineLock theLock(mVoiceLock);
+			SoundEngineVoice *theVoice = GetVoice(inVoiceID);
+			if (theVoice == NULL)
+				return kSoundEngineErrInvalidID;
+			
+			if (inEnable && !theVoice->mMeterSlot)
+			{
+				UInt32 theSlot;
+				OSStatus result = sMeters.AddVoice(inVoiceID, &theSlot);
+				if (result)
+					return result;
+				theVoice->mMeterSlot = theSlot + 1;
+			}
+			else if (!inEnable && theVoice->mMeterSlot)
+			{
+				sMeters.RemoveVoice(theVoice->mMeterSlot - 1);
+				theVoice->mMeterSlot = 0;
+			}
+			return noErr;
+		}
+		
+		OSStatus SetVirtualVoiceThreshold(Float32 inValue)
+		{
+			SoundEngineLock theLock(mVoiceLock);
+			mVirtualThreshold = inValue;
+			return noErr;
+		}
+		
+		// for the effects loaded from now on
+		OSStatus SetEffectTrimThreshold(Float32 inValue)
+		{
+			if (inValue < 0.0)
+				return kSoundEngineErrInvalidRange;
+			mTrimThreshold = inValue;
+			return noErr;
+		}
+		
+		OSStatus GetEffectInfo(UInt32 inEffectID, SoundEngineEffectInfo *outInfo)
+		{
+			SoundEngineLock theLock(mVoiceLock);
+			SoundEngineEffect *theEffect = mEffectsMap->Get(inEffectID);
+			if (theEffect == NULL)
+				return kSoundEngineErrInvalidID;
+			
+			outInfo->mFrames = theEffect->GetFrames();
+			outInfo->mTrimStart = theEffect->GetTrimStart();
+			outInfo->mTrimEnd = theEffect->GetTrimEnd();
+			outInfo->mSampleRate = theEffect->GetSampleRate();
+			outInfo->mPeak = theEffect->GetPeak();
+			outInfo->mLoudness = theEffect->GetLoudness();
+			return noErr;
+		}
+		
+		// Voices below the new count are kept; shrinking fails while a voice above it is primed.
+		OSStatus SetMaxVoices(UInt32 inMaxVoices)
+		{
+			if ((inMaxVoices < 1) || (inMaxVoices > kMaxVoiceCapacity))
+				return kSoundEngineErrInvalidRange;
+			
+			SoundEngineLock theLock(mVoiceLock);
+			for (UInt32 i = inMaxVoices; i < mVoices.size(); ++i)
+			{
+				if (mLanes.mState[i] != kVoiceState_Free)
+					return kSoundEngineErrNoSourcesAvailable;
+			}
+			if (!SetVoiceCapacity(inMaxVoices))
+				return kSoundEngineErrPoolExhausted;
+			return noErr;
+		}
+		
+		OSStatus SetVoiceUpdateThreads(UInt32 inThreads)
+		{
+			if ((inThreads < 1) || (inThreads > kMaxTaskThreads))
+				return kSoundEngineErrInvalidRange;
+			SoundEngineLock theLock(mVoiceLock);
+			mTaskPool.SetThreads(inThreads);
+			return noErr;
+		}
+						
+		OSStatus LoadEffect(const char *inFilePath, UInt32 *outEffectID, const volatile int32_t *inCanceled = NULL)
+		{
+			SoundEngineEffect *theEffect = new SoundEngineEffect(inFilePath, OSAtomicIncrement32Barrier(&mLastEffectID));
+			OSStatus result = theEffect->initialize(mTrimThreshold, inCanceled);
+			if (result == noErr)
+			{
+				// without a context yet, OpenDevice makes the buffers of every effect in the map
+				SoundEngineLock theLock(mVoiceLock);
+				if (mContext)
+					result = theEffect->CreateBuffers();
+				if (result == noErr)
+				{
+					*outEffectID = theEffect->GetEffectID();
+					mEffectsMap->Add(*outEffectID, &theEffect);
+					return noErr;
+				}
+			}
+			delete theEffect;
+			return result;
+		}
+				
+		OSStatus UnloadEffect(UInt32 inEffectID)
+		{
+			SoundEngineLock theLock(mVoiceLock);
+			
+			// the voices still primed with this effect go away with it
+			for (UInt32 i=0; i < mVoices.size(); i++)
+			{
+				if ((mLanes.mState[i] != kVoiceState_Free) && (mVoices[i].mEffectID == inEffectID))
+					FreeVoice(i);
+			}
+			// a voice that lost its source may still be fading out on it, mixing the effect data
+			StopFadingSources(inEffectID);
+			
+			// [FIXED] SoundEngineEffect should be deleted before remove from the map
+			SoundEngineEffect *theEffect = mEffectsMap->Get(inEffectID);
+			if (theEffect){
+				delete theEffect;
+			}
+			mEffectsMap->Remove(inEffectID);
+			return 0;
+		}
+
+
+		OSStatus PrimeEffect(UInt32 inEffectID, UInt8 inPriority, SoundEngineVoiceID *outVoiceID)
+		{
+			SoundEngineLock theLock(mVoiceLock);
+			return PrimeVoice(inEffectID, inPriority, outVoiceID);
+		}
+		
+		// Fire and forget: the command only goes through the lock free queue, the voice update thread
+		// acquires the voice, starts it and gives it back to the pool when it stops.
+		OSStatus PlayEffect(UInt32 inEffectID, Float32 inGain, Float32 inPitch, Float32 inPan, UInt8 inPriority)
+		{
+			SoundEngineEffectCommand theCommand;
+			theCommand.mEffectID = inEffectID;
+			theCommand.mGain = inGain;
+			theCommand.mPitch = inPitch;
+			theCommand.mPan = (inPan < -1.0) ? -1.0 : ((inPan > 1.0) ? 1.0 : inPan);
+			theCommand.mPriority = inPriority;
+			if (!mEffectCommands.Push(theCommand))
+				return kSoundEngineErrNoSourcesAvailable;
+			
+			RequestDevice();
+			semaphore_signal(mWakeSemaphore);
+			return noErr;
+		}
+		
+	private:
+		OSStatus PrimeVoice(UInt32 inEffectID, UInt8 inPriority, SoundEngineVoiceID *outVoiceID)
+		{
+			SoundEngineEffect *theEffect = mEffectsMap->Get(inEffectID);
+			if (theEffect == NULL)
+				return kSoundEngineErrInvalidID;
+			
+			// Priming no longer takes an OpenAL source, only a logical voice. Sources are bound 
+			// by the voice update thread to the voices that are playing and audible.
+			if (mFreeVoices.empty())
+				return kSoundEngineErrNoSourcesAvailable;
+			
+			UInt32 theIndex = mFreeVoices.back();
+			mFreeVoices.pop_back();
+			
+			SoundEngineVoice *theVoice = &mVoices[theIndex];
+			UInt16 theGeneration = theVoice->mGeneration + 1;
+			*theVoice = SoundEngineVoice();
+			theVoice->mGeneration = theGeneration;
+			theVoice->mEffectID = inEffectID;
+			theVoice->mPitch = 1.0;
+			theVoice->mBus = kSoundEngineBus_Effects;
+			theVoice->mFrames = theEffect->GetFrames();
+			theVoice->mSampleRate = theEffect->GetSampleRate();
+			theVoice->mPriority = (inPriority < kSoundEnginePriorityLevels) ? inPriority : kSoundEnginePriorityHighest;
+			theVoice->mLooping = theEffect->HasLoopPoints();
+			theVoice->mLoopStart = theEffect->GetLoopStart();
+			theVoice->mLoopEnd = theEffect->GetLoopEnd();
+			theVoice->mEnvelope = theEffect->GetEnvelope();
+			theVoice->mLeadIn = theEffect->GetTrimStart();
+			
+			mLanes.mState[theIndex] = kVoiceState_Stopped;
+			mLanes.mCursor[theIndex] = 0.0;
+			mLanes.mIncrement[theIndex] = theVoice->mSampleRate;
+			mLanes.mGain[theIndex] = 1.0;
+			mLanes.mPan[theIndex] = 0.0;
+			
+			*outVoiceID = VoiceIDForIndex(theIndex, theGeneration);
+			return noErr;
+		}
+		
+		// A voice starts before the data of an effect trimmed at load, with its cursor as many frames
+		// before 0 as were trimmed. It waits out the lead-in virtual.
+		void StartVoice(SoundEngineVoice *inVoice)
+		{
+			UInt32 theIndex = GetVoiceIndex(inVoice);
+			mLanes.mCursor[theIndex] = -(Float64)inVoice->mLeadIn;
+			mLanes.mState[theIndex] = kVoiceState_Playing;
+			inVoice->mLeadInEnd = 0;
+			
+			// restarting binds the buffers again, a looping source may be past its intro
+			if (inVoice->IsReal())
+				ReleaseSource(inVoice);
+			
+			if (inVoice->mLeadIn)
+			{
+				BeginLeadIn(theIndex, GetSampleTime());
+				return;
+			}
+			Float32 theGain = GetAudibleGain(inVoice);
+			if (theGain >= mVirtualThreshold)
+				MakeVoiceReal(inVoice, theGain, true);
+			// else the voice starts virtual, the update thread binds a source when it turns audible
+		}
+		
+		// The sound of the voice starts when the sample clock gets to the end of its lead-in, from
+		// the update thread like a scheduled start. The voices ending their lead-in together start in
+		// one alSourcePlayv.
+		void BeginLeadIn(UInt32 inIndex, UInt64 inNow)
+		{
+			SoundEngineVoice *theVoice = &mVoices[inIndex];
+			SoundEngineVoiceID theVoiceID = VoiceIDForIndex(inIndex, theVoice->mGeneration);
+			theVoice->mLeadInEnd = inNow + (UInt64)ceil(-mLanes.mCursor[inIndex] / mLanes.mIncrement[inIndex] * mClockRate);
+			
+			ScheduledStartMap::iterator it = mLeadIns.find(theVoice->mLeadInEnd);
+			if (it == mLeadIns.end())
+				mLeadIns.insert(std::make_pair(theVoice->mLeadInEnd, std::vector<SoundEngineVoiceID>(1, theVoiceID)));
+			else if (std::find(it->second.begin(), it->second.end(), theVoiceID) == it->second.end())
+				it->second.push_back(theVoiceID);
+		}
+		
+		// voices stopped or started again since their lead-in began are left out
+		void EndLeadIns(UInt64 inNow)
+		{
+			while (!mLeadIns.empty() && (mLeadIns.begin()->first <= inNow))
+			{
+				ScheduledStartMap::iterator it = mLeadIns.begin();
+				std::vector<SoundEngineVoiceID> &theGroup = it->second;
+				UInt32 theCount = 0;
+				for (UInt32 i = 0; i < theGroup.size(); ++i)
+				{
+					SoundEngineVoice *theVoice = GetVoice(theGroup[i]);
+					if (theVoice && (theVoice->mLeadInEnd == it->first) && (mLanes.mState[GetVoiceIndex(theVoice)] == kVoiceState_Playing))
+						theGroup[theCount++] = theGroup[i];
+				}
+				if (theCount)
+					StartGroup(&theGroup[0], theCount, it->first, true);
+				mLeadIns.erase(it);
+			}
+		}
+		
+		// Runs on the voice update thread with the voice lock held. Commands for effects unloaded since
+		// they were queued, or that find no free voice, are dropped.
+		void DrainEffectCommands()
+		{
+			SoundEngineEffectCommand theCommand;
+			while (mEffectCommands.Pop(theCommand))
+			{
+				SoundEngineVoiceID theVoiceID;
+				if (PrimeVoice(theCommand.mEffectID, theCommand.mPriority, &theVoiceID))
+					continue;
+				
+				// a one-shot nobody holds an ID to could never be stopped, it plays its loop region once
+				UInt32 theIndex = VoiceIndexForID(theVoiceID);
+				SoundEngineVoice *theVoice = &mVoices[theIndex];
+				theVoice->mOneShot = true;
+				theVoice->mLooping = false;
+				theVoice->mPitch = theCommand.mPitch;
+				theVoice->mRelative = true;
+				mLanes.mIncrement[theIndex] = theVoice->mSampleRate * theCommand.mPitch;
+				mLanes.mGain[theIndex] = theCommand.mGain;
+				mLanes.mPan[theIndex] = theCommand.mPan;
+				
+				StartVoice(theVoice);
+			}
+		}
+		
+	public:
+		OSStatus UnprimeEffect(SoundEngineVoiceID inVoiceID)
+		{
+			SoundEngineLock theLock(mVoiceLock);
+			if (GetVoice(inVoiceID) == NULL)
+				return kSoundEngineErrInvalidID;
+			FreeVoice(VoiceIndexForID(inVoiceID));
+			return noErr;
+		}
+
+		OSStatus SetEffectPriority(SoundEngineVoiceID inVoiceID, UInt8 inPriority)
+		{
+			SoundEngineLock theLock(mVoiceLock);
+			SoundEngineVoice *theVoice = GetVoice(inVoiceID);
+			if (theVoice == NULL)
+				return kSoundEngineErrInvalidID;
+			
+			theVoice->mPriority = (inPriority < kSoundEnginePriorityLevels) ? inPriority : kSoundEnginePriorityHighest;
+			if (theVoice->IsReal())
+				UpdateVoiceBucket(theVoice, GetAudibleGain(theVoice));
+			return noErr;
+		}
+
+		OSStatus SetEffectOcclusion(SoundEngineVoiceID inVoiceID, Float32 inValue)
+		{
+			SoundEngineLock theLock(mVoiceLock);
+			SoundEngineVoice *theVoice = GetVoice(inVoiceID);
+			if (theVoice == NULL)
+				return kSoundEngineErrInvalidID;
+			// before the context exists the value waits for MakeVoiceReal, whether ASA is there is not known yet
+			if (mContext && !mHasASA)
+				return kSoundEngineErrUnsupported;
+			
+			theVoice->mOcclusion = inValue;
+			if (theVoice->IsReal())
+				return alcASASetSourceProc(mASAOcclusion, theVoice->mSourceID, &theVoice->mOcclusion, sizeof(Float32));
+			return noErr;
+		}
+		
+		OSStatus SetEffectReverbSend(SoundEngineVoiceID inVoiceID, Float32 inValue)
+		{
+			SoundEngineLock theLock(mVoiceLock);
+			SoundEngineVoice *theVoice = GetVoice(inVoiceID);
+			if (theVoice == NULL)
+				return kSoundEngineErrInvalidID;
+			if (mContext && !mHasASA)
+				return kSoundEngineErrUnsupported;
+			
+			theVoice->mReverbSend = inValue;
+			if (theVoice->IsReal())
+				return alcASASetSourceProc(mASAReverbSendLevel, theVoice->mSourceID, &theVoice->mReverbSend, sizeof(Float32));
+			return noErr;
+		}
+		
+		// kept until the context exists, ApplyContextState sets it then
+		OSStatus SetReverb(Boolean inOn, UInt32 inRoomType, Float32 inLevelDB)
+		{
+			SoundEngineLock theLock(mVoiceLock);
+			if (mContext == NULL)
+			{
+				mReverbSet = true;
+				mReverbOn = inOn;
+				mReverbRoomType = inRoomType;
+				mReverbLevel = inLevelDB;
+				return noErr;
+			}
+			return ApplyReverb(inOn, inRoomType, inLevelDB);
+		}
+		
+		OSStatus ApplyReverb(Boolean inOn, UInt32 inRoomType, Float32 inLevelDB)
+		{
+			if (!mHasASA)
+				return kSoundEngineErrUnsupported;
+			
+			ALuint theOn = inOn;
+			ALint theRoomType = inRoomType;
+			OSStatus result = alcASASetListenerProc(mASAReverbOn, &theOn, sizeof(theOn));
+			if (result == noErr)
+				result = alcASASetListenerProc(mASAReverbRoomType, &theRoomType, sizeof(theRoomType));
+			if (result == noErr)
+				result = alcASASetListenerProc(mASAReverbGlobalLevel, &inLevelDB, sizeof(inLevelDB));
+			
+			// kept for a new context
+			if (result == noErr)
+			{
+				mReverbSet = true;
+				mReverbOn = inOn;
+				mReverbRoomType = inRoomType;
+				mReverbLevel = inLevelDB;
+			}
+			return result;
+		}
 
-			else
+		OSStatus StartEffect(SoundEngineVoiceID inVoiceID)
+		{
+			RequestDevice();
+			SoundEngineLock theLock(mVoiceLock);
+			SoundEngineVoice *theVoice = GetVoice(inVoiceID);
+			if (theVoice == NULL)
+				return kSoundEngineErrInvalidID;
+			
+			StartVoice(theVoice);
+			return GetALError();
+		}
+	
+		OSStatus StopEffect(SoundEngineVoiceID inVoiceID)
+		{
+			SoundEngineLock theLock(mVoiceLock);
+			SoundEngineVoice *theVoice = GetVoice(inVoiceID);
+			if (theVoice == NULL)
+				return kSoundEngineErrInvalidID;
+			
+			if (theVoice->IsReal())
+				ReleaseSource(theVoice);
+			mLanes.mState[GetVoiceIndex(theVoice)] = kVoiceState_Stopped;
+			mLanes.mCursor[GetVoiceIndex(theVoice)] = 0.0;
+			CancelScheduledStart(inVoiceID);
+			return GetALError();
+		}
+		
+		OSStatus SetEffectLooping(SoundEngineVoiceID inVoiceID, Boolean inLooping)
+		{
+			SoundEngineLock theLock(mVoiceLock);
+			SoundEngineVoice *theVoice = GetVoice(inVoiceID);
+			if (theVoice == NULL)
+				return kSoundEngineErrInvalidID;
+			
+			// the silence trimmed off an effect was part of the period of a whole effect loop
+			SoundEngineEffect *theEffect = mEffectsMap->Get(theVoice->mEffectID);
+			if (inLooping && theEffect && !theEffect->HasLoopPoints() && (theEffect->GetTrimStart() || theEffect->GetTrimEnd()))
+				return kSoundEngineErrInvalidRange;
+			
+			Boolean wasReal = theVoice->IsReal();
+			if (wasReal)
+				MakeVoiceVirtual(theVoice);
+			theVoice->mLooping = inLooping;
+			AdvanceCursor(GetVoiceIndex(theVoice), 0.0);
+			if (wasReal)
+				MakeVoiceReal(theVoice, GetAudibleGain(theVoice), true);
+			return GetALError();
+		}
+		
+		OSStatus SetEffectLoopPoints(UInt32 inEffectID, UInt32 inLoopStart, UInt32 inLoopEnd)
+		{
+			SoundEngineLock theLock(mVoiceLock);
+			SoundEngineEffect *theEffect = mEffectsMap->Get(inEffectID);
+			if (theEffect == NULL)
+				return kSoundEngineErrInvalidID;
+			
+			// no source may hold the loop buffers while they are replaced
+			std::vector<UInt32> theRealVoices;
+			for (UInt32 i=0; i < mVoices.size(); i++)
 			{
-				UInt32 numBytes;
-				while (nPackets == 0)
+				SoundEngineVoice *theVoice = &mVoices[i];
+				if ((mLanes.mState[i] != kVoiceState_Free) && (theVoice->mEffectID == inEffectID) && theVoice->IsReal())
 				{
-					// if loadAtOnce, get all packets in the file, otherwise ~.5 seconds of data
-					nPackets = THIS->GetNumPacketsToRead(CurFileInfo);					
-					result = AudioFileReadPackets(CurFileInfo->mAFID, false, &numBytes, THIS->mPacketDescs, THIS->mCurrentPacket, &nPackets, 
-											inCompleteAQBuffer->mAudioData);
-						AssertNoError("Error reading file data", end);
-					
-					inCompleteAQBuffer->mAudioDataByteSize = numBytes;	
-											
-					if (nPackets == 0) // no packets were read, this file has ended.
-					{
-						if (CurFileInfo->mLoadAtOnce)
-							CurFileInfo->mFileDataInQueue = true;
-						
-						THIS->mCurrentPacket = 0;
-						UInt32 theNextFileIndex = (THIS->mCurrentFileIndex < THIS->mBGFileInfo.size()-1) ? THIS->mCurrentFileIndex+1 : 0;
-						
-						// we have gone through the playlist. if mStopAtEnd, stop the queue here
-						if (theNextFileIndex == 0 && THIS->mStopAtEnd)
-						{
-							THIS->mStopped = true;
-							result = AudioQueueStop(inAQ, false);
-								AssertNoError("Error stopping queue", end);
-							return;
-						}
-						
-						SInt8 theQueueState = GetQueueStateForNextBuffer(CurFileInfo, THIS->mBGFileInfo[theNextFileIndex]);
-						if (theNextFileIndex != THIS->mCurrentFileIndex)
-						{
-							// if were are not looping the same file. Close the old one and open the new
-							result = AudioFileClose(CurFileInfo->mAFID);
-								AssertNoError("Error closing file", end);
-							THIS->mCurrentFileIndex = theNextFileIndex;
+					MakeVoiceVirtual(theVoice);
+					theRealVoices.push_back(i);
+				}
+			}
+			StopFadingSources(inEffectID);
+			
+			Boolean hadLoopPoints = theEffect->HasLoopPoints();
+			OSStatus result = theEffect->SetFileLoopPoints(inLoopStart, inLoopEnd);
+			
+			for (UInt32 i=0; i < mVoices.size(); i++)
+			{
+				SoundEngineVoice *theVoice = &mVoices[i];
+				if ((mLanes.mState[i] == kVoiceState_Free) || (theVoice->mEffectID != inEffectID))
+					continue;
+				// voices still looping as PrimeVoice set them follow the effect, SetEffectLooping and one-shots are kept
+				if (!theVoice->mOneShot && (theVoice->mLooping == hadLoopPoints))
+					theVoice->mLooping = theEffect->HasLoopPoints();
+				theVoice->mLoopStart = theEffect->GetLoopStart();
+				theVoice->mLoopEnd = theEffect->GetLoopEnd();
+				AdvanceCursor(i, 0.0);
+			}
+			for (UInt32 i=0; i < theRealVoices.size(); i++)
+				MakeVoiceReal(&mVoices[theRealVoices[i]], GetAudibleGain(&mVoices[theRealVoices[i]]), true);
+			return result;
+		}
+		
+		UInt64 GetSampleTime()
+		{
+			return (UInt64)(HostTimeToSeconds(mach_absolute_time() - mClockStartTime) * mClockRate);
+		}
+		
+		// Starts a set of voices together, now if inSampleTime has already passed, otherwise from the 
+		// voice update thread when the sample clock reaches it.
+		OSStatus StartEffectGroup(const SoundEngineVoiceID *inVoiceIDs, UInt32 inCount, UInt64 inSampleTime)
+		{
+			RequestDevice();
+			SoundEngineLock theLock(mVoiceLock);
+			for (UInt32 i = 0; i < inCount; ++i)
+			{
+				if (GetVoice(inVoiceIDs[i]) == NULL)
+					return kSoundEngineErrInvalidID;
+			}
+			
+			if (inSampleTime > GetSampleTime())
+			{
+				mScheduledStarts.insert(std::make_pair(inSampleTime, std::vector<SoundEngineVoiceID>(inVoiceIDs, inVoiceIDs + inCount)));
+				return noErr;
+			}
+			return StartGroup(inVoiceIDs, inCount, inSampleTime);
+		}
 
-							result = LoadFileDataInfo(CurFileInfo->mFilePath, CurFileInfo->mAFID, CurFileInfo->mFileFormat, CurFileInfo->mFileDataSize);
-								AssertNoError("Error opening file", end);
-						}
-						
-						switch (theQueueState) 
-						{							
-							// if we need to resize the buffer, set the buffer's audio data size to the new file's size
-							// we will also need to get the new file cookie
-							case kQueueState_ResizeBuffer:
-								inCompleteAQBuffer->mAudioDataByteSize = CurFileInfo->mFileDataSize;							
-							// if the data format is the same but we just need a new cookie, attach a new cookie
-							case kQueueState_NeedNewCookie:
-								result = AttachNewCookie(inAQ, CurFileInfo);
-									AssertNoError("Error attaching new file cookie data to queue", end);
-								break;
-							
-							// we can keep the same queue, but not the same buffer(s)
-							case kQueueState_NeedNewBuffers:
-								THIS->mBuffersToDispose.push_back(inCompleteAQBuffer);
-								THIS->SetupBuffers(CurFileInfo);
-								break;
-							
-							// if the data formats are not the same, we need to dispose the current queue and create a new one
-							case kQueueState_NeedNewQueue:
-								THIS->mMakeNewQueueWhenStopped = true;
-								result = AudioQueueStop(inAQ, false);
-									AssertNoError("Error stopping queue", end);
-								return;
-								
-							default:
-								break;
-						}
-					}
+		
+		OSStatus SetEffectPitch(SoundEngineVoiceID inVoiceID, Float32 inValue)
+		{
+			SoundEngineLock theLock(mVoiceLock);
+			SoundEngineVoice *theVoice = GetVoice(inVoiceID);
+			if (theVoice == NULL)
+				return kSoundEngineErrInvalidID;
+			
+			theVoice->mPitch = inValue;
+			mLanes.mIncrement[GetVoiceIndex(theVoice)] = theVoice->mSampleRate * inValue;
+			if (theVoice->IsReal())
+				alSourcef(theVoice->mSourceID, AL_PITCH, inValue);
+			return GetALError();
+		}
+
+		OSStatus SetEffectVolume(SoundEngineVoiceID inVoiceID, Float32 inValue)
+		{
+			SoundEngineLock theLock(mVoiceLock);
+			SoundEngineVoice *theVoice = GetVoice(inVoiceID);
+			if (theVoice == NULL)
+				return kSoundEngineErrInvalidID;
+			
+			mLanes.mGain[GetVoiceIndex(theVoice)] = inValue;
+			if (theVoice->IsReal())
+				alSourcef(theVoice->mSourceID, AL_GAIN, GetSourceGain(theVoice));
+			return GetALError();
+		}
+				
+		OSStatus	SetEffectPosition(SoundEngineVoiceID inVoiceID, Float32 inX, Float32 inY, Float32 inZ)	
+		{
+			SoundEngineLock theLock(mVoiceLock);
+			SoundEngineVoice *theVoice = GetVoice(inVoiceID);
+			if (theVoice == NULL)
+				return kSoundEngineErrInvalidID;
+			
+			theVoice->mPosition[0] = inX;
+			theVoice->mPosition[1] = inY;
+			theVoice->mPosition[2] = inZ;
+			if (theVoice->IsReal())
+				alSource3f(theVoice->mSourceID, AL_POSITION, inX, inY, inZ);
+			return GetALError();
+		}
+		
+		// Called every kVoiceUpdateInterval from the voice update thread. Real voices that fell below
+		// the audibility threshold give their source back, virtual voices advance their cursor and
+		// take a free source as soon as they are audible again.
+		//
+		// The pass runs in two phases. The first computes the audible gain of every playing voice and 
+		// advances the virtual ones; it touches nothing but the voice itself and the partial sums of its
+		// chunk, and is split over the task pool. The second makes the OpenAL calls and moves sources
+		// around, in voice order on this thread. Partial sums are combined in chunk order, so the bus 
+		// levels are bit for bit the same with any number of threads.
+		void UpdateVoices()
+		{
+			SoundEngineLock theLock(mVoiceLock);
+			
+			UInt64 theNow = mach_absolute_time();
+			Float64 theElapsed = HostTimeToSeconds(theNow - mLastUpdateTime);
+			mLastUpdateTime = theNow;
+			
+			UpdateFadingSources(theElapsed);
+			
+			mPassElapsed = theElapsed;
+			mPassProfiling = sProfiler.IsEnabled();
+			mPassBusMetering = sMeters.IsBusMetering();
+			mPassTime = theNow;
+			
+			// the meters read the envelope of a real voice from where its source plays, the cursor is
+			// not kept up while the voice is not metered
+			for (UInt32 i = 0; i < mVoices.size(); ++i)
+			{
+				SoundEngineVoice *theVoice = &mVoices[i];
+				if ((mLanes.mState[i] == kVoiceState_Playing) && theVoice->IsReal() && (theVoice->mMeterSlot || mPassBusMetering))
+					mLanes.mCursor[i] = GetSourceCursor(theVoice);
+			}
+			
+			UInt32 theNumChunks = mPassChunks.size();
+			if (mVoices.size() - mFreeVoices.size() >= kParallelVoiceThreshold)
+				mTaskPool.Run(VoiceChunkTask, this, theNumChunks);
+			else
+			{
+				for (UInt32 i = 0; i < theNumChunks; ++i)
+					UpdateVoiceChunk(i);
+			}
+			
+			Float32 theBusLevels[kSoundEngineMaxBuses] = { 0.0 };
+			Float64 theBusTimes[kSoundEngineMaxBuses] = { 0.0 };
+			Float32 theBusPeaks[kSoundEngineMaxBuses] = { 0.0 };
+			Float32 theBusMeanSquares[kSoundEngineMaxBuses] = { 0.0 };
+			for (UInt32 i = 0; i < theNumChunks; ++i)
+			{
+				for (UInt32 j = 0; j < kSoundEngineMaxBuses; ++j)
+				{
+					theBusLevels[j] += mPassChunks[i].mBusLevels[j];
+					theBusTimes[j] += mPassChunks[i].mBusTimes[j];
+					theBusPeaks[j] = std::max(theBusPeaks[j], mPassChunks[i].mBusPeaks[j]);
+					theBusMeanSquares[j] += mPassChunks[i].mBusMeanSquares[j];
+				}
+			}
+			
+			// every effects bus, silent ones too, so their windows keep closing
+			if (mPassBusMetering)
+			{
+				for (UInt32 j = kSoundEngineBus_Master + 1; j < sBusGraph.GetNumBuses(); ++j)
+				{
+					if (sBusGraph.GetCategory(j) == kSoundEngineBus_Effects)
+						sMeters.MeterBus(j, theBusPeaks[j], theBusMeanSquares[j], theElapsed, theNow);
+				}
+			}
+			
+			for (UInt32 i=0; i < mVoices.size(); i++)
+			{
+				if (mLanes.mState[i] != kVoiceState_Playing)
+					continue;
+				
+				ApplyVoiceUpdate(i, mPassGains[i], mPassEnded[i]);
+				if (mVoices[i].mOneShot && (mLanes.mState[i] == kVoiceState_Stopped))
+					FreeVoice(i);
+			}
+			
+			sBusGraph.SetCategoryActivity(kSoundEngineBus_Effects, theBusLevels);
+			
+			// after the voice loop as well, the queued plays start from their first frame
+			DrainEffectCommands();
+			
+			// after the voice loop, so the voices started here do not advance by the elapsed time
+			UInt64 theSampleTime = GetSampleTime();
+			while (!mScheduledStarts.empty() && (mScheduledStarts.begin()->first <= theSampleTime))
+			{
+				ScheduledStartMap::iterator it = mScheduledStarts.begin();
+				StartGroup(&it->second[0], it->second.size(), it->first);
+				mScheduledStarts.erase(it);
+			}
+			EndLeadIns(GetSampleTime());
+			
+			if (mPassProfiling)
+			{
+				sProfiler.RecordBlock(kSoundEngineProfile_EffectsPassTime, kSoundEngineProfile_EffectsPassLoad, HostTimeToSeconds(mach_absolute_time() - theNow), kVoiceUpdateInterval);
+				for (UInt32 i = 0; i < kSoundEngineMaxBuses; ++i)
+				{
+					if (theBusTimes[i] > 0.0)
+						sProfiler.RecordBus(i, theBusTimes[i]);
+				}
+			}
+		}
+		
+	private:
+		struct VoicePassChunk {
+			Float32								mBusLevels[kSoundEngineMaxBuses];	// of the real voices in the chunk
+			Float64								mBusTimes[kSoundEngineMaxBuses];
+			Float32								mBusPeaks[kSoundEngineMaxBuses];
+			Float32								mBusMeanSquares[kSoundEngineMaxBuses];
+		};
+		
+		static void VoiceChunkTask(void *inRefCon, UInt32 inTask)
+		{
+			((OpenALObject*)inRefCon)->UpdateVoiceChunk(inTask);
+		}
+		
+		// first phase, on any thread of the pool
+		void UpdateVoiceChunk(UInt32 inChunk)
+		{
+			VoicePassChunk &theChunk = mPassChunks[inChunk];
+			memset(&theChunk, 0, sizeof(theChunk));
+			
+			UInt32 theEnd = std::min<UInt32>((inChunk + 1) * kVoiceChunkSize, mVoices.size());
+			for (UInt32 i = inChunk * kVoiceChunkSize; i < theEnd; ++i)
+			{
+				if (mLanes.mState[i] != kVoiceState_Playing)
+					continue;
+				
+				SoundEngineVoice *theVoice = &mVoices[i];
+				
+				UInt64 theVoiceStart = mPassProfiling ? mach_absolute_time() : 0;
+				
+				Float32 theGain = GetAudibleGain(theVoice);
+				mPassGains[i] = theGain;
+				mPassEnded[i] = false;
+				Float64 theCursor = mLanes.mCursor[i];
+				Boolean isMetered = theVoice->mMeterSlot || (mPassBusMetering && theVoice->IsReal());
+				if (theVoice->IsReal())
+				{
+					theChunk.mBusLevels[theVoice->mBus] += theGain;
+					// OpenAL plays a real voice, the meters measure the pass from the cursor of its source
+					if (isMetered)
+						AdvanceCursor(i, mPassElapsed * mLanes.mIncrement[i]);
+				}
+				else
+					mPassEnded[i] = !AdvanceCursor(i, mPassElapsed * mLanes.mIncrement[i]);
+				if (isMetered)
+					MeterVoice(i, theCursor, theGain, theChunk);
+				
+				if (mPassProfiling)
+				{
+					Float64 theSeconds = HostTimeToSeconds(mach_absolute_time() - theVoiceStart);
+					sProfiler.RecordVoice(theSeconds);
+					theChunk.mBusTimes[theVoice->mBus] += theSeconds;
+				}
+			}
+		}
+		
+		// the envelope of the effect over what the voice played during the pass
+		void MeterVoice(UInt32 inIndex, Float64 inStart, Float32 inGain, VoicePassChunk &ioChunk)
+		{
+			SoundEngineVoice *theVoice = &mVoices[inIndex];
+			if (theVoice->mEnvelope == NULL)
+				return;
+			
+			Float64 theEnd = mLanes.mCursor[inIndex];
+			Float32 thePeak = 0.0;
+			Float32 theMeanSquares = 0.0;
+			UInt32 theBlocks = 0;
+			if (theEnd >= inStart)
+				theVoice->mEnvelope->Measure(inStart, theEnd, thePeak, theMeanSquares, theBlocks);
+			else
+			{
+				// wrapped inside the loop region
+				theVoice->mEnvelope->Measure(inStart, theVoice->mLoopEnd, thePeak, theMeanSquares, theBlocks);
+				theVoice->mEnvelope->Measure(theVoice->mLoopStart, theEnd, thePeak, theMeanSquares, theBlocks);
+			}
+			thePeak *= inGain;
+			Float32 theMeanSquare = (theBlocks) ? theMeanSquares / theBlocks * inGain * inGain : 0.0;
+			
+			if (theVoice->IsReal())
+			{
+				ioChunk.mBusPeaks[theVoice->mBus] = std::max(ioChunk.mBusPeaks[theVoice->mBus], thePeak);
+				ioChunk.mBusMeanSquares[theVoice->mBus] += theMeanSquare;
+			}
+			if (theVoice->mMeterSlot)
+				sMeters.PublishVoice(theVoice->mMeterSlot - 1, thePeak, sqrtf(theMeanSquare), mPassTime);
+		}
+		
+		// second phase, in voice order on the update thread
+		void ApplyVoiceUpdate(UInt32 inIndex, Float32 inGain, Boolean inEnded)
+		{
+			SoundEngineVoice *inVoice = &mVoices[inIndex];
+			if (inVoice->IsReal())
+			{
+				if (inVoice->mLoopPhase == kLoopPhase_Intro)
+					UpdateLoopPhase(inVoice);
+				
+				ALint theSourceState;
+				alGetSourcei(inVoice->mSourceID, AL_SOURCE_STATE, &theSourceState);
+				if (theSourceState == AL_STOPPED)
+				{
+					ReleaseSource(inVoice);
+					mLanes.mState[inIndex] = kVoiceState_Stopped;
+					mLanes.mCursor[inIndex] = 0.0;
+				}
+				else if (inGain < mVirtualThreshold)
+					MakeVoiceVirtual(inVoice);
+				else
+					UpdateVoiceBucket(inVoice, inGain);
+			}
+			else
+			{
+				if (inEnded)
+				{
+					mLanes.mState[inIndex] = kVoiceState_Stopped;
+					mLanes.mCursor[inIndex] = 0.0;
+				}
+				else if ((inGain >= mVirtualThreshold) && (inVoice->mLeadInEnd == 0))
+					MakeVoiceReal(inVoice, inGain, false);
+			}
+		}
+		
+		static void* VoiceUpdateThreadEntry(void *inRefCon)
+		{
+			OpenALObject *THIS = (OpenALObject*)inRefCon;
+			while (THIS->mUpdateThreadRunning)
+			{
+				THIS->UpdateVoices();
+				
+				// a queued PlayEffect signals the semaphore and cuts the wait short
+				useconds_t theSleep = THIS->GetSleepTime();
+				mach_timespec_t theTimeout = { theSleep / 1000000, (clock_res_t)((theSleep % 1000000) * 1000) };
+				semaphore_timedwait(THIS->mWakeSemaphore, theTimeout);
+			}
+			return NULL;
+		}
+		
+		// wake up early when a scheduled start or the end of a lead-in falls before the next pass
+		useconds_t GetSleepTime()
+		{
+			SoundEngineLock theLock(mVoiceLock);
+			Float64 theSeconds = kVoiceUpdateInterval;
+			if (!mScheduledStarts.empty() || !mLeadIns.empty())
+			{
+				UInt64 theNow = GetSampleTime();
+				UInt64 theNext = (mScheduledStarts.empty()) ? mLeadIns.begin()->first : mScheduledStarts.begin()->first;
+				if (!mLeadIns.empty() && (mLeadIns.begin()->first < theNext))
+					theNext = mLeadIns.begin()->first;
+				Float64 theWait = (theNext > theNow) ? (theNext - theNow) / mClockRate : 0.0;
+				if (theWait < theSeconds)
+					theSeconds = theWait;
+			}
+			return (useconds_t)(theSeconds * 1000000.0);
+		}
+		
+		// All the voices of a group go through a single alSourcePlayv, which OpenAL starts in the 
+		// same mix cycle. A group started after its sample time skips the frames it is late by. A voice
+		// of a trimmed effect starts its sound at the end of its lead-in, or from inSampleTime when
+		// inLeadInOver.
+		OSStatus StartGroup(const SoundEngineVoiceID *inVoiceIDs, UInt32 inCount, UInt64 inSampleTime, Boolean inLeadInOver = false)
+		{
+			UInt64 theNow = GetSampleTime();
+			Float64 theLateness = (inSampleTime && (theNow > inSampleTime)) ? (theNow - inSampleTime) / mClockRate : 0.0;
+			
+			for (UInt32 i = 0; i < inCount; ++i)
+			{
+				SoundEngineVoice *theVoice = GetVoice(inVoiceIDs[i]);
+				if (theVoice == NULL)
+					continue;
+				
+				// a real voice binds its buffers again from the new cursor
+				if (theVoice->IsReal())
+					ReleaseSource(theVoice);
+				
+				UInt32 theIndex = GetVoiceIndex(theVoice);
+				mLanes.mCursor[theIndex] = (inLeadInOver) ? 0.0 : -(Float64)theVoice->mLeadIn;
+				theVoice->mLeadInEnd = 0;
+				if (!AdvanceCursor(theIndex, theLateness * mLanes.mIncrement[theIndex]))
+				{
+					mLanes.mState[theIndex] = kVoiceState_Stopped;
+					mLanes.mCursor[theIndex] = 0.0;
+					continue;
 				}
+				mLanes.mState[theIndex] = kVoiceState_Playing;
+				
+				if (mLanes.mCursor[theIndex] < 0.0)
+				{
+					BeginLeadIn(theIndex, theNow);
+					continue;
+				}
+				Float32 theGain = GetAudibleGain(theVoice);
+				if (theGain >= mVirtualThreshold)
+					MakeVoiceReal(theVoice, theGain, true, false);
+			}
+			
+			// collected afterwards, a voice of the group may have lost its source to a later one
+			ALuint theSources[MAX_SOURCES + kStealReserveSources];
+			ALsizei theNumSources = 0;
+			for (UInt32 i = 0; i < inCount; ++i)
+			{
+				SoundEngineVoice *theVoice = GetVoice(inVoiceIDs[i]);
+				if (theVoice && theVoice->IsReal() && (theNumSources < MAX_SOURCES + kStealReserveSources))
+					theSources[theNumSources++] = theVoice->mSourceID;
+			}
+			if (theNumSources)
+				alSourcePlayv(theNumSources, theSources);
+			return GetALError();
+		}
+		
+		// Moves the play cursor of a voice, wrapping a looping voice inside its loop region. Returns
+		// false once a voice that does not loop has played to its end.
+		Boolean AdvanceCursor(UInt32 inIndex, Float64 inFrames)
+		{
+			SoundEngineVoice *theVoice = &mVoices[inIndex];
+			Float64 &theCursor = mLanes.mCursor[inIndex];
+			theCursor += inFrames;
+			if (theVoice->mLooping && (theCursor >= theVoice->mLoopEnd) && (theVoice->mLoopEnd > theVoice->mLoopStart))
+				theCursor = theVoice->mLoopStart + fmod(theCursor - theVoice->mLoopStart, (Float64)(theVoice->mLoopEnd - theVoice->mLoopStart));
+			return theCursor < theVoice->mFrames;
+		}
+		
+		// play cursor of a real voice, AL_SAMPLE_OFFSET is relative to the loop buffer once past the intro
+		Float64 GetSourceCursor(SoundEngineVoice *inVoice)
+		{
+			ALint theOffset = 0;
+			alGetSourcei(inVoice->mSourceID, AL_SAMPLE_OFFSET, &theOffset);
+			return (inVoice->mLoopPhase == kLoopPhase_Body) ? inVoice->mLoopStart + theOffset : theOffset;
+		}
+		
+		// Sets the buffers of a source for the voice cursor. A looping voice before its loop start 
+		// queues the intro then the loop region; the update thread turns looping on once the intro 
+		// has been processed. The loop region must outlast one pass of the update thread.
+		void BindVoiceBuffers(SoundEngineVoice *inVoice, ALuint inSourceID)
+		{
+			SoundEngineEffect *theEffect = mEffectsMap->Get(inVoice->mEffectID);
+			Float64 theCursor = mLanes.mCursor[GetVoiceIndex(inVoice)];
+			alSourcei(inSourceID, AL_BUFFER, 0);
+			if (!inVoice->mLooping || (theEffect == NULL))
+			{
+				inVoice->mLoopPhase = kLoopPhase_None;
+				alSourcei(inSourceID, AL_BUFFER, theEffect ? theEffect->GetBufferID() : 0);
+				alSourcei(inSourceID, AL_LOOPING, AL_FALSE);
+				alSourcei(inSourceID, AL_SAMPLE_OFFSET, (ALint)theCursor);
+			}
+			else if (theCursor < inVoice->mLoopStart)
+			{
+				ALuint theBuffers[2] = { theEffect->GetIntroBufferID(), theEffect->GetLoopBufferID() };
+				inVoice->mLoopPhase = kLoopPhase_Intro;
+				alSourceQueueBuffers(inSourceID, 2, theBuffers);
+				alSourcei(inSourceID, AL_LOOPING, AL_FALSE);
+				alSourcei(inSourceID, AL_SAMPLE_OFFSET, (ALint)theCursor);
+			}
+			else
+			{
+				inVoice->mLoopPhase = kLoopPhase_Body;
+				alSourcei(inSourceID, AL_BUFFER, theEffect->GetLoopBufferID());
+				alSourcei(inSourceID, AL_LOOPING, AL_TRUE);
+				alSourcei(inSourceID, AL_SAMPLE_OFFSET, (ALint)(theCursor - inVoice->mLoopStart));
+			}
+		}
+		
+		void UpdateLoopPhase(SoundEngineVoice *inVoice)
+		{
+			ALint theProcessed = 0;
+			alGetSourcei(inVoice->mSourceID, AL_BUFFERS_PROCESSED, &theProcessed);
+			if (theProcessed > 0)
+			{
+				// the intro is done, from now on the source only loops the region
+				ALuint theBuffer;
+				alSourceUnqueueBuffers(inVoice->mSourceID, 1, &theBuffer);
+				alSourcei(inVoice->mSourceID, AL_LOOPING, AL_TRUE);
+				inVoice->mLoopPhase = kLoopPhase_Body;
+			}
+		}
+		
+		void CancelScheduledStart(SoundEngineVoiceID inVoiceID)
+		{
+			for (ScheduledStartMap::iterator it = mScheduledStarts.begin(); it != mScheduledStarts.end(); )
+			{
+				std::vector<SoundEngineVoiceID> &theGroup = it->second;
+				theGroup.erase(std::remove(theGroup.begin(), theGroup.end(), inVoiceID), theGroup.end());
+				if (theGroup.empty())
+					mScheduledStarts.erase(it++);
+				else
+					++it;
 			}
+		}
+		
+		SoundEngineVoice* GetVoice(SoundEngineVoiceID inVoiceID)
+		{
+			UInt32 theIndex = VoiceIndexForID(inVoiceID);
+			if (theIndex >= mVoices.size())
+				return NULL;
 			
-			result = AudioQueueEnqueueBuffer(inAQ, inCompleteAQBuffer, (THIS->mPacketDescs ? nPackets : 0), THIS->mPacketDescs);
-				AssertNoError("Error enqueuing new buffer", end);
-			if (CurFileInfo->mLoadAtOnce)
-				CurFileInfo->mFileDataInQueue = true;
-				
-			THIS->mCurrentPacket += nPackets;
+			SoundEngineVoice *theVoice = &mVoices[theIndex];
+			if ((mLanes.mState[theIndex] == kVoiceState_Free) || (theVoice->mGeneration != VoiceGenerationForID(inVoiceID)))
+				return NULL;
+			return theVoice;
+		}
 		
-		end:
-			return;
+		void FreeVoice(UInt32 inIndex)
+		{
+			SoundEngineVoice *theVoice = &mVoices[inIndex];
+			if (theVoice->IsReal())
+				ReleaseSource(theVoice);
+			if (theVoice->mMeterSlot)
+				sMeters.RemoveVoice(theVoice->mMeterSlot - 1);
+			theVoice->mMeterSlot = 0;
+			mLanes.mState[inIndex] = kVoiceState_Free;
+			mFreeVoices.push_back(inIndex);
 		}
 		
-		OSStatus SetupQueue(BG_FileInfo *inFileInfo)
+		// gain OpenAL applies on the source itself, before listener gain and distance attenuation
+		Float32 GetSourceGain(SoundEngineVoice *inVoice)
 		{
-			UInt32 size = 0;
-			OSStatus result = AudioQueueNewOutput(&inFileInfo->mFileFormat, QueueCallback, this, CFRunLoopGetCurrent(), kCFRunLoopCommonModes, 0, &mQueue);
-			if(result != noErr)
+			return mLanes.mGain[GetVoiceIndex(inVoice)] * sBusGraph.GetGainBelowCategory(inVoice->mBus);
+		}
+		
+		// gain OpenAL applies on the sum of all sources
+		Float32 GetListenerGain()
+		{
+			return mListenerGain * sBusGraph.GetGain(kSoundEngineBus_Effects);
+		}
+		
+		// gain the voice would be heard at, following the default AL_INVERSE_DISTANCE_CLAMPED model
+		Float32 GetAudibleGain(SoundEngineVoice *inVoice)
+		{
+			// relative voices are panned at the reference distance
+			Float32 theDistance = mReferenceDistance;
+			if (!inVoice->mRelative)
 			{
-				printf("%s: %d\n", "Error creating queue", (int)result);
-				return result;
+				Float32 dx = inVoice->mPosition[0] - mListenerPosition[0];
+				Float32 dy = inVoice->mPosition[1] - mListenerPosition[1];
+				Float32 dz = inVoice->mPosition[2] - mListenerPosition[2];
+				theDistance = sqrtf(dx*dx + dy*dy + dz*dz);
 			}
 			
-			// (2) If the file has a cookie, we should get it and set it on the AQ
-			size = sizeof(UInt32);
-			result = AudioFileGetPropertyInfo (inFileInfo->mAFID, kAudioFilePropertyMagicCookieData, &size, NULL);
-
-			if (!result && size) {
-				char* cookie = new char [size];		
-				result = AudioFileGetProperty (inFileInfo->mAFID, kAudioFilePropertyMagicCookieData, &size, cookie);
-				if(result != noErr)
-				{
-					printf("%s: %d\n", "Error getting magic cookie", (int)result);
-					return result;
-				}
+			if (theDistance < mReferenceDistance)
+				theDistance = mReferenceDistance;
+			if (theDistance > mMaxDistance)
+				theDistance = mMaxDistance;
+			
+			Float32 theAttenuation = 1.0;
+			Float32 theDenominator = mReferenceDistance + mRolloffFactor * (theDistance - mReferenceDistance);
+			if (theDenominator > 0.0)
+				theAttenuation = mReferenceDistance / theDenominator;
+			
+			return GetSourceGain(inVoice) * GetListenerGain() * theAttenuation;
+		}
+		
+		UInt32 GetVoiceIndex(SoundEngineVoice *inVoice)
+		{
+			return (UInt32)(inVoice - &mVoices[0]);
+		}
+		
+		// Real voices are kept in buckets ordered by priority, then loudness band, each bucket being
+		// a list where the oldest voice is at the head. The first voice of the lowest non empty 
+		// bucket is the one to steal, found in constant time from the bucket bitmask.
+		static UInt8 GetBucket(UInt8 inPriority, Float32 inGain)
+		{
+			UInt32 theBand = kLoudnessBands - 1;
+			if (inGain < 1.0)
+			{
+				Float32 theAttenuation = (inGain > 0.0) ? -20.0 * log10f(inGain) : 1000.0;
+				UInt32 theBandsDown = (UInt32)(theAttenuation / 6.0);
+				theBand = (theBandsDown < kLoudnessBands - 1) ? kLoudnessBands - 1 - theBandsDown : 0;
+			}
+			return inPriority * kLoudnessBands + theBand;
+		}
+		
+		void LinkVoice(UInt32 inIndex, UInt8 inBucket)
+		{
+			SoundEngineVoice *theVoice = &mVoices[inIndex];
+			theVoice->mBucket = inBucket;
+			theVoice->mPrevReal = mBucketTail[inBucket];
+			theVoice->mNextReal = kNoVoice;
+			if (mBucketTail[inBucket] != kNoVoice)
+				mVoices[mBucketTail[inBucket]].mNextReal = inIndex;
+			else
+				mBucketHead[inBucket] = inIndex;
+			mBucketTail[inBucket] = inIndex;
+			mBucketMask[inBucket >> 6] |= (1ULL << (inBucket & 63));
+		}
+		
+		void UnlinkVoice(UInt32 inIndex)
+		{
+			SoundEngineVoice *theVoice = &mVoices[inIndex];
+			UInt8 theBucket = theVoice->mBucket;
+			if (theVoice->mPrevReal != kNoVoice)
+				mVoices[theVoice->mPrevReal].mNextReal = theVoice->mNextReal;
+			else
+				mBucketHead[theBucket] = theVoice->mNextReal;
+			if (theVoice->mNextReal != kNoVoice)
+				mVoices[theVoice->mNextReal].mPrevReal = theVoice->mPrevReal;
+			else
+				mBucketTail[theBucket] = theVoice->mPrevReal;
+			if (mBucketHead[theBucket] == kNoVoice)
+				mBucketMask[theBucket >> 6] &= ~(1ULL << (theBucket & 63));
+		}
+		
+		void UpdateVoiceBucket(SoundEngineVoice *inVoice, Float32 inGain)
+		{
+			UInt8 theBucket = GetBucket(inVoice->mPriority, inGain);
+			if (theBucket != inVoice->mBucket)
+			{
+				UInt32 theIndex = GetVoiceIndex(inVoice);
+				UnlinkVoice(theIndex);
+				LinkVoice(theIndex, theBucket);
+			}
+		}
+		
+		UInt32 GetStealCandidate()
+		{
+			if (mBucketMask[0])
+				return mBucketHead[__builtin_ctzll(mBucketMask[0])];
+			if (mBucketMask[1])
+				return mBucketHead[64 + __builtin_ctzll(mBucketMask[1])];
+			return kNoVoice;
+		}
+		
+		// Takes the source of a lower ranked voice, which goes virtual. The victim fades out on its
+		// own source while the thief starts on a reserve one, unless the reserve is already in use.
+		Boolean StealSource(UInt8 inBucket, Boolean inStealEqual, ALuint &outSourceID)
+		{
+			UInt32 theVictimIndex = GetStealCandidate();
+			if (theVictimIndex == kNoVoice)
+				return false;
+			
+			SoundEngineVoice *theVictim = &mVoices[theVictimIndex];
+			if ((theVictim->mBucket > inBucket) || ((theVictim->mBucket == inBucket) && !inStealEqual))
+				return false;
+			
+			mLanes.mCursor[theVictimIndex] = GetSourceCursor(theVictim);
+			UnlinkVoice(theVictimIndex);
+			
+			if (mReserveSources.empty())
+			{
+				alSourceStop(theVictim->mSourceID);
+				outSourceID = theVictim->mSourceID;
+			}
+			else
+			{
+				FadingSource theFade;
+				theFade.mSourceID = theVictim->mSourceID;
+				theFade.mEffectID = theVictim->mEffectID;
+				theFade.mGain = GetSourceGain(theVictim);
+				theFade.mStep = theFade.mGain * (kVoiceUpdateInterval / kStealFadeTime);
+				mFadingSources.push_back(theFade);
 				
-				result = AudioQueueSetProperty(mQueue, kAudioQueueProperty_MagicCookie, cookie, size);
-				delete [] cookie;
-				if(result != noErr)
-				{
-					printf("%s: %d\n", "Error setting magic cookie", (int)result);
-					return result;
-				}
+				outSourceID = mReserveSources.back();
+				mReserveSources.pop_back();
 			}
-
-			// channel layout
-			OSStatus err = AudioFileGetPropertyInfo(inFileInfo->mAFID, kAudioFilePropertyChannelLayout, &size, NULL);
-			if (err == noErr && size > 0) {
-				AudioChannelLayout *acl = (AudioChannelLayout *)malloc(size);
-				result = AudioFileGetProperty(inFileInfo->mAFID, kAudioFilePropertyChannelLayout, &size, acl);
-				if(result != noErr)
+			theVictim->mSourceID = 0;
+			return true;
+		}
+		
+		void UpdateFadingSources(Float64 inElapsed)
+		{
+			for (UInt32 i = 0; i < mFadingSources.size(); )
+			{
+				FadingSource &theFade = mFadingSources[i];
+				theFade.mGain -= theFade.mStep * (inElapsed / kVoiceUpdateInterval);
+				if (theFade.mGain > 0.0)
 				{
-					printf("%s: %d\n", "Error getting channel layout from file", (int)result);
-					return result;
+					alSourcef(theFade.mSourceID, AL_GAIN, theFade.mGain);
+					++i;
+					continue;
 				}
 				
-				result = AudioQueueSetProperty(mQueue, kAudioQueueProperty_ChannelLayout, acl, size);
-				free(acl);
-				if(result != noErr)
+				alSourceStop(theFade.mSourceID);
+				alSourcei(theFade.mSourceID, AL_BUFFER, 0);
+				mReserveSources.push_back(theFade.mSourceID);
+				mFadingSources[i] = mFadingSources.back();
+				mFadingSources.pop_back();
+			}
+		}
+		
+		// cuts the fades still playing the buffers of an effect about to be deleted
+		void StopFadingSources(UInt32 inEffectID)
+		{
+			for (UInt32 i = 0; i < mFadingSources.size(); )
+			{
+				FadingSource &theFade = mFadingSources[i];
+				if (theFade.mEffectID != inEffectID)
 				{
-					printf("%s: %d\n", "Error setting channel layout on queue", (int)result);
-					return result;
+					++i;
+					continue;
 				}
+				
+				alSourceStop(theFade.mSourceID);
+				alSourcei(theFade.mSourceID, AL_BUFFER, 0);
+				mReserveSources.push_back(theFade.mSourceID);
+				mFadingSources[i] = mFadingSources.back();
+				mFadingSources.pop_back();
+			}
+		}
+		
+		// inStealEqual lets a newly started voice take the source of the oldest voice of the same
+		// rank; a voice coming back from virtual only steals from strictly lower ranked ones.
+		Boolean MakeVoiceReal(SoundEngineVoice *inVoice, Float32 inGain, Boolean inStealEqual, Boolean inPlay = true)
+		{
+			UInt8 theBucket = GetBucket(inVoice->mPriority, inGain);
+			ALuint theSourceID;
+			if (!mFreeSources.empty())
+			{
+				theSourceID = mFreeSources.back();
+				mFreeSources.pop_back();
 			}
+			else if (!StealSource(theBucket, inStealEqual, theSourceID))
+				return false;
 			
-			// add a notification proc for when the queue stops
-			result = AudioQueueAddPropertyListener(mQueue, kAudioQueueProperty_IsRunning, QueueStoppedProc, this);
-			if(result != noErr)
+			BindVoiceBuffers(inVoice, theSourceID);
+			alSourcef(theSourceID, AL_PITCH, inVoice->mPitch);
+			alSourcef(theSourceID, AL_GAIN, GetSourceGain(inVoice));
+			if (inVoice->mRelative)
 			{
-				printf("%s: %d\n", "Error adding isRunning property listener to queue", (int)result);
-				return result;
+				// on a half circle in front of the listener, at the reference distance so the distance 
+				// model leaves the gain alone
+				Float32 thePan = mLanes.mPan[GetVoiceIndex(inVoice)];
+				alSourcei(theSourceID, AL_SOURCE_RELATIVE, AL_TRUE);
+				alSource3f(theSourceID, AL_POSITION, thePan * mReferenceDistance, 0.0, -sqrtf(1.0 - thePan * thePan) * mReferenceDistance);
+			}
+			else
+			{
+				alSourcei(theSourceID, AL_SOURCE_RELATIVE, AL_FALSE);
+				alSource3f(theSourceID, AL_POSITION, inVoice->mPosition[0], inVoice->mPosition[1], inVoice->mPosition[2]);
 			}
+			if (mHasASA)
+			{
+				alcASASetSourceProc(mASAOcclusion, theSourceID, &inVoice->mOcclusion, sizeof(Float32));
+				alcASASetSourceProc(mASAReverbSendLevel, theSourceID, &inVoice->mReverbSend, sizeof(Float32));
+			}
+			if (inPlay)
+				alSourcePlay(theSourceID);
 			
-			// we need to reset this variable so that if the queue is stopped mid buffer we don't dispose it 
-			mMakeNewQueueWhenStopped = false;
+			inVoice->mSourceID = theSourceID;
+			LinkVoice(GetVoiceIndex(inVoice), theBucket);
+			return true;
+		}
+		
+		void MakeVoiceVirtual(SoundEngineVoice *inVoice)
+		{
+			mLanes.mCursor[GetVoiceIndex(inVoice)] = GetSourceCursor(inVoice);
+			ReleaseSource(inVoice);
+		}
+		
+		void ReleaseSource(SoundEngineVoice *inVoice)
+		{
+			UnlinkVoice(GetVoiceIndex(inVoice));
+			alSourceStop(inVoice->mSourceID);
+			alSourcei(inVoice->mSourceID, AL_BUFFER, 0);
+			mFreeSources.push_back(inVoice->mSourceID);
+			inVoice->mSourceID = 0;
+		}
+		
+		// Sizes everything kept per voice; the cost of a pass grows linearly with the capacity. The
+		// free list is rebuilt so the lowest free index is handed out first.
+		Boolean SetVoiceCapacity(UInt32 inCapacity)
+		{
+			if (!mLanes.Resize(inCapacity))
+				return false;
 			
-			// volume
-			result = SetVolume(mVolume);
+			mVoices.resize(inCapacity, SoundEngineVoice());
+			mFreeVoices.clear();
+			for (int i = inCapacity - 1; i >= 0; --i)
+			{
+				if (mLanes.mState[i] == kVoiceState_Free)
+					mFreeVoices.push_back(i);
+			}
+			mPassGains.assign(inCapacity, 0.0);
+			mPassEnded.assign(inCapacity, false);
+			mPassChunks.resize((inCapacity + kVoiceChunkSize - 1) / kVoiceChunkSize);
+			return true;
+		}
+		
+		// the context, its sources and the sample clock rate
+		OSStatus CreateContext()
+		{
+			OSStatus result = noErr;
+			
+			// if a mixer output rate was specified, set it here
+			// must be done before the alcCreateContext() call
+			if (mOutputRate)
+				alcMacOSXMixerOutputRateProc(mOutputRate);
+			
+			// Create an OpenAL Context
+			mContext = alcCreateContext(mDevice, NULL);
+				AssertNoOALError("Error creating OpenAL context", end)
+			
+			alcMakeContextCurrent(mContext);
+				AssertNoOALError("Error setting current OpenAL context", end)
+			
+			alGenSources(MAX_SOURCES + kStealReserveSources, mSourceID); 
+				AssertNoOALError("Error generating sources", end)
+			
+			for (int i = 0; i < MAX_SOURCES; ++i)
+				mFreeSources.push_back(mSourceID[i]);
+			for (int i = MAX_SOURCES; i < MAX_SOURCES + kStealReserveSources; ++i)
+				mReserveSources.push_back(mSourceID[i]);
+			
+			// the sample clock runs at the mixer rate from here on
+			{
+				ALCint theFrequency = 0;
+				alcGetIntegerv(mDevice, ALC_FREQUENCY, 1, &theFrequency);
+				if (theFrequency > 0)
+					mClockRate = theFrequency;
+				else if (mOutputRate)
+					mClockRate = mOutputRate;
+			}
 			
 		end:
 			return result;
 		}
-
-		OSStatus SetupBuffers(BG_FileInfo *inFileInfo)
+		
+		// Real voices are made virtual first, their cursor is kept for the next sources.
+		void DeleteSources()
 		{
-			int numBuffersToQueue = kNumberBuffers;
-			UInt32 maxPacketSize;
-			UInt32 size = sizeof(maxPacketSize);
-			// we need to calculate how many packets we read at a time, and how big a buffer we need
-			// we base this on the size of the packets in the file and an approximate duration for each buffer
-				
-			// first check to see what the max size of a packet is - if it is bigger
-			// than our allocation default size, that needs to become larger
-			OSStatus result = AudioFileGetProperty(inFileInfo->mAFID, kAudioFilePropertyPacketSizeUpperBound, &size, &maxPacketSize);
-			if(result != noErr)
+			for (UInt32 i=0; i < mVoices.size(); i++)
 			{
-				printf("%s: %d\n", "Error getting packet upper bound size", (int)result);
-				return result;
+				if (mVoices[i].IsReal())
+					MakeVoiceVirtual(&mVoices[i]);
 			}
-			
-			bool isFormatVBR = (inFileInfo->mFileFormat.mBytesPerPacket == 0 || inFileInfo->mFileFormat.mFramesPerPacket == 0);
-
-			CalculateBytesForTime(inFileInfo->mFileFormat, maxPacketSize, 0.5/*seconds*/, &mBufferByteSize, &mNumPacketsToRead);
-			
-			// if the file is smaller than the capacity of all the buffer queues, always load it at once
-			if ((mBufferByteSize * numBuffersToQueue) > inFileInfo->mFileDataSize)
-				inFileInfo->mLoadAtOnce = true;
-				
-			if (inFileInfo->mLoadAtOnce)
+			for (UInt32 i=0; i < mFadingSources.size(); i++)
 			{
-				UInt64 theFileNumPackets;
-				size = sizeof(UInt64);
-				result = AudioFileGetProperty(inFileInfo->mAFID, kAudioFilePropertyAudioDataPacketCount, &size, &theFileNumPackets);
-					AssertNoError("Error getting packet count for file", end);
-				
-				mNumPacketsToRead = (UInt32)theFileNumPackets;
-				mBufferByteSize = inFileInfo->mFileDataSize;
-				numBuffersToQueue = 1;
-			}	
-			else
-			{
-				mNumPacketsToRead = mBufferByteSize / maxPacketSize;
+				alSourceStop(mFadingSources[i].mSourceID);
+				alSourcei(mFadingSources[i].mSourceID, AL_BUFFER, 0);
 			}
+			mFadingSources.clear();
 			
-			if (isFormatVBR)
-				mPacketDescs = new AudioStreamPacketDescription [mNumPacketsToRead];
-			else
-				mPacketDescs = NULL; // we don't provide packet descriptions for constant bit rate formats (like linear PCM)	
-				
-			// allocate the queue's buffers
-			for (int i = 0; i < numBuffersToQueue; ++i) 
+			alDeleteSources(MAX_SOURCES + kStealReserveSources, mSourceID);
+			mFreeSources.clear();
+			mReserveSources.clear();
+		}
+		
+		void DestroyContext()
+		{
+			if (mContext == NULL)
+				return;
+			alcMakeContextCurrent(NULL);
+			alcDestroyContext(mContext);
+			mContext = NULL;
+		}
+		
+		void StartUpdateThread()
+		{
+			mLastUpdateTime = mach_absolute_time();
+			mUpdateThreadRunning = true;
+			if (pthread_create(&mUpdateThread, NULL, VoiceUpdateThreadEntry, this))
 			{
-				result = AudioQueueAllocateBuffer(mQueue, mBufferByteSize, &mBuffers[i]);
-					AssertNoError("Error allocating buffer for queue", end);
-				QueueCallback (this, mQueue, mBuffers[i]);
-				if (inFileInfo->mLoadAtOnce)
-					inFileInfo->mFileDataInQueue = true;
+				printf("Error creating voice update thread\n");
+				mUpdateThreadRunning = false;
 			}
+		}
 		
-		end:
-			return result;
+		void StopUpdateThread()
+		{
+			if (mUpdateThreadRunning) {
+				mUpdateThreadRunning = false;
+				semaphore_signal(mWakeSemaphore);
+				pthread_join(mUpdateThread, NULL);
+			}
+		}
+		
+		static void* StartupThreadEntry(void *inRefCon)
+		{
+			((OpenALObject*)inRefCon)->OpenDeviceOrRetry();
+			return NULL;
+		}
+		
+		UInt64 RecordStartupPhase(UInt32 inPhase, UInt64 inPhaseStart)
+		{
+			UInt64 theNow = mach_absolute_time();
+			mStartupTimes[inPhase] = HostTimeToSeconds(theNow - inPhaseStart);
+			return theNow;
+		}
+		
+		// what the API sets on the listener and the sources, kept for the next context
+		void ApplyContextState()
+		{
+			for (int i = 0; i < MAX_SOURCES + kStealReserveSources; ++i)
+			{
+				alSourcef(mSourceID[i], AL_REFERENCE_DISTANCE, mReferenceDistance);
+				alSourcef(mSourceID[i], AL_MAX_DISTANCE, mMaxDistance);
+			}
+			alListener3f(AL_POSITION, mListenerPosition[0], mListenerPosition[1], mListenerPosition[2]);
+			alListenerf(AL_GAIN, GetListenerGain());
+			if (mHasASA && mReverbSet)
+				ApplyReverb(mReverbOn, mReverbRoomType, mReverbLevel);
+		}
+		
+		// OpenAL reports an error for any call made before the context exists
+		OSStatus GetALError()
+		{
+			return (mContext) ? alGetError() : noErr;
+		}
+		
+		Float32									mOutputRate;
+		ALCcontext*								mContext;
+		ALCdevice*								mDevice;
+		SoundEngineEffectMap*					mEffectsMap;
+		struct FadingSource {
+			ALuint								mSourceID;
+			UInt32								mEffectID;		// whose buffers the source still plays
+			Float32								mGain;
+			Float32								mStep;
+		};
+		
+		ALuint									mSourceID[MAX_SOURCES + kStealReserveSources];
+		std::vector<ALuint>						mFreeSources;
+		std::vector<ALuint>						mReserveSources;
+		std::vector<FadingSource>				mFadingSources;
+		UInt32									mBucketHead[kVoiceBuckets];
+		UInt32									mBucketTail[kVoiceBuckets];
+		UInt64									mBucketMask[2];
+		
+		std::vector<SoundEngineVoice>			mVoices;
+		SoundEngineVoiceLanes					mLanes;				// the hot fields of mVoices
+		std::vector<UInt32>						mFreeVoices;
+		pthread_mutex_t							mVoiceLock;
+		SoundEngineCommandQueue<SoundEngineEffectCommand, kEffectCommandSlots>	mEffectCommands;
+		semaphore_t								mWakeSemaphore;		// cuts the update thread sleep short
+		
+		SoundEngineTaskPool						mTaskPool;
+		std::vector<Float32>					mPassGains;			// per voice, from the first phase of a pass
+		std::vector<Boolean>					mPassEnded;
+		std::vector<VoicePassChunk>				mPassChunks;
+		Float64									mPassElapsed;
+		UInt64									mPassTime;
+		Boolean									mPassBusMetering;
+		Boolean									mPassProfiling;
+		
+		Float32									mListenerPosition[3];
+		Float32									mListenerGain;
+		Float32									mReferenceDistance;
+		Float32									mMaxDistance;
+		Float32									mRolloffFactor;
+		Float32									mVirtualThreshold;
+		Float32									mTrimThreshold;
+		
+		Boolean									mHasASA;
+		ALuint									mASAOcclusion;
+		ALuint									mASAReverbSendLevel;
+		ALuint									mASAReverbOn;
+		ALuint									mASAReverbRoomType;
+		ALuint									mASAReverbGlobalLevel;
+		Boolean									mReverbSet;
+		Boolean									mReverbOn;
+		UInt32									mReverbRoomType;
+		Float32									mReverbLevel;
+		
+		typedef std::multimap<UInt64, std::vector<SoundEngineVoiceID> > ScheduledStartMap;
+		ScheduledStartMap						mScheduledStarts;	// voice groups by start sample time
+		ScheduledStartMap						mLeadIns;			// voices by the sample time their lead-in ends
+		UInt64									mClockStartTime;	// host time of sample time 0
+		Float64									mClockRate;
+		
+		UInt64									mLastUpdateTime;
+		pthread_t								mUpdateThread;
+		volatile bool							mUpdateThreadRunning;
+		
+		volatile int32_t						mLastEffectID;		// effect IDs are handed out before any buffer exists
+		pthread_mutex_t							mDeviceLock;		// held while the device is opened or the context rebuilt
+		volatile int32_t						mDeviceRequested;
+		pthread_t								mStartupThread;
+		Boolean									mHasStartupThread;
+		Float64									mStartupTimes[kSoundEngineStartupPhases];
+};
+
+#pragma mark ***** BackgroundStreamPool *****
+//==================================================================================================
+//	BackgroundStreamPool class
+//==================================================================================================
+// Music streams handed out as SoundEngineStreamIDs. A stream only owns a BackgroundTrackMgr, and so an 
+// AudioQueue and its buffers, while a track is loaded; an idle stream is a few bytes. The lock guards 
+// the pool against the crossfade threads swapping a track manager in, and must be held around any use 
+// of a stream. Bumping the serial of a stream cancels any crossfade still loading for it.
+class BackgroundStreamPool
+{
+	public:
+		struct Stream {
+			BackgroundTrackMgr *				mTrackMgr;
+			SoundEngineBusID					mBus;
+			UInt32								mSerial;
+			UInt16								mGeneration;
+			Boolean								mInUse;
+		};
+		
+		BackgroundStreamPool()
+		{
+			pthread_mutex_init(&mLock, NULL);
+			for (UInt32 i = 0; i < kBackgroundMusicSlots; ++i)
+				mSlotStreams[i] = 0;
+		}
+		
+		pthread_mutex_t &GetLock() { return mLock; }
+		
+		OSStatus CreateStream(SoundEngineBusID inBus, SoundEngineStreamID *outStreamID)
+		{
+			UInt32 theIndex;
+			if (!mFreeStreams.empty())
+			{
+				theIndex = mFreeStreams.back();
+				mFreeStreams.pop_back();
+			}
+			else if (mStreams.size() < 0xFFFF)
+			{
+				theIndex = mStreams.size();
+				Stream theStream;
+				theStream.mGeneration = 0;
+				mStreams.push_back(theStream);
+			}
+			else
+				return kSoundEngineErrNoSourcesAvailable;
+			
+			Stream &theStream = mStreams[theIndex];
+			theStream.mTrackMgr = NULL;
+			theStream.mBus = inBus;
+			theStream.mSerial = 0;
+			theStream.mInUse = true;
+			*outStreamID = ((UInt32)theStream.mGeneration << 16) | (theIndex + 1);
+			return noErr;
 		}
 		
-		OSStatus LoadTrack(const char* inFilePath, Boolean inAddToQueue, Boolean inLoadAtOnce)
+		OSStatus DestroyStream(SoundEngineStreamID inStreamID)
 		{
-			BG_FileInfo *fileInfo = new BG_FileInfo;
-			fileInfo->mFilePath = (char *)malloc(strlen(inFilePath)+1);
-			strcpy(fileInfo->mFilePath, inFilePath);
-			
-			OSStatus result = LoadFileDataInfo(fileInfo->mFilePath, fileInfo->mAFID, fileInfo->mFileFormat, fileInfo->mFileDataSize);
-				AssertNoError("Error getting file data info", fail);
-			fileInfo->mLoadAtOnce = inLoadAtOnce;
-			fileInfo->mFileDataInQueue = false;
-			// if not adding to the queue, clear the current file vector
-			if (!inAddToQueue)
-				mBGFileInfo.clear();
-				
-			mBGFileInfo.push_back(fileInfo);
+			Stream *theStream = GetStream(inStreamID);
+			if (theStream == NULL)
+				return kSoundEngineErrInvalidID;
 			
-			// setup the queue if this is the first (or only) file
-			if (mBGFileInfo.size() == 1)
+			Unload(theStream);
+			theStream->mInUse = false;
+			++theStream->mGeneration;
+			mFreeStreams.push_back((inStreamID & 0xFFFF) - 1);
+			for (UInt32 i = 0; i < kBackgroundMusicSlots; ++i)
 			{
-				result = SetupQueue(fileInfo);
-					AssertNoError("Error setting up queue", fail);
-				result = SetupBuffers(fileInfo);
-					AssertNoError("Error setting up queue buffers", fail);					
+				if (mSlotStreams[i] == inStreamID)
+					mSlotStreams[i] = 0;
 			}
-			// if this is just part of the playlist, close the file for now
-			else
-			{
-				result = AudioFileClose(fileInfo->mAFID);
-					AssertNoError("Error closing file", fail);
-			}	
-			return result;
+			return noErr;
+		}
 		
-		fail:
-			if (fileInfo)
-				delete fileInfo;
-			return result;
+		Stream *GetStream(SoundEngineStreamID inStreamID)
+		{
+			UInt32 theIndex = (inStreamID & 0xFFFF) - 1;
+			if (theIndex >= mStreams.size())
+				return NULL;
+			Stream &theStream = mStreams[theIndex];
+			return (theStream.mInUse && (theStream.mGeneration == (UInt16)(inStreamID >> 16))) ? &theStream : NULL;
 		}
 		
-		OSStatus UpdateGain()
+		BackgroundTrackMgr *GetTrackMgr(SoundEngineStreamID inStreamID)
 		{
-			return SetVolume(mVolume);
+			Stream *theStream = GetStream(inStreamID);
+			return theStream ? theStream->mTrackMgr : NULL;
 		}
 		
-		OSStatus SetVolume(Float32 inVolume)
+		void Unload(Stream *inStream)
 		{
-			mVolume = inVolume;
-			return AudioQueueSetParameter(mQueue, kAudioQueueParam_Volume, mVolume * gMasterVolumeGain);
+			++inStream->mSerial;
+			if (inStream->mTrackMgr)
+			{
+				delete inStream->mTrackMgr;
+				inStream->mTrackMgr = NULL;
+			}
 		}
 		
-		OSStatus Start()
+		// the stream behind an int slot of the old API, created on first use
+		SoundEngineStreamID GetSlotStream(int inSlot)
 		{
-			
-			OSStatus result = AudioQueuePrime(mQueue, 1, NULL);	
-			if (result)
+			if ((inSlot < 0) || (inSlot >= kBackgroundMusicSlots))
+				return 0;
+			if ((mSlotStreams[inSlot] == 0) && CreateStream(kSoundEngineBus_Music, &mSlotStreams[inSlot]))
+				return 0;
+			return mSlotStreams[inSlot];
+		}
+		
+		UInt32 GetNumStreams() const { return mStreams.size(); }
+		BackgroundTrackMgr *GetTrackMgrAtIndex(UInt32 inIndex) { return mStreams[inIndex].mInUse ? mStreams[inIndex].mTrackMgr : NULL; }
+		
+		// track managers are kept across a re-initialization, the ones that were playing carry on
+		void RestartAll()
+		{
+			for (UInt32 i = 0; i < mStreams.size(); ++i)
 			{
-				mStopped = true;
-				printf("Error priming queue");
-				return result;
+				if (mStreams[i].mInUse && mStreams[i].mTrackMgr)
+					mStreams[i].mTrackMgr->Restart();
 			}
-			mStopped = false;
-			return AudioQueueStart(mQueue, NULL);
 		}
 		
-		OSStatus Stop(Boolean inStopAtEnd)
+		void UnloadAll()
 		{
-			if (inStopAtEnd)
+			for (UInt32 i = 0; i < mStreams.size(); ++i)
 			{
-				mStopAtEnd = true;
-				return noErr;
+				if (mStreams[i].mInUse)
+					Unload(&mStreams[i]);
 			}
-			else{
-				mStopped = true;
-				return AudioQueueStop(mQueue, true);
+		}
+		
+		void DestroyAll()
+		{
+			UnloadAll();
+			for (UInt32 i = 0; i < mStreams.size(); ++i)
+			{
+				if (mStreams[i].mInUse)
+				{
+					mStreams[i].mInUse = false;
+					++mStreams[i].mGeneration;
+					mFreeStreams.push_back(i);
+				}
 			}
+			for (UInt32 i = 0; i < kBackgroundMusicSlots; ++i)
+				mSlotStreams[i] = 0;
 		}
-	
+		
 	private:
-		AudioQueueRef						mQueue;
-		AudioQueueBufferRef					mBuffers[kNumberBuffers];
-		UInt32								mBufferByteSize;
-		SInt64								mCurrentPacket;
-		UInt32								mNumPacketsToRead;
-		Float32								mVolume;
-		AudioStreamPacketDescription *		mPacketDescs;
-		std::vector<BG_FileInfo*>			mBGFileInfo;
-		UInt32								mCurrentFileIndex;
-		Boolean								mMakeNewQueueWhenStopped;
-		Boolean								mStopAtEnd;
-		Boolean								mStopped;
-		std::vector<AudioQueueBufferRef>	mBuffersToDispose;
+		pthread_mutex_t							mLock;
+		std::vector<Stream>						mStreams;
+		std::vector<UInt32>						mFreeStreams;
+		SoundEngineStreamID						mSlotStreams[kBackgroundMusicSlots];
 };
 
-#pragma mark ***** SoundEngineEffect *****
+static BackgroundStreamPool sBackgroundStreams;
+
+#pragma mark ***** BackgroundCrossfade *****
 //==================================================================================================
-//	SoundEngineEffect class
+//	BackgroundCrossfade
 //==================================================================================================
-class SoundEngineEffect
+// Replaces the track manager of a stream without a gap. The new file is opened and its first buffers 
+// read on a thread of its own, then both queues play overlapped for the fade time and the old 
+// manager is disposed of on that same thread once it is silent.
+struct BackgroundCrossfade
 {
-	public:	
-		// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-		SoundEngineEffect(const char* inPath) 
-			:	
-				mBufferID(0),
-				mPath(inPath),
-				mData(NULL),
-				mDataSize(0)
-			{ }
-		
-		~SoundEngineEffect()
-		{			
-			if (mData)
-				free(mData);
+	SoundEngineStreamID		mStreamID;
+	char					mFilePath[PATH_MAX];
+	Float64					mFadeTime;
+	Boolean					mLoadAtOnce;
+	SoundEngineBusID		mBus;
+	UInt32					mSerial;
+	CFRunLoopRef			mRunLoop;
+	
+	static void *operator new(size_t inSize) throw() { return GetPool().Allocate(); }
+	static void operator delete(void *inBlock) { GetPool().Release(inBlock); }
+	static SoundEngineBlockPool<BackgroundCrossfade, kCrossfadeBlocks> &GetPool()
+	{
+		static SoundEngineBlockPool<BackgroundCrossfade, kCrossfadeBlocks> sPool;
+		return sPool;
+	}
+};
+
+// Counts the crossfade threads, so that teardown waits until none is left. Teardown cancels them
+// first: a crossfade still loading drops its track, one fading out stops waiting for the fade.
+class BackgroundCrossfadeTracker
+{
+	public:
+		BackgroundCrossfadeTracker()
+			:	mCount(0),
+				mCanceled(false)
+		{
+			pthread_mutex_init(&mLock, NULL);
+			pthread_cond_init(&mCondition, NULL);
 		}
 		
-		// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-		// Accessors
-		// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-		UInt32	GetEffectID() { return mBufferID; }		
-
-		// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-		// Helper Functions
-		// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-		ALenum GetALFormat(AudioStreamBasicDescription inFileFormat)
+		// false while teardown is in progress
+		Boolean Begin()
 		{
-			if (inFileFormat.mFormatID != kAudioFormatLinearPCM)
-				return kSoundEngineErrInvalidFileFormat;
-				
-			if ((inFileFormat.mChannelsPerFrame > 2) || (inFileFormat.mChannelsPerFrame < 1))
-				return kSoundEngineErrInvalidFileFormat;
-			
-			if(inFileFormat.mBitsPerChannel == 8)
-				return (inFileFormat.mChannelsPerFrame == 1) ? AL_FORMAT_MONO8 : AL_FORMAT_STEREO8;
-			else if(inFileFormat.mBitsPerChannel == 16)
-				return (inFileFormat.mChannelsPerFrame == 1) ? AL_FORMAT_MONO16 : AL_FORMAT_STEREO16;
-
-			return kSoundEngineErrInvalidFileFormat;
+			SoundEngineLock theLock(mLock);
+			if (mCanceled)
+				return false;
+			++mCount;
+			return true;
 		}
-
-		OSStatus LoadFileData(const char *inFilePath, void* &outData, UInt32 &outDataSize, ALuint &outBufferID)
+		
+		void End()
 		{
-			AudioFileID theAFID = 0;
-			OSStatus result = noErr;
-			UInt64 theFileSize = 0;
-			AudioStreamBasicDescription theFileFormat;
-			
-			result = LoadFileDataInfo(inFilePath, theAFID, theFileFormat, theFileSize);
-			outDataSize = (UInt32)theFileSize;
-				AssertNoError("Error loading file info", fail)
-
-			outData = malloc(outDataSize);
-
-			result = AudioFileReadBytes(theAFID, false, 0, &outDataSize, outData);
-				AssertNoError("Error reading file data", fail)
-				
-			if (!TestAudioFormatNativeEndian(theFileFormat) && (theFileFormat.mBitsPerChannel > 8)) 
-				return kSoundEngineErrInvalidFileFormat;
+			SoundEngineLock theLock(mLock);
+			if (--mCount == 0)
+				pthread_cond_broadcast(&mCondition);
+		}
 		
-			alGenBuffers(1, &outBufferID);
-			/*ALenum			error;
-			if((error = alGetError()) != AL_NO_ERROR) {
-				printf("Error Generating Buffers: %x", error);
-				exit(1);
-			}*/
-				AssertNoOALError("Error generating buffer\n", fail);
-			
-			alBufferDataStaticProc(outBufferID, GetALFormat(theFileFormat), outData, outDataSize, theFileFormat.mSampleRate);
-				AssertNoOALError("Error attaching data to buffer\n", fail);
-
-			AudioFileClose(theAFID);
-			return result;
+		Boolean IsCanceled() { return mCanceled; }
+		
+		// sleeps for the fade, false when canceled before it is over
+		Boolean Wait(Float64 inSeconds)
+		{
+			struct timeval theNow;
+			gettimeofday(&theNow, NULL);
+			Float64 theEnd = theNow.tv_sec + theNow.tv_usec * 1.0e-6 + inSeconds;
+			struct timespec theDeadline;
+			theDeadline.tv_sec = (time_t)theEnd;
+			theDeadline.tv_nsec = (long)((theEnd - theDeadline.tv_sec) * 1.0e9);
 			
-		fail:			
-			if (theAFID)
-				AudioFileClose(theAFID);
-			if (outData)
+			SoundEngineLock theLock(mLock);
+			while (!mCanceled)
 			{
-				free(outData);
-				outData = NULL;
+				if (pthread_cond_timedwait(&mCondition, &mLock, &theDeadline) == ETIMEDOUT)
+					return true;
 			}
-			return result;
+			return false;
 		}
 		
-		OSStatus initialize()
+		void CancelAll()
 		{
-			OSStatus result = AL_NO_ERROR;			
-
-			result = LoadFileData(mPath, mData, mDataSize, mBufferID);
-				AssertNoError("Error loading sound file info", end)
-
-		end:
-			return result;
+			SoundEngineLock theLock(mLock);
+			mCanceled = true;
+			pthread_cond_broadcast(&mCondition);
+			while (mCount)
+				pthread_cond_wait(&mCondition, &mLock);
+			mCanceled = false;
 		}
-
+		
 	private:
-		ALuint					mBufferID;
-		const char*				mPath;
-		void*					mData;
-		UInt32					mDataSize;
+		pthread_mutex_t							mLock;
+		pthread_cond_t							mCondition;
+		UInt32									mCount;
+		volatile Boolean						mCanceled;
 };
 
-#pragma mark ***** SoundEngineEffectMap *****
-//==================================================================================================
-//	SoundEngineEffectMap class
-//==================================================================================================
-class SoundEngineEffectMap 
-	: std::multimap<UInt32, SoundEngineEffect*, std::less<ALuint> > 
+static BackgroundCrossfadeTracker	sCrossfades;
+
+static void *BackgroundCrossfadeThreadEntry(void *inArg)
 {
-	public:
-    // add a new context to the map
-    void Add (const	ALuint	inEffectToken, SoundEngineEffect **inEffect)
+	BackgroundCrossfade *theCrossfade = (BackgroundCrossfade*)inArg;
+	BackgroundTrackMgr *theNewMgr = new BackgroundTrackMgr(theCrossfade->mBus, theCrossfade->mRunLoop);
+	BackgroundTrackMgr *theOldMgr = NULL;
+	BackgroundStreamPool::Stream *theStream;
+	
+	OSStatus result = (theNewMgr) ? theNewMgr->LoadTrack(theCrossfade->mFilePath, false, theCrossfade->mLoadAtOnce) : kSoundEngineErrPoolExhausted;
+	if (result)
 	{
-		iterator	it = upper_bound(inEffectToken);
-		insert(it, value_type (inEffectToken, *inEffect));
+		printf("%s: %d\n", "Error loading crossfade track", (int)result);
+		delete theNewMgr;
+		goto end;
 	}
-
-    SoundEngineEffect* Get(ALuint	inEffectToken) 
+	
+	pthread_mutex_lock(&sBackgroundStreams.GetLock());
+	theStream = sBackgroundStreams.GetStream(theCrossfade->mStreamID);
+	if ((theStream == NULL) || (theCrossfade->mSerial != theStream->mSerial) || sCrossfades.IsCanceled())
 	{
-        iterator	it = find(inEffectToken);
-        if (it != end())
-            return ((*it).second);
-		return (NULL);
-    }
-
-    void Remove (const	ALuint	inSourceToken) {
-        iterator 	it = find(inSourceToken);
-        if (it != end())
-            erase(it);
-    }
+		// the stream was unloaded or crossfaded again while we were loading, or the engine is torn down
+		pthread_mutex_unlock(&sBackgroundStreams.GetLock());
+		delete theNewMgr;
+		goto end;
+	}
 	
-    SoundEngineEffect* GetEffectByIndex(UInt32	inIndex) {
-        iterator	it = begin();
-
-		for (UInt32 i = 0; i < inIndex; i++) {
-            if (it != end())
-                ++it;
-            else
-                i = inIndex;
-        }
-        
-        if (it != end())
-            return ((*it).second);		
-		return (NULL);
-    }
-
-	iterator GetIterator() { return begin(); }
+	theOldMgr = theStream->mTrackMgr;
+	if (theOldMgr)
+	{
+		theNewMgr->SetVolume(theOldMgr->GetVolume());
+		if (!theOldMgr->Fade(false, theCrossfade->mFadeTime))
+			theOldMgr->SetVolume(0.0);
+	}
+	theNewMgr->Fade(true, theCrossfade->mFadeTime);
+	result = theNewMgr->Start();
+	if (result)
+		printf("%s: %d\n", "Error starting crossfade track", (int)result);
 	
-    UInt32 Size () const { return size(); }
-    bool Empty () const { return empty(); }
-};
-
-#pragma mark ***** OpenALObject *****
-//==================================================================================================
-//	OpenALObject class
-//==================================================================================================
-class OpenALObject
-{	
-	public:	
-		OpenALObject(Float32 inMixerOutputRate)
-			:	mOutputRate(inMixerOutputRate),
-				mGain(1.0),
-				mContext(NULL),
-				mDevice(NULL),
-				mEffectsMap(NULL) 
-		{
-			mEffectsMap = new SoundEngineEffectMap();
-		}
-		
-		~OpenALObject() { Teardown(); }
-
-		OSStatus Initialize()
-		{
-			OSStatus result = noErr;
-			mDevice = alcOpenDevice(NULL);
-				AssertNoOALError("Error opening output device", end)
-			if(mDevice == NULL) { return kSoundEngineErrDeviceNotFound; }
-			
-			// if a mixer output rate was specified, set it here
-			// must be done before the alcCreateContext() call
-			if (mOutputRate)
-				alcMacOSXMixerOutputRateProc(mOutputRate);
-			
-			// Create an OpenAL Context
-			mContext = alcCreateContext(mDevice, NULL);
-				AssertNoOALError("Error creating OpenAL context", end)
-			
-			alcMakeContextCurrent(mContext);
-				AssertNoOALError("Error setting current OpenAL context", end)
-			
-			alGenSources(MAX_SOURCES, mSourceID); 
-				AssertNoOALError("Error generating sources", end)
-			
-			for (int i = 0; i < MAX_SOURCES; ++i){
-				mSourcePrimed[i] = FALSE;
+	theStream->mTrackMgr = theNewMgr;
+	pthread_mutex_unlock(&sBackgroundStreams.GetLock());
+	
+	if (theOldMgr)
+	{
+		// let the fade out finish, the queue latency is well under 100 ms
+		sCrossfades.Wait(theCrossfade->mFadeTime + 0.1);
+		theOldMgr->Stop(false);
+		delete theOldMgr;
+	}
+	
+end:
+	delete theCrossfade;
+	sCrossfades.End();
+	return NULL;
+}
+
+#pragma mark ***** SoundEngineLoader *****
+//==================================================================================================
+//	SoundEngineLoader class
+//==================================================================================================
+// Loads effects and stream tracks on a thread of its own, one at a time in the order they were asked
+// for. A load is canceled up to the moment its result is committed: a pending one is dropped without
+// touching the disk, a running effect stops reading at its next slice, and whatever was loaded by then
+// is released. Completions go to the proc of the request on the loader thread, or, without a proc, to
+// a lock free queue polled by the application.
+enum {
+	kLoadKind_Effect		= 0,
+	kLoadKind_Track			= 1,
+};
+
+struct SoundEngineLoadRequest
+{
+	SoundEngineLoadID		mLoadID;
+	UInt32					mKind;
+	char					mFilePath[PATH_MAX];
+	SoundEngineStreamID		mStreamID;
+	SoundEngineBusID		mBus;
+	UInt32					mSerial;		// of the stream, a track that is superseded meanwhile is dropped
+	CFRunLoopRef			mRunLoop;
+	Boolean					mAddToQueue;
+	Boolean					mLoadAtOnce;
+	SoundEngineLoadProc		mProc;
+	void *					mUserData;
+	volatile int32_t		mCanceled;
+};
+
+class SoundEngineLoader
+{
+	public:
+		SoundEngineLoader()
+			:	mThreadState(kThreadState_None),
+				mLastLoadID(0),
+				mCurrent(NULL),
+				mCommitting(false),
+				mDraining(false)
+		{
+			pthread_mutex_init(&mLock, NULL);
+			pthread_cond_init(&mWorkCondition, NULL);
+			pthread_cond_init(&mIdleCondition, NULL);
+		}
+		
+		// takes the request over, also when it fails
+		OSStatus Submit(SoundEngineLoadRequest *inRequest, SoundEngineLoadID *outLoadID)
+		{
+			SoundEngineLock theLock(mLock);
+			if (mThreadState == kThreadState_None)
+				mThreadState = pthread_create(&mThread, NULL, ThreadEntry, this) ? kThreadState_Failed : kThreadState_Running;
+			if (mThreadState != kThreadState_Running)
+			{
+				delete inRequest;
+				return kSoundEngineErrUnitialized;
 			}
-			 
-		end:
-			return result;
+			
+			if (++mLastLoadID == 0)
+				++mLastLoadID;
+			inRequest->mLoadID = mLastLoadID;
+			inRequest->mCanceled = 0;
+			mPending.push_back(inRequest);
+			pthread_cond_signal(&mWorkCondition);
+			*outLoadID = inRequest->mLoadID;
+			return noErr;
 		}
 		
-		void Teardown()
+		// kSoundEngineErrInvalidID once the load is done or committing, it then completes as it would have
+		OSStatus Cancel(SoundEngineLoadID inLoadID)
 		{
-			if (mEffectsMap) {
-				// [FIXED] In old FOR loop, Remove() will decrease Size(), but variable i will increase whenever
-				while (mEffectsMap->Size()){
-					SoundEngineEffect *theEffect = mEffectsMap->GetEffectByIndex(0);
-					if (theEffect){
-						mEffectsMap->Remove(theEffect->GetEffectID());
-						delete theEffect;
-					}
+			SoundEngineLock theLock(mLock);
+			for (UInt32 i = 0; i < mPending.size(); ++i)
+			{
+				if (mPending[i]->mLoadID == inLoadID)
+				{
+					mPending[i]->mCanceled = 1;
+					return noErr;
 				}
-				delete mEffectsMap;
 			}
-			
-			// [FIXED] alGenSources() created sources should be deleted.
-			alDeleteSources(MAX_SOURCES, mSourceID);
-			
-			if (mContext){
-				alcMakeContextCurrent(NULL);
-				alcDestroyContext(mContext);
+			if (mCurrent && (mCurrent->mLoadID == inLoadID) && !mCommitting)
+			{
+				mCurrent->mCanceled = 1;
+				return noErr;
 			}
-			
-			if (mDevice) alcCloseDevice(mDevice);
+			return kSoundEngineErrInvalidID;
 		}
-
-		OSStatus SetListenerPosition(Float32 inX, Float32 inY, Float32 inZ)
+		
+		// cancels everything and waits until every load has completed, before the engine is torn down
+		void CancelAll()
 		{
-			alListener3f(AL_POSITION, inX, inY, inZ);
-			return alGetError();
+			SoundEngineLock theLock(mLock);
+			for (UInt32 i = 0; i < mPending.size(); ++i)
+				mPending[i]->mCanceled = 1;
+			if (mCurrent && !mCommitting)
+				mCurrent->mCanceled = 1;
+			mDraining = true;
+			while (mCurrent || !mPending.empty())
+				pthread_cond_wait(&mIdleCondition, &mLock);
+			mDraining = false;
 		}
-
-		OSStatus SetListenerGain(Float32 inValue)
+		
+		// Cancels everything and joins the thread, the next load starts a new one.
+		void Stop()
+		{
+			CancelAll();
+			pthread_mutex_lock(&mLock);
+			if (mThreadState != kThreadState_Running)
+			{
+				pthread_mutex_unlock(&mLock);
+				return;
+			}
+			mThreadState = kThreadState_Stopping;
+			pthread_cond_signal(&mWorkCondition);
+			pthread_mutex_unlock(&mLock);
+			
+			pthread_join(mThread, NULL);
+			
+			SoundEngineLock theLock(mLock);
+			mThreadState = kThreadState_None;
+		}
+		
+		// single consumer
+		Boolean PopEvent(SoundEngineLoadEvent &outEvent) { return mEvents.Pop(outEvent); }
+		
+	private:
+		enum {
+			kThreadState_None		= 0,
+			kThreadState_Running	= 1,
+			kThreadState_Failed		= 2,
+			kThreadState_Stopping	= 3,	// loads are refused until the thread is joined
+		};
+		
+		static OSStatus LoadEffect(SoundEngineLoadRequest *inRequest, UInt32 *outEffectID)
 		{
-			alListenerf(AL_GAIN, inValue);
-			return alGetError();
+			return (sOpenALObject) ? sOpenALObject->LoadEffect(inRequest->mFilePath, outEffectID, &inRequest->mCanceled) : kSoundEngineErrUnitialized;
 		}
 		
-		OSStatus SetMaxDistance(Float32 inValue)
+		// a track that replaces the one of its stream is loaded into a track manager of its own, without
+		// the lock of the streams, and swapped in by CommitTrack
+		static OSStatus LoadTrack(SoundEngineLoadRequest *inRequest, BackgroundTrackMgr **outTrackMgr)
 		{
-			OSStatus result = 0;
-			for (UInt32 i=0; i < MAX_SOURCES; i++)
+			*outTrackMgr = NULL;
+			if (inRequest->mAddToQueue)
+				return noErr;
+			
+			BackgroundTrackMgr *theTrackMgr = new BackgroundTrackMgr(inRequest->mBus, inRequest->mRunLoop);
+			if (theTrackMgr == NULL)
+				return kSoundEngineErrPoolExhausted;
+			OSStatus result = theTrackMgr->LoadTrack(inRequest->mFilePath, false, inRequest->mLoadAtOnce);
+			if (result)
 			{
-				alSourcef(mSourceID[i], AL_MAX_DISTANCE, inValue);
-
-				if ((result = alGetError()) != AL_NO_ERROR)
-					return result;
+				delete theTrackMgr;
+				return result;
 			}
-			return result;			
+			*outTrackMgr = theTrackMgr;
+			return noErr;
 		}
-
-	
-		OSStatus SetReferenceDistance(Float32 inValue)
+		
+		static OSStatus CommitTrack(SoundEngineLoadRequest *inRequest, BackgroundTrackMgr *inTrackMgr)
 		{
-			OSStatus result = 0;
-			for (UInt32 i=0; i < MAX_SOURCES; i++)
+			BackgroundTrackMgr *theOldMgr = NULL;
+			OSStatus result = noErr;
 			{
-				alSourcef(mSourceID[i], AL_REFERENCE_DISTANCE, inValue);
-				
-				if ((result = alGetError()) != AL_NO_ERROR)
-					return result;
+				SoundEngineLock theLock(sBackgroundStreams.GetLock());
+				BackgroundStreamPool::Stream *theStream = sBackgroundStreams.GetStream(inRequest->mStreamID);
+				if ((theStream == NULL) || (theStream->mSerial != inRequest->mSerial))
+					result = kSoundEngineErrCanceled;
+				else if (inTrackMgr)
+				{
+					// the new track keeps the volume of the stream, and plays on if the old one was playing
+					theOldMgr = theStream->mTrackMgr;
+					if (theOldMgr)
+					{
+						inTrackMgr->SetVolume(theOldMgr->GetVolume());
+						if (theOldMgr->IsPlaying())
+						{
+							theOldMgr->Stop(false);
+							result = inTrackMgr->Start();
+						}
+					}
+					theStream->mTrackMgr = inTrackMgr;
+					inTrackMgr = NULL;
+				}
+				else
+				{
+					// a file added to the playlist is only opened for its format, as LoadTrack does
+					if (theStream->mTrackMgr == NULL)
+						theStream->mTrackMgr = new BackgroundTrackMgr(theStream->mBus, inRequest->mRunLoop);
+					result = (theStream->mTrackMgr) ? theStream->mTrackMgr->LoadTrack(inRequest->mFilePath, true, inRequest->mLoadAtOnce) : kSoundEngineErrPoolExhausted;
+				}
 			}
-			return result;		
+			delete inTrackMgr;
+			delete theOldMgr;
+			return result;
 		}
-
-	
-		OSStatus SetEffectsVolume(Float32 inValue)
+		
+		void Deliver(SoundEngineLoadRequest *inRequest, const SoundEngineLoadEvent &inEvent)
 		{
-			OSStatus result = 0;
-			for (UInt32 i=0; i < MAX_SOURCES; i++)
+			if (inRequest->mProc)
 			{
-				alSourcef(mSourceID[i], AL_GAIN, inValue * gMasterVolumeGain);
-				
-				if ((result = alGetError()) != AL_NO_ERROR)
-					return result;
+				inRequest->mProc(inRequest->mUserData, &inEvent);
+				return;
 			}
-			return result;		
+			// the queue only fills up when nobody polls it, the loads wait for room rather than lose an 
+			// effect; while the engine is torn down nobody will
+			while (!mEvents.Push(inEvent) && !mDraining)
+				usleep(1000);
 		}
 		
-	
-		OSStatus UpdateGain()
+		static void *ThreadEntry(void *inLoader)
 		{
-			return SetEffectsVolume(mGain);
+			((SoundEngineLoader*)inLoader)->Run();
+			return NULL;
 		}
-						
-		OSStatus LoadEffect(const char *inFilePath, UInt32 *outEffectID)
+		
+		void Run()
 		{
-			SoundEngineEffect *theEffect = new SoundEngineEffect(inFilePath);
-			OSStatus result = theEffect->initialize();
-			if (result == noErr)
+			pthread_mutex_lock(&mLock);
+			while (true)
 			{
-				*outEffectID = theEffect->GetEffectID();
-				mEffectsMap->Add(*outEffectID, &theEffect);
+				while (mPending.empty() && (mThreadState == kThreadState_Running))
+					pthread_cond_wait(&mWorkCondition, &mLock);
+				if (mPending.empty())
+					break;
+				SoundEngineLoadRequest *theRequest = mPending.front();
+				mPending.erase(mPending.begin());
+				mCurrent = theRequest;
+				pthread_mutex_unlock(&mLock);
+				
+				SoundEngineLoadEvent theEvent;
+				theEvent.mLoadID = theRequest->mLoadID;
+				theEvent.mResult = kSoundEngineErrCanceled;
+				theEvent.mEffectID = 0;
+				BackgroundTrackMgr *theTrackMgr = NULL;
+				if (!theRequest->mCanceled)
+					theEvent.mResult = (theRequest->mKind == kLoadKind_Effect) ? LoadEffect(theRequest, &theEvent.mEffectID) : LoadTrack(theRequest, &theTrackMgr);
+				
+				// past this point the load can not be canceled anymore
+				pthread_mutex_lock(&mLock);
+				Boolean isCanceled = theRequest->mCanceled;
+				mCommitting = true;
+				pthread_mutex_unlock(&mLock);
+				
+				if (isCanceled)
+				{
+					if ((theEvent.mResult == noErr) && (theRequest->mKind == kLoadKind_Effect) && sOpenALObject)
+						sOpenALObject->UnloadEffect(theEvent.mEffectID);
+					delete theTrackMgr;
+					theEvent.mResult = kSoundEngineErrCanceled;
+					theEvent.mEffectID = 0;
+				}
+				else if ((theEvent.mResult == noErr) && (theRequest->mKind == kLoadKind_Track))
+					theEvent.mResult = CommitTrack(theRequest, theTrackMgr);
+				
+				Deliver(theRequest, theEvent);
+				delete theRequest;
+				
+				pthread_mutex_lock(&mLock);
+				mCurrent = NULL;
+				mCommitting = false;
+				pthread_cond_broadcast(&mIdleCondition);
 			}
-			return result;
+			pthread_mutex_unlock(&mLock);
 		}
-				
-		OSStatus UnloadEffect(UInt32 inEffectID)
+		
+		pthread_mutex_t							mLock;
+		pthread_cond_t							mWorkCondition;
+		pthread_cond_t							mIdleCondition;
+		pthread_t								mThread;
+		UInt32									mThreadState;
+		SoundEngineLoadID						mLastLoadID;
+		std::vector<SoundEngineLoadRequest*>	mPending;
+		SoundEngineLoadRequest *				mCurrent;
+		Boolean									mCommitting;
+		volatile Boolean						mDraining;
+		SoundEngineCommandQueue<SoundEngineLoadEvent, kLoadEventSlots>	mEvents;
+};
+
+static SoundEngineLoader	sLoader;
+
+static SoundEngineLoadRequest *NewLoadRequest(UInt32 inKind, const char* inPath, SoundEngineLoadProc inProc, void *inUserData)
+{
+	if (strlen(inPath) >= PATH_MAX)
+		return NULL;
+	SoundEngineLoadRequest *theRequest = new SoundEngineLoadRequest;
+	memset(theRequest, 0, sizeof(SoundEngineLoadRequest));
+	theRequest->mKind = inKind;
+	strcpy(theRequest->mFilePath, inPath);
+	theRequest->mProc = inProc;
+	theRequest->mUserData = inUserData;
+	return theRequest;
+}
+
+#pragma mark ***** API *****
+//==================================================================================================
+//	Sound Engine
+//==================================================================================================
+
+extern "C"
+OSStatus  SoundEngine_Initialize(Float32 inMixerOutputRate)
+{
+	// Initialized already: a new output rate, or the end of an interruption. Only the context is
+	// rebuilt, effects and streams are kept. A full initialization is the fallback.
+	if (sOpenALObject && (sOpenALObject->Reinitialize(inMixerOutputRate) == noErr))
+	{
 		{
-			// [FIXED] SoundEngineEffect should be deleted before remove from the map
-			SoundEngineEffect *theEffect = mEffectsMap->Get(inEffectID);
-			if (theEffect){
-				delete theEffect;
-			}
-			mEffectsMap->Remove(inEffectID);
-			return 0;
+			SoundEngineLock theLock(sBackgroundStreams.GetLock());
+			sBackgroundStreams.RestartAll();
+		}
+		// a deferred engine opens its device now
+		return sOpenALObject->Initialize();
+	}
+	
+	// as in SoundEngine_Teardown, no load may be running into the engine that is deleted
+	sLoader.CancelAll();
+	if (sOpenALObject)
+		delete sOpenALObject;
+
+	{
+		SoundEngineLock theLock(sBackgroundStreams.GetLock());
+		sBackgroundStreams.UnloadAll();
+	}
+
+	sOpenALObject = new OpenALObject(inMixerOutputRate);	
+	
+	return sOpenALObject->Initialize();
+	
+}
+
+extern "C"
+OSStatus  SoundEngine_InitializeDeferred(Float32 inMixerOutputRate)
+{
+	if (sOpenALObject)
+		return sOpenALObject->Reinitialize(inMixerOutputRate);
+	
+	sOpenALObject = new OpenALObject(inMixerOutputRate);
+	return noErr;
+}
+
+extern "C"
+OSStatus  SoundEngine_GetStartupTime(UInt32 inPhase, Float64 *outSeconds)
+{
+	return (sOpenALObject) ? sOpenALObject->GetStartupTime(inPhase, outSeconds) : kSoundEngineErrUnitialized;
+}
+
+extern "C"
+OSStatus  SoundEngine_Teardown()
+{
+	// no load or crossfade may be running into what is torn down, the pending ones complete as canceled first
+	sLoader.Stop();
+	sCrossfades.CancelAll();
+	
+	if (sOpenALObject)
+	{
+		delete sOpenALObject;
+		sOpenALObject = NULL;
+	}
+	
+	{
+		SoundEngineLock theLock(sBackgroundStreams.GetLock());
+		sBackgroundStreams.DestroyAll();
+	}
+	
+	// after the streams, nothing is left to refill or to read for
+	sRefillThread.Stop();
+	sIOScheduler.Stop();
+	
+	return 0; 
+}
+
+extern "C"
+OSStatus  SoundEngine_SetMasterVolume(int slot, Float32 inValue)
+{
+	return SoundEngine_SetBusVolume(kSoundEngineBus_Master, inValue);
+}
+
+extern "C"
+OSStatus  SoundEngine_CreateBus(SoundEngineBusID inParent, SoundEngineBusID *outBus)
+{
+	return sBusGraph.CreateBus(inParent, outBus);
+}
+
+extern "C"
+OSStatus  SoundEngine_SetBusVolume(SoundEngineBusID inBus, Float32 inValue)
+{
+	OSStatus result = sBusGraph.SetVolume(inBus, inValue);
+	if (result) return result;
+	
+	SoundEngineBusID theCategory = sBusGraph.GetCategory(inBus);
+	if ((theCategory == kSoundEngineBus_Master) || (theCategory == kSoundEngineBus_Music))
+	{
+		SoundEngineLock theLock(sBackgroundStreams.GetLock());
+		for (UInt32 i = 0; i < sBackgroundStreams.GetNumStreams(); ++i) {
+			BackgroundTrackMgr *theTrackMgr = sBackgroundStreams.GetTrackMgrAtIndex(i);
+			if (theTrackMgr && (result = theTrackMgr->UpdateGain()))
+				return result;
 		}
+	}
+	
+	if (sOpenALObject && ((theCategory == kSoundEngineBus_Master) || (theCategory == kSoundEngineBus_Effects)))
+		result = sOpenALObject->UpdateBusGain(inBus);
+	
+	return result;
+}
+
+extern "C"
+OSStatus  SoundEngine_SetBusFilter(SoundEngineBusID inBus, UInt32 inSection, UInt32 inType, Float32 inFrequency, Float32 inQ, Float32 inGainDB)
+{
+	if (!sBusGraph.IsValid(inBus) || (sBusGraph.GetCategory(inBus) != kSoundEngineBus_Music))
+		return kSoundEngineErrInvalidID;
+	
+	OSStatus result = sBusGraph.SetFilter(inBus, inSection, inType, inFrequency, inQ, inGainDB);
+	if (result) return result;
+	
+	SoundEngineLock theLock(sBackgroundStreams.GetLock());
+	for (UInt32 i = 0; i < sBackgroundStreams.GetNumStreams(); ++i) {
+		BackgroundTrackMgr *theTrackMgr = sBackgroundStreams.GetTrackMgrAtIndex(i);
+		if (theTrackMgr)
+			theTrackMgr->UpdateDSP();
+	}
+	return noErr;
+}
+
+extern "C"
+OSStatus  SoundEngine_SetBusLowPass(SoundEngineBusID inBus, Float32 inCutoff)
+{
+	if (!sBusGraph.IsValid(inBus) || (sBusGraph.GetCategory(inBus) != kSoundEngineBus_Music))
+		return kSoundEngineErrInvalidID;
+	
+	OSStatus result = sBusGraph.SetLowPass(inBus, inCutoff);
+	if (result) return result;
+	
+	SoundEngineLock theLock(sBackgroundStreams.GetLock());
+	for (UInt32 i = 0; i < sBackgroundStreams.GetNumStreams(); ++i) {
+		BackgroundTrackMgr *theTrackMgr = sBackgroundStreams.GetTrackMgrAtIndex(i);
+		if (theTrackMgr)
+			theTrackMgr->UpdateDSP();
+	}
+	return noErr;
+}
+
+extern "C"
+OSStatus  SoundEngine_SetProfilingEnabled(Boolean inEnabled)
+{
+	sProfiler.SetEnabled(inEnabled);
+	return noErr;
+}
+
+extern "C"
+OSStatus  SoundEngine_GetProfile(UInt32 inMetric, SoundEngineProfile *outProfile)
+{
+	return sProfiler.Get(inMetric, outProfile);
+}
+
+extern "C"
+OSStatus  SoundEngine_GetBusProfile(SoundEngineBusID inBus, SoundEngineProfile *outProfile)
+{
+	if (!sBusGraph.IsValid(inBus))
+		return kSoundEngineErrInvalidID;
+	return sProfiler.GetBus(inBus, outProfile);
+}
+
+extern "C"
+OSStatus  SoundEngine_ResetProfile()
+{
+	sProfiler.Reset();
+	sIOScheduler.ResetQueueDepth();
+	sRealtimeGuard.Reset();
+	return noErr;
+}
+
+extern "C"
+OSStatus  SoundEngine_GetReadQueueDepth(UInt32 *outDepth, UInt32 *outMaxDepth)
+{
+	sIOScheduler.GetQueueDepth(outDepth, outMaxDepth);
+	return noErr;
+}
+
+extern "C"
+OSStatus  SoundEngine_SetRealtimeCheck(UInt32 inMode)
+{
+	if (inMode > kSoundEngineRealtimeCheck_Report)
+		return kSoundEngineErrInvalidID;
+	sRealtimeGuard.SetMode(inMode);
+	return noErr;
+}
+
+extern "C"
+OSStatus  SoundEngine_GetRealtimeViolations(UInt32 inKind, UInt32 *outCount)
+{
+	return sRealtimeGuard.GetViolations(inKind, outCount);
+}
+
+extern "C"
+OSStatus  SoundEngine_AddDucking(SoundEngineBusID inKeyBus, SoundEngineBusID inTargetBus, Float32 inThreshold, Float32 inDepthDB, Float32 inAttackMs, Float32 inReleaseMs, UInt32 *outDuckingID)
+{
+	if (!sBusGraph.IsValid(inTargetBus) || (sBusGraph.GetCategory(inTargetBus) != kSoundEngineBus_Music))
+		return kSoundEngineErrInvalidID;
+	return sBusGraph.AddDucking(inKeyBus, inTargetBus, inThreshold, inDepthDB, inAttackMs, inReleaseMs, outDuckingID);
+}
+
+extern "C"
+OSStatus  SoundEngine_RemoveDucking(UInt32 inDuckingID)
+{
+	return sBusGraph.RemoveDucking(inDuckingID);
+}
+
+extern "C"
+OSStatus  SoundEngine_SetBusActivity(SoundEngineBusID inBus, Float32 inLevel)
+{
+	// effects activity is measured by the engine itself
+	if (!sBusGraph.IsValid(inBus) || (sBusGraph.GetCategory(inBus) == kSoundEngineBus_Effects))
+		return kSoundEngineErrInvalidID;
+	sBusGraph.SetActivity(inBus, inLevel);
+	return noErr;
+}
 
+extern "C"
+OSStatus  SoundEngine_SetBusMetering(Boolean inEnable)
+{
+	sMeters.SetBusMetering(inEnable);
+	return noErr;
+}
 
-		OSStatus PrimeEffect(UInt32 inEffectID, ALuint *sourceID)
-		{
-// JM hack!
-// Usar el recurso que esté libre, nada de el primero que esté libre o parado (código original)
-            for (int i = 0; i < MAX_SOURCES; ++i){
-				if (! mSourcePrimed[i]){
-					mSourcePrimed[i] = TRUE;
-					alSourcei(mSourceID[i], AL_BUFFER, inEffectID);
-					*sourceID = mSourceID[i];
-					return alGetError();
-				}
-            }
-
-/*            
-			// Locate an available source.  We consider a source available if it is either not primed or is in the stoppped state
-			for (int i = 0; i < MAX_SOURCES; ++i){
-				if (! mSourcePrimed[i]){
-					mSourcePrimed[i] = TRUE;
-					alSourcei(mSourceID[i], AL_BUFFER, inEffectID);
-					*sourceID = mSourceID[i];
-					return alGetError();
-				}
-				
-				ALint sourceState;
-				alGetSourcei(mSourceID[i], AL_SOURCE_STATE, &sourceState);
-				if (sourceState == AL_STOPPED){
-					alSourcei(mSourceID[i], AL_BUFFER, inEffectID);
-					*sourceID = mSourceID[i];
-					return 0;
-				}
-			}
-*/
-				
+extern "C"
+OSStatus  SoundEngine_GetBusMeter(SoundEngineBusID inBus, Float32 *outPeak, Float32 *outRMS)
+{
+	if (!sBusGraph.IsValid(inBus))
+		return kSoundEngineErrInvalidID;
+	sMeters.ReadBus(inBus, outPeak, outRMS);
+	return noErr;
+}
 
-			// If we fell through the loop, then no available sources
-			return kSoundEngineErrNoSourcesAvailable;
-		}
-	
+extern "C"
+OSStatus  SoundEngine_GetBusVolume(SoundEngineBusID inBus, Float32 *outValue)
+{
+	if (!sBusGraph.IsValid(inBus))
+		return kSoundEngineErrInvalidID;
+	*outValue = sBusGraph.GetVolume(inBus);
+	return noErr;
+}
 
-		OSStatus StartEffect(ALuint sourceID)
-		{
-			alSourcePlay(sourceID);
-			return alGetError();
-		}
-	
-	
-		OSStatus StopEffect(ALuint sourceID)
-		{
-			alSourceStop(sourceID);
-			return alGetError();
-		}
-		
-		OSStatus SetEffectPitch(ALuint sourceID, Float32 inValue)
-		{
-			alSourcef(sourceID, AL_PITCH, inValue);
-			return alGetError();
-		}
+extern "C"
+OSStatus  SoundEngine_SetListenerPosition(Float32 inX, Float32 inY, Float32 inZ)
+{	
+	return (sOpenALObject) ? sOpenALObject->SetListenerPosition(inX, inY, inZ) : kSoundEngineErrUnitialized;
+}
 
-		OSStatus SetEffectVolume(ALuint sourceID, Float32 inValue)
-		{
-			alSourcef(sourceID, AL_GAIN, inValue * gMasterVolumeGain);
-			return alGetError();
-		}
-				
-		OSStatus	SetEffectPosition(ALuint sourceID, Float32 inX, Float32 inY, Float32 inZ)	
-		{
-			alSource3f(sourceID, AL_POSITION, inX, inY, inZ);
-			return alGetError();
-		}
-				
-	private:
-		Float32									mOutputRate;
-		Float32									mGain;
-		ALCcontext*								mContext;
-		ALCdevice*								mDevice;
-		SoundEngineEffectMap*					mEffectsMap;
-		ALuint									mSourceID[MAX_SOURCES];
-		bool									mSourcePrimed[MAX_SOURCES];
-};
+extern "C"
+OSStatus  SoundEngine_SetListenerGain(Float32 inValue)
+{
+	return (sOpenALObject) ? sOpenALObject->SetListenerGain(inValue) : kSoundEngineErrUnitialized;
+}
 
-#pragma mark ***** API *****
-//==================================================================================================
-//	Sound Engine
-//==================================================================================================
+// streams play music, or speech read from a narration file
+static Boolean IsStreamBus(SoundEngineBusID inBus)
+{
+	if (!sBusGraph.IsValid(inBus))
+		return false;
+	SoundEngineBusID theCategory = sBusGraph.GetCategory(inBus);
+	return (theCategory == kSoundEngineBus_Music) || (theCategory == kSoundEngineBus_Speech);
+}
 
 extern "C"
-OSStatus  SoundEngine_Initialize(Float32 inMixerOutputRate)
+OSStatus  SoundEngine_CreateStream(SoundEngineBusID inBus, SoundEngineStreamID *outStreamID)
 {
-	if (sOpenALObject)
-		delete sOpenALObject;
+	if (!IsStreamBus(inBus))
+		return kSoundEngineErrInvalidID;
+	
+	SoundEngineLock theLock(sBackgroundStreams.GetLock());
+	return sBackgroundStreams.CreateStream(inBus, outStreamID);
+}
 
-	for (int i = 0; i < kBackgroundMusicSlots; ++i) {
-		if (sBackgroundTrackMgr[i]) {
-			delete sBackgroundTrackMgr[i];
-			sBackgroundTrackMgr[i] = NULL;
-		}
-	}
+extern "C"
+OSStatus  SoundEngine_DestroyStream(SoundEngineStreamID inStreamID)
+{
+	SoundEngineLock theLock(sBackgroundStreams.GetLock());
+	return sBackgroundStreams.DestroyStream(inStreamID);
+}
 
-	sOpenALObject = new OpenALObject(inMixerOutputRate);	
-	for (int i = 0; i < kBackgroundMusicSlots; ++i)
-		sBackgroundTrackMgr[i] = new BackgroundTrackMgr();
-	
-	return sOpenALObject->Initialize();
+extern "C"
+OSStatus  SoundEngine_LoadStreamTrack(SoundEngineStreamID inStreamID, const char* inPath, Boolean inAddToQueue, Boolean inLoadAtOnce)
+{
+	SoundEngineLock theLock(sBackgroundStreams.GetLock());
+	BackgroundStreamPool::Stream *theStream = sBackgroundStreams.GetStream(inStreamID);
+	if (theStream == NULL)
+		return kSoundEngineErrInvalidID;
 	
+	if (theStream->mTrackMgr == NULL)
+		theStream->mTrackMgr = new BackgroundTrackMgr(theStream->mBus);
+	if (theStream->mTrackMgr == NULL)
+		return kSoundEngineErrPoolExhausted;
+	return theStream->mTrackMgr->LoadTrack(inPath, inAddToQueue, inLoadAtOnce);
 }
 
 extern "C"
-OSStatus  SoundEngine_Teardown()
+OSStatus  SoundEngine_LoadStreamTrackAsync(SoundEngineStreamID inStreamID, const char* inPath, Boolean inAddToQueue, Boolean inLoadAtOnce, 
+												SoundEngineLoadProc inProc, void *inUserData, SoundEngineLoadID *outLoadID)
 {
-	if (sOpenALObject)
+	SoundEngineLoadRequest *theRequest = NewLoadRequest(kLoadKind_Track, inPath, inProc, inUserData);
+	if (theRequest == NULL)
+		return kSoundEngineErrFileNotFound;
+	theRequest->mStreamID = inStreamID;
+	theRequest->mAddToQueue = inAddToQueue;
+	theRequest->mLoadAtOnce = inLoadAtOnce;
+	theRequest->mRunLoop = CFRunLoopGetCurrent();
 	{
-		delete sOpenALObject;
-		sOpenALObject = NULL;
+		SoundEngineLock theLock(sBackgroundStreams.GetLock());
+		BackgroundStreamPool::Stream *theStream = sBackgroundStreams.GetStream(inStreamID);
+		if (theStream == NULL)
+		{
+			delete theRequest;
+			return kSoundEngineErrInvalidID;
+		}
+		theRequest->mBus = theStream->mBus;
+		// a track that replaces the current one cancels a crossfade still loading for the stream
+		theRequest->mSerial = (inAddToQueue) ? theStream->mSerial : ++theStream->mSerial;
 	}
+	return sLoader.Submit(theRequest, outLoadID);
+}
+
+extern "C"
+OSStatus  SoundEngine_LoadStreamMappedTrack(SoundEngineStreamID inStreamID, const char* inPath)
+{
+	SoundEngineLock theLock(sBackgroundStreams.GetLock());
+	BackgroundStreamPool::Stream *theStream = sBackgroundStreams.GetStream(inStreamID);
+	if (theStream == NULL)
+		return kSoundEngineErrInvalidID;
 	
-	for (int i = 0; i < kBackgroundMusicSlots; ++i) {
-		if (sBackgroundTrackMgr[i])
-			delete sBackgroundTrackMgr[i];
-	}
+	if (theStream->mTrackMgr == NULL)
+		theStream->mTrackMgr = new BackgroundTrackMgr(theStream->mBus);
+	if (theStream->mTrackMgr == NULL)
+		return kSoundEngineErrPoolExhausted;
+	return theStream->mTrackMgr->LoadTrack(inPath, false, false, true);
+}
+
+extern "C"
+OSStatus  SoundEngine_SetDecodeCacheDirectory(const char* inPath)
+{
+	return sDecodeCache.SetDirectory(inPath);
+}
+
+extern "C"
+OSStatus  SoundEngine_PlayStreamRegion(SoundEngineStreamID inStreamID, Float64 inStart, Float64 inLength)
+{
+	SoundEngineLock theLock(sBackgroundStreams.GetLock());
+	BackgroundTrackMgr *theTrackMgr = sBackgroundStreams.GetTrackMgr(inStreamID);
+	return (theTrackMgr) ? theTrackMgr->PlayRegion(inStart, inLength) : kSoundEngineErrUnitialized;
+}
+
+extern "C"
+OSStatus  SoundEngine_CrossfadeStreamTrack(SoundEngineStreamID inStreamID, const char* inPath, Boolean inLoadAtOnce, Float32 inFadeTime)
+{
+	if (strlen(inPath) >= PATH_MAX)
+		return kSoundEngineErrFileNotFound;
 	
-	for (int i = 0; i < kBackgroundMusicSlots; ++i) {
-		if (sBackgroundTrackMgr[i]) {
-			delete sBackgroundTrackMgr[i];
-			sBackgroundTrackMgr[i] = NULL;
+	BackgroundCrossfade *theCrossfade = new BackgroundCrossfade;
+	if (theCrossfade == NULL)
+		return kSoundEngineErrPoolExhausted;
+	theCrossfade->mStreamID = inStreamID;
+	theCrossfade->mFadeTime = (inFadeTime > 0.0) ? inFadeTime : 0.0;
+	theCrossfade->mLoadAtOnce = inLoadAtOnce;
+	theCrossfade->mRunLoop = CFRunLoopGetCurrent();
+	{
+		SoundEngineLock theLock(sBackgroundStreams.GetLock());
+		BackgroundStreamPool::Stream *theStream = sBackgroundStreams.GetStream(inStreamID);
+		if (theStream == NULL)
+		{
+			delete theCrossfade;
+			return kSoundEngineErrInvalidID;
 		}
+		theCrossfade->mBus = theStream->mBus;
+		theCrossfade->mSerial = ++theStream->mSerial;
+	}
+	strcpy(theCrossfade->mFilePath, inPath);
+	if (!sCrossfades.Begin())
+	{
+		delete theCrossfade;
+		return kSoundEngineErrUnitialized;
 	}
 	
-	return 0; 
+	pthread_t theThread;
+	pthread_attr_t theAttributes;
+	pthread_attr_init(&theAttributes);
+	pthread_attr_setdetachstate(&theAttributes, PTHREAD_CREATE_DETACHED);
+	int theError = pthread_create(&theThread, &theAttributes, BackgroundCrossfadeThreadEntry, theCrossfade);
+	pthread_attr_destroy(&theAttributes);
+	if (theError)
+	{
+		delete theCrossfade;
+		sCrossfades.End();
+		return kSoundEngineErrUnitialized;
+	}
+	return noErr;
 }
 
 extern "C"
-OSStatus  SoundEngine_SetMasterVolume(int slot, Float32 inValue)
+OSStatus  SoundEngine_SetStreamBus(SoundEngineStreamID inStreamID, SoundEngineBusID inBus)
 {
-	OSStatus result = noErr;
-	gMasterVolumeGain = inValue;
-	if (sBackgroundTrackMgr[slot])
-		result = sBackgroundTrackMgr[slot]->UpdateGain();
+	if (!IsStreamBus(inBus))
+		return kSoundEngineErrInvalidID;
 	
-	if (result) return result;
-		
-	if (sOpenALObject) 
-		return sOpenALObject->UpdateGain();
+	SoundEngineLock theLock(sBackgroundStreams.GetLock());
+	BackgroundStreamPool::Stream *theStream = sBackgroundStreams.GetStream(inStreamID);
+	if (theStream == NULL)
+		return kSoundEngineErrInvalidID;
 	
-	return result;
+	theStream->mBus = inBus;
+	return (theStream->mTrackMgr) ? theStream->mTrackMgr->SetBus(inBus) : noErr;
 }
 
 extern "C"
-OSStatus  SoundEngine_SetListenerPosition(Float32 inX, Float32 inY, Float32 inZ)
-{	
-	return (sOpenALObject) ? sOpenALObject->SetListenerPosition(inX, inY, inZ) : kSoundEngineErrUnitialized;
+OSStatus  SoundEngine_UnloadStreamTrack(SoundEngineStreamID inStreamID)
+{
+	SoundEngineLock theLock(sBackgroundStreams.GetLock());
+	BackgroundStreamPool::Stream *theStream = sBackgroundStreams.GetStream(inStreamID);
+	if (theStream == NULL)
+		return kSoundEngineErrInvalidID;
+	
+	sBackgroundStreams.Unload(theStream);
+	return 0;
 }
 
 extern "C"
-OSStatus  SoundEngine_SetListenerGain(Float32 inValue)
+OSStatus  SoundEngine_StartStream(SoundEngineStreamID inStreamID)
 {
-	return (sOpenALObject) ? sOpenALObject->SetListenerGain(inValue) : kSoundEngineErrUnitialized;
+	SoundEngineLock theLock(sBackgroundStreams.GetLock());
+	BackgroundTrackMgr *theTrackMgr = sBackgroundStreams.GetTrackMgr(inStreamID);
+	return (theTrackMgr) ? theTrackMgr->Start() : kSoundEngineErrUnitialized;
+}
+
+extern "C"
+OSStatus  SoundEngine_StopStream(SoundEngineStreamID inStreamID, Boolean stopAtEnd)
+{
+	SoundEngineLock theLock(sBackgroundStreams.GetLock());
+	BackgroundTrackMgr *theTrackMgr = sBackgroundStreams.GetTrackMgr(inStreamID);
+	return (theTrackMgr) ? theTrackMgr->Stop(stopAtEnd) : kSoundEngineErrUnitialized;
+}
+
+extern "C"
+OSStatus  SoundEngine_PauseStream(SoundEngineStreamID inStreamID)
+{
+	SoundEngineLock theLock(sBackgroundStreams.GetLock());
+	BackgroundTrackMgr *theTrackMgr = sBackgroundStreams.GetTrackMgr(inStreamID);
+	return (theTrackMgr) ? theTrackMgr->Pause() : kSoundEngineErrUnitialized;
+}
+
+extern "C"
+OSStatus  SoundEngine_ResumeStream(SoundEngineStreamID inStreamID)
+{
+	SoundEngineLock theLock(sBackgroundStreams.GetLock());
+	BackgroundTrackMgr *theTrackMgr = sBackgroundStreams.GetTrackMgr(inStreamID);
+	return (theTrackMgr) ? theTrackMgr->Resume() : kSoundEngineErrUnitialized;
+}
+
+extern "C"
+OSStatus  SoundEngine_SetStreamLoopPoints(SoundEngineStreamID inStreamID, UInt32 inLoopStart, UInt32 inLoopEnd)
+{
+	SoundEngineLock theLock(sBackgroundStreams.GetLock());
+	BackgroundTrackMgr *theTrackMgr = sBackgroundStreams.GetTrackMgr(inStreamID);
+	return (theTrackMgr) ? theTrackMgr->SetLoopPoints(inLoopStart, inLoopEnd) : kSoundEngineErrUnitialized;
+}
+
+extern "C"
+OSStatus  SoundEngine_SetStreamVolume(SoundEngineStreamID inStreamID, Float32 inValue)
+{
+	SoundEngineLock theLock(sBackgroundStreams.GetLock());
+	BackgroundTrackMgr *theTrackMgr = sBackgroundStreams.GetTrackMgr(inStreamID);
+	return (theTrackMgr) ? theTrackMgr->SetVolume(inValue) : kSoundEngineErrUnitialized;
+}
+
+static SoundEngineStreamID GetBackgroundMusicStream(int slot)
+{
+	SoundEngineLock theLock(sBackgroundStreams.GetLock());
+	return sBackgroundStreams.GetSlotStream(slot);
 }
 
 extern "C"
 OSStatus  SoundEngine_LoadBackgroundMusicTrack(int slot, const char* inPath, Boolean inAddToQueue, Boolean inLoadAtOnce)
 {
-	if (sBackgroundTrackMgr[slot] == NULL)
-		sBackgroundTrackMgr[slot] = new BackgroundTrackMgr();
-	return sBackgroundTrackMgr[slot]->LoadTrack(inPath, inAddToQueue, inLoadAtOnce);
+	return SoundEngine_LoadStreamTrack(GetBackgroundMusicStream(slot), inPath, inAddToQueue, inLoadAtOnce);
+}
+
+extern "C"
+OSStatus  SoundEngine_LoadBackgroundMusicTrackAsync(int slot, const char* inPath, Boolean inAddToQueue, Boolean inLoadAtOnce, 
+														SoundEngineLoadProc inProc, void *inUserData, SoundEngineLoadID *outLoadID)
+{
+	return SoundEngine_LoadStreamTrackAsync(GetBackgroundMusicStream(slot), inPath, inAddToQueue, inLoadAtOnce, inProc, inUserData, outLoadID);
+}
+
+extern "C"
+OSStatus  SoundEngine_CrossfadeBackgroundMusic(int slot, const char* inPath, Boolean inLoadAtOnce, Float32 inFadeTime)
+{
+	return SoundEngine_CrossfadeStreamTrack(GetBackgroundMusicStream(slot), inPath, inLoadAtOnce, inFadeTime);
+}
+
+extern "C"
+OSStatus  SoundEngine_SetBackgroundMusicBus(int slot, SoundEngineBusID inBus)
+{
+	return SoundEngine_SetStreamBus(GetBackgroundMusicStream(slot), inBus);
 }
 
 extern "C"
 OSStatus  SoundEngine_UnloadBackgroundMusicTrack(int slot)
 {
-	if (sBackgroundTrackMgr[slot])
-	{
-		delete sBackgroundTrackMgr[slot];
-		sBackgroundTrackMgr[slot] = NULL;
-	}
-		
-	return 0;
+	return SoundEngine_UnloadStreamTrack(GetBackgroundMusicStream(slot));
 }
 
 extern "C"
 OSStatus  SoundEngine_StartBackgroundMusic(int slot)
 {
-	return (sBackgroundTrackMgr[slot]) ? sBackgroundTrackMgr[slot]->Start() : kSoundEngineErrUnitialized;
+	return SoundEngine_StartStream(GetBackgroundMusicStream(slot));
 }
 
 extern "C"
 OSStatus  SoundEngine_StopBackgroundMusic(int slot, Boolean stopAtEnd)
 {
-	return (sBackgroundTrackMgr[slot]) ?  sBackgroundTrackMgr[slot]->Stop(stopAtEnd) : kSoundEngineErrUnitialized;
+	return SoundEngine_StopStream(GetBackgroundMusicStream(slot), stopAtEnd);
 }
 
 extern "C"
 OSStatus  SoundEngine_SetBackgroundMusicVolume(int slot, Float32 inValue)
 {
-	return (sBackgroundTrackMgr[slot]) ? sBackgroundTrackMgr[slot]->SetVolume(inValue) : kSoundEngineErrUnitialized;
+	return SoundEngine_SetStreamVolume(GetBackgroundMusicStream(slot), inValue);
+}
+
+extern "C"
+OSStatus  SoundEngine_SetBackgroundMusicLoopPoints(int slot, UInt32 inLoopStart, UInt32 inLoopEnd)
+{
+	return SoundEngine_SetStreamLoopPoints(GetBackgroundMusicStream(slot), inLoopStart, inLoopEnd);
 }
 
 extern "C"
 OSStatus  SoundEngine_LoadEffect(const char* inPath, UInt32* outEffectID)
 {
-	OSStatus result = noErr;
+	// loading needs no device, it is opened at the first playback
 	if (sOpenALObject == NULL)
-	{
 		sOpenALObject = new OpenALObject(0.0);
-		result = sOpenALObject->Initialize();
-	}	
-	return (result) ? result : sOpenALObject->LoadEffect(inPath, outEffectID);
+	return sOpenALObject->LoadEffect(inPath, outEffectID);
+}
+
+extern "C"
+OSStatus  SoundEngine_LoadEffectAsync(const char* inPath, SoundEngineLoadProc inProc, void *inUserData, SoundEngineLoadID *outLoadID)
+{
+	SoundEngineLoadRequest *theRequest = NewLoadRequest(kLoadKind_Effect, inPath, inProc, inUserData);
+	if (theRequest == NULL)
+		return kSoundEngineErrFileNotFound;
+	// made here rather than on the loader thread, which only loads into it
+	if (sOpenALObject == NULL)
+		sOpenALObject = new OpenALObject(0.0);
+	return sLoader.Submit(theRequest, outLoadID);
+}
+
+extern "C"
+OSStatus  SoundEngine_CancelLoad(SoundEngineLoadID inLoadID)
+{
+	return sLoader.Cancel(inLoadID);
+}
+
+extern "C"
+OSStatus  SoundEngine_GetLoadEvent(SoundEngineLoadEvent *outEvent)
+{
+	if (!sLoader.PopEvent(*outEvent))
+		return kSoundEngineErrNoEvent;
+	return noErr;
 }
 
 
@@ -1299,45 +7109,140 @@ OSStatus  SoundEngine_UnloadEffect(UInt32 inEffectID)
 }
 
 extern "C"
-OSStatus  SoundEngine_PrimeEffect(UInt32 inEffectID, ALuint *sourceID)
+OSStatus  SoundEngine_PrimeEffect(UInt32 inEffectID, SoundEngineVoiceID *outVoiceID)
+{
+	return (sOpenALObject) ? sOpenALObject->PrimeEffect(inEffectID, kSoundEnginePriorityDefault, outVoiceID) : kSoundEngineErrUnitialized;
+}
+
+extern "C"
+OSStatus  SoundEngine_PrimeEffectWithPriority(UInt32 inEffectID, UInt8 inPriority, SoundEngineVoiceID *outVoiceID)
+{
+	return (sOpenALObject) ? sOpenALObject->PrimeEffect(inEffectID, inPriority, outVoiceID) : kSoundEngineErrUnitialized;
+}
+
+extern "C"
+OSStatus  SoundEngine_SetEffectPriority(SoundEngineVoiceID inVoiceID, UInt8 inPriority)
+{
+	return (sOpenALObject) ? sOpenALObject->SetEffectPriority(inVoiceID, inPriority) : kSoundEngineErrUnitialized;
+}
+
+extern "C"
+OSStatus  SoundEngine_UnprimeEffect(SoundEngineVoiceID inVoiceID)
+{
+	return (sOpenALObject) ? sOpenALObject->UnprimeEffect(inVoiceID) : kSoundEngineErrUnitialized;
+}
+
+extern "C"
+OSStatus  SoundEngine_SetEffectLoopPoints(UInt32 inEffectID, UInt32 inLoopStart, UInt32 inLoopEnd)
+{
+	return (sOpenALObject) ? sOpenALObject->SetEffectLoopPoints(inEffectID, inLoopStart, inLoopEnd) : kSoundEngineErrUnitialized;
+}
+
+extern "C"
+OSStatus  SoundEngine_SetEffectLooping(SoundEngineVoiceID inVoiceID, Boolean inLooping)
+{
+	return (sOpenALObject) ? sOpenALObject->SetEffectLooping(inVoiceID, inLooping) : kSoundEngineErrUnitialized;
+}
+
+extern "C"
+OSStatus  SoundEngine_StartEffect(SoundEngineVoiceID inVoiceID)
+{
+	return (sOpenALObject) ? sOpenALObject->StartEffect(inVoiceID) : kSoundEngineErrUnitialized;
+}
+
+extern "C"
+OSStatus  SoundEngine_PlayEffect(UInt32 inEffectID, Float32 inGain, Float32 inPitch, Float32 inPan, UInt8 inPriority)
+{
+	return (sOpenALObject) ? sOpenALObject->PlayEffect(inEffectID, inGain, inPitch, inPan, inPriority) : kSoundEngineErrUnitialized;
+}
+
+extern "C"
+OSStatus  SoundEngine_GetSampleTime(UInt64 *outSampleTime)
+{
+	if (sOpenALObject == NULL)
+		return kSoundEngineErrUnitialized;
+	*outSampleTime = sOpenALObject->GetSampleTime();
+	return noErr;
+}
+
+extern "C"
+OSStatus  SoundEngine_StartEffectAt(SoundEngineVoiceID inVoiceID, UInt64 inSampleTime)
 {
-	return (sOpenALObject) ? sOpenALObject->PrimeEffect(inEffectID, sourceID) : kSoundEngineErrUnitialized;
+	return (sOpenALObject) ? sOpenALObject->StartEffectGroup(&inVoiceID, 1, inSampleTime) : kSoundEngineErrUnitialized;
 }
 
 extern "C"
-OSStatus  SoundEngine_StartEffect(ALuint sourceID)
+OSStatus  SoundEngine_StartEffectGroup(const SoundEngineVoiceID *inVoiceIDs, UInt32 inCount, UInt64 inSampleTime)
 {
-	return (sOpenALObject) ? sOpenALObject->StartEffect(sourceID) : kSoundEngineErrUnitialized;
+	return (sOpenALObject) ? sOpenALObject->StartEffectGroup(inVoiceIDs, inCount, inSampleTime) : kSoundEngineErrUnitialized;
 }
 
 extern "C"
-OSStatus  SoundEngine_StopEffect(ALuint sourceID)
+OSStatus  SoundEngine_StopEffect(SoundEngineVoiceID inVoiceID)
 {	
-	return (sOpenALObject) ?  sOpenALObject->StopEffect(sourceID) : kSoundEngineErrUnitialized;
+	return (sOpenALObject) ?  sOpenALObject->StopEffect(inVoiceID) : kSoundEngineErrUnitialized;
 }
 		
 extern "C"
-OSStatus  SoundEngine_SetEffectPitch(ALuint sourceID, Float32 inValue)
+OSStatus  SoundEngine_SetEffectPitch(SoundEngineVoiceID inVoiceID, Float32 inValue)
+{
+	return (sOpenALObject) ? sOpenALObject->SetEffectPitch(inVoiceID, inValue) : kSoundEngineErrUnitialized;
+}
+
+extern "C"
+OSStatus  SoundEngine_SetEffectLevel(SoundEngineVoiceID inVoiceID, Float32 inValue)
+{
+	return (sOpenALObject) ? sOpenALObject->SetEffectVolume(inVoiceID, inValue) : kSoundEngineErrUnitialized;
+}
+
+extern "C"
+OSStatus	SoundEngine_SetEffectPosition(SoundEngineVoiceID inVoiceID, Float32 inX, Float32 inY, Float32 inZ)
+{
+	return (sOpenALObject) ? sOpenALObject->SetEffectPosition(inVoiceID, inX, inY, inZ) : kSoundEngineErrUnitialized;	
+}
+
+extern "C"
+OSStatus  SoundEngine_SetEffectOcclusion(SoundEngineVoiceID inVoiceID, Float32 inValue)
 {
-	return (sOpenALObject) ? sOpenALObject->SetEffectPitch(sourceID, inValue) : kSoundEngineErrUnitialized;
+	return (sOpenALObject) ? sOpenALObject->SetEffectOcclusion(inVoiceID, inValue) : kSoundEngineErrUnitialized;
 }
 
 extern "C"
-OSStatus  SoundEngine_SetEffectLevel(ALuint sourceID, Float32 inValue)
+OSStatus  SoundEngine_SetEffectReverbSend(SoundEngineVoiceID inVoiceID, Float32 inValue)
 {
-	return (sOpenALObject) ? sOpenALObject->SetEffectVolume(sourceID, inValue) : kSoundEngineErrUnitialized;
+	return (sOpenALObject) ? sOpenALObject->SetEffectReverbSend(inVoiceID, inValue) : kSoundEngineErrUnitialized;
 }
 
 extern "C"
-OSStatus	SoundEngine_SetEffectPosition(ALuint sourceID, Float32 inX, Float32 inY, Float32 inZ)
+OSStatus  SoundEngine_SetReverb(Boolean inOn, UInt32 inRoomType, Float32 inLevelDB)
 {
-	return (sOpenALObject) ? sOpenALObject->SetEffectPosition(sourceID, inX, inY, inZ) : kSoundEngineErrUnitialized;	
+	return (sOpenALObject) ? sOpenALObject->SetReverb(inOn, inRoomType, inLevelDB) : kSoundEngineErrUnitialized;
 }
 
 extern "C"
 OSStatus  SoundEngine_SetEffectsVolume(Float32 inValue)
 {
-	return (sOpenALObject) ? sOpenALObject->SetEffectsVolume(inValue) : kSoundEngineErrUnitialized;
+	return SoundEngine_SetBusVolume(kSoundEngineBus_Effects, inValue);
+}
+
+extern "C"
+OSStatus  SoundEngine_SetEffectBus(SoundEngineVoiceID inVoiceID, SoundEngineBusID inBus)
+{
+	if (!sBusGraph.IsValid(inBus) || (sBusGraph.GetCategory(inBus) != kSoundEngineBus_Effects))
+		return kSoundEngineErrInvalidID;
+	return (sOpenALObject) ? sOpenALObject->SetEffectBus(inVoiceID, inBus) : kSoundEngineErrUnitialized;
+}
+
+extern "C"
+OSStatus  SoundEngine_SetVoiceMetering(SoundEngineVoiceID inVoiceID, Boolean inEnable)
+{
+	return (sOpenALObject) ? sOpenALObject->SetVoiceMetering(inVoiceID, inEnable) : kSoundEngineErrUnitialized;
+}
+
+extern "C"
+OSStatus  SoundEngine_GetVoiceMeter(SoundEngineVoiceID inVoiceID, Float32 *outPeak, Float32 *outRMS)
+{
+	return sMeters.ReadVoice(inVoiceID, outPeak, outRMS);
 }
 
 extern "C"
@@ -1352,5 +7257,35 @@ OSStatus  SoundEngine_SetReferenceDistance(Float32 inValue)
 	return (sOpenALObject) ? sOpenALObject->SetReferenceDistance(inValue) : kSoundEngineErrUnitialized;
 }
 
+extern "C"
+OSStatus  SoundEngine_SetVirtualVoiceThreshold(Float32 inValue)
+{
+	return (sOpenALObject) ? sOpenALObject->SetVirtualVoiceThreshold(inValue) : kSoundEngineErrUnitialized;
+}
+
+extern "C"
+OSStatus  SoundEngine_SetEffectTrimThreshold(Float32 inValue)
+{
+	return (sOpenALObject) ? sOpenALObject->SetEffectTrimThreshold(inValue) : kSoundEngineErrUnitialized;
+}
+
+extern "C"
+OSStatus  SoundEngine_GetEffectInfo(UInt32 inEffectID, SoundEngineEffectInfo *outInfo)
+{
+	return (sOpenALObject) ? sOpenALObject->GetEffectInfo(inEffectID, outInfo) : kSoundEngineErrUnitialized;
+}
+
+extern "C"
+OSStatus  SoundEngine_SetVoiceUpdateThreads(UInt32 inThreads)
+{
+	return (sOpenALObject) ? sOpenALObject->SetVoiceUpdateThreads(inThreads) : kSoundEngineErrUnitialized;
+}
+
+extern "C"
+OSStatus  SoundEngine_SetMaxVoices(UInt32 inMaxVoices)
+{
+	return (sOpenALObject) ? sOpenALObject->SetMaxVoices(inMaxVoices) : kSoundEngineErrUnitialized;
+}
+
 #endif
 #endif
@@ -129,6 +129,16 @@ extern "C"
 		The format of the file is invalid. Effect data must be little-endian 8 or 16 bit LPCM.
     @constant   kSoundEngineErrDeviceNotFound 
 		The output device was not found.
+    @constant   kSoundEngineErrUnsupported 
+		The feature is not available on this device, e.g. ALC_EXT_ASA is missing.
+    @constant   kSoundEngineErrInvalidRange 
+		A range of frames, e.g. loop points, falls outside of the sound.
+    @constant   kSoundEngineErrPoolExhausted 
+		Too many streams, playlist files or crossfades are in use at once.
+    @constant   kSoundEngineErrCanceled 
+		An async load was canceled before it completed.
+    @constant   kSoundEngineErrNoEvent 
+		No async load has completed since the last call to SoundEngine_GetLoadEvent.
 
 */
 enum {
@@ -138,15 +148,81 @@ enum {
 		kSoundEngineErrInvalidFileFormat	= 4,
 		kSoundEngineErrDeviceNotFound		= 5,
 		kSoundEngineErrNoSourcesAvailable   = 6,
+		kSoundEngineErrUnsupported			= 7,
+		kSoundEngineErrInvalidRange			= 8,
+		kSoundEngineErrPoolExhausted		= 9,
+		kSoundEngineErrCanceled				= 10,
+		kSoundEngineErrNoEvent				= 11,
+};
+
+/*!
+    @typedef    SoundEngineVoiceID
+    @abstract   Refers to a primed effect. A voice only holds an OpenAL source while it is playing and 
+				audible; otherwise it is virtual and keeps advancing its play cursor without being mixed.
+*/
+typedef UInt32 SoundEngineVoiceID;
+
+/*!
+    @typedef    SoundEngineStreamID
+    @abstract   Refers to a music stream created with SoundEngine_CreateStream. Any number of streams can 
+				play at once; a stream only holds an audio queue while a track is loaded. The int slot 
+				functions address two streams the engine creates on first use.
+*/
+typedef UInt32 SoundEngineStreamID;
+
+/*!
+    @enum SoundEngine voice priorities
+    @abstract   When all the OpenAL sources are in use, an audible voice takes the source of the voice 
+				with the lowest priority, then the quietest, then the oldest. The stolen voice fades out
+				quickly and goes virtual.
+*/
+enum {
+		kSoundEnginePriorityLowest			= 0,
+		kSoundEnginePriorityDefault			= 8,
+		kSoundEnginePriorityHighest			= 15,
+		kSoundEnginePriorityLevels			= 16,
+};
+
+/*!
+    @typedef    SoundEngineBusID
+    @abstract   Refers to a mix bus. Buses form a tree: master, with the music, effects and speech 
+				categories below it, and any sub-bus created below a category. A voice or a music 
+				slot is heard at its own level times the volume of every bus up to master.
+*/
+typedef UInt32 SoundEngineBusID;
+
+enum {
+		kSoundEngineBus_Master				= 0,
+		kSoundEngineBus_Music				= 1,
+		kSoundEngineBus_Effects				= 2,
+		kSoundEngineBus_Speech				= 3,
+		kSoundEngineMaxBuses				= 32,
+		kSoundEngineMaxDuckings				= 4,
+};
+
+/*!
+    @enum SoundEngine bus filters
+    @abstract   Biquad sections for SoundEngine_SetBusFilter, designed after the RBJ audio EQ cookbook.
+				Gain is only used by the peak and shelf filters.
+*/
+enum {
+		kSoundEngineFilter_None				= 0,
+		kSoundEngineFilter_LowPass			= 1,
+		kSoundEngineFilter_HighPass			= 2,
+		kSoundEngineFilter_Peak				= 3,
+		kSoundEngineFilter_LowShelf			= 4,
+		kSoundEngineFilter_HighShelf		= 5,
+		kSoundEngineMaxFilterSections		= 4,
 };
 
 
 /*!
     @function       SoundEngine_Initialize
-    @abstract       Initializes and sets up the sound engine. Calling after a previous initialize will
-						reset the state of the SoundEngine, with all previous effects and music tracks
-						erased. Note: This is not required, loading an effect or background track will 
-						initialize as necessary.
+    @abstract       Initializes and sets up the sound engine. Calling after a previous initialize only 
+						rebuilds the OpenAL context, e.g. for a new output rate or at the end of an audio
+						interruption: loaded effects, their IDs, primed voices and streams are kept, and 
+						the streams that were playing carry on. Note: This is not required, loading an 
+						effect or background track will initialize as necessary.
     @param          inMixerOutputRate
                         A Float32 that represents the output sample rate of the mixer unit. Setting this to 
 						0 will use the default rate (the sample rate of the device)
@@ -154,22 +230,352 @@ enum {
 */
 OSStatus  SoundEngine_Initialize(Float32 inMixerOutputRate);
 
+/*!
+    @function       SoundEngine_InitializeDeferred
+    @abstract       Sets up the sound engine without touching the audio hardware. Effects and tracks load
+						as usual; the device is opened on a thread of its own at the first effect 
+						playback, which starts as soon as the device is up. SoundEngine_Initialize opens
+						it right away instead. Loading an effect before any initialize starts the engine
+						this way.
+    @param          inMixerOutputRate
+                        A Float32 that represents the output sample rate of the mixer unit. Setting this to 
+						0 will use the default rate (the sample rate of the device)
+	@result         A OSStatus indicating success or failure.
+*/
+OSStatus  SoundEngine_InitializeDeferred(Float32 inMixerOutputRate);
+
+/*!
+    @function       SoundEngine_GetStartupTime
+    @abstract       Gets how long a phase of opening the device took, 0 until the device is open.
+    @param          inPhase
+                        One of the kSoundEngineStartup constants.
+    @param          outSeconds
+                        Receives the duration.
+    @result         A OSStatus indicating success or failure.
+*/
+OSStatus  SoundEngine_GetStartupTime(UInt32 inPhase, Float64 *outSeconds);
+
 /*!
     @function       SoundEngine_Teardown
-    @abstract       Tearsdown the sound engine.
+    @abstract       Tearsdown the sound engine. Async loads still pending are canceled and have completed
+					when it returns.
     @result         A OSStatus indicating success or failure.
 */
 OSStatus  SoundEngine_Teardown();
 
 /*!
     @function       SoundEngine_SetMasterVolume
-    @abstract       Sets the overall volume of all sounds coming from the process
+    @abstract       Sets the overall volume of all sounds coming from the process. Same as setting the 
+					volume of kSoundEngineBus_Master.
+    @param          slot
+                        Unused, the master volume applies to every slot.
     @param          inValue
                         A Float32 that represents the level. The range is between 0.0 and 1.0 (inclusive).
     @result         A OSStatus indicating success or failure.
 */
 OSStatus  SoundEngine_SetMasterVolume(int slot, Float32 inValue);
 
+/*!
+    @enum SoundEngine profile metrics
+    @abstract   Histograms kept by the profiler, see SoundEngine_GetProfile.
+    @constant   kSoundEngineProfile_MusicBlockTime
+                    Time, in microseconds, a music stream takes to render one block, decoding included.
+    @constant   kSoundEngineProfile_MusicBlockLoad
+                    The same, in percent of the duration of the block.
+    @constant   kSoundEngineProfile_EffectsPassTime
+                    Time, in microseconds, of one pass of the voice update thread over all playing voices.
+    @constant   kSoundEngineProfile_EffectsPassLoad
+                    The same, in percent of the 10 ms between two passes.
+    @constant   kSoundEngineProfile_VoiceTime
+                    Time, in microseconds, one playing voice takes in a pass.
+    @constant   kSoundEngineProfile_StreamReadLatency
+                    Time, in microseconds, from the request of a music stream refill to the end of its read.
+    @constant   kSoundEngineProfile_SpeechReadLatency
+                    The same, for speech reads.
+    @constant   kSoundEngineProfile_LoadReadLatency
+                    The same, for each 64 KB chunk of an effect or of a track loaded at once.
+    @constant   kSoundEngineProfileBins
+                    Time bin 0 counts samples under 1 us and bin i samples in [2^(i-1), 2^i) us. Load bin i
+					counts samples in [4i, 4i+4) %. The last bin of either also counts everything above.
+*/
+enum {
+		kSoundEngineProfile_MusicBlockTime	= 0,
+		kSoundEngineProfile_MusicBlockLoad	= 1,
+		kSoundEngineProfile_EffectsPassTime	= 2,
+		kSoundEngineProfile_EffectsPassLoad	= 3,
+		kSoundEngineProfile_VoiceTime		= 4,
+		kSoundEngineProfile_StreamReadLatency	= 5,
+		kSoundEngineProfile_SpeechReadLatency	= 6,
+		kSoundEngineProfile_LoadReadLatency	= 7,
+		kSoundEngineProfileMetrics			= 8,
+		kSoundEngineProfileBins				= 32,
+		kSoundEngineProfileLoadBinWidth		= 4,
+};
+
+/*!
+    @struct     SoundEngineProfile
+    @abstract   A copy of one histogram. Mean and max are in the unit of the metric.
+*/
+typedef struct SoundEngineProfile {
+	UInt32		mCount;
+	Float32		mMean;
+	Float32		mMax;
+	UInt32		mBins[kSoundEngineProfileBins];
+} SoundEngineProfile;
+
+/*!
+    @enum SoundEngine startup phases
+    @abstract   Phases of opening the device, timed for SoundEngine_GetStartupTime.
+    @constant   kSoundEngineStartup_Device
+                    Opening the output device.
+    @constant   kSoundEngineStartup_Context
+                    Creating the OpenAL context and its sources.
+    @constant   kSoundEngineStartup_Buffers
+                    Making the buffers of the effects loaded before the device was open.
+    @constant   kSoundEngineStartup_Total
+                    The whole startup, the voice update thread included.
+*/
+enum {
+		kSoundEngineStartup_Device			= 0,
+		kSoundEngineStartup_Context			= 1,
+		kSoundEngineStartup_Buffers			= 2,
+		kSoundEngineStartup_Total			= 3,
+		kSoundEngineStartupPhases			= 4,
+};
+
+/*!
+    @enum SoundEngine realtime check modes
+    @abstract   What SoundEngine_SetRealtimeCheck does about a violation of the realtime contract: an
+				allocation, free, lock or blocking call made from an audio callback.
+    @constant   kSoundEngineRealtimeCheck_Off
+                    Nothing is checked, the default.
+    @constant   kSoundEngineRealtimeCheck_Count
+                    Violations are counted, cheap enough to leave on in release builds.
+    @constant   kSoundEngineRealtimeCheck_Report
+                    Violations are counted and printed with the call stack that made them.
+*/
+enum {
+		kSoundEngineRealtimeCheck_Off		= 0,
+		kSoundEngineRealtimeCheck_Count		= 1,
+		kSoundEngineRealtimeCheck_Report	= 2,
+};
+
+/*!
+    @enum SoundEngine realtime violations
+    @abstract   Kinds of violation counted by the realtime check. Allocations and frees made outside
+				of the engine's own code are only caught in debug builds, where the default malloc zone 
+				is patched.
+*/
+enum {
+		kSoundEngineRealtimeViolation_Alloc		= 0,
+		kSoundEngineRealtimeViolation_Free		= 1,
+		kSoundEngineRealtimeViolation_Lock		= 2,
+		kSoundEngineRealtimeViolation_Syscall	= 3,
+		kSoundEngineRealtimeViolationKinds		= 4,
+};
+
+/*!
+    @function       SoundEngine_CreateBus
+    @abstract       Creates a sub-bus
+    @param          inParent
+                        The category or sub-bus to mix into. Can not be kSoundEngineBus_Master.
+    @param          outBus
+                        A SoundEngineBusID that refers to the new bus.
+    @result         A OSStatus indicating success or failure.
+*/
+OSStatus  SoundEngine_CreateBus(SoundEngineBusID inParent, SoundEngineBusID *outBus);
+
+/*!
+    @function       SoundEngine_SetBusVolume
+    @abstract       Sets the volume of a bus. Changing master, music or effects does not touch the voices,
+					only a sub-bus of effects has to update the voices currently holding a source.
+    @param          inBus
+                        The bus to adjust.
+    @param          inValue
+                        A Float32 that represents the level. The range is between 0.0 and 1.0 (inclusive).
+    @result         A OSStatus indicating success or failure.
+*/
+OSStatus  SoundEngine_SetBusVolume(SoundEngineBusID inBus, Float32 inValue);
+
+/*!
+    @function       SoundEngine_SetBusFilter
+    @abstract       Sets one biquad section of the DSP chain of a music bus. The chain runs on the render
+					thread of every music queue routed to the bus or one of its sub-buses, sub-bus first.
+    @param          inBus
+                        kSoundEngineBus_Music or one of its sub-buses.
+    @param          inSection
+                        The section to set, less than kSoundEngineMaxFilterSections.
+    @param          inType
+                        One of the kSoundEngineFilter constants. kSoundEngineFilter_None removes the section.
+    @param          inFrequency
+                        Cutoff or center frequency, in Hz.
+    @param          inQ
+                        Quality factor. 0.707 gives a flat pass band for low and high pass filters.
+    @param          inGainDB
+                        Boost or cut, in dB, for the peak and shelf filters.
+    @result         A OSStatus indicating success or failure.
+*/
+OSStatus  SoundEngine_SetBusFilter(SoundEngineBusID inBus, UInt32 inSection, UInt32 inType, Float32 inFrequency, Float32 inQ, Float32 inGainDB);
+
+/*!
+    @function       SoundEngine_SetBusLowPass
+    @abstract       Sets a one-pole low-pass on a music bus, run after its biquad sections. Cheap enough 
+					to follow occlusion changes.
+    @param          inBus
+                        kSoundEngineBus_Music or one of its sub-buses.
+    @param          inCutoff
+                        Cutoff frequency, in Hz. 0.0 removes the low-pass.
+    @result         A OSStatus indicating success or failure.
+*/
+OSStatus  SoundEngine_SetBusLowPass(SoundEngineBusID inBus, Float32 inCutoff);
+
+/*!
+    @function       SoundEngine_SetProfilingEnabled
+    @abstract       Turns the render path timers on or off. They are off by default; when on, they cost a 
+					few atomic adds per block and two clock reads per playing voice and pass.
+    @result         A OSStatus indicating success or failure.
+*/
+OSStatus  SoundEngine_SetProfilingEnabled(Boolean inEnabled);
+
+/*!
+    @function       SoundEngine_GetProfile
+    @abstract       Copies one of the profiler histograms. Can be called from any thread.
+    @param          inMetric
+                        One of the kSoundEngineProfile constants.
+    @param          outProfile
+                        Receives the histogram.
+    @result         A OSStatus indicating success or failure.
+*/
+OSStatus  SoundEngine_GetProfile(UInt32 inMetric, SoundEngineProfile *outProfile);
+
+/*!
+    @function       SoundEngine_GetBusProfile
+    @abstract       Copies the histogram of the time, in microseconds, spent per block on what is routed 
+					directly to a bus: music streams on it, their DSP chain included, or its voices in a 
+					pass of the update thread. Sub-buses are not included. mMax is the longest block.
+    @result         A OSStatus indicating success or failure.
+*/
+OSStatus  SoundEngine_GetBusProfile(SoundEngineBusID inBus, SoundEngineProfile *outProfile);
+
+/*!
+    @function       SoundEngine_ResetProfile
+    @abstract       Clears all the profiler histograms.
+    @result         A OSStatus indicating success or failure.
+*/
+OSStatus  SoundEngine_ResetProfile();
+
+/*!
+    @function       SoundEngine_GetReadQueueDepth
+    @abstract       Reports the disk reads waiting to be served. All reads of the engine share one queue
+					where music refills go first, then speech, then loads.
+    @param          outDepth
+                        Reads waiting now. Can be NULL.
+    @param          outMaxDepth
+                        Most reads waiting at once since the last SoundEngine_ResetProfile. Can be NULL.
+    @result         A OSStatus indicating success or failure.
+*/
+OSStatus  SoundEngine_GetReadQueueDepth(UInt32 *outDepth, UInt32 *outMaxDepth);
+
+/*!
+    @function       SoundEngine_SetRealtimeCheck
+    @abstract       Checks that the audio callbacks keep to the realtime contract. Can be called at any time.
+    @param          inMode
+                        One of the kSoundEngineRealtimeCheck constants.
+    @result         A OSStatus indicating success or failure.
+*/
+OSStatus  SoundEngine_SetRealtimeCheck(UInt32 inMode);
+
+/*!
+    @function       SoundEngine_GetRealtimeViolations
+    @abstract       Gets the number of violations of one kind since the last SoundEngine_ResetProfile.
+    @param          inKind
+                        One of the kSoundEngineRealtimeViolation constants.
+    @param          outCount
+                        Receives the count.
+    @result         A OSStatus indicating success or failure.
+*/
+OSStatus  SoundEngine_GetRealtimeViolations(UInt32 inKind, UInt32 *outCount);
+
+/*!
+    @function       SoundEngine_AddDucking
+    @abstract       Ducks a music bus while a key bus is active. The gain reduction is computed once per
+					block on the render thread of each music queue routed to the target bus, no further 
+					calls are needed once set up.
+    @param          inKeyBus
+                        The bus whose activity triggers the ducking. Effects buses are measured by the 
+						engine; other buses report their activity with SoundEngine_SetBusActivity.
+    @param          inTargetBus
+                        kSoundEngineBus_Music or one of its sub-buses.
+    @param          inThreshold
+                        Activity level above which the target is ducked.
+    @param          inDepthDB
+                        Gain reduction when fully ducked, in dB.
+    @param          inAttackMs
+                        Time constant of the gain going down, in milliseconds.
+    @param          inReleaseMs
+                        Time constant of the gain coming back, in milliseconds.
+    @param          outDuckingID
+                        Refers to the ducking, to remove it.
+    @result         A OSStatus indicating success or failure.
+*/
+OSStatus  SoundEngine_AddDucking(SoundEngineBusID inKeyBus, SoundEngineBusID inTargetBus, Float32 inThreshold, Float32 inDepthDB, Float32 inAttackMs, Float32 inReleaseMs, UInt32 *outDuckingID);
+
+/*!
+    @function       SoundEngine_RemoveDucking
+    @abstract       Removes a ducking added with SoundEngine_AddDucking. The target gain is released normally.
+    @result         A OSStatus indicating success or failure.
+*/
+OSStatus  SoundEngine_RemoveDucking(UInt32 inDuckingID);
+
+/*!
+    @function       SoundEngine_SetBusActivity
+    @abstract       Reports the level of a bus the engine does not play itself, such as speech played 
+					through AVAudioPlayer. Call it when playback starts, stops or changes level.
+    @param          inBus
+                        Any bus outside of the effects category.
+    @param          inLevel
+                        The level the bus is heard at, 0.0 when silent.
+    @result         A OSStatus indicating success or failure.
+*/
+OSStatus  SoundEngine_SetBusActivity(SoundEngineBusID inBus, Float32 inLevel);
+
+/*!
+    @function       SoundEngine_SetBusMetering
+    @abstract       Turns the bus meters on or off, off by default. A bus meter measures what the bus 
+					and the buses below it are heard at, every 30 ms or so. Music and speech streams 
+					are measured on their mixed blocks; effects are estimated from the levels of the 
+					effect files at the play cursor of each voice, as OpenAL mixes them out of reach.
+    @param          inEnable
+                        True to measure.
+    @result         A OSStatus indicating success or failure.
+*/
+OSStatus  SoundEngine_SetBusMetering(Boolean inEnable);
+
+/*!
+    @function       SoundEngine_GetBusMeter
+    @abstract       Gets the last levels measured on a bus. Does not block, can be called from any thread, 
+					e.g. at every frame of a level meter. Levels go to 0.0 shortly after the bus falls silent.
+    @param          inBus
+                        The bus to query.
+    @param          outPeak
+                        Receives the peak level, linear, or NULL.
+    @param          outRMS
+                        Receives the RMS level, linear, or NULL.
+    @result         A OSStatus indicating success or failure.
+*/
+OSStatus  SoundEngine_GetBusMeter(SoundEngineBusID inBus, Float32 *outPeak, Float32 *outRMS);
+
+/*!
+    @function       SoundEngine_GetBusVolume
+    @abstract       Gets the volume of a bus
+    @param          inBus
+                        The bus to query.
+    @param          outValue
+                        The volume set with SoundEngine_SetBusVolume, 1.0 by default.
+    @result         A OSStatus indicating success or failure.
+*/
+OSStatus  SoundEngine_GetBusVolume(SoundEngineBusID inBus, Float32 *outValue);
+
 /*!
     @function       SoundEngine_SetListenerPosition
     @abstract       Sets the position of the listener in the 3D space
@@ -192,6 +598,86 @@ OSStatus  SoundEngine_SetListenerPosition(Float32 inX, Float32 inY, Float32 inZ)
 */
 OSStatus  SoundEngine_SetListenerGain(Float32 inValue);
 
+/*!
+    @typedef    SoundEngineLoadID
+    @abstract   Refers to an async load until it completes. 0 is never a valid ID.
+*/
+typedef UInt32 SoundEngineLoadID;
+
+/*!
+    @struct     SoundEngineLoadEvent
+    @abstract   The completion of an async load.
+    @field      mLoadID
+                    The load that completed.
+    @field      mResult
+                    The result the blocking call would have returned, kSoundEngineErrCanceled for a 
+					canceled load.
+    @field      mEffectID
+                    The loaded effect, 0 for a track or a failed load.
+*/
+typedef struct SoundEngineLoadEvent {
+	SoundEngineLoadID	mLoadID;
+	OSStatus			mResult;
+	UInt32				mEffectID;
+} SoundEngineLoadEvent;
+
+/*!
+    @typedef    SoundEngineLoadProc
+    @abstract   Called on the loader thread when an async load completes, canceled ones included.
+					It may call back into the engine, but should return quickly, the next load waits.
+*/
+typedef void (*SoundEngineLoadProc)(void *inUserData, const SoundEngineLoadEvent *inEvent);
+
+/*!
+    @struct     SoundEngineEffectInfo
+    @abstract   What the analysis of an effect found when it was loaded.
+    @field      mFrames
+                    Frames kept in memory, once the silence has been trimmed off.
+    @field      mTrimStart
+                    Frames of silence trimmed off the head of the file. Voices wait them out before
+					they play, the sound starts when it would have.
+    @field      mTrimEnd
+                    Frames of silence trimmed off the tail of the file.
+    @field      mSampleRate
+                    Of the effect.
+    @field      mPeak
+                    Largest sample magnitude, linear, 1.0 is full scale.
+    @field      mLoudness
+                    RMS level of the trimmed effect, linear. A gain of a target level over it 
+					normalizes the effect.
+*/
+typedef struct SoundEngineEffectInfo {
+	UInt32		mFrames;
+	UInt32		mTrimStart;
+	UInt32		mTrimEnd;
+	Float64		mSampleRate;
+	Float32		mPeak;
+	Float32		mLoudness;
+} SoundEngineEffectInfo;
+
+/*!
+    @function       SoundEngine_CancelLoad
+    @abstract       Cancels an async load. A load that has not started is dropped without reading the 
+					file; a running one stops and releases what it loaded. Either way it completes
+					with kSoundEngineErrCanceled.
+    @param          inLoadID
+                        The ID returned when the load was started.
+    @result         A OSStatus indicating success or failure. kSoundEngineErrInvalidID if the load 
+					already completed or is being committed, it then completes with its own result.
+*/
+OSStatus  SoundEngine_CancelLoad(SoundEngineLoadID inLoadID);
+
+/*!
+    @function       SoundEngine_GetLoadEvent
+    @abstract       Takes the oldest completion of the async loads started without a proc. Does not 
+					block or lock, e.g. for a game loop; call it from one thread only. The loads wait
+					while the events are not taken.
+    @param          outEvent
+                        Receives the completion.
+    @result         A OSStatus indicating success or failure. kSoundEngineErrNoEvent if there is none.
+*/
+OSStatus  SoundEngine_GetLoadEvent(SoundEngineLoadEvent *outEvent);
+
 /*!
     @function       SoundEngine_LoadBackgroundMusicTrack
     @abstract       Tells the background music player which file to play
@@ -208,6 +694,38 @@ OSStatus  SoundEngine_SetListenerGain(Float32 inValue);
 */
 OSStatus  SoundEngine_LoadBackgroundMusicTrack(int slot, const char* inPath, Boolean inAddToQueue, Boolean inLoadAtOnce);
 
+/*!
+    @function       SoundEngine_LoadBackgroundMusicTrackAsync
+    @abstract       Same as SoundEngine_LoadBackgroundMusicTrack, but returns at once. The file is opened
+					and buffered on the loader thread and replaces the track of the slot when done, 
+					unless the slot was unloaded, crossfaded or loaded again meanwhile.
+    @param          inProc
+                        Called with the completion, or NULL to get it from SoundEngine_GetLoadEvent.
+    @param          inUserData
+                        Passed to inProc.
+    @param          outLoadID
+                        Receives the ID of the load, for SoundEngine_CancelLoad.
+	@result         A OSStatus indicating success or failure.
+*/
+OSStatus  SoundEngine_LoadBackgroundMusicTrackAsync(int slot, const char* inPath, Boolean inAddToQueue, Boolean inLoadAtOnce, 
+														SoundEngineLoadProc inProc, void *inUserData, SoundEngineLoadID *outLoadID);
+
+/*!
+    @function       SoundEngine_CrossfadeBackgroundMusic
+    @abstract       Replaces the track of a slot with an equal-power crossfade. The file is opened and 
+					buffered on a background thread and starts at the volume of the current track, which 
+					keeps playing until the fade is over. If the slot is empty the track just fades in.
+					Returns at once; unloading or crossfading the slot again cancels a pending crossfade.
+    @param          inPath
+                        The absolute path to the file to play.
+    @param          inLoadAtOnce
+                        As in SoundEngine_LoadBackgroundMusicTrack.
+    @param          inFadeTime
+                        Duration of the crossfade, in seconds.
+	@result         A OSStatus indicating success or failure.
+*/
+OSStatus  SoundEngine_CrossfadeBackgroundMusic(int slot, const char* inPath, Boolean inLoadAtOnce, Float32 inFadeTime);
+
 /*!
     @function       SoundEngine_UnloadBackgroundMusicTrack
     @abstract       Tells the background music player to release all resources and stop playing.
@@ -241,6 +759,160 @@ OSStatus  SoundEngine_StopBackgroundMusic(int slot, Boolean inStopAtEnd);
 */
 OSStatus  SoundEngine_SetBackgroundMusicVolume(int slot, Float32 inValue);
 
+/*!
+    @function       SoundEngine_SetBackgroundMusicLoopPoints
+    @abstract       Loops a region of the loaded track instead of the whole file. The intro before the 
+					region plays once. Loop markers found in the file are applied when a track is loaded.
+    @param          inLoopStart
+                        First frame of the region, in frames of the decoded audio.
+    @param          inLoopEnd
+                        Frame after the last frame of the region. 0 and 0 loop the whole file.
+    @result         A OSStatus indicating success or failure. kSoundEngineErrInvalidRange if the region 
+					falls outside of the track, kSoundEngineErrUnsupported for a playlist.
+*/
+OSStatus  SoundEngine_SetBackgroundMusicLoopPoints(int slot, UInt32 inLoopStart, UInt32 inLoopEnd);
+
+/*!
+    @function       SoundEngine_SetBackgroundMusicBus
+    @abstract       Routes a background music slot to a bus. Slots go to kSoundEngineBus_Music by default.
+    @param          inBus
+                        kSoundEngineBus_Music or one of its sub-buses.
+    @result         A OSStatus indicating success or failure.
+*/
+OSStatus  SoundEngine_SetBackgroundMusicBus(int slot, SoundEngineBusID inBus);
+
+/*!
+    @function       SoundEngine_CreateStream
+    @abstract       Creates a music stream. Nothing is allocated for playback until a track is loaded.
+    @param          inBus
+                        kSoundEngineBus_Music or kSoundEngineBus_Speech, or one of their sub-buses.
+    @param          outStreamID
+                        Refers to the stream in the other stream functions.
+    @result         A OSStatus indicating success or failure.
+*/
+OSStatus  SoundEngine_CreateStream(SoundEngineBusID inBus, SoundEngineStreamID *outStreamID);
+
+/*!
+    @function       SoundEngine_DestroyStream
+    @abstract       Unloads the track of a stream and releases the stream. The ID becomes invalid.
+    @result         A OSStatus indicating success or failure.
+*/
+OSStatus  SoundEngine_DestroyStream(SoundEngineStreamID inStreamID);
+
+/*!
+    @function       SoundEngine_LoadStreamTrack
+    @abstract       Same as SoundEngine_LoadBackgroundMusicTrack, for a stream.
+    @result         A OSStatus indicating success or failure.
+*/
+OSStatus  SoundEngine_LoadStreamTrack(SoundEngineStreamID inStreamID, const char* inPath, Boolean inAddToQueue, Boolean inLoadAtOnce);
+
+/*!
+    @function       SoundEngine_LoadStreamTrackAsync
+    @abstract       Same as SoundEngine_LoadBackgroundMusicTrackAsync, for a stream.
+    @result         A OSStatus indicating success or failure.
+*/
+OSStatus  SoundEngine_LoadStreamTrackAsync(SoundEngineStreamID inStreamID, const char* inPath, Boolean inAddToQueue, Boolean inLoadAtOnce, 
+												SoundEngineLoadProc inProc, void *inUserData, SoundEngineLoadID *outLoadID);
+
+/*!
+    @function       SoundEngine_CrossfadeStreamTrack
+    @abstract       Same as SoundEngine_CrossfadeBackgroundMusic, for a stream.
+    @result         A OSStatus indicating success or failure.
+*/
+OSStatus  SoundEngine_CrossfadeStreamTrack(SoundEngineStreamID inStreamID, const char* inPath, Boolean inLoadAtOnce, Float32 inFadeTime);
+
+/*!
+    @function       SoundEngine_LoadStreamMappedTrack
+    @abstract       Loads a track into a stream by mapping the whole file in memory, for a file many short
+					regions are played from, e.g. a narration file. Replaces the track of the stream.
+    @param          inPath
+                        The path of the file.
+    @result         A OSStatus indicating success or failure.
+*/
+OSStatus  SoundEngine_LoadStreamMappedTrack(SoundEngineStreamID inStreamID, const char* inPath);
+
+/*!
+    @function       SoundEngine_SetDecodeCacheDirectory
+    @abstract       Keeps decoded PCM of the compressed tracks that are loaded at once, including files too
+					short to be streamed, in a directory. A track is decoded in the background the first 
+					time it is loaded, and played from its source meanwhile. Later loads map the decoded
+					PCM, also after a relaunch, until the source file changes. Can be called before 
+					SoundEngine_Initialize.
+    @param          inPath
+                        The directory, created if needed, e.g. in Library/Caches. NULL turns the cache off.
+    @result         A OSStatus indicating success or failure.
+*/
+OSStatus  SoundEngine_SetDecodeCacheDirectory(const char* inPath);
+
+/*!
+    @function       SoundEngine_PlayStreamRegion
+    @abstract       Plays a region of the track of a stream once, stopping whatever the stream was playing.
+    @param          inStart
+                        Start of the region, in seconds.
+    @param          inLength
+                        Duration of the region, in seconds. The region ends at the end of the track at most,
+						0.0 or less plays to the end of the track.
+    @result         A OSStatus indicating success or failure. kSoundEngineErrInvalidRange if the region 
+					starts past the end of the track.
+*/
+OSStatus  SoundEngine_PlayStreamRegion(SoundEngineStreamID inStreamID, Float64 inStart, Float64 inLength);
+
+/*!
+    @function       SoundEngine_UnloadStreamTrack
+    @abstract       Stops the stream and releases its audio queue and file. The stream can be loaded again.
+    @result         A OSStatus indicating success or failure.
+*/
+OSStatus  SoundEngine_UnloadStreamTrack(SoundEngineStreamID inStreamID);
+
+/*!
+    @function       SoundEngine_StartStream
+    @abstract       Same as SoundEngine_StartBackgroundMusic, for a stream.
+    @result         A OSStatus indicating success or failure.
+*/
+OSStatus  SoundEngine_StartStream(SoundEngineStreamID inStreamID);
+
+/*!
+    @function       SoundEngine_StopStream
+    @abstract       Same as SoundEngine_StopBackgroundMusic, for a stream.
+    @result         A OSStatus indicating success or failure.
+*/
+OSStatus  SoundEngine_StopStream(SoundEngineStreamID inStreamID, Boolean inStopAtEnd);
+
+/*!
+    @function       SoundEngine_PauseStream
+    @abstract       Pauses a stream, SoundEngine_ResumeStream continues from where it was paused.
+    @result         A OSStatus indicating success or failure.
+*/
+OSStatus  SoundEngine_PauseStream(SoundEngineStreamID inStreamID);
+
+/*!
+    @function       SoundEngine_ResumeStream
+    @abstract       Continues a paused stream.
+    @result         A OSStatus indicating success or failure.
+*/
+OSStatus  SoundEngine_ResumeStream(SoundEngineStreamID inStreamID);
+
+/*!
+    @function       SoundEngine_SetStreamVolume
+    @abstract       Same as SoundEngine_SetBackgroundMusicVolume, for a stream.
+    @result         A OSStatus indicating success or failure.
+*/
+OSStatus  SoundEngine_SetStreamVolume(SoundEngineStreamID inStreamID, Float32 inValue);
+
+/*!
+    @function       SoundEngine_SetStreamLoopPoints
+    @abstract       Same as SoundEngine_SetBackgroundMusicLoopPoints, for a stream.
+    @result         A OSStatus indicating success or failure.
+*/
+OSStatus  SoundEngine_SetStreamLoopPoints(SoundEngineStreamID inStreamID, UInt32 inLoopStart, UInt32 inLoopEnd);
+
+/*!
+    @function       SoundEngine_SetStreamBus
+    @abstract       Same as SoundEngine_SetBackgroundMusicBus, for a stream. Speech buses are allowed too.
+    @result         A OSStatus indicating success or failure.
+*/
+OSStatus  SoundEngine_SetStreamBus(SoundEngineStreamID inStreamID, SoundEngineBusID inBus);
+
 
 /*!
     @function       SoundEngine_LoadEffect
@@ -253,6 +925,23 @@ OSStatus  SoundEngine_SetBackgroundMusicVolume(int slot, Float32 inValue);
 */
 OSStatus  SoundEngine_LoadEffect(const char* inPath, UInt32* outEffectID);
 
+/*!
+    @function       SoundEngine_LoadEffectAsync
+    @abstract       Same as SoundEngine_LoadEffect, but returns at once. The effect is loaded on the loader
+					thread and its ID comes with the completion. Loads run one at a time, in the order
+					they were started.
+    @param          inPath
+                        The absolute path to the file to load.
+    @param          inProc
+                        Called with the completion, or NULL to get it from SoundEngine_GetLoadEvent.
+    @param          inUserData
+                        Passed to inProc.
+    @param          outLoadID
+                        Receives the ID of the load, for SoundEngine_CancelLoad.
+    @result         A OSStatus indicating success or failure.
+*/
+OSStatus  SoundEngine_LoadEffectAsync(const char* inPath, SoundEngineLoadProc inProc, void *inUserData, SoundEngineLoadID *outLoadID);
+
 /*!
     @function       SoundEngine_UnloadEffect
     @abstract       Releases all resources associated with the given effect ID
@@ -262,36 +951,182 @@ OSStatus  SoundEngine_LoadEffect(const char* inPath, UInt32* outEffectID);
 */
 OSStatus  SoundEngine_UnloadEffect(UInt32 inEffectID);
 
+/*!
+    @function       SoundEngine_SetEffectTrimThreshold
+    @abstract       Sets the level below which the head and the tail of an effect are trimmed off when it
+					is loaded, in blocks of 256 frames. The loop region of the file is always kept. 
+					Effects already loaded keep their data. Meant for effects played as one-shots: a 
+					voice waits out the trimmed head before its sound starts, from the voice update 
+					thread like a scheduled start, and the effect can not loop without a loop region.
+    @param          inValue
+                        A Float32 that represents the level, -60 dB is 0.001. Defaults to 0.0, which 
+						keeps every frame.
+    @result         A OSStatus indicating success or failure.
+*/
+OSStatus  SoundEngine_SetEffectTrimThreshold(Float32 inValue);
+
+/*!
+    @function       SoundEngine_GetEffectInfo
+    @abstract       Gets the trimmed length, the peak and the loudness of an effect, measured at load.
+    @param          inEffectID
+                        The ID of the effect.
+    @param          outInfo
+                        Receives the analysis of the effect.
+    @result         A OSStatus indicating success or failure.
+*/
+OSStatus  SoundEngine_GetEffectInfo(UInt32 inEffectID, SoundEngineEffectInfo *outInfo);
+
 	
 /*!
- @function       SoundEngine_StartEffect
- @abstract       Binds the sound effect buffer to a source
+ @function       SoundEngine_PrimeEffect
+ @abstract       Binds the sound effect buffer to a new voice. No OpenAL source is held until the voice
+					is started and audible.
+ @param          inEffectID
+					The ID of the effect to prime.
+ @param			outVoiceID
+					A SoundEngineVoiceID that refers to the voice.
+ @result         A OSStatus indicating success or failure. kSoundEngineErrNoSourcesAvailable is returned
+					when all the voices are primed.
+ */
+OSStatus  SoundEngine_PrimeEffect(UInt32 inEffectID, SoundEngineVoiceID *outVoiceID);
+
+/*!
+ @function       SoundEngine_PrimeEffectWithPriority
+ @abstract       Same as SoundEngine_PrimeEffect, with the priority used when sources have to be stolen
  @param          inEffectID
 					The ID of the effect to prime.
- @param			outSourceID
-					A ALuint ID that refers to the OpenAL source.
+ @param          inPriority
+					Between kSoundEnginePriorityLowest and kSoundEnginePriorityHighest. 
+					SoundEngine_PrimeEffect uses kSoundEnginePriorityDefault.
+ @param			outVoiceID
+					A SoundEngineVoiceID that refers to the voice.
+ @result         A OSStatus indicating success or failure.
+ */
+OSStatus  SoundEngine_PrimeEffectWithPriority(UInt32 inEffectID, UInt8 inPriority, SoundEngineVoiceID *outVoiceID);
+
+/*!
+ @function       SoundEngine_SetEffectPriority
+ @abstract       Changes the priority of a voice
+ @param          inVoiceID
+					The ID of the voice to adjust.
+ @param          inPriority
+					Between kSoundEnginePriorityLowest and kSoundEnginePriorityHighest.
  @result         A OSStatus indicating success or failure.
  */
-OSStatus  SoundEngine_PrimeEffect(UInt32 inEffectID, ALuint *outSourceID);
+OSStatus  SoundEngine_SetEffectPriority(SoundEngineVoiceID inVoiceID, UInt8 inPriority);
 	
+/*!
+ @function       SoundEngine_UnprimeEffect
+ @abstract       Stops a voice and makes it available for a later prime
+ @param          inVoiceID
+					The ID of the voice to release.
+ @result         A OSStatus indicating success or failure.
+ */
+OSStatus  SoundEngine_UnprimeEffect(SoundEngineVoiceID inVoiceID);
+
+/*!
+ @function       SoundEngine_SetEffectLoopPoints
+ @abstract       Sets the loop region of an effect. Voices of an effect with a loop region play the 
+				 intro once, then repeat the region until stopped. Loop markers found in the file are 
+				 applied when the effect is loaded.
+ @param          inEffectID
+					The ID of the effect to adjust.
+ @param          inLoopStart
+					First frame of the region, counted in the file, before any trimming.
+ @param          inLoopEnd
+					Frame after the last frame of the region. 0 and 0 remove the region.
+ @result         A OSStatus indicating success or failure. kSoundEngineErrInvalidRange if the region 
+				 falls outside of the effect, or starts in the silence trimmed off its head.
+ */
+OSStatus  SoundEngine_SetEffectLoopPoints(UInt32 inEffectID, UInt32 inLoopStart, UInt32 inLoopEnd);
+
+/*!
+ @function       SoundEngine_SetEffectLooping
+ @abstract       Turns looping of a voice on or off. A voice loops by default when its effect has a 
+				 loop region; without one, the whole effect loops. An effect trimmed at load can only 
+				 loop through a loop region.
+ @param          inVoiceID
+					The ID of the voice to adjust.
+ @param          inLooping
+					Whether the voice loops.
+ @result         A OSStatus indicating success or failure. kSoundEngineErrInvalidRange to loop a trimmed
+				 effect without a loop region.
+ */
+OSStatus  SoundEngine_SetEffectLooping(SoundEngineVoiceID inVoiceID, Boolean inLooping);
 	
 /*!
     @function       SoundEngine_StartEffect
-    @abstract       Starts playback of a source
-    @param          sourceID
-                        The ID of the source to start.
+    @abstract       Starts playback of a voice
+    @param          inVoiceID
+                        The ID of the voice to start.
+    @result         A OSStatus indicating success or failure.
+*/
+OSStatus  SoundEngine_StartEffect(SoundEngineVoiceID inVoiceID);
+
+/*!
+    @function       SoundEngine_PlayEffect
+    @abstract       Plays an effect without priming it. A voice is taken from the pool, set up and started 
+					by the voice update thread, and goes back to the pool as soon as it stops, so the same
+					effect can be retriggered over itself. The call never blocks.
+    @param          inEffectID
+                        The ID of the effect to play.
+    @param          inGain
+                        Gain of the voice, 1.0 is unity.
+    @param          inPitch
+                        Pitch of the voice, 1.0 is the original pitch.
+    @param          inPan
+                        From -1.0 (left) to 1.0 (right), 0.0 is centered.
+    @param          inPriority
+                        Between kSoundEnginePriorityLowest and kSoundEnginePriorityHighest.
+    @result         A OSStatus indicating success or failure. kSoundEngineErrNoSourcesAvailable is returned
+					when too many plays are waiting for the voice update thread. A play that finds no free
+					voice is dropped; effects with a loop region play it once.
+*/
+OSStatus  SoundEngine_PlayEffect(UInt32 inEffectID, Float32 inGain, Float32 inPitch, Float32 inPan, UInt8 inPriority);
+
+/*!
+    @function       SoundEngine_GetSampleTime
+    @abstract       Gets the engine sample clock, in frames at the mixer output rate since 
+					SoundEngine_Initialize. Start times are given against this clock.
+    @result         A OSStatus indicating success or failure.
+*/
+OSStatus  SoundEngine_GetSampleTime(UInt64 *outSampleTime);
+
+/*!
+    @function       SoundEngine_StartEffectAt
+    @abstract       Starts a voice when the sample clock reaches inSampleTime. A time already passed 
+					starts it at once; stopping the voice before then cancels the start.
+    @param          inVoiceID
+                        The ID of the voice to start.
+    @param          inSampleTime
+                        The start time, see SoundEngine_GetSampleTime.
+    @result         A OSStatus indicating success or failure.
+*/
+OSStatus  SoundEngine_StartEffectAt(SoundEngineVoiceID inVoiceID, UInt64 inSampleTime);
+
+/*!
+    @function       SoundEngine_StartEffectGroup
+    @abstract       Starts several voices in the same mix cycle, so layered sounds do not flam. Starts 
+					are checked every 10 ms at worst; a group that starts late skips the frames it is 
+					late by, so it stays aligned to its scheduled time.
+    @param          inVoiceIDs
+                        The IDs of the voices to start.
+    @param          inCount
+                        The number of voices.
+    @param          inSampleTime
+                        The start time, see SoundEngine_GetSampleTime. 0 starts the group at once.
     @result         A OSStatus indicating success or failure.
 */
-OSStatus  SoundEngine_StartEffect(ALuint sourceID);
+OSStatus  SoundEngine_StartEffectGroup(const SoundEngineVoiceID *inVoiceIDs, UInt32 inCount, UInt64 inSampleTime);
 
 /*!
     @function       SoundEngine_StopEffect
-    @abstract       Stops playback of a source
-	@param          sourceID
-						The ID of the source to stop.
+    @abstract       Stops playback of a voice
+	@param          inVoiceID
+						The ID of the voice to stop.
     @result         A OSStatus indicating success or failure.
 */
-OSStatus  SoundEngine_StopEffect(ALuint sourceID);
+OSStatus  SoundEngine_StopEffect(SoundEngineVoiceID inVoiceID);
 
 /*!
     @function       SoundEngine_Vibrate
@@ -304,32 +1139,32 @@ OSStatus  SoundEngine_StopEffect(ALuint sourceID);
 /*!
     @function       SoundEngine_SetEffectPitch
     @abstract       Applies pitch shifting to an effect
-	@param          sourceID
-						The ID of the source to adjust.
+	@param          inVoiceID
+						The ID of the voice to adjust.
     @param          inValue
                         A Float32 that represents the pitch scalar, with 1.0 being unchanged. Must 
 						be greater than 0.
     @result         A OSStatus indicating success or failure.
 */
-OSStatus  SoundEngine_SetEffectPitch(ALuint sourceID, Float32 inValue);
+OSStatus  SoundEngine_SetEffectPitch(SoundEngineVoiceID inVoiceID, Float32 inValue);
 
 /*!
     @function       SoundEngine_SetEffectVolume
     @abstract       Sets the volume for an effect
-	@param          sourceID
-						The ID of the source to adjust.
+	@param          inVoiceID
+						The ID of the voice to adjust.
     @param          inValue
                         A Float32 that represents the level. The range is between 0.0 and 1.0 (inclusive).
     @result         A OSStatus indicating success or failure.
 */
-OSStatus  SoundEngine_SetEffectLevel(ALuint sourceID, Float32 inValue);
+OSStatus  SoundEngine_SetEffectLevel(SoundEngineVoiceID inVoiceID, Float32 inValue);
 
 /*!
     @function       SoundEngine_SetEffectPosition
     @abstract       Tells the engine whether a given effect should loop when played or if it should
 					play through just once and stop.
-	@param          sourceID
-						The ID of the source to adjust.
+	@param          inVoiceID
+						The ID of the voice to adjust.
     @param          inX
                         A Float32 that represents the effect's position along the X axis. Maximum distance
 						is 100000.0 (absolute, not per axis), reference distance (distance from which gain 
@@ -344,11 +1179,90 @@ OSStatus  SoundEngine_SetEffectLevel(ALuint sourceID, Float32 inValue);
 						which gain begins to attenuate) is 1.0
 	@result         A OSStatus indicating success or failure.
 */
-OSStatus	SoundEngine_SetEffectPosition(ALuint sourceID, Float32 inX, Float32 inY, Float32 inZ);
+OSStatus	SoundEngine_SetEffectPosition(SoundEngineVoiceID inVoiceID, Float32 inX, Float32 inY, Float32 inZ);
+
+/*!
+    @function       SoundEngine_SetEffectBus
+    @abstract       Routes a voice to a bus. Voices go to kSoundEngineBus_Effects by default.
+	@param          inVoiceID
+						The ID of the voice to adjust.
+    @param          inBus
+                        kSoundEngineBus_Effects or one of its sub-buses.
+    @result         A OSStatus indicating success or failure.
+*/
+OSStatus  SoundEngine_SetEffectBus(SoundEngineVoiceID inVoiceID, SoundEngineBusID inBus);
+
+/*!
+    @function       SoundEngine_SetVoiceMetering
+    @abstract       Meters a voice, independently of the bus meters. Up to 16 voices are metered at once; 
+					a voice stops being metered when it is unprimed or its one-shot ends.
+	@param          inVoiceID
+						The ID of the voice to meter.
+    @param          inEnable
+                        True to meter the voice, false to release its meter.
+    @result         A OSStatus indicating success or failure. kSoundEngineErrNoSourcesAvailable if 16 
+					voices are metered already.
+*/
+OSStatus  SoundEngine_SetVoiceMetering(SoundEngineVoiceID inVoiceID, Boolean inEnable);
+
+/*!
+    @function       SoundEngine_GetVoiceMeter
+    @abstract       Gets the levels of a metered voice over the last pass of the voice update thread, 
+					estimated from the effect file at the play cursor times the gain the voice is heard 
+					at. A virtual voice reports what it would be heard at. Does not block.
+	@param          inVoiceID
+						The ID of the voice.
+    @param          outPeak
+                        Receives the peak level, linear, or NULL.
+    @param          outRMS
+                        Receives the RMS level, linear, or NULL.
+    @result         A OSStatus indicating success or failure. kSoundEngineErrInvalidID if the voice is 
+					not metered.
+*/
+OSStatus  SoundEngine_GetVoiceMeter(SoundEngineVoiceID inVoiceID, Float32 *outPeak, Float32 *outRMS);
+
+/*!
+    @function       SoundEngine_SetEffectOcclusion
+    @abstract       Muffles a voice as if heard through a wall, using the ALC_EXT_ASA low-pass
+	@param          inVoiceID
+						The ID of the voice to adjust.
+    @param          inValue
+                        Attenuation of the high frequencies in dB, between -100.0 and 0.0 (no occlusion).
+    @result         A OSStatus indicating success or failure. kSoundEngineErrUnsupported if ALC_EXT_ASA 
+					is not available. Before the device is open the value is kept for the voice.
+*/
+OSStatus  SoundEngine_SetEffectOcclusion(SoundEngineVoiceID inVoiceID, Float32 inValue);
+
+/*!
+    @function       SoundEngine_SetEffectReverbSend
+    @abstract       Sets how much of a voice is sent to the shared reverb
+	@param          inVoiceID
+						The ID of the voice to adjust.
+    @param          inValue
+                        Send level, between 0.0 (dry) and 1.0.
+    @result         A OSStatus indicating success or failure. kSoundEngineErrUnsupported if ALC_EXT_ASA 
+					is not available. Before the device is open the value is kept for the voice.
+*/
+OSStatus  SoundEngine_SetEffectReverbSend(SoundEngineVoiceID inVoiceID, Float32 inValue);
+
+/*!
+    @function       SoundEngine_SetReverb
+    @abstract       Configures the reverb shared by all the effects
+    @param          inOn
+                        Turns the reverb on or off.
+    @param          inRoomType
+                        One of the ALC_ASA_REVERB_ROOM_TYPE values, 0 (small room) to 12 (large hall 2).
+    @param          inLevelDB
+                        Output level of the reverb, between -40.0 and 40.0 dB.
+    @result         A OSStatus indicating success or failure. kSoundEngineErrUnsupported if ALC_EXT_ASA 
+					is not available. Before the device is open the reverb is kept and set once it is.
+*/
+OSStatus  SoundEngine_SetReverb(Boolean inOn, UInt32 inRoomType, Float32 inLevelDB);
 
 /*!
    @function       SoundEngine_SetEffectsVolume
-   @abstract       Sets the overall volume for the effects
+   @abstract       Sets the overall volume for the effects. Same as setting the volume of 
+				   kSoundEngineBus_Effects
    @param          inValue
                        A Float32 that represents the level. The range is between 0.0 and 1.0 (inclusive).
    @result         A OSStatus indicating success or failure.
@@ -376,6 +1290,39 @@ OSStatus	SoundEngine_SetMaxDistance(Float32 inValue);
 */
 OSStatus	SoundEngine_SetReferenceDistance(Float32 inValue);
 
+/*!
+   @function       SoundEngine_SetVirtualVoiceThreshold
+   @abstract       Sets the gain below which a playing voice is made virtual. A virtual voice gives its 
+				   OpenAL source back and is not mixed, but keeps advancing its play cursor. It becomes 
+				   real again when its gain, including distance attenuation, goes over the threshold.
+   @param          inValue
+                       A Float32 that represents the level. Defaults to 0.001 (-60 dB).
+   @result         A OSStatus indicating success or failure.
+*/
+OSStatus	SoundEngine_SetVirtualVoiceThreshold(Float32 inValue);
+
+/*!
+   @function       SoundEngine_SetVoiceUpdateThreads
+   @abstract       Sets how many threads share the voice update pass once 256 or more voices are primed. 
+				   Defaults to one less than the number of active cores, at most 4. The result does not
+				   depend on the number of threads.
+   @param          inThreads
+                       A UInt32 from 1, a single thread, to 4.
+   @result         A OSStatus indicating success or failure.
+*/
+OSStatus	SoundEngine_SetVoiceUpdateThreads(UInt32 inThreads);
+
+/*!
+   @function       SoundEngine_SetMaxVoices
+   @abstract       Sets how many effects can be primed at once, real or virtual. Defaults to 1024. The
+				   memory and the cost of a voice update pass grow linearly with it. Primed voices are
+				   kept, the count cannot go below the highest one still primed.
+   @param          inMaxVoices
+                       A UInt32 from 1 to 65534.
+   @result         A OSStatus indicating success or failure.
+*/
+OSStatus	SoundEngine_SetMaxVoices(UInt32 inMaxVoices);
+
 #if defined(__cplusplus)
 }
 #endif
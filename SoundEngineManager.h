@@ -6,16 +6,31 @@
 //
 
 #import <Foundation/Foundation.h>
+#import "SoundEngine.h"
 
 
 @class AmbientSound;
+@class SoundEffectTable;
+
+
+// A prepared effect, played without any name lookup. It is the engine effect ID, so it goes stale
+// when its page is unloaded. Each play takes a voice of its own, retriggers overlap.
+typedef UInt32 SoundEffectHandle;
+#define kSoundEffectHandleInvalid 0
+
+static inline OSStatus SoundEngineManager_PlayEffect(SoundEffectHandle handle) {
+	return SoundEngine_PlayEffect(handle, 1.0, 1.0, 0.0, kSoundEnginePriorityDefault);
+}
 
 
 @interface SoundEngineManager : NSObject {
 	bool _initialized;
 	NSMutableDictionary *_effects;
+	NSString *_lastPage;
+	SoundEffectTable *_lastPageEffects;
+	NSMutableDictionary *_loads;	// params of the effects loading in the background, by load ID
 	
-	AmbientSound *_ambients[2];
+	NSMutableDictionary *_ambients;
 }
 
 + (SoundEngineManager*) sharedManager;
@@ -29,8 +44,10 @@
 
 - (bool) isEffectPrepared:(NSString*)name fromPage:(NSString*)page;
 
-- (void) prepareEffect:(NSString*)name withFile:(NSString*)path fromPage:(NSString*)page inBackground:(bool)background;
-- (void) prepareEffect:(NSString*)name withFile:(NSString*)path fromPage:(NSString*)page;
+// Both return the handle of the effect, kSoundEffectHandleInvalid while it loads in the background.
+- (SoundEffectHandle) prepareEffect:(NSString*)name withFile:(NSString*)path fromPage:(NSString*)page inBackground:(bool)background;
+- (SoundEffectHandle) prepareEffect:(NSString*)name withFile:(NSString*)path fromPage:(NSString*)page;
+- (SoundEffectHandle) handleForEffect:(NSString*)name fromPage:(NSString*)page;
 - (void) playEffect:(NSString*)name fromPage:(NSString*)page;
 - (void) unloadEffectsFromPage:(NSString*)page;
 
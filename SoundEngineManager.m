@@ -6,7 +6,6 @@
 //
 
 #import "SoundEngineManager.h"
-#import "SoundEngine.h"
 #import "AmbientSound.h"
 #import "macros.h"
 
@@ -18,6 +17,119 @@ static const NSString* kPathParam = @"path";
 static const NSString* kPageParam = @"page";
 
 
+#define kPerfectHashSeeds 64	// seeds tried before the slot table doubles
+#define kPerfectHashGrowths 3	// doublings tried before colliding names share slots
+
+
+static inline UInt32 SlotForHash(NSUInteger hash, UInt32 seed, UInt32 mask) {
+	UInt32 x = ((UInt32)hash ^ (UInt32)((UInt64)hash >> 32) ^ seed) * 0x9E3779B1;
+	return (x ^ (x >> 15)) & mask;
+}
+
+
+// Effects of one page. Names are found through a perfect hash rebuilt whenever the page gets a new
+// effect, so a lookup costs one string hash and one string compare. Names with the same hash, or
+// still colliding once the table has grown a few times, share a slot and are told apart by a compare.
+@interface SoundEffectTable : NSObject {
+@public
+	NSMutableArray *_names;
+	NSUInteger *_hashes;
+	UInt32 *_effectIds;
+	UInt32 _count;
+	SInt32 *_slots;		// entry of each slot, -1 when empty
+	SInt32 *_next;		// next entry of the same slot, -1 at the end
+	UInt32 _mask;
+	UInt32 _seed;
+}
+
+- (void) addEffect:(NSString*)name effectId:(UInt32)effectId;
+- (int) indexOfEffect:(NSString*)name;
+
+@end
+
+
+@implementation SoundEffectTable
+
+- (id) init
+{
+	if (self = [super init]) {
+		_names = [[NSMutableArray alloc] init];
+	}
+	return self;
+}
+
+- (bool) buildSlots:(UInt32)size withSeed:(UInt32)seed sharing:(bool)sharing
+{
+	for (UInt32 i = 0; i < size; i++)
+		_slots[i] = -1;
+	for (UInt32 i = 0; i < _count; i++) {
+		UInt32 slot = SlotForHash(_hashes[i], seed, size - 1);
+		// no seed separates equal hashes
+		if (_slots[slot] != -1 && !sharing && _hashes[_slots[slot]] != _hashes[i])
+			return NO;
+		_next[i] = _slots[slot];
+		_slots[slot] = i;
+	}
+	_mask = size - 1;
+	_seed = seed;
+	return YES;
+}
+
+- (void) rebuild
+{
+	UInt32 size = 1;
+	while (size < _count * 2)
+		size <<= 1;
+	
+	for (UInt32 growth = 0; growth < kPerfectHashGrowths; growth++, size <<= 1) {
+		_slots = realloc(_slots, size * sizeof(SInt32));
+		for (UInt32 seed = 0; seed < kPerfectHashSeeds; seed++) {
+			if ([self buildSlots:size withSeed:seed sharing:NO])
+				return;
+		}
+	}
+	_slots = realloc(_slots, size * sizeof(SInt32));
+	[self buildSlots:size withSeed:0 sharing:YES];
+}
+
+- (void) addEffect:(NSString*)name effectId:(UInt32)effectId
+{
+	int index = [self indexOfEffect:name];
+	if (index < 0) {
+		index = _count++;
+		_hashes = realloc(_hashes, _count * sizeof(NSUInteger));
+		_effectIds = realloc(_effectIds, _count * sizeof(UInt32));
+		_next = realloc(_next, _count * sizeof(SInt32));
+		_hashes[index] = [name hash];
+		[_names addObject:name];
+		[self rebuild];
+	}
+	_effectIds[index] = effectId;
+}
+
+- (int) indexOfEffect:(NSString*)name
+{
+	if (_count == 0)
+		return -1;
+	SInt32 index = _slots[SlotForHash([name hash], _seed, _mask)];
+	while (index >= 0 && ![name isEqualToString:[_names objectAtIndex:index]])
+		index = _next[index];
+	return index;
+}
+
+- (void) dealloc
+{
+	[_names release];
+	free(_hashes);
+	free(_effectIds);
+	free(_slots);
+	free(_next);
+	[super dealloc];
+}
+
+@end
+
+
 
 @implementation SoundEngineManager
 
@@ -51,8 +163,8 @@ static const NSString* kPageParam = @"page";
 	if (self = [super init]) {
 		_initialized = false;
 		_effects = [[NSMutableDictionary alloc] init];
-		_ambients[0] = nil;
-		_ambients[1] = nil;
+		_loads = [[NSMutableDictionary alloc] init];
+		_ambients = [[NSMutableDictionary alloc] init];
 	}
 	return self;
 }
@@ -68,82 +180,123 @@ static const NSString* kPageParam = @"page";
 	NSLog(@"initilizing sound engine");
 	_initialized = true;
 
-	SoundEngine_Initialize(44100);
+	NSString *caches = [NSSearchPathForDirectoriesInDomains(NSCachesDirectory, NSUserDomainMask, YES) objectAtIndex:0];
+	SoundEngine_SetDecodeCacheDirectory([[caches stringByAppendingPathComponent:@"DecodedAudio"] fileSystemRepresentation]);
+	SoundEngine_InitializeDeferred(44100);
+	// effects only play as one-shots here, their silent ends are not worth keeping
+	SoundEngine_SetEffectTrimThreshold(0.001);
 	SoundEngine_SetListenerPosition(0.0, 0.0, 1.0);
-	SoundEngine_SetMasterVolume(0, 1.0);
-	SoundEngine_SetMasterVolume(1, 1.0);
+	SoundEngine_SetBusVolume(kSoundEngineBus_Master, 1.0);
 	SoundEngine_SetEffectsVolume(1.0);
 }
 
-- (bool) isEffectPrepared:(NSString*)name fromPage:(NSString*)page
+// called with the lock held, the page played last is kept aside since it is usually played again
+- (SoundEffectTable*) effectsForPage:(NSString*)page
 {
-    NSArray *pageComponents = [_effects objectForKey:page];
-    NSDictionary *pageEffects = [pageComponents objectAtIndex:0];
-    return ([pageEffects objectForKey:name] != nil);
+	if (page != _lastPage && ![page isEqualToString:_lastPage]) {
+		SoundEffectTable *effects = [_effects objectForKey:page];
+		if (effects == nil)
+			return nil;
+		[_lastPage release];
+		_lastPage = [page copy];
+		_lastPageEffects = effects;
+	}
+	return _lastPageEffects;
 }
 
-- (void) setEffectId:(UInt32)soundId andSourceId:(ALuint)sourceId withName:(NSString*)name fromPage:(NSString*)page
+- (bool) isEffectPrepared:(NSString*)name fromPage:(NSString*)page
 {
-	NSMutableDictionary *pageEffects, *pageSources;
-	NSArray *pageComponents = [_effects objectForKey:page];
-    if (pageComponents) {
-        pageEffects = [pageComponents objectAtIndex:0];
-        pageSources = [pageComponents objectAtIndex:1];
-    } else {
-		pageEffects = [[NSMutableDictionary alloc] init];
-        pageSources = [[NSMutableDictionary alloc] init];
-        pageComponents = [NSArray arrayWithObjects:pageEffects, pageSources, nil];
-		[_effects setObject:pageComponents forKey:page];
-        [pageEffects release];
-        [pageSources release];
-    }
-
-	NSNumber *sid = [[NSNumber alloc] initWithUnsignedLong:soundId];
-	[pageEffects setObject:sid forKey:name];
-	[sid release];
-
-	sid = [[NSNumber alloc] initWithUnsignedInt:sourceId];
-	[pageSources setObject:sid forKey:name];
-	[sid release];
+	return ([self handleForEffect:name fromPage:page] != kSoundEffectHandleInvalid);
 }
 
-- (UInt32) effectIdForName:(NSString*)name fromPage:(NSString*)page
+- (void) setEffectId:(UInt32)soundId withName:(NSString*)name fromPage:(NSString*)page
 {
-    UInt32 ret = -1;
-	NSArray *pageComponents = [_effects objectForKey:page];
-    if (pageComponents) {
-        NSMutableDictionary *pageEffects = [pageComponents objectAtIndex:0];
-        ret = [[pageEffects objectForKey:name] unsignedLongValue];
-    }
-    return ret;
+	@synchronized (self) {
+		SoundEffectTable *effects = [_effects objectForKey:page];
+		if (effects == nil) {
+			effects = [[SoundEffectTable alloc] init];
+			[_effects setObject:effects forKey:page];
+			[effects release];
+		}
+		[effects addEffect:name effectId:soundId];
+	}
 }
 
-- (ALuint) sourceIdForName:(NSString*)name fromPage:(NSString*)page
+- (SoundEffectHandle) handleForEffect:(NSString*)name fromPage:(NSString*)page
 {
-    ALuint ret = -1;
-	NSArray *pageComponents = [_effects objectForKey:page];
-    if (pageComponents) {
-        NSMutableDictionary *pageSources = [pageComponents objectAtIndex:1];
-        ret = [[pageSources objectForKey:name] unsignedIntValue];
-    }
-    return ret;
+	@synchronized (self) {
+		SoundEffectTable *effects = [self effectsForPage:page];
+		int index = [effects indexOfEffect:name];
+		return (effects && index >= 0) ? effects->_effectIds[index] : kSoundEffectHandleInvalid;
+	}
+	return kSoundEffectHandleInvalid;
 }
 
 
 
-- (void) performPrepareEffectInBackgroundWithParams:(NSDictionary*)params
+- (void) effectLoad:(SoundEngineLoadID)loadId finishedWithResult:(OSStatus)result effectId:(UInt32)soundId
+{
+	@synchronized (self) {
+		NSNumber *key = [NSNumber numberWithUnsignedInt:loadId];
+		NSDictionary *params = [_loads objectForKey:key];
+		if (params == nil) {
+			// its page was unloaded after the load could no longer be canceled
+			if (result == noErr)
+				SoundEngine_UnloadEffect(soundId);
+			return;
+		}
+		
+		NSString* name = [params objectForKey:kNameParam];
+		NSString* page = [params objectForKey:kPageParam];
+		if (result == noErr) {
+			[self setEffectId:soundId withName:name fromPage:page];
+			NSLog(@"Effect with name %@ for page %@ loaded with soundId=%lu", name, page, soundId);
+		} else if (result != kSoundEngineErrCanceled) {
+			NSLog(@"Effect with name %@ for page %@ could not be loaded", name, page);
+		}
+		[_loads removeObjectForKey:key];
+	}
+}
+
+// called on the engine loader thread
+static void EffectLoaded(void *userData, const SoundEngineLoadEvent *event)
 {
-    // Set up a pool for the background task.
     NSAutoreleasePool* pool = [[NSAutoreleasePool alloc] init];
-    
-    [self performPrepareEffectWithParams:params];
-    [params release];
-    
+    [(SoundEngineManager*)userData effectLoad:event->mLoadID finishedWithResult:event->mResult effectId:event->mEffectID];
     [pool release];
 }
 
+- (bool) isEffectLoading:(NSString*)name fromPage:(NSString*)page
+{
+	@synchronized (self) {
+		for (NSDictionary *params in [_loads allValues]) {
+			if ([[params objectForKey:kNameParam] isEqualToString:name] && [[params objectForKey:kPageParam] isEqualToString:page])
+				return YES;
+		}
+	}
+	return NO;
+}
+
+- (void) performPrepareEffectInBackgroundWithParams:(NSDictionary*)params
+{
+	if (!_initialized) {
+		[self initialize];
+	}
+	
+	// held across the start so the completion always finds the load registered
+	@synchronized (self) {
+		SoundEngineLoadID loadId;
+		NSString* path = [params objectForKey:kPathParam];
+		if (SoundEngine_LoadEffectAsync([path UTF8String], EffectLoaded, self, &loadId)) {
+			NSLog(@"Effect with name %@ for page %@ could not be loaded", [params objectForKey:kNameParam], [params objectForKey:kPageParam]);
+			return;
+		}
+		[_loads setObject:params forKey:[NSNumber numberWithUnsignedInt:loadId]];
+	}
+}
+
 
-- (void) performPrepareEffectWithParams:(NSDictionary*)params
+- (SoundEffectHandle) performPrepareEffectWithParams:(NSDictionary*)params
 {
     NSString* name = [params objectForKey:kNameParam];
     NSString* path = [params objectForKey:kPathParam];
@@ -153,19 +306,23 @@ static const NSString* kPageParam = @"page";
 		[self initialize];
 	}
 	
+    // no voice is primed here, every play takes one from the engine pool and gives it back when done
     UInt32 soundId;
-    ALuint sourceId;
-    SoundEngine_LoadEffect([path UTF8String], &soundId);
-    SoundEngine_PrimeEffect(soundId, &sourceId);
+    if (SoundEngine_LoadEffect([path UTF8String], &soundId)) {
+        NSLog(@"Effect with name %@ for page %@ could not be loaded", name, page);
+        return kSoundEffectHandleInvalid;
+    }
         
-    [self setEffectId:soundId andSourceId:sourceId withName:name fromPage:page];
-    NSLog(@"Effect with name %@ for page %@ loaded with soundId=%lu and sourceId=%u", name, page, soundId, sourceId);
+    [self setEffectId:soundId withName:name fromPage:page];
+    NSLog(@"Effect with name %@ for page %@ loaded with soundId=%lu", name, page, soundId);
+    return soundId;
 }
 
-- (void) prepareEffect:(NSString*)name withFile:(NSString*)path fromPage:(NSString*)page inBackground:(bool)background
+- (SoundEffectHandle) prepareEffect:(NSString*)name withFile:(NSString*)path fromPage:(NSString*)page inBackground:(bool)background
 {
-    if ([self isEffectPrepared:name fromPage:page]) {
-        return;
+    SoundEffectHandle handle = [self handleForEffect:name fromPage:page];
+    if (handle != kSoundEffectHandleInvalid) {
+        return handle;
     }
 
     NSDictionary *params = [[NSDictionary alloc] initWithObjectsAndKeys:
@@ -174,40 +331,55 @@ static const NSString* kPageParam = @"page";
                                 page, kPageParam,
                                 nil];
     if (background) {
-        [params retain]; // released on background thread
-        [self performSelectorInBackground:@selector(performPrepareEffectInBackgroundWithParams:) withObject:params];
+        if (![self isEffectLoading:name fromPage:page])
+            [self performPrepareEffectInBackgroundWithParams:params];
     } else {
-        [self performPrepareEffectWithParams:params];
+        handle = [self performPrepareEffectWithParams:params];
     }
     
     [params release];
+    return handle;
 }
 
-- (void) prepareEffect:(NSString*)name withFile:(NSString*)path fromPage:(NSString*)page
+- (SoundEffectHandle) prepareEffect:(NSString*)name withFile:(NSString*)path fromPage:(NSString*)page
 {
-    [self prepareEffect:name withFile:path fromPage:page inBackground:NO];
+    return [self prepareEffect:name withFile:path fromPage:page inBackground:NO];
 }
 
 - (void) playEffect:(NSString*)name fromPage:(NSString*)page
 {
-    ALuint sourceId = [self sourceIdForName:name fromPage:page];
-	if (sourceId == -1) {
+    SoundEffectHandle handle = [self handleForEffect:name fromPage:page];
+	if (handle == kSoundEffectHandleInvalid) {
 		NSLog(@"Sound %@ doesn't prepared", name);
 		return;
 	}
-	SoundEngine_StartEffect(sourceId);
+	SoundEngineManager_PlayEffect(handle);
 }
 
 - (void) unloadEffectsFromPage:(NSString*)page
 {
-	NSArray *pageComponents = [_effects objectForKey:page];
-	NSMutableDictionary *pageEffects = [pageComponents objectAtIndex:0];
-	for (NSString* name in pageEffects) {
-		NSLog(@"Unload effect name %@ for page %@", name, page);
-        NSNumber *sid = [pageEffects objectForKey:name];
-        SoundEngine_UnloadEffect([sid unsignedLongValue]);
+	@synchronized (self) {
+		// the loads still running for the page are not worth finishing
+		for (NSNumber *key in [_loads allKeys]) {
+			if ([[[_loads objectForKey:key] objectForKey:kPageParam] isEqualToString:page]) {
+				SoundEngine_CancelLoad([key unsignedIntValue]);
+				[_loads removeObjectForKey:key];
+			}
+		}
+		
+		SoundEffectTable *effects = [_effects objectForKey:page];
+		if (effects == nil)
+			return;
+		for (UInt32 i = 0; i < effects->_count; i++) {
+			NSLog(@"Unload effect name %@ for page %@", [effects->_names objectAtIndex:i], page);
+			SoundEngine_UnloadEffect(effects->_effectIds[i]);
+		}
+		if (effects == _lastPageEffects) {
+			SAFE_RELEASE(_lastPage);
+			_lastPageEffects = nil;
+		}
+		[_effects removeObjectForKey:page];
 	}
-    [_effects removeObjectForKey:page];
 }
 
 + (void) vibrate
@@ -215,20 +387,28 @@ static const NSString* kPageParam = @"page";
 	SoundEngine_Vibrate();
 }
 
+- (AmbientSound*) ambientInSlot:(int)slot
+{
+	return [_ambients objectForKey:[NSNumber numberWithInt:slot]];
+}
+
 - (void) loadAmbient:(NSString*)path inSlot:(int)slot
 {
 	if (!_initialized) {
 		[self initialize];
 	}
 
-	if (_ambients[slot] == nil) {
-		_ambients[slot] = [[AmbientSound alloc] init];
+	AmbientSound *ambient = [self ambientInSlot:slot];
+	if (ambient == nil) {
+			// each slot streams on its own engine stream, there is no limit on the number of layers
+		ambient = [[AmbientSound alloc] init];
+		[_ambients setObject:ambient forKey:[NSNumber numberWithInt:slot]];
+		[ambient release];
 	} else{
-		[_ambients[slot] stopAndUnloadWithFadeTime:0.0];
+		[ambient stopAndUnloadWithFadeTime:0.0];
 	}
 
-	_ambients[slot].slot = slot;
-	[_ambients[slot] loadFromPath:path];
+	[ambient loadFromPath:path];
 }
 
 - (void) loadAndPlayAmbient:(NSString*)path withFadeTime:(double)time inSlot:(int)slot
@@ -240,41 +420,42 @@ static const NSString* kPageParam = @"page";
 
 - (void) playLoadedAmbientWithFadeTime:(double)time inSlot:(int)slot
 {
-	[_ambients[slot] playLoadedWithFadeTime:time];
+	[[self ambientInSlot:slot] playLoadedWithFadeTime:time];
 }
 
 
 - (void) stopAndUnloadAmbientWithFadeTime:(double)fade inSlot:(int)slot
 {
-	[_ambients[slot] stopAndUnloadWithFadeTime:fade];
+	[[self ambientInSlot:slot] stopAndUnloadWithFadeTime:fade];
 }
 
 - (void) replaceCurrentAmbientWith:(NSString*)path withFadeTime:(double)fade inSlot:(int)slot
 {
-    if (_ambients[slot] == nil) {
+    AmbientSound *ambient = [self ambientInSlot:slot];
+    if (ambient == nil) {
         [self loadAndPlayAmbient:path withFadeTime:fade inSlot:slot];
     } else {
-        [_ambients[slot] replaceCurrentWith:path withFadeTime:fade];
+        [ambient replaceCurrentWith:path withFadeTime:fade];
     }    
 }
 
 
 - (void) dealloc
 {
-	for (int i = 0; i < ARRAY_LEN(_ambients); ++i) {
-		if (_ambients[i] != nil) {
-			if (_ambients[i].volume != -1.0) {
-				[_ambients[i] stopAndUnloadWithFadeTime:0.0];
-			}
-			SAFE_RELEASE(_ambients[i]);
+	for (AmbientSound *ambient in [_ambients allValues]) {
+		if (ambient.volume != -1.0) {
+			[ambient stopAndUnloadWithFadeTime:0.0];
 		}
 	}
+	SAFE_RELEASE(_ambients);
 
-	for (NSString* page in _effects) {
+	for (NSString* page in [_effects allKeys]) {
 		[self unloadEffectsFromPage:page];
 	}
-	[_effects release];
+	// the loads still completing are delivered during the teardown, they look up the pages
 	SoundEngine_Teardown();
+	[_effects release];
+	[_loads release];
 	[super dealloc];
 }
 
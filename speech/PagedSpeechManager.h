@@ -10,13 +10,30 @@
 #import "SpeechManager.h"
 
 
+// One chunk of narration per page, in a flat table indexed by page number.
+typedef struct PagedSpeechEntry {
+	NSTimeInterval start;		// -1 when the page has no speech
+	NSTimeInterval length;
+	float volume;
+} PagedSpeechEntry;
+
+// Pages above this are rejected, the table has one entry per page up to the highest one.
+#define kPagedSpeechMaxPage 65535
+
+
 @interface PagedSpeechManager : SpeechManager {
 	int _currentPage;
+	PagedSpeechEntry *_pages;
+	int _pageCount;
 }
 
 @property (nonatomic, assign) int currentPage;
 
 
+// Reads a chunk index written next to the narration file, see PagedSpeechManager.m for the format.
+// initWithFile: loads <file>.chunks when there is one.
+- (bool) loadChunkIndex:(NSString*)path;
+
 - (void) addSpeechForPageNumber:(NSNumber*)page withChunk:(SpeechChunk*)chunk;
 - (void) addSpeechForPage:(int)page withChunk:(SpeechChunk*)chunk;
 
@@ -9,24 +9,155 @@
 #import "PagedSpeechManager.h"
 #import "SpeechChunk.h"
 
+
+// Chunk index sidecar, all fields little-endian:
+//   header   'SPCI' (UInt32), version 1 (UInt32), sample rate (Float64), entry count (UInt32), reserved (UInt32)
+//   entries  page (UInt32), start frame (UInt32), length in frames (UInt32), gain (Float32), sorted by page
+#define kChunkIndexMagic		0x49435053		// 'SPCI' as read from a little-endian file
+#define kChunkIndexVersion		1
+#define kChunkIndexHeaderSize	24
+#define kChunkIndexEntrySize	16
+
+
+static UInt32 ReadUInt32(const UInt8 *bytes) {
+	UInt32 value;
+	memcpy(&value, bytes, sizeof(value));
+	return CFSwapInt32LittleToHost(value);
+}
+
+
 @implementation PagedSpeechManager
 
 @synthesize currentPage = _currentPage;
 
 
+- (id) initWithFile:(NSString*)file {
+	if (self = [super initWithFile:file]) {
+		NSString *index = [file stringByAppendingPathExtension:@"chunks"];
+		if ([[NSFileManager defaultManager] fileExistsAtPath:index])
+			[self loadChunkIndex:index];
+	}
+	return self;
+}
+
+
+- (bool) growToPage:(int)page {
+	if (page < 0 || page > kPagedSpeechMaxPage) {
+		DDLogError(@"Speech page %d out of range", page);
+		return NO;
+	}
+	if (page < _pageCount)
+		return YES;
+	
+	PagedSpeechEntry *pages = realloc(_pages, (page + 1) * sizeof(PagedSpeechEntry));
+	if (!pages)
+		return NO;
+	for (int i = _pageCount; i <= page; i++) {
+		pages[i].start = -1.0;
+		pages[i].length = -1.0;
+		pages[i].volume = 1.0f;
+	}
+	_pages = pages;
+	_pageCount = page + 1;
+	return YES;
+}
+
+
+- (bool) loadChunkIndex:(NSString*)path {
+	// the whole index comes in with one read
+	NSData *data = [NSData dataWithContentsOfFile:path];
+	const UInt8 *bytes = [data bytes];
+	if ([data length] < kChunkIndexHeaderSize || ReadUInt32(bytes) != kChunkIndexMagic || ReadUInt32(bytes + 4) != kChunkIndexVersion) {
+		DDLogError(@"Invalid speech chunk index %@", path);
+		return NO;
+	}
+	
+	CFSwappedFloat64 swappedRate;
+	memcpy(&swappedRate, bytes + 8, sizeof(swappedRate));
+	Float64 sampleRate = CFConvertFloat64SwappedToHost(swappedRate);
+	UInt32 count = ReadUInt32(bytes + 16);
+	if (sampleRate <= 0.0 || [data length] < kChunkIndexHeaderSize + (NSUInteger)count * kChunkIndexEntrySize) {
+		DDLogError(@"Invalid speech chunk index %@", path);
+		return NO;
+	}
+	
+	// entries should be sorted by page, an index that isn't still loads since the table is indexed by page
+	const UInt8 *entries = bytes + kChunkIndexHeaderSize;
+	UInt32 lastPage = 0;
+	bool sorted = YES;
+	for (UInt32 i = 0; i < count; i++) {
+		UInt32 page = ReadUInt32(entries + i * kChunkIndexEntrySize);
+		if (page > kPagedSpeechMaxPage) {
+			DDLogError(@"Speech page %u out of range in %@", (unsigned)page, path);
+			continue;
+		}
+		if (page < lastPage)
+			sorted = NO;
+		else
+			lastPage = page;
+	}
+	if (!sorted)
+		DDLogError(@"Speech chunk index %@ isn't sorted by page", path);
+	if (count > 0 && ![self growToPage:lastPage])
+		return NO;
+	
+	for (UInt32 i = 0; i < count; i++) {
+		const UInt8 *entry = entries + i * kChunkIndexEntrySize;
+		UInt32 page = ReadUInt32(entry);
+		if (page >= (UInt32)_pageCount)
+			continue;
+		CFSwappedFloat32 swappedGain;
+		memcpy(&swappedGain, entry + 12, sizeof(swappedGain));
+		_pages[page].start = ReadUInt32(entry + 4) / sampleRate;
+		_pages[page].length = ReadUInt32(entry + 8) / sampleRate;
+		_pages[page].volume = CFConvertFloat32SwappedToHost(swappedGain);
+	}
+	DDLogVerbose(@"Loaded %u speech chunks from %@", (unsigned)count, path);
+	return YES;
+}
+
+
 - (void) addSpeechForPageNumber:(NSNumber*)page withChunk:(SpeechChunk*)chunk {
-    DDLogCVerbose(@"Add speech for page %@ start=%f len=%f", page, chunk->start, chunk->length);
-	[self addSpeech:page withChunk:chunk];
+	[self addSpeechForPage:[page intValue] withChunk:chunk];
 }
 
 
 - (void) addSpeechForPage:(int)page withChunk:(SpeechChunk*)chunk {
 	DDLogCVerbose(@"Add speech for page %d start=%f len=%f", page, chunk->start, chunk->length);
-	[self addSpeech:[NSNumber numberWithInt:page] withChunk:chunk];
+	if ([self growToPage:page]) {
+		_pages[page].start = chunk->start;
+		_pages[page].length = chunk->length;
+		_pages[page].volume = chunk->volume;
+	}
+}
+
+
+// pages live in the table, any other speech id in the dictionary of SpeechManager
+- (PagedSpeechEntry*) entryForSpeech:(id)speechId {
+	if (![speechId isKindOfClass:[NSNumber class]])
+		return NULL;
+	int page = [speechId intValue];
+	return (page >= 0 && page < _pageCount && _pages[page].start >= 0.0) ? &_pages[page] : NULL;
+}
+
+- (NSTimeInterval) startTimeForSpeech:(id)speechId {
+	PagedSpeechEntry *entry = [self entryForSpeech:speechId];
+	return entry ? entry->start : [super startTimeForSpeech:speechId];
 }
 
+- (NSTimeInterval) lengthForSpeech:(id)speechId {
+	PagedSpeechEntry *entry = [self entryForSpeech:speechId];
+	return entry ? entry->length : [super lengthForSpeech:speechId];
+}
+
+- (float) volumeForSpeech:(id)speechId {
+	PagedSpeechEntry *entry = [self entryForSpeech:speechId];
+	return entry ? entry->volume : [super volumeForSpeech:speechId];
+}
+
+
 - (bool) playSpeechForPage:(int)page {
-	return [self playSpeech:[NSNumber numberWithInt:page]];	
+	return [self playSpeechForPage:page stoppingPrevious:YES];
 }
 
 - (bool) isPlayingPage:(int)page {
@@ -34,10 +165,15 @@
     return (n != nil && [n intValue] == page);
 }
 
+// pages missing from the table may still have been added to SpeechManager with addSpeech:, playSpeech: looks up both
 - (bool) playSpeechForPage:(int)page stoppingPrevious:(bool)stop {
 	return [self playSpeech:[NSNumber numberWithInt:page] stoppingPrevious:stop];
 }
 
 
+- (void) dealloc {
+	free(_pages);
+	[super dealloc];
+}
 
 @end
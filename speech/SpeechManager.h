@@ -6,8 +6,8 @@
 //  Copyright 2010 __MyCompanyName__. All rights reserved.
 //
 #import <Foundation/Foundation.h>
-#import <AVFoundation/AVFoundation.h>
 #import <AudioToolbox/AudioToolbox.h>
+#import "SoundEngine.h"
 
 
 
@@ -21,9 +21,12 @@
 @class SpeechChunk;
 
 
-@interface SpeechManager : NSObject<AVAudioPlayerDelegate> {
+@interface SpeechManager : NSObject {
 	NSString* _soundFile;
-	AVAudioPlayer *_player;
+	SoundEngineStreamID _stream;
+	float _volume;
+	bool _playing;
+	bool _paused;
 	NSTimer *_stopTimer;
 	NSMutableDictionary *_sounds;
 	id _lastSpeechId;
@@ -47,7 +50,9 @@
 - (void) stopWithFadeStep:(double)step;
 - (void) stopWithFade;
 - (id) playingId;
+- (NSTimeInterval) startTimeForSpeech:(id)speechId;
 - (NSTimeInterval) lengthForSpeech:(id)speechId;
+- (float) volumeForSpeech:(id)speechId;
 
 
 
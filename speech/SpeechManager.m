@@ -22,6 +22,7 @@
 	if (self = [super init]) {
 		_soundFile = [file retain];
 		_sounds = [[NSMutableDictionary alloc] initWithCapacity:8];
+		_volume = 1.0f;
 	}
 	return self;
 }
@@ -35,13 +36,15 @@
 
 - (void) stopStepWithFadeStep:(NSNumber*)step
 {
-    if ([_player isPlaying]) {
-        if (_player.volume > [step doubleValue]) {
-            _player.volume -= [step doubleValue];
+    if (_playing) {
+        if (_volume > [step doubleValue]) {
+            _volume -= [step doubleValue];
+            SoundEngine_SetStreamVolume(_stream, _volume);
             [self performSelector:@selector(stopStepWithFadeStep:) withObject:step afterDelay:0.1];
         } else {
             [self stopSpeechId:_lastSpeechId];
-            _player.volume = 1.0;
+            _volume = 1.0;
+            SoundEngine_SetStreamVolume(_stream, _volume);
             [step release];
             _isFading = NO;
         }
@@ -65,12 +68,6 @@
     }
 }
 
-/*
-- (void)audioPlayerDidFinishPlaying:(AVAudioPlayer *)player successfully:(BOOL)flag
-{
-}
- */
-
 - (bool) playSpeech:(id)speechId {
 	return [self playSpeech:speechId stoppingPrevious:YES];
 }
@@ -92,7 +89,10 @@
 
 - (void) stopSpeechId:(id)speechId {
 	[self invalidateStopTimer];
-    [_player stop];
+    SoundEngine_StopStream(_stream, false);
+    _playing = NO;
+    _paused = NO;
+    SoundEngine_SetBusActivity(kSoundEngineBus_Speech, 0.0);
     [_delegate speechFinished:speechId];
 }
 
@@ -113,16 +113,29 @@
 
 - (void) pause {
 	[self invalidateStopTimer];
-	[_player pause];
+	if (_playing) {
+		SoundEngine_PauseStream(_stream);
+		_paused = YES;
+	}
+	_playing = NO;
+	SoundEngine_SetBusActivity(kSoundEngineBus_Speech, 0.0);
 }
 
 
 - (bool) registerStopTimerAndPlaySpeech:(id)speechId {
-	_player.volume = [self volumeForSpeech:speechId];
-	bool ret = [_player play];
-    if (!ret) DDLogError(@"ERROR playing speech %@", speechId);
+	_volume = [self volumeForSpeech:speechId];
+	SoundEngine_SetStreamVolume(_stream, _volume);
 	NSTimeInterval length = [self lengthForSpeech:speechId];
-		//NSLog(@"play sound %@ with length %f and volume %f", soundId, length, _player.volume); 
+	// a paused chunk continues, anything else plays its region of the narration file
+	OSStatus result = _paused ? SoundEngine_ResumeStream(_stream) 
+							  : SoundEngine_PlayStreamRegion(_stream, [self startTimeForSpeech:speechId], length);
+	bool ret = (result == noErr);
+	_paused = NO;
+	_playing = ret;
+    if (result == kSoundEngineErrInvalidRange) DDLogError(@"Sound %@ beyond duration!!", speechId);
+    else if (!ret) DDLogError(@"ERROR playing speech %@", speechId);
+    else SoundEngine_SetBusActivity(kSoundEngineBus_Speech, _volume);
+		//NSLog(@"play sound %@ with length %f and volume %f", soundId, length, _volume); 
     if (length == 0.0) {
         [self stopSpeechId:speechId];
     } else if (length != -1) {
@@ -141,23 +154,23 @@
 	}
 }
 
-- (void) createPlayer {
-	_player = [[AVAudioPlayer alloc] initWithContentsOfURL:[NSURL fileURLWithPath:_soundFile] error:nil];
-	[_player prepareToPlay];
-	[_player play];
-	[_player stop];
+- (void) createStream {
+	if (SoundEngine_CreateStream(kSoundEngineBus_Speech, &_stream) == noErr) {
+		if (SoundEngine_LoadStreamMappedTrack(_stream, [_soundFile fileSystemRepresentation]) != noErr)
+			DDLogError(@"ERROR loading speech file %@", _soundFile);
+	}
 }
 
 - (id) playingId {
-    return [_player isPlaying] ? _lastSpeechId : nil;
+    return _playing ? _lastSpeechId : nil;
 }
 
 - (bool) playSpeech:(id)speechId stoppingPrevious:(bool)stop {
     DDLogVerbose(@"playing speech \"%@\"", speechId);
     
-	if (!_player) {
-		[self createPlayer];		
-	} else if ([_player isPlaying] && stop) {
+	if (!_stream) {
+		[self createStream];		
+	} else if (_playing && stop) {
 		[self stopSpeechId:_lastSpeechId];
 	}
 	
@@ -166,12 +179,10 @@
 	
 	bool ret = NO;
 	NSTimeInterval startTime = [self startTimeForSpeech:speechId];
-    if (startTime >= _player.duration) {
-        DDLogError(@"Sound %@ beyond duration!!", speechId);
-    } else if (startTime == -1) {
+    if (startTime == -1) {
         DDLogError(@"Speech %@ doesn't found!!", speechId);
     } else {
-		_player.currentTime = startTime;
+		_paused = NO;
 		ret = [self registerStopTimerAndPlaySpeech:speechId];
 	}
 //	NSLog(@"play page=%d start=%f len=%f stack=%d", _currentPage, startTime, length, _stopSoundStack);
@@ -181,7 +192,7 @@
 
 - (void) dealloc {
 	[self invalidateStopTimer];
-	[_player release];
+	if (_stream) SoundEngine_DestroyStream(_stream);
 	[_sounds release];
 	[_lastSpeechId release];
 	[_soundFile release];